@@ -0,0 +1,330 @@
+#include "audit_log.hpp"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstddef>
+#include <cstring>
+#include <ctime>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include "common/flash_region.hpp"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "network/storage.hpp"
+#include "sdkconfig.h"
+
+static const char* TAG = "audit";
+
+namespace AuditLog {
+    static constexpr FlashRegion::Region REGION = FlashRegion::Region::AUDIT;
+    static constexpr uint32_t SECTOR_MAGIC = 0x54445541; // "AUDT"
+    static constexpr uint32_t EMPTY = 0xffffffff;
+
+    // Slot 0 of every sector holds the header, the rest hold records. A
+    // record's sequence alone says which sector and slot it lives in.
+    static constexpr size_t SLOTS_PER_SECTOR = 4096 / sizeof(Record);
+    static constexpr size_t RECORDS_PER_SECTOR = SLOTS_PER_SECTOR - 1;
+
+    // Group commit, records wait in RAM until this many are pending or the
+    // oldest has waited FLUSH_DELAY
+    static constexpr size_t BATCH_SIZE = 32;
+    static constexpr size_t FLUSH_THRESHOLD = 16;
+    static constexpr TickType_t FLUSH_DELAY = pdMS_TO_TICKS(30 * 1000);
+
+    // Anything earlier is uptime, nothing has set the clock yet
+    static constexpr time_t WALL_CLOCK_VALID = 1704067200; // 2024-01-01
+
+    struct SectorHeader {
+        uint32_t magic;
+        uint32_t base; // sequence of the sector's first record
+    };
+
+    static size_t sectors = 0;
+    static uint16_t boot = 0;
+
+    // Everything below is guarded by log_lock. Sequences in [flushed, next)
+    // are pending in batch, indexed by sequence % BATCH_SIZE.
+    static SemaphoreHandle_t log_lock = NULL;
+    static SemaphoreHandle_t flush_lock = NULL; // one flush at a time
+    static Record batch[BATCH_SIZE];
+    static uint32_t oldest = 0;
+    static uint32_t flushed = 0;
+    static uint32_t next_sequence = 0;
+    static TickType_t first_pending_at = 0;
+    static uint32_t dropped = 0;
+    static uint32_t flushes = 0;
+
+    static TaskHandle_t audit_task = NULL;
+
+    static size_t sector_of(uint32_t sequence) {
+        return (sequence / RECORDS_PER_SECTOR) % sectors;
+    }
+
+    static size_t offset_of(uint32_t sequence) {
+        return (sequence % RECORDS_PER_SECTOR + 1) * sizeof(Record);
+    }
+
+    static uint32_t record_crc(const Record& record) {
+        return esp_rom_crc32_le(0, (const uint8_t*)&record, offsetof(Record, crc));
+    }
+
+    static bool read_header(size_t sector, SectorHeader& header) {
+        return FlashRegion::read_raw(REGION, sector, 0, &header, sizeof(header)) && header.magic == SECTOR_MAGIC &&
+               header.base % RECORDS_PER_SECTOR == 0 && sector_of(header.base) == sector;
+    }
+
+    // Finds the oldest and next sequence from the sector headers and the
+    // first empty slot of the newest sector. A torn record still counts as
+    // used, the next one goes after it.
+    static void recover() {
+        bool any = false;
+        uint32_t newest_base = 0;
+        uint32_t oldest_base = 0;
+        for (size_t sector = 0; sector < sectors; sector++) {
+            SectorHeader header;
+            if (!read_header(sector, header)) {
+                continue;
+            }
+            if (!any || header.base > newest_base) {
+                newest_base = header.base;
+            }
+            if (!any || header.base < oldest_base) {
+                oldest_base = header.base;
+            }
+            any = true;
+        }
+        if (!any) {
+            return;
+        }
+
+        uint32_t sequence = newest_base;
+        for (; sequence < newest_base + RECORDS_PER_SECTOR; sequence++) {
+            uint32_t stored;
+            if (!FlashRegion::read_raw(REGION, sector_of(sequence), offset_of(sequence), &stored, sizeof(stored)) ||
+                stored == EMPTY) {
+                break;
+            }
+        }
+        oldest = oldest_base;
+        flushed = sequence;
+        next_sequence = sequence;
+    }
+
+    // Erases the sector sequence starts and stamps its header, dropping the
+    // oldest sector once the log has wrapped
+    static bool start_sector(uint32_t sequence) {
+        uint32_t lost_until = sequence + RECORDS_PER_SECTOR;
+        if (lost_until > sectors * RECORDS_PER_SECTOR) {
+            lost_until -= sectors * RECORDS_PER_SECTOR;
+            xSemaphoreTake(log_lock, portMAX_DELAY);
+            if (oldest < lost_until) {
+                oldest = lost_until;
+            }
+            xSemaphoreGive(log_lock);
+        }
+
+        size_t sector = sector_of(sequence);
+        SectorHeader header = {.magic = SECTOR_MAGIC, .base = sequence};
+        return FlashRegion::erase_raw(REGION, sector) &&
+               FlashRegion::write_raw(REGION, sector, 0, &header, sizeof(header));
+    }
+
+    // Writes [flushed, next) as few flash writes as the sector boundaries allow
+    static bool flush_pending() {
+        static Record out[BATCH_SIZE];
+
+        xSemaphoreTake(flush_lock, portMAX_DELAY);
+        xSemaphoreTake(log_lock, portMAX_DELAY);
+        uint32_t from = flushed;
+        uint32_t count = next_sequence - flushed;
+        for (uint32_t i = 0; i < count; i++) {
+            out[i] = batch[(from + i) % BATCH_SIZE];
+        }
+        xSemaphoreGive(log_lock);
+
+        uint32_t done = 0;
+        while (done < count) {
+            uint32_t sequence = from + done;
+            if (sequence % RECORDS_PER_SECTOR == 0 && !start_sector(sequence)) {
+                break;
+            }
+            uint32_t run = std::min<uint32_t>(count - done, RECORDS_PER_SECTOR - sequence % RECORDS_PER_SECTOR);
+            if (!FlashRegion::write_raw(REGION, sector_of(sequence), offset_of(sequence), &out[done],
+                                        run * sizeof(Record))) {
+                break;
+            }
+            done += run;
+        }
+        if (done < count) {
+            ESP_LOGE(TAG, "Failed to write %" PRIu32 " audit records, keeping them pending", count - done);
+        }
+
+        xSemaphoreTake(log_lock, portMAX_DELAY);
+        flushed += done;
+        first_pending_at = xTaskGetTickCount();
+        if (done > 0) {
+            flushes++;
+        }
+        xSemaphoreGive(log_lock);
+        xSemaphoreGive(flush_lock);
+        return done == count;
+    }
+
+    static void append(Record& record) {
+        if (log_lock == NULL) {
+            return;
+        }
+        time_t now = time(NULL);
+        record.time = (uint32_t)now;
+        record.boot = boot;
+        record.flags = now >= WALL_CLOCK_VALID ? FLAG_WALL_CLOCK : 0;
+
+        bool wake = false;
+        xSemaphoreTake(log_lock, portMAX_DELAY);
+        uint32_t pending = next_sequence - flushed;
+        if (pending >= BATCH_SIZE) {
+            dropped++;
+        } else {
+            record.sequence = next_sequence++;
+            record.crc = record_crc(record);
+            batch[record.sequence % BATCH_SIZE] = record;
+            if (pending == 0) {
+                first_pending_at = xTaskGetTickCount();
+            }
+            // First record starts the flush clock, the threshold cuts it short
+            wake = pending == 0 || pending + 1 == FLUSH_THRESHOLD;
+        }
+        xSemaphoreGive(log_lock);
+
+        if (wake && audit_task != NULL) {
+            xTaskNotifyGive(audit_task);
+        }
+    }
+
+    static void set_tag(Record& record, const CardTagID& tag) {
+        record.tag_length = (uint8_t)tag.type;
+        memcpy(record.tag, tag.value.data(), record.tag_length);
+    }
+
+    void record(const StateChange& change) {
+        Record record = {};
+        record.kind = Kind::StateChange;
+        record.from = (uint8_t)change.from;
+        record.to = (uint8_t)change.to;
+        record.reason = (uint8_t)change.reason;
+        if (change.who.has_value()) {
+            set_tag(record, change.who.value());
+        }
+        append(record);
+    }
+
+    void record_auth(const CardTagID& requester, IOState to_state, bool granted) {
+        Record record = {};
+        record.kind = granted ? Kind::AuthGranted : Kind::AuthDenied;
+        record.to = (uint8_t)to_state;
+        set_tag(record, requester);
+        append(record);
+    }
+
+    void record_fault(IOState from, FaultReason reason) {
+        Record record = {};
+        record.kind = Kind::Fault;
+        record.from = (uint8_t)from;
+        record.to = (uint8_t)IOState::FAULT;
+        record.reason = (uint8_t)reason;
+        append(record);
+    }
+
+    void flush() {
+        if (log_lock != NULL) {
+            flush_pending();
+        }
+    }
+
+    Cursor first(uint32_t from) {
+        xSemaphoreTake(log_lock, portMAX_DELAY);
+        Cursor cursor = {.sequence = from < oldest ? oldest : from};
+        xSemaphoreGive(log_lock);
+        return cursor;
+    }
+
+    bool next(Cursor& cursor, Record& out) {
+        while (true) {
+            xSemaphoreTake(log_lock, portMAX_DELAY);
+            if (cursor.sequence < oldest) {
+                cursor.sequence = oldest; // overwritten while we walked
+            }
+            uint32_t sequence = cursor.sequence;
+            bool at_end = sequence >= next_sequence;
+            bool pending = sequence >= flushed;
+            if (!at_end && pending) {
+                out = batch[sequence % BATCH_SIZE];
+            }
+            xSemaphoreGive(log_lock);
+
+            if (at_end) {
+                return false;
+            }
+            cursor.sequence++;
+            if (pending) {
+                return true;
+            }
+            if (FlashRegion::read_raw(REGION, sector_of(sequence), offset_of(sequence), &out, sizeof(out)) &&
+                out.sequence == sequence && out.crc == record_crc(out)) {
+                return true;
+            }
+        }
+    }
+
+    Stats get_stats() {
+        xSemaphoreTake(log_lock, portMAX_DELAY);
+        Stats stats = {
+            .oldest = oldest,
+            .next = next_sequence,
+            .pending = next_sequence - flushed,
+            .dropped = dropped,
+            .flushes = flushes,
+        };
+        xSemaphoreGive(log_lock);
+        return stats;
+    }
+
+    static void audit_task_fn(void*) {
+        while (true) {
+            xSemaphoreTake(log_lock, portMAX_DELAY);
+            uint32_t pending = next_sequence - flushed;
+            TickType_t waited = xTaskGetTickCount() - first_pending_at;
+            xSemaphoreGive(log_lock);
+
+            if (pending >= FLUSH_THRESHOLD || (pending > 0 && waited >= FLUSH_DELAY)) {
+                if (!flush_pending()) {
+                    // Back off instead of hammering a failing flash
+                    ulTaskNotifyTake(pdTRUE, FLUSH_DELAY);
+                }
+                continue;
+            }
+            ulTaskNotifyTake(pdTRUE, pending > 0 ? FLUSH_DELAY - waited : portMAX_DELAY);
+        }
+    }
+
+    int init() {
+        sectors = FlashRegion::slots(REGION);
+        boot = (uint16_t)Storage::get_boot_count();
+        log_lock = xSemaphoreCreateMutex();
+        flush_lock = xSemaphoreCreateMutex();
+        if (log_lock == NULL || flush_lock == NULL) {
+            ESP_LOGE(TAG, "Failed to create audit log locks");
+            return 1;
+        }
+
+        recover();
+        ESP_LOGI(TAG, "Audit log holds %" PRIu32 "-%" PRIu32, oldest, next_sequence);
+
+        if (xTaskCreate(audit_task_fn, "audit", CONFIG_AUDIT_TASK_STACK_SIZE, NULL, 0, &audit_task) != pdPASS) {
+            ESP_LOGE(TAG, "Failed to start audit task");
+            return 1;
+        }
+        return 0;
+    }
+} // namespace AuditLog
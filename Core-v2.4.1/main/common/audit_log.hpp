@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "common/types.hpp"
+
+// Append-only trail of state changes, auth decisions and faults, kept in the
+// AUDIT flash region as fixed size binary records. Records are batched in RAM
+// and written together, and the log wraps a sector at a time so every sector
+// sees the same number of erases. Recording never allocates.
+namespace AuditLog {
+    enum class Kind : uint8_t {
+        StateChange = 1, // from, to, reason (StateChangeReason)
+        AuthGranted,     // to is the requested state
+        AuthDenied,      // to is the requested state
+        Fault,           // from is the state faulted out of, reason is the FaultReason
+    };
+
+    // Set in Record::flags when time is wall clock seconds rather than uptime
+    static constexpr uint8_t FLAG_WALL_CLOCK = 1 << 0;
+
+    struct Record {
+        uint32_t sequence; // one up per record, also gives its place in flash
+        uint32_t time;     // seconds, see FLAG_WALL_CLOCK
+        uint16_t boot;     // low bits of the boot counter, orders uptime stamps
+        Kind kind;
+        uint8_t flags;
+        uint8_t from;       // IOState
+        uint8_t to;         // IOState
+        uint8_t reason;     // meaning depends on kind
+        uint8_t tag_length; // 0 if no card was involved
+        uint8_t tag[10];
+        uint8_t reserved[2];
+        uint32_t crc;
+    };
+    static_assert(sizeof(Record) == 32, "Records must tile a flash sector");
+
+    // Walks the log oldest first, including records not yet flushed
+    struct Cursor {
+        uint32_t sequence;
+    };
+
+    struct Stats {
+        uint32_t oldest;  // first sequence still held
+        uint32_t next;    // sequence the next record gets
+        uint32_t pending; // recorded but not yet on flash
+        uint32_t dropped; // recorded while the batch was full
+        uint32_t flushes;
+    };
+
+    int init();
+
+    // Queue a record for the next flush. Never blocks on flash.
+    void record(const StateChange& change);
+    void record_auth(const CardTagID& requester, IOState to_state, bool granted);
+    void record_fault(IOState from, FaultReason reason);
+
+    // Writes everything pending now, e.g. before a restart
+    void flush();
+
+    // Starts at from, or the oldest record if that has been overwritten
+    Cursor first(uint32_t from = 0);
+    // False once the cursor reaches the newest record. Torn records are skipped.
+    bool next(Cursor& cursor, Record& out);
+
+    Stats get_stats();
+} // namespace AuditLog
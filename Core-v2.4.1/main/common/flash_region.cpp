@@ -0,0 +1,232 @@
+#include "flash_region.hpp"
+
+#include <algorithm>
+
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+
+static const char* TAG = "flash-region";
+
+namespace FlashRegion {
+    static constexpr uint32_t MAGIC = 0x4e475246; // "FRGN"
+    static constexpr size_t SECTOR_SIZE = 4096;
+
+    struct Header {
+        uint32_t magic;
+        uint32_t length;
+        uint32_t crc;
+    };
+
+    struct Layout {
+        size_t offset;
+        size_t slot_size; // sector multiple
+        size_t slots;
+    };
+
+    // Indexed by Region. Offsets are sector aligned and never move once
+    // shipped, new regions go after the last one.
+    static constexpr Layout LAYOUT[] = {
+        {.offset = 0, .slot_size = 4 * SECTOR_SIZE, .slots = 1},                 // ANIMATIONS
+        {.offset = 4 * SECTOR_SIZE, .slot_size = SECTOR_SIZE, .slots = 16},      // SONGS
+        {.offset = 20 * SECTOR_SIZE, .slot_size = 32 * SECTOR_SIZE, .slots = 8}, // CLIPS
+        {.offset = 276 * SECTOR_SIZE, .slot_size = SECTOR_SIZE, .slots = 64},    // AUDIT
+        {.offset = 340 * SECTOR_SIZE, .slot_size = 2 * SECTOR_SIZE, .slots = 1}, // CERTS
+    };
+
+    static const esp_partition_t* partition = NULL;
+
+    int init() {
+        partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, "spiffs");
+        if (partition == NULL) {
+            ESP_LOGE(TAG, "No spiffs partition, flash regions unavailable");
+            return 1;
+        }
+        const Layout& last = LAYOUT[sizeof(LAYOUT) / sizeof(LAYOUT[0]) - 1];
+        if (last.offset + last.slot_size * last.slots > partition->size) {
+            ESP_LOGE(TAG, "Regions don't fit in the %u byte partition", (unsigned)partition->size);
+            partition = NULL;
+            return 1;
+        }
+        return 0;
+    }
+
+    size_t slots(Region region) {
+        return LAYOUT[(size_t)region].slots;
+    }
+
+    size_t capacity(Region region) {
+        return LAYOUT[(size_t)region].slot_size - sizeof(Header);
+    }
+
+    static size_t slot_offset(Region region, size_t slot) {
+        const Layout& layout = LAYOUT[(size_t)region];
+        return layout.offset + slot * layout.slot_size;
+    }
+
+    // Sectors are erased as the write reaches them, so a big blob doesn't
+    // stall the writer for the whole erase up front
+    static bool erase_sector_at(const Writer& writer, size_t pos) {
+        size_t offset = slot_offset(writer.region, writer.slot) + pos;
+        esp_err_t err = esp_partition_erase_range(partition, offset - offset % SECTOR_SIZE, SECTOR_SIZE);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to erase region %d slot %u: %s", (int)writer.region, (unsigned)writer.slot,
+                     esp_err_to_name(err));
+            return false;
+        }
+        return true;
+    }
+
+    bool begin_write(Writer& writer, Region region, size_t slot) {
+        if (partition == NULL || slot >= slots(region)) {
+            return false;
+        }
+        writer = {.region = region, .slot = slot, .length = 0, .crc = 0};
+        return erase_sector_at(writer, 0);
+    }
+
+    bool append(Writer& writer, const void* data, size_t len) {
+        if (writer.length + len > capacity(writer.region)) {
+            return false;
+        }
+        size_t pos = sizeof(Header) + writer.length;
+        size_t end = pos + len;
+        for (size_t sector = (pos + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE; sector < end;
+             sector += SECTOR_SIZE) {
+            if (!erase_sector_at(writer, sector)) {
+                return false;
+            }
+        }
+
+        esp_err_t err = esp_partition_write(partition, slot_offset(writer.region, writer.slot) + pos, data, len);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to write region %d slot %u: %s", (int)writer.region, (unsigned)writer.slot,
+                     esp_err_to_name(err));
+            return false;
+        }
+        writer.crc = esp_rom_crc32_le(writer.crc, (const uint8_t*)data, len);
+        writer.length += len;
+        return true;
+    }
+
+    bool finish(Writer& writer) {
+        // Header goes last so a power cut part way through leaves the slot empty
+        Header header = {
+            .magic = MAGIC,
+            .length = (uint32_t)writer.length,
+            .crc = writer.crc,
+        };
+        esp_err_t err =
+            esp_partition_write(partition, slot_offset(writer.region, writer.slot), &header, sizeof(header));
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to write region %d slot %u header: %s", (int)writer.region, (unsigned)writer.slot,
+                     esp_err_to_name(err));
+            return false;
+        }
+        return true;
+    }
+
+    bool write(Region region, const void* data, size_t len, size_t slot) {
+        Writer writer;
+        return len <= capacity(region) && begin_write(writer, region, slot) && append(writer, data, len) &&
+               finish(writer);
+    }
+
+    static bool read_header(Region region, size_t slot, Header& header) {
+        if (partition == NULL || slot >= slots(region)) {
+            return false;
+        }
+        if (esp_partition_read(partition, slot_offset(region, slot), &header, sizeof(header)) != ESP_OK) {
+            return false;
+        }
+        return header.magic == MAGIC && header.length <= capacity(region);
+    }
+
+    bool read(Region region, void* out, size_t max, size_t& len, size_t slot) {
+        Header header;
+        if (!read_header(region, slot, header) || header.length > max) {
+            return false;
+        }
+        if (!read_at(region, slot, 0, out, header.length)) {
+            return false;
+        }
+        if (esp_rom_crc32_le(0, (const uint8_t*)out, header.length) != header.crc) {
+            ESP_LOGW(TAG, "Region %d slot %u failed its CRC", (int)region, (unsigned)slot);
+            return false;
+        }
+        len = header.length;
+        return true;
+    }
+
+    bool stat(Region region, size_t slot, size_t& len, uint32_t& crc) {
+        Header header;
+        if (!read_header(region, slot, header)) {
+            return false;
+        }
+
+        uint8_t chunk[256];
+        uint32_t actual = 0;
+        for (size_t pos = 0; pos < header.length; pos += sizeof(chunk)) {
+            size_t n = std::min(sizeof(chunk), header.length - pos);
+            if (!read_at(region, slot, pos, chunk, n)) {
+                return false;
+            }
+            actual = esp_rom_crc32_le(actual, chunk, n);
+        }
+        if (actual != header.crc) {
+            ESP_LOGW(TAG, "Region %d slot %u failed its CRC", (int)region, (unsigned)slot);
+            return false;
+        }
+        len = header.length;
+        crc = header.crc;
+        return true;
+    }
+
+    bool read_at(Region region, size_t slot, size_t offset, void* out, size_t len) {
+        if (partition == NULL || slot >= slots(region)) {
+            return false;
+        }
+        return esp_partition_read(partition, slot_offset(region, slot) + sizeof(Header) + offset, out, len) == ESP_OK;
+    }
+
+    bool clear(Region region, size_t slot) {
+        if (partition == NULL || slot >= slots(region)) {
+            return false;
+        }
+        return esp_partition_erase_range(partition, slot_offset(region, slot), SECTOR_SIZE) == ESP_OK;
+    }
+
+    size_t slot_size(Region region) {
+        return LAYOUT[(size_t)region].slot_size;
+    }
+
+    static bool raw_in_range(Region region, size_t slot, size_t offset, size_t len) {
+        return partition != NULL && slot < slots(region) && offset + len <= slot_size(region);
+    }
+
+    bool erase_raw(Region region, size_t slot) {
+        if (!raw_in_range(region, slot, 0, 0)) {
+            return false;
+        }
+        return esp_partition_erase_range(partition, slot_offset(region, slot), slot_size(region)) == ESP_OK;
+    }
+
+    bool write_raw(Region region, size_t slot, size_t offset, const void* data, size_t len) {
+        if (!raw_in_range(region, slot, offset, len)) {
+            return false;
+        }
+        esp_err_t err = esp_partition_write(partition, slot_offset(region, slot) + offset, data, len);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to write region %d slot %u: %s", (int)region, (unsigned)slot, esp_err_to_name(err));
+            return false;
+        }
+        return true;
+    }
+
+    bool read_raw(Region region, size_t slot, size_t offset, void* out, size_t len) {
+        if (!raw_in_range(region, slot, offset, len)) {
+            return false;
+        }
+        return esp_partition_read(partition, slot_offset(region, slot) + offset, out, len) == ESP_OK;
+    }
+} // namespace FlashRegion
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Raw blobs in the spiffs partition, which the firmware never mounts. Regions
+// are split into one or more slots, each holding one blob behind a header with
+// its length and CRC, so a torn or never written slot just reads as empty.
+// Regions that lay out their own slots use the *_raw calls instead.
+namespace FlashRegion {
+    enum class Region {
+        ANIMATIONS,
+        SONGS,
+        CLIPS,
+        AUDIT,
+        CERTS,
+    };
+
+    // Streams a blob too big to hold in RAM into a slot. The slot reads as
+    // empty until finish() writes the header.
+    struct Writer {
+        Region region;
+        size_t slot;
+        size_t length;
+        uint32_t crc;
+    };
+
+    int init();
+
+    size_t slots(Region region);
+    // Largest blob a slot can hold
+    size_t capacity(Region region);
+
+    // Replaces the slot's contents. Erases whole sectors, keep writes rare.
+    bool write(Region region, const void* data, size_t len, size_t slot = 0);
+
+    // False if the slot is empty, corrupt or holds more than max bytes
+    bool read(Region region, void* out, size_t max, size_t& len, size_t slot = 0);
+
+    bool begin_write(Writer& writer, Region region, size_t slot);
+    bool append(Writer& writer, const void* data, size_t len);
+    bool finish(Writer& writer);
+
+    // Length and CRC of the slot's blob, checked a chunk at a time so it works
+    // for blobs bigger than RAM. False if the slot is empty or corrupt.
+    bool stat(Region region, size_t slot, size_t& len, uint32_t& crc);
+
+    // Part of the slot's blob, without checking it. Use stat() first.
+    bool read_at(Region region, size_t slot, size_t offset, void* out, size_t len);
+
+    // Drops the blob so the slot reads as empty
+    bool clear(Region region, size_t slot = 0);
+
+    // No header or CRC, offsets are from the start of the slot. Flash only
+    // clears bits, so write_raw needs the bytes erased since they were last
+    // written.
+    size_t slot_size(Region region);
+    bool erase_raw(Region region, size_t slot);
+    bool write_raw(Region region, size_t slot, size_t offset, const void* data, size_t len);
+    bool read_raw(Region region, size_t slot, size_t offset, void* out, size_t len);
+} // namespace FlashRegion
@@ -0,0 +1,361 @@
+#include "log_ring.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+
+#include "esp_memory_utils.h"
+
+// Log record arguments, in format string order, all little endian:
+//   integers, chars, '*' widths and precisions  u32, or u64 for ll and j
+//   floating point                              f64
+//   %p                                          u32
+//   %s                                          0xFF then the u32 address if the string is in flash,
+//                                               otherwise a u8 length and that many bytes
+//   %n, %%                                      nothing
+// tools/decode_log.py walks the format string the same way, keep the two in step.
+namespace LogRing {
+    static constexpr size_t RING_COUNT = 16;
+    static constexpr size_t RING_SIZE = 512; // power of two, so the free running counters wrap cleanly
+    static constexpr uint8_t FLASH_STRING = 0xFF;
+    // Thread local slot pointing a task at its ring, slot 0 belongs to pthreads
+    static constexpr BaseType_t TLS_INDEX = 1;
+
+    // Single producer, single consumer. Each record is a length byte then the record.
+    struct Ring {
+        std::atomic<TaskHandle_t> owner{nullptr};
+        std::atomic<uint32_t> head{0}; // bytes ever written, only the producer moves it
+        std::atomic<uint32_t> tail{0}; // bytes ever read, only the consumer moves it
+        std::atomic<uint32_t> dropped{0};
+        uint8_t data[RING_SIZE];
+    };
+
+    // Claimed by the first task that logs into them. Tasks do exit, the websocket client is recreated on every
+    // reconnect and app_main returns, so a ring is handed back once its owner is deleted and it has drained.
+    static Ring rings[RING_COUNT];
+    // For tasks that found every ring taken, and interrupts
+    static Ring shared;
+    // Owner of a ring whose task was deleted, never a real task handle
+    static const TaskHandle_t RELEASED = (TaskHandle_t)&shared;
+    static portMUX_TYPE shared_lock = portMUX_INITIALIZER_UNLOCKED;
+
+    static TaskHandle_t consumer_task = NULL;
+    static size_t read_index = 0; // RING_COUNT is the shared ring
+
+    static std::atomic<uint32_t> records{0};
+    static std::atomic<uint32_t> dropped_total{0};
+    static std::atomic<uint32_t> fallbacks{0};
+
+    struct Record {
+        uint8_t data[MAX_RECORD];
+        size_t length = 0;
+        bool cut = false;
+
+        bool put(const void* value, size_t size) {
+            if (cut || length + size > MAX_RECORD) {
+                cut = true;
+                return false;
+            }
+            memcpy(data + length, value, size);
+            length += size;
+            return true;
+        }
+
+        void put_u32(uint32_t value) { put(&value, sizeof(value)); }
+        void put_u64(uint64_t value) { put(&value, sizeof(value)); }
+        void put_f64(double value) { put(&value, sizeof(value)); }
+
+        void put_string(const char* s, int precision) {
+            if (s == nullptr) {
+                s = "(null)";
+            }
+            if (esp_ptr_in_drom(s)) {
+                uint8_t marker = FLASH_STRING;
+                put(&marker, 1);
+                put_u32((uint32_t)(uintptr_t)s);
+                return;
+            }
+
+            // Never scan past what could fit, hot path strings can be whole JSON messages
+            size_t room = length + 1 < MAX_RECORD ? std::min<size_t>(MAX_RECORD - length - 1, FLASH_STRING - 1) : 0;
+            size_t limit = precision >= 0 ? std::min<size_t>(precision, room + 1) : room + 1;
+            size_t n = strnlen(s, limit);
+            bool fits = n <= room;
+            uint8_t stored = fits ? n : room;
+            if (put(&stored, 1)) {
+                put(s, stored);
+            }
+            if (!fits) {
+                cut = true;
+            }
+        }
+    };
+
+    static void copy_in(Ring& ring, uint32_t at, const uint8_t* src, size_t len) {
+        size_t offset = at % RING_SIZE;
+        size_t first = std::min(len, RING_SIZE - offset);
+        memcpy(ring.data + offset, src, first);
+        memcpy(ring.data, src + first, len - first);
+    }
+
+    static void copy_out(const Ring& ring, uint32_t at, uint8_t* dst, size_t len) {
+        size_t offset = at % RING_SIZE;
+        size_t first = std::min(len, RING_SIZE - offset);
+        memcpy(dst, ring.data + offset, first);
+        memcpy(dst + first, ring.data, len - first);
+    }
+
+    static bool push(Ring& ring, const uint8_t* record, size_t len) {
+        uint32_t head = ring.head.load(std::memory_order_relaxed);
+        uint32_t tail = ring.tail.load(std::memory_order_acquire);
+        if (RING_SIZE - (head - tail) < len + 1) {
+            ring.dropped.fetch_add(1, std::memory_order_relaxed);
+            dropped_total.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        uint8_t length = len;
+        copy_in(ring, head, &length, 1);
+        copy_in(ring, head + 1, record, len);
+        ring.head.store(head + 1 + len, std::memory_order_release);
+        return true;
+    }
+
+    // Runs as the owner task is deleted, after its last record. The consumer frees the ring once it is empty.
+    static void release(int, void* data) {
+        static_cast<Ring*>(data)->owner.store(RELEASED, std::memory_order_release);
+    }
+
+    static Ring* ring_for_current_task() {
+        if (xPortInIsrContext()) {
+            return nullptr;
+        }
+
+        // A handle can be reused by a later task, so the slot rather than the owner says whose ring it is
+        Ring* mine = static_cast<Ring*>(pvTaskGetThreadLocalStoragePointer(NULL, TLS_INDEX));
+        if (mine != nullptr) {
+            return mine;
+        }
+
+        TaskHandle_t self = xTaskGetCurrentTaskHandle();
+        for (Ring& ring : rings) {
+            TaskHandle_t owner = nullptr;
+            if (ring.owner.compare_exchange_strong(owner, self)) {
+                vTaskSetThreadLocalStoragePointerAndDelCallback(NULL, TLS_INDEX, &ring, release);
+                return &ring;
+            }
+        }
+        return nullptr;
+    }
+
+    static int store(const uint8_t* record, size_t len) {
+        Ring* ring = ring_for_current_task();
+        bool stored;
+        if (ring != nullptr) {
+            stored = push(*ring, record, len);
+        } else {
+            taskENTER_CRITICAL_SAFE(&shared_lock);
+            stored = push(shared, record, len);
+            taskEXIT_CRITICAL_SAFE(&shared_lock);
+        }
+        if (!stored) {
+            return -1;
+        }
+
+        records.fetch_add(1, std::memory_order_relaxed);
+        // From an interrupt the record waits for the next wake up
+        if (consumer_task != NULL && !xPortInIsrContext()) {
+            xTaskNotifyGive(consumer_task);
+        }
+        return len;
+    }
+
+    void init(TaskHandle_t consumer) {
+        consumer_task = consumer;
+    }
+
+    int vlog(const char* fmt, va_list args) {
+        // The address is only meaningful to the decoder if it points into the ELF
+        if (!esp_ptr_in_drom(fmt)) {
+            fallbacks.fetch_add(1, std::memory_order_relaxed);
+            return vtext(fmt, args);
+        }
+
+        Record record;
+        uint8_t type = (uint8_t)RecordType::Log;
+        record.put(&type, 1);
+        record.put_u32((uint32_t)(uintptr_t)fmt);
+
+        for (const char* p = fmt; *p != '\0' && !record.cut; p++) {
+            if (*p != '%') {
+                continue;
+            }
+            p++;
+
+            while (*p != '\0' && strchr("-+ #0", *p) != nullptr) {
+                p++;
+            }
+            if (*p == '*') {
+                record.put_u32(va_arg(args, int));
+                p++;
+            }
+            while (*p >= '0' && *p <= '9') {
+                p++;
+            }
+
+            int precision = -1;
+            if (*p == '.') {
+                p++;
+                if (*p == '*') {
+                    precision = va_arg(args, int);
+                    record.put_u32(precision);
+                    p++;
+                } else {
+                    precision = 0;
+                    while (*p >= '0' && *p <= '9') {
+                        precision = precision * 10 + (*p++ - '0');
+                    }
+                }
+            }
+
+            // Everything but long long and intmax_t is 32 bits on the ESP32
+            bool wide = false;
+            bool long_double = false;
+            if (*p == 'h') {
+                p += p[1] == 'h' ? 2 : 1;
+            } else if (*p == 'l') {
+                wide = p[1] == 'l';
+                p += wide ? 2 : 1;
+            } else if (*p == 'j') {
+                wide = true;
+                p++;
+            } else if (*p == 'z' || *p == 't') {
+                p++;
+            } else if (*p == 'L') {
+                long_double = true;
+                p++;
+            }
+
+            switch (*p) {
+                case 'd':
+                case 'i':
+                case 'u':
+                case 'o':
+                case 'x':
+                case 'X':
+                case 'c':
+                    if (wide) {
+                        record.put_u64(va_arg(args, unsigned long long));
+                    } else {
+                        record.put_u32(va_arg(args, unsigned int));
+                    }
+                    break;
+                case 'f':
+                case 'F':
+                case 'e':
+                case 'E':
+                case 'g':
+                case 'G':
+                case 'a':
+                case 'A':
+                    record.put_f64(long_double ? (double)va_arg(args, long double) : va_arg(args, double));
+                    break;
+                case 'p':
+                    record.put_u32((uint32_t)(uintptr_t)va_arg(args, void*));
+                    break;
+                case 's':
+                    record.put_string(va_arg(args, const char*), precision);
+                    break;
+                case 'n':
+                    va_arg(args, void*);
+                    break;
+                case '\0':
+                    p--;
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        if (record.cut) {
+            record.data[0] = (uint8_t)RecordType::Truncated;
+        }
+        return store(record.data, record.length);
+    }
+
+    int vtext(const char* fmt, va_list args) {
+        uint8_t record[MAX_RECORD];
+        record[0] = (uint8_t)RecordType::Text;
+        int written = vsnprintf((char*)record + 1, MAX_RECORD - 1, fmt, args);
+        if (written < 0) {
+            return -1;
+        }
+        return store(record, 1 + std::min<size_t>(written, MAX_RECORD - 2));
+    }
+
+    int text(const char* data, size_t len) {
+        uint8_t record[MAX_RECORD];
+        record[0] = (uint8_t)RecordType::Text;
+        len = std::min(len, MAX_RECORD - 1);
+        memcpy(record + 1, data, len);
+        return store(record, 1 + len);
+    }
+
+    static size_t pop(Ring& ring, uint8_t* out, size_t max) {
+        uint32_t tail = ring.tail.load(std::memory_order_relaxed);
+        uint32_t head = ring.head.load(std::memory_order_acquire);
+        if (head == tail) {
+            // Report losses once what made it in has gone out
+            uint32_t dropped = ring.dropped.exchange(0, std::memory_order_relaxed);
+            if (dropped == 0 || max < 5) {
+                return 0;
+            }
+            out[0] = (uint8_t)RecordType::Dropped;
+            memcpy(out + 1, &dropped, sizeof(dropped));
+            return 5;
+        }
+
+        uint8_t length;
+        copy_out(ring, tail, &length, 1);
+        size_t copied = std::min<size_t>(length, max);
+        copy_out(ring, tail + 1, out, copied);
+        ring.tail.store(tail + 1 + length, std::memory_order_release);
+        return copied;
+    }
+
+    size_t read(uint8_t* out, size_t max) {
+        // Stays on one ring until it is empty so a task's lines come out together
+        for (size_t i = 0; i <= RING_COUNT; i++) {
+            size_t index = (read_index + i) % (RING_COUNT + 1);
+            Ring& ring = index == RING_COUNT ? shared : rings[index];
+            // Checked first, so everything the owner wrote before it was deleted is seen by pop
+            bool released = ring.owner.load(std::memory_order_acquire) == RELEASED;
+            size_t len = pop(ring, out, max);
+            if (len > 0) {
+                read_index = index;
+                return len;
+            }
+            if (released) {
+                ring.owner.store(nullptr, std::memory_order_release);
+            }
+        }
+        return 0;
+    }
+
+    Stats get_stats() {
+        uint32_t used = 0;
+        for (const Ring& ring : rings) {
+            TaskHandle_t owner = ring.owner.load(std::memory_order_relaxed);
+            if (owner != nullptr && owner != RELEASED) {
+                used++;
+            }
+        }
+        return {
+            .rings_used = used,
+            .records = records.load(std::memory_order_relaxed),
+            .dropped = dropped_total.load(std::memory_order_relaxed),
+            .fallbacks = fallbacks.load(std::memory_order_relaxed),
+        };
+    }
+} // namespace LogRing
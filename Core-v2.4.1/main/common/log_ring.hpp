@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+// Deferred logging. A log call stores the flash address of its format string and
+// the raw arguments, the text is rebuilt on the host by tools/decode_log.py from
+// the matching ELF. Each task gets its own single producer ring, so logging takes
+// no lock and does no formatting.
+namespace LogRing {
+    enum class RecordType : uint8_t {
+        Log = 1,   // u32 format address, then the arguments, see encode in log_ring.cpp
+        Truncated, // as Log, but arguments were cut short to fit
+        Text,      // already formatted text
+        Dropped,   // u32 records lost because a ring was full
+    };
+
+    // Largest record, type byte included
+    static constexpr size_t MAX_RECORD = 255;
+
+    struct Stats {
+        uint32_t rings_used; // rings claimed by a task, the rest share one locked ring
+        uint32_t records;
+        uint32_t dropped;
+        uint32_t fallbacks; // format strings outside flash, sent as text
+    };
+
+    // consumer is notified whenever a record is written
+    void init(TaskHandle_t consumer);
+
+    // Captures one log call, never blocks. Returns the record size or -1 if dropped.
+    int vlog(const char* fmt, va_list args);
+    // Formats on the calling task and stores the result as a Text record
+    int vtext(const char* fmt, va_list args);
+    int text(const char* data, size_t len);
+
+    // Copies the next record into out, returns its size or 0 once every ring is
+    // empty. Only the consumer task may call this.
+    size_t read(uint8_t* out, size_t max);
+
+    Stats get_stats();
+} // namespace LogRing
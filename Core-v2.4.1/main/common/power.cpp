@@ -0,0 +1,104 @@
+#include "power.hpp"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "esp_log.h"
+#ifdef CONFIG_PM_ENABLE
+#include "esp_sleep.h"
+#endif
+
+static const char* TAG = "power";
+
+namespace Power {
+    // Ballpark ESP32-S2 figures at 3.3 V with WiFi associated in modem sleep
+    static constexpr uint32_t CPU_BUSY_UA = 24000;  // 240 MHz, running
+    static constexpr uint32_t CPU_IDLE_UA = 15000;  // 240 MHz, waiting for an interrupt
+    static constexpr uint32_t LIGHT_SLEEP_UA = 750; // clocks gated, RAM retained
+    static constexpr uint32_t WIFI_AVG_UA = 2000;   // radio waking for DTIM beacons
+
+    int init() {
+#ifdef CONFIG_PM_ENABLE
+        esp_pm_config_t config = {
+            .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+            .min_freq_mhz = CONFIG_XTAL_FREQ,
+#ifdef CONFIG_LIGHT_SLEEP_ENABLE
+            .light_sleep_enable = true,
+#else
+            .light_sleep_enable = false,
+#endif
+        };
+        esp_err_t err = esp_pm_configure(&config);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to configure power management: %s", esp_err_to_name(err));
+            return 1;
+        }
+#ifdef CONFIG_LIGHT_SLEEP_ENABLE
+        // Individual pins opt in with gpio_wakeup_enable
+        esp_sleep_enable_gpio_wakeup();
+#endif
+        ESP_LOGI(TAG, "Power management on, %d-%d MHz", config.min_freq_mhz, config.max_freq_mhz);
+#endif
+        return 0;
+    }
+
+    bool Lock::create(const char* name) {
+#ifdef CONFIG_PM_ENABLE
+        esp_err_t err = esp_pm_lock_create(ESP_PM_APB_FREQ_MAX, 0, name, &handle);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to create power lock %s: %s", name, esp_err_to_name(err));
+            return false;
+        }
+#endif
+        return true;
+    }
+
+    void Lock::acquire() {
+#ifdef CONFIG_PM_ENABLE
+        if (handle) {
+            esp_pm_lock_acquire(handle);
+        }
+#endif
+    }
+
+    void Lock::release() {
+#ifdef CONFIG_PM_ENABLE
+        if (handle) {
+            esp_pm_lock_release(handle);
+        }
+#endif
+    }
+
+    bool estimate(Estimate& out) {
+#if configGENERATE_RUN_TIME_STATS
+        static configRUN_TIME_COUNTER_TYPE last_idle = 0;
+        static configRUN_TIME_COUNTER_TYPE last_total = 0;
+
+        configRUN_TIME_COUNTER_TYPE idle = ulTaskGetIdleRunTimeCounter();
+        configRUN_TIME_COUNTER_TYPE total = portGET_RUN_TIME_COUNTER_VALUE();
+        configRUN_TIME_COUNTER_TYPE elapsed = total - last_total;
+        if (elapsed == 0) {
+            return false;
+        }
+
+        uint32_t idle_permille = (uint32_t)((uint64_t)(idle - last_idle) * 1000 / elapsed);
+        if (idle_permille > 1000) {
+            idle_permille = 1000;
+        }
+        last_idle = idle;
+        last_total = total;
+
+        uint32_t busy_permille = 1000 - idle_permille;
+        out.idle_permille = idle_permille;
+        out.awake_ua = (busy_permille * CPU_BUSY_UA + idle_permille * CPU_IDLE_UA) / 1000 + WIFI_AVG_UA;
+#ifdef CONFIG_LIGHT_SLEEP_ENABLE
+        out.sleep_ua = (busy_permille * CPU_BUSY_UA + idle_permille * LIGHT_SLEEP_UA) / 1000 + WIFI_AVG_UA;
+#else
+        out.sleep_ua = out.awake_ua;
+#endif
+        return true;
+#else
+        return false;
+#endif
+    }
+} // namespace Power
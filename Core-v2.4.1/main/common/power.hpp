@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+
+#include "sdkconfig.h"
+#ifdef CONFIG_PM_ENABLE
+#include "esp_pm.h"
+#endif
+
+// Dynamic frequency scaling and automatic light sleep. The SoC sleeps whenever
+// every task is blocked and nobody holds a lock, so anything driving a clocked
+// peripheral (LEDC, a USB host connection) has to hold a Power::Lock meanwhile.
+namespace Power {
+    int init();
+
+    class Lock {
+      public:
+        // Keeps APB at full speed, which also keeps the chip out of light sleep
+        bool create(const char* name);
+        void acquire();
+        void release();
+
+      private:
+#ifdef CONFIG_PM_ENABLE
+        esp_pm_lock_handle_t handle = nullptr;
+#endif
+    };
+
+    struct Estimate {
+        uint32_t idle_permille; // time spent in the idle task since the previous estimate
+        uint32_t awake_ua;      // what that idle time would cost with the CPU clocked
+        uint32_t sleep_ua;      // what it costs when idle time is spent in light sleep
+    };
+
+    // Rough SoC current from idle time accounting, excludes LEDs, the NFC
+    // front end and anything else on the board. False if run time stats are off.
+    bool estimate(Estimate& out);
+} // namespace Power
@@ -0,0 +1,141 @@
+#include "queues.hpp"
+
+#include <cinttypes>
+
+#include "esp_log.h"
+
+static const char* TAG = "queues";
+
+namespace Queues {
+    static Counters counter_table[MAX_QUEUES];
+    static std::atomic<size_t> counter_count{0};
+
+    static void update_max(std::atomic<uint32_t>& target, uint32_t value) {
+        uint32_t current = target.load(std::memory_order_relaxed);
+        while (value > current && !target.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    void Counters::setup(const char* new_name, uint32_t new_capacity) {
+        name = new_name;
+        capacity = new_capacity;
+    }
+
+    void Counters::on_send(bool ok, TickType_t wait, uint32_t depth) {
+        if (ok) {
+            sent.fetch_add(1, std::memory_order_relaxed);
+        } else if (wait == 0) {
+            drops.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            timeouts.fetch_add(1, std::memory_order_relaxed);
+        }
+        update_max(high_water, depth);
+    }
+
+    void Counters::on_receive() {
+        received.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void Counters::on_latency(TickType_t enqueued_at) {
+        uint32_t waited = xTaskGetTickCount() - enqueued_at;
+        latency_total_ticks.fetch_add(waited, std::memory_order_relaxed);
+        update_max(latency_max_ticks, waited);
+    }
+
+    void Counters::on_drop() {
+        drops.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void Counters::on_full_probe(uint32_t depth) {
+        full_probes.fetch_add(1, std::memory_order_relaxed);
+        update_max(high_water, depth);
+    }
+
+    Stats Counters::snapshot() const {
+        uint32_t rx = received.load(std::memory_order_relaxed);
+        uint32_t total = latency_total_ticks.load(std::memory_order_relaxed);
+        return {
+            .name = name,
+            .capacity = capacity,
+            .high_water = high_water.load(std::memory_order_relaxed),
+            .sent = sent.load(std::memory_order_relaxed),
+            .timeouts = timeouts.load(std::memory_order_relaxed),
+            .drops = drops.load(std::memory_order_relaxed),
+            .full_probes = full_probes.load(std::memory_order_relaxed),
+            .received = rx,
+            .latency_avg_ms = rx == 0 ? 0 : (uint32_t)pdTICKS_TO_MS(total / rx),
+            .latency_max_ms = (uint32_t)pdTICKS_TO_MS(latency_max_ticks.load(std::memory_order_relaxed)),
+        };
+    }
+
+    Counters* register_queue(const char* name, uint32_t capacity) {
+        size_t index = counter_count.fetch_add(1);
+        if (index >= MAX_QUEUES) {
+            counter_count.store(MAX_QUEUES);
+            ESP_LOGW(TAG, "No room to track queue %s", name);
+            return nullptr;
+        }
+        counter_table[index].setup(name, capacity);
+        return &counter_table[index];
+    }
+
+    size_t get_stats(Stats* out, size_t max) {
+        size_t count = counter_count.load();
+        if (count > max) {
+            count = max;
+        }
+        for (size_t i = 0; i < count; i++) {
+            out[i] = counter_table[i].snapshot();
+        }
+        return count;
+    }
+
+    void log_stats() {
+        Stats stats[MAX_QUEUES];
+        size_t count = get_stats(stats, MAX_QUEUES);
+        for (size_t i = 0; i < count; i++) {
+            const Stats& s = stats[i];
+            ESP_LOGI(TAG,
+                     "%-14s hw %" PRIu32 "/%" PRIu32 " sent %" PRIu32 " rx %" PRIu32 " timeouts %" PRIu32
+                     " drops %" PRIu32 " full %" PRIu32 " latency avg %" PRIu32 "ms max %" PRIu32 "ms",
+                     s.name, s.high_water, s.capacity, s.sent, s.received, s.timeouts, s.drops, s.full_probes,
+                     s.latency_avg_ms, s.latency_max_ms);
+        }
+    }
+
+    bool StreamBuffer::create(const char* name, size_t size, size_t trigger_level) {
+        handle = xStreamBufferCreate(size, trigger_level);
+        if (handle == NULL) {
+            return false;
+        }
+        counters = register_queue(name, size);
+        return true;
+    }
+
+    size_t StreamBuffer::send(const void* data, size_t len, TickType_t wait) {
+        size_t written = xStreamBufferSend(handle, data, len, wait);
+        if (counters) {
+            bool ok = written == len;
+            counters->on_send(ok || written > 0, wait, xStreamBufferBytesAvailable(handle));
+            if (!ok && written > 0) {
+                counters->on_drop();
+            }
+        }
+        return written;
+    }
+
+    size_t StreamBuffer::receive(void* data, size_t len, TickType_t wait) {
+        size_t read = xStreamBufferReceive(handle, data, len, wait);
+        if (counters && read > 0) {
+            counters->on_receive();
+        }
+        return read;
+    }
+
+    void StreamBuffer::reset() {
+        if (counters && xStreamBufferBytesAvailable(handle) > 0) {
+            counters->on_drop();
+        }
+        xStreamBufferReset(handle);
+    }
+} // namespace Queues
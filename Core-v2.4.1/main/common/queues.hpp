@@ -0,0 +1,159 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/stream_buffer.h>
+#include <freertos/task.h>
+
+// Thin wrappers around FreeRTOS queues and stream buffers that keep per queue
+// telemetry so queue sizes can be picked from data instead of guesses.
+namespace Queues {
+    // Size of the registry, so callers can size a get_stats buffer that fits every queue
+    static constexpr size_t MAX_QUEUES = 12;
+
+    struct Stats {
+        const char* name;
+        uint32_t capacity;   // items, or bytes for stream buffers
+        uint32_t high_water; // deepest the queue has been right after a send
+        uint32_t sent;
+        uint32_t timeouts; // sends that waited and still found no room
+        uint32_t drops;    // sends that gave up without waiting, short writes, or data thrown away by a reset
+        uint32_t full_probes; // try_send calls that found the queue full, the caller retries so nothing was lost
+        uint32_t received;
+        uint32_t latency_avg_ms; // enqueue to dequeue, queues only
+        uint32_t latency_max_ms;
+    };
+
+    class Counters {
+      public:
+        void setup(const char* name, uint32_t capacity);
+        void on_send(bool ok, TickType_t wait, uint32_t depth);
+        void on_receive();
+        void on_latency(TickType_t enqueued_at);
+        void on_drop();
+        void on_full_probe(uint32_t depth);
+        Stats snapshot() const;
+
+      private:
+        const char* name = nullptr;
+        uint32_t capacity = 0;
+        std::atomic<uint32_t> high_water{0};
+        std::atomic<uint32_t> sent{0};
+        std::atomic<uint32_t> timeouts{0};
+        std::atomic<uint32_t> drops{0};
+        std::atomic<uint32_t> full_probes{0};
+        std::atomic<uint32_t> received{0};
+        std::atomic<uint32_t> latency_total_ticks{0};
+        std::atomic<uint32_t> latency_max_ticks{0};
+    };
+
+    // Returns a slot from a fixed table, or nullptr once it is full.
+    // Counters are never freed, queues in this firmware live forever.
+    Counters* register_queue(const char* name, uint32_t capacity);
+
+    // Copies up to max entries into out, returns how many were written
+    size_t get_stats(Stats* out, size_t max);
+    // Dumps every queue to the log (and so over USB), the network task calls it every CONFIG_QUEUE_STATS_LOG_PERIOD
+    void log_stats();
+
+    // Each item carries the tick it was sent on so the receiver can measure how
+    // long it sat in the queue. T is copied bytewise, same as a raw FreeRTOS queue.
+    template <typename T> class Queue {
+      public:
+        bool create(const char* name, UBaseType_t length) {
+            handle = xQueueCreate(length, SLOT_SIZE);
+            if (handle == NULL) {
+                return false;
+            }
+            counters = register_queue(name, length);
+            return true;
+        }
+
+        bool send(const T& item, TickType_t wait) {
+            uint8_t slot[SLOT_SIZE];
+            TickType_t now = xTaskGetTickCount();
+            memcpy(slot, &item, sizeof(T));
+            memcpy(slot + sizeof(T), &now, sizeof(TickType_t));
+
+            bool ok = xQueueSend(handle, slot, wait) == pdTRUE;
+            if (counters) {
+                counters->on_send(ok, wait, uxQueueMessagesWaiting(handle));
+            }
+            return ok;
+        }
+
+        // Zero wait send for callers that keep the item and retry when the queue is full.
+        // A full queue is counted as a probe rather than a drop. front jumps the queue.
+        bool try_send(const T& item, bool front = false) {
+            uint8_t slot[SLOT_SIZE];
+            TickType_t now = xTaskGetTickCount();
+            memcpy(slot, &item, sizeof(T));
+            memcpy(slot + sizeof(T), &now, sizeof(TickType_t));
+
+            bool ok = (front ? xQueueSendToFront(handle, slot, 0) : xQueueSend(handle, slot, 0)) == pdTRUE;
+            if (counters) {
+                if (ok) {
+                    counters->on_send(true, 0, uxQueueMessagesWaiting(handle));
+                } else {
+                    counters->on_full_probe(uxQueueMessagesWaiting(handle));
+                }
+            }
+            return ok;
+        }
+
+        bool receive(T& item, TickType_t wait) {
+            uint8_t slot[SLOT_SIZE];
+            if (xQueueReceive(handle, slot, wait) != pdTRUE) {
+                return false;
+            }
+            TickType_t enqueued_at;
+            memcpy(&item, slot, sizeof(T));
+            memcpy(&enqueued_at, slot + sizeof(T), sizeof(TickType_t));
+            if (counters) {
+                counters->on_receive();
+                counters->on_latency(enqueued_at);
+            }
+            return true;
+        }
+
+        // Waits for something to be available without taking it
+        bool peek(TickType_t wait) {
+            uint8_t slot[SLOT_SIZE];
+            return xQueuePeek(handle, slot, wait) == pdTRUE;
+        }
+
+        void reset() {
+            if (counters && uxQueueMessagesWaiting(handle) > 0) {
+                counters->on_drop();
+            }
+            xQueueReset(handle);
+        }
+
+        bool valid() const {
+            return handle != NULL;
+        }
+
+      private:
+        static constexpr size_t SLOT_SIZE = sizeof(T) + sizeof(TickType_t);
+        QueueHandle_t handle = NULL;
+        Counters* counters = nullptr;
+    };
+
+    class StreamBuffer {
+      public:
+        bool create(const char* name, size_t size, size_t trigger_level);
+        size_t send(const void* data, size_t len, TickType_t wait);
+        size_t receive(void* data, size_t len, TickType_t wait);
+        void reset();
+        bool valid() const {
+            return handle != NULL;
+        }
+
+      private:
+        StreamBufferHandle_t handle = NULL;
+        Counters* counters = nullptr;
+    };
+} // namespace Queues
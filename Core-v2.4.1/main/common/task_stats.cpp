@@ -0,0 +1,108 @@
+#include "task_stats.hpp"
+
+#include <cstring>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include "esp_log.h"
+#include "sdkconfig.h"
+#ifdef CONFIG_HEAP_TASK_TRACKING
+#include "esp_heap_task_info.h"
+#endif
+
+static const char* TAG = "task-stats";
+
+namespace TaskStats {
+    static SemaphoreHandle_t collect_lock = NULL;
+
+#if configUSE_TRACE_FACILITY && configGENERATE_RUN_TIME_STATS
+    static TaskStatus_t statuses[MAX_TASKS];
+
+    static configRUN_TIME_COUNTER_TYPE previous_counter(const Window& window, TaskHandle_t handle) {
+        for (size_t i = 0; i < window.count; i++) {
+            if (window.previous[i].handle == handle) {
+                return window.previous[i].counter;
+            }
+        }
+        return 0;
+    }
+#endif
+
+#ifdef CONFIG_HEAP_TASK_TRACKING
+    static heap_task_totals_t heap_totals[MAX_TASKS];
+
+    static size_t collect_heap() {
+        size_t num_totals = 0;
+        heap_task_info_params_t params = {};
+        params.caps[0] = MALLOC_CAP_INTERNAL;
+        params.mask[0] = MALLOC_CAP_INTERNAL;
+        params.totals = heap_totals;
+        params.num_totals = &num_totals;
+        params.max_totals = MAX_TASKS;
+        heap_caps_get_per_task_info(&params);
+        return num_totals;
+    }
+
+    static uint32_t heap_owned_by(TaskHandle_t handle, size_t num_totals) {
+        for (size_t i = 0; i < num_totals; i++) {
+            if (heap_totals[i].task == handle) {
+                return heap_totals[i].size[0];
+            }
+        }
+        return 0;
+    }
+#endif
+
+    void init() {
+        collect_lock = xSemaphoreCreateMutex();
+        if (collect_lock == NULL) {
+            ESP_LOGE(TAG, "Couldn't create task stats lock");
+        }
+    }
+
+    size_t collect(Window& window, TaskInfo* out, size_t max) {
+#if configUSE_TRACE_FACILITY && configGENERATE_RUN_TIME_STATS
+        if (collect_lock == NULL || xSemaphoreTake(collect_lock, pdMS_TO_TICKS(100)) != pdTRUE) {
+            return 0;
+        }
+
+        configRUN_TIME_COUNTER_TYPE total = 0;
+        size_t count = uxTaskGetSystemState(statuses, MAX_TASKS, &total);
+        configRUN_TIME_COUNTER_TYPE elapsed = total - window.total;
+#ifdef CONFIG_HEAP_TASK_TRACKING
+        size_t num_totals = collect_heap();
+#endif
+
+        size_t written = 0;
+        for (size_t i = 0; i < count; i++) {
+            const TaskStatus_t& status = statuses[i];
+            configRUN_TIME_COUNTER_TYPE ran = status.ulRunTimeCounter - previous_counter(window, status.xHandle);
+
+            if (written < max) {
+                TaskInfo& info = out[written++];
+                strncpy(info.name, status.pcTaskName, sizeof(info.name) - 1);
+                info.name[sizeof(info.name) - 1] = '\0';
+                info.priority = status.uxCurrentPriority;
+                info.cpu_permille = elapsed == 0 ? 0 : (uint32_t)((uint64_t)ran * 1000 / elapsed);
+                info.stack_free = status.usStackHighWaterMark * sizeof(StackType_t);
+#ifdef CONFIG_HEAP_TASK_TRACKING
+                info.heap_bytes = heap_owned_by(status.xHandle, num_totals);
+#else
+                info.heap_bytes = 0;
+#endif
+            }
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            window.previous[i] = {.handle = statuses[i].xHandle, .counter = statuses[i].ulRunTimeCounter};
+        }
+        window.count = count;
+        window.total = total;
+
+        xSemaphoreGive(collect_lock);
+        return written;
+#else
+        return 0;
+#endif
+    }
+} // namespace TaskStats
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+// Per task CPU, stack and heap usage, used to size task stacks from field data.
+// Needs CONFIG_FREERTOS_USE_TRACE_FACILITY, CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+// and CONFIG_HEAP_TASK_TRACKING. Without them collect() reports nothing.
+namespace TaskStats {
+    static constexpr size_t MAX_TASKS = 24;
+    // Anything under this many untouched stack bytes gets called out
+    static constexpr uint32_t LOW_STACK_BYTES = 256;
+
+    struct TaskInfo {
+        char name[configMAX_TASK_NAME_LEN];
+        UBaseType_t priority;
+        uint32_t cpu_permille; // share of the CPU since the previous collect() with the same window
+        uint32_t stack_free;   // bytes of stack never touched since the task started
+        uint32_t heap_bytes;   // heap currently owned by allocations made from this task
+    };
+
+    // Run time counters from a caller's previous collect(), CPU share is the
+    // delta. Each caller keeps its own so they don't cut each other's short.
+    struct Window {
+        struct RunTime {
+            TaskHandle_t handle;
+            configRUN_TIME_COUNTER_TYPE counter;
+        };
+
+        RunTime previous[MAX_TASKS] = {};
+        size_t count = 0;
+        configRUN_TIME_COUNTER_TYPE total = 0;
+    };
+
+    void init();
+
+    // Fills out with one entry per task and moves window on to now, returns the
+    // number of entries written
+    size_t collect(Window& window, TaskInfo* out, size_t max);
+} // namespace TaskStats
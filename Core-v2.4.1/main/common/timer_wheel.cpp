@@ -0,0 +1,234 @@
+#include "timer_wheel.hpp"
+
+#include <atomic>
+#include <cinttypes>
+#include <freertos/task.h>
+
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+static const char* TAG = "timer-wheel";
+
+namespace TimerWheel {
+    static constexpr size_t SLOTS = 64;
+    // Expiries handed to owners per pass, anything beyond waits for the next pass
+    static constexpr size_t MAX_EXPIRED = 8;
+    // Above every application task so expiries are posted on time
+    static constexpr UBaseType_t TASK_PRIORITY = 1;
+
+    struct Expired {
+        Timer* timer;
+        PostFn post;
+        uint32_t id;
+        uint32_t generation;
+        TickType_t expiry;
+    };
+
+    static portMUX_TYPE wheel_lock = portMUX_INITIALIZER_UNLOCKED;
+    static Timer* slots[SLOTS] = {};
+    static TickType_t processed_until = 0; // every expiry at or before this has been handed out
+    static TickType_t next_wake = 0;
+    static bool sleeping_forever = true;
+    static TaskHandle_t timer_task = NULL;
+
+    static std::atomic<uint32_t> fired{0};
+    static std::atomic<uint32_t> post_retries{0};
+    static std::atomic<uint32_t> late_max_ticks{0};
+
+    static bool before_or_at(TickType_t a, TickType_t b) {
+        return (int32_t)(a - b) <= 0;
+    }
+
+    // Both take wheel_lock as held
+    static void link(Timer& timer) {
+        Timer*& head = slots[timer.expiry % SLOTS];
+        timer.prev = nullptr;
+        timer.next = head;
+        if (head) {
+            head->prev = &timer;
+        }
+        head = &timer;
+        timer.armed = true;
+    }
+
+    static void unlink(Timer& timer) {
+        if (timer.prev) {
+            timer.prev->next = timer.next;
+        } else {
+            slots[timer.expiry % SLOTS] = timer.next;
+        }
+        if (timer.next) {
+            timer.next->prev = timer.prev;
+        }
+        timer.prev = nullptr;
+        timer.next = nullptr;
+        timer.armed = false;
+    }
+
+    // Wake the service task if it is going to sleep past this expiry
+    static bool needs_wake(TickType_t expiry) {
+        return sleeping_forever || (int32_t)(expiry - next_wake) < 0;
+    }
+
+    void arm(Timer& timer, TickType_t delay, TickType_t period) {
+        if (delay == 0) {
+            delay = 1;
+        }
+
+        taskENTER_CRITICAL(&wheel_lock);
+        if (timer.armed) {
+            unlink(timer);
+        }
+        timer.generation++;
+        timer.period = period;
+        timer.expiry = xTaskGetTickCount() + delay;
+        link(timer);
+        bool wake = needs_wake(timer.expiry);
+        taskEXIT_CRITICAL(&wheel_lock);
+
+        if (wake && timer_task != NULL) {
+            xTaskNotifyGive(timer_task);
+        }
+    }
+
+    void cancel(Timer& timer) {
+        taskENTER_CRITICAL(&wheel_lock);
+        if (timer.armed) {
+            unlink(timer);
+        }
+        timer.generation++;
+        taskEXIT_CRITICAL(&wheel_lock);
+    }
+
+    bool is_current(const Timer& timer, uint32_t generation) {
+        taskENTER_CRITICAL(&wheel_lock);
+        bool current = timer.generation == generation;
+        taskEXIT_CRITICAL(&wheel_lock);
+        return current;
+    }
+
+    // Unlinks whatever expired by now into out. Only the slots for ticks since
+    // the last pass can hold due timers, a full lap covers every slot.
+    static size_t collect_expired(TickType_t now, Expired* out) {
+        size_t count = 0;
+
+        taskENTER_CRITICAL(&wheel_lock);
+        TickType_t steps = now - processed_until;
+        if (steps > SLOTS) {
+            steps = SLOTS;
+        }
+
+        TickType_t step = 1;
+        for (; step <= steps && count < MAX_EXPIRED; step++) {
+            Timer* timer = slots[(processed_until + step) % SLOTS];
+            while (timer && count < MAX_EXPIRED) {
+                Timer* next = timer->next;
+                if (before_or_at(timer->expiry, now)) {
+                    out[count++] = {
+                        .timer = timer,
+                        .post = timer->post,
+                        .id = timer->id,
+                        .generation = timer->generation,
+                        .expiry = timer->expiry,
+                    };
+                    unlink(*timer);
+                    if (timer->period != 0) {
+                        timer->expiry += timer->period;
+                        if (before_or_at(timer->expiry, now)) {
+                            timer->expiry = now + timer->period;
+                        }
+                        link(*timer);
+                    }
+                }
+                timer = next;
+            }
+        }
+
+        if (count < MAX_EXPIRED) {
+            processed_until = now;
+        } else {
+            // Out of room, the next pass starts again from the slot it stopped in
+            processed_until += step - 2;
+        }
+        taskEXIT_CRITICAL(&wheel_lock);
+        return count;
+    }
+
+    // Sleep time until the nearest expiry, also records it so arm() knows
+    // whether the task needs waking
+    static TickType_t time_to_next(TickType_t now) {
+        taskENTER_CRITICAL(&wheel_lock);
+        bool any = false;
+        TickType_t nearest = 0;
+        for (size_t i = 0; i < SLOTS; i++) {
+            for (Timer* timer = slots[i]; timer; timer = timer->next) {
+                if (!any || (int32_t)(timer->expiry - nearest) < 0) {
+                    nearest = timer->expiry;
+                    any = true;
+                }
+            }
+        }
+
+        TickType_t wait = portMAX_DELAY;
+        if (any) {
+            wait = before_or_at(nearest, now) ? 0 : nearest - now;
+            next_wake = nearest;
+        }
+        sleeping_forever = !any;
+        taskEXIT_CRITICAL(&wheel_lock);
+        return wait;
+    }
+
+    static void retry(const Expired& expired) {
+        taskENTER_CRITICAL(&wheel_lock);
+        // Only if nobody re-armed or cancelled it meanwhile
+        if (!expired.timer->armed && expired.timer->generation == expired.generation) {
+            expired.timer->expiry = xTaskGetTickCount() + 1;
+            link(*expired.timer);
+        }
+        taskEXIT_CRITICAL(&wheel_lock);
+        post_retries.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static void timer_task_fn(void*) {
+        Expired expired[MAX_EXPIRED];
+
+        while (true) {
+            TickType_t now = xTaskGetTickCount();
+            size_t count = collect_expired(now, expired);
+
+            for (size_t i = 0; i < count; i++) {
+                TickType_t late = xTaskGetTickCount() - expired[i].expiry;
+                if (late > late_max_ticks.load(std::memory_order_relaxed)) {
+                    late_max_ticks.store(late, std::memory_order_relaxed);
+                }
+                fired.fetch_add(1, std::memory_order_relaxed);
+
+                if (expired[i].post != nullptr && !expired[i].post(expired[i].id, expired[i].generation)) {
+                    ESP_LOGW(TAG, "Owner queue full for timer %" PRIu32 ", retrying", expired[i].id);
+                    retry(expired[i]);
+                }
+            }
+
+            ulTaskNotifyTake(pdTRUE, time_to_next(xTaskGetTickCount()));
+        }
+    }
+
+    int init() {
+        processed_until = xTaskGetTickCount();
+        if (xTaskCreate(timer_task_fn, "timer_wheel", CONFIG_TIMER_WHEEL_TASK_STACK_SIZE, NULL, TASK_PRIORITY,
+                        &timer_task) != pdPASS) {
+            ESP_LOGE(TAG, "Failed to start timer task");
+            return 1;
+        }
+        return 0;
+    }
+
+    Stats get_stats() {
+        return {
+            .fired = fired.load(std::memory_order_relaxed),
+            .post_retries = post_retries.load(std::memory_order_relaxed),
+            .late_max_ms = pdTICKS_TO_MS(late_max_ticks.load(std::memory_order_relaxed)),
+        };
+    }
+} // namespace TimerWheel
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <freertos/FreeRTOS.h>
+
+// Timeouts for the state machines. Expiry never runs owner code, it posts a
+// typed event into the owner's queue so every transition happens on the owning
+// task. Timers sit in a hashed wheel of intrusive lists: arm and cancel are
+// O(1), and the service task sleeps until the nearest expiry.
+namespace TimerWheel {
+    // Posts the expiry into the owner's queue. Runs on the timer task, must not
+    // block for long. Returning false retries a tick later.
+    using PostFn = bool (*)(uint32_t id, uint32_t generation);
+
+    struct Timer {
+        PostFn post = nullptr;
+        uint32_t id = 0; // handed back to post, lets one post function serve several timers
+
+        // Owned by the wheel
+        Timer* prev = nullptr;
+        Timer* next = nullptr;
+        TickType_t expiry = 0;
+        TickType_t period = 0;
+        uint32_t generation = 0;
+        bool armed = false;
+    };
+
+    struct Stats {
+        uint32_t fired;
+        uint32_t post_retries; // expiries the owner's queue had no room for
+        uint32_t late_max_ms;  // worst expiry to post delay
+    };
+
+    int init();
+
+    // (Re)starts the timer, dropping any pending expiry. A non zero period
+    // keeps it firing until cancelled. Safe from any task.
+    void arm(Timer& timer, TickType_t delay, TickType_t period = 0);
+    void cancel(Timer& timer);
+
+    // False if the timer was re-armed or cancelled after this expiry was
+    // posted, owners should drop the event in that case.
+    bool is_current(const Timer& timer, uint32_t generation);
+
+    Stats get_stats();
+} // namespace TimerWheel
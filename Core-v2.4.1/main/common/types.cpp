@@ -87,8 +87,8 @@ std::optional<IOState> parse_iostate(const char* str) {
         return IOState::WELCOMED;
     } else if (0 == strcasecmp(str, "alwaysonwaiting")) {
         return IOState::ALWAYS_ON_WAITING;
-    } else if (0 == strcasecmp(str, "alwaysonwaiting")) {
-        return IOState::ALWAYS_ON_WAITING;
+    } else if (0 == strcasecmp(str, "lockoutwaiting")) {
+        return IOState::LOCKOUT_WAITING;
     } else if (0 == strcasecmp(str, "idlewaiting")) {
         return IOState::IDLE_WAITING;
     } else if (0 == strcasecmp(str, "awaitauth")) {
@@ -165,11 +165,28 @@ const char* io_event_type_to_string(IOEventType type) {
             return "Network Command";
         case IOEventType::CARD_READ_ERROR:
             return "Card Read Error";
+        case IOEventType::TIMEOUT:
+            return "Timeout";
+        case IOEventType::FAULT:
+            return "Fault";
         default:
             return "Unknown IOEvent Type";
     }
 }
 
+const char* io_timer_to_string(IOTimer timer) {
+    switch (timer) {
+        case IOTimer::WAITING:
+            return "Waiting";
+        case IOTimer::IDENTIFY:
+            return "Identify";
+        case IOTimer::DENIED:
+            return "Denied";
+        default:
+            return "Unknown IOTimer";
+    }
+}
+
 std::string CardDetectedEvent::to_string() const {
     return "detected:" + card_tag_id.to_string();
 }
@@ -208,6 +225,10 @@ std::string IOEvent::to_string() const {
             return "Card Removed";
         case IOEventType::NETWORK_COMMAND:
             return "Network Command: " + network_command.to_string();
+        case IOEventType::TIMEOUT:
+            return std::string("Timeout: ") + io_timer_to_string(timeout.timer);
+        case IOEventType::FAULT:
+            return std::string("Fault: ") + fault_reason_to_string(fault.reason);
         default:
             return "INVALID IOEVENT";
     }
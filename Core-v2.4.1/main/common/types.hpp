@@ -76,6 +76,8 @@ enum class IOEventType {
     CARD_REMOVED,
     CARD_READ_ERROR,
     NETWORK_COMMAND,
+    TIMEOUT,
+    FAULT,
 };
 const char* io_event_type_to_string(IOEventType type);
 
@@ -114,6 +116,31 @@ struct NetworkCommandEvent {
     std::string to_string() const;
 };
 
+enum class IOTimer {
+    WAITING,
+    IDENTIFY,
+    DENIED,
+};
+const char* io_timer_to_string(IOTimer timer);
+
+struct TimeoutEvent {
+    IOTimer timer;
+    uint32_t generation; // checked against the timer, stale expiries are dropped
+};
+
+enum class FaultReason {
+    SERVER_COMMANDED,
+    TEMP_ERROR,
+    START_FAIL,
+    CARD_SWITCH,
+    SOFTWARE_ERROR,
+};
+const char* fault_reason_to_string(FaultReason type);
+
+struct FaultEvent {
+    FaultReason reason;
+};
+
 // From other things, to IO
 struct IOEvent {
     IOEventType type;
@@ -123,6 +150,8 @@ struct IOEvent {
         CardDetectedEvent card_detected;
         CardRemovedEvent card_removed;
         NetworkCommandEvent network_command;
+        TimeoutEvent timeout;
+        FaultEvent fault;
     };
     std::string to_string() const;
 };
@@ -159,9 +188,10 @@ struct AuthResponse {
 // Things to tell network task
 enum class NetworkEventType {
     AuthRequest,
-    Message,
     StateChange,
     PleaseRestart,
+    SongMissing,
+    CABundleResult,
 };
 
 struct NetworkEvent {
@@ -169,8 +199,9 @@ struct NetworkEvent {
     union {
         int _ = 0;
         AuthRequest auth_request;
-        char* message; // allocated using new[]. Sending this also sends lifetime (network will delete[])
         StateChange state_change;
+        uint16_t song_id;
+        bool ca_bundle_installed;
     };
 };
 enum class HardwareEdition {
@@ -178,12 +209,4 @@ enum class HardwareEdition {
     STANDARD,
 };
 
-enum class FaultReason {
-    SERVER_COMMANDED,
-    TEMP_ERROR,
-    START_FAIL,
-    CARD_SWITCH,
-    SOFTWARE_ERROR,
-};
 StateChangeReason fault_reason_to_state_change_reason(FaultReason fault);
-const char* fault_reason_to_string(FaultReason type);
@@ -0,0 +1,309 @@
+#include "AnimationPack.hpp"
+
+#include <cstdlib>
+#include <cstring>
+
+#include "common/flash_region.hpp"
+#include "esp_log.h"
+
+static const char* TAG = "anim-pack";
+
+namespace AnimationPack {
+    static constexpr uint8_t FORMAT_VERSION = 1;
+    static constexpr size_t MAX_PACK_BYTES = 2048;
+    static constexpr size_t MAX_PALETTE = 32;
+    static constexpr size_t MAX_FRAMES = 192;
+    static constexpr size_t BUILTIN_COUNT = sizeof(Animation::BUILTINS) / sizeof(Animation::BUILTINS[0]);
+
+    // Stored layout: header, palette_len RGB triples, then count entries of
+    // {builtin index, frame count, frames}
+    struct Header {
+        uint8_t version;
+        uint8_t palette_len;
+        uint8_t count;
+        uint8_t reserved;
+    };
+
+    static_assert(sizeof(Animation::Frame) == 6, "pack frames are stored bytewise");
+
+    // Sized from the stored pack by init, a board without one spends nothing on them
+    static Animation::RGB* palette = nullptr;
+    static Animation::Frame* frames = nullptr;
+    static Animation::Animation overrides[BUILTIN_COUNT];
+    static bool overridden[BUILTIN_COUNT] = {};
+
+    static int builtin_index(const char* name) {
+        for (size_t i = 0; i < BUILTIN_COUNT; i++) {
+            if (strcmp(Animation::BUILTINS[i]->name, name) == 0) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    static bool frame_ok(const Animation::Frame& frame, uint8_t palette_len) {
+        for (uint8_t p : frame.pixels) {
+            if (p >= palette_len) {
+                return false;
+            }
+        }
+        return frame.hold > 0 && frame.fade <= frame.hold;
+    }
+
+    // Walks a stored pack and counts its frames. With apply set the frames are
+    // copied into place, otherwise it only checks that everything is in bounds.
+    static bool parse(const uint8_t* data, size_t len, bool apply, size_t& frames_used) {
+        Header header;
+        if (len < sizeof(header)) {
+            return false;
+        }
+        memcpy(&header, data, sizeof(header));
+        if (header.version != FORMAT_VERSION || header.palette_len == 0 || header.palette_len > MAX_PALETTE) {
+            return false;
+        }
+
+        size_t pos = sizeof(header);
+        size_t palette_bytes = header.palette_len * sizeof(Animation::RGB);
+        if (pos + palette_bytes > len) {
+            return false;
+        }
+        if (apply) {
+            memcpy(palette, data + pos, palette_bytes);
+        }
+        pos += palette_bytes;
+
+        frames_used = 0;
+        for (uint8_t n = 0; n < header.count; n++) {
+            if (pos + 2 > len) {
+                return false;
+            }
+            uint8_t index = data[pos];
+            uint8_t length = data[pos + 1];
+            pos += 2;
+            if (index >= BUILTIN_COUNT || length == 0 || frames_used + length > MAX_FRAMES ||
+                pos + length * sizeof(Animation::Frame) > len) {
+                return false;
+            }
+
+            for (uint8_t f = 0; f < length; f++) {
+                Animation::Frame frame;
+                memcpy(&frame, data + pos, sizeof(frame));
+                pos += sizeof(frame);
+                if (!frame_ok(frame, header.palette_len)) {
+                    return false;
+                }
+                if (apply) {
+                    memcpy(&frames[frames_used + f], &frame, sizeof(frame));
+                }
+            }
+
+            if (apply) {
+                overrides[index] = {
+                    .name = Animation::BUILTINS[index]->name,
+                    .palette = palette,
+                    .frames = &frames[frames_used],
+                    .length = length,
+                };
+                overridden[index] = true;
+            }
+            frames_used += length;
+        }
+        return pos == len;
+    }
+
+    // Reads a checked pack into storage sized for it
+    static bool load(const uint8_t* data, size_t len, size_t frame_count) {
+        Header header;
+        memcpy(&header, data, sizeof(header));
+        palette = (Animation::RGB*)malloc(header.palette_len * sizeof(Animation::RGB));
+        frames = (Animation::Frame*)malloc(frame_count * sizeof(Animation::Frame));
+        if (palette == nullptr || (frame_count > 0 && frames == nullptr)) {
+            free(palette);
+            free(frames);
+            palette = nullptr;
+            frames = nullptr;
+            return false;
+        }
+        return parse(data, len, true, frame_count);
+    }
+
+    int init() {
+        // Only needed while loading, the pack keeps just its palette and frames
+        uint8_t* stored = (uint8_t*)malloc(MAX_PACK_BYTES);
+        if (stored == nullptr) {
+            ESP_LOGE(TAG, "No memory to read the animation pack");
+            return 1;
+        }
+        size_t len = 0;
+        size_t frame_count = 0;
+        bool found = FlashRegion::read(FlashRegion::Region::ANIMATIONS, stored, MAX_PACK_BYTES, len);
+        bool ok = found && parse(stored, len, false, frame_count);
+        bool loaded = ok && load(stored, len, frame_count);
+        free(stored);
+
+        if (!found) {
+            return 0; // nothing stored, built-ins it is
+        }
+        if (!ok) {
+            ESP_LOGE(TAG, "Stored animation pack is malformed, ignoring it");
+            return 1;
+        }
+        if (!loaded) {
+            ESP_LOGE(TAG, "No memory for the animation pack, using the built-ins");
+            return 1;
+        }
+
+        int count = 0;
+        for (bool o : overridden) {
+            count += o;
+        }
+        ESP_LOGI(TAG, "Loaded animation pack replacing %d animations", count);
+        return 0;
+    }
+
+    const Animation::Animation* resolve(const Animation::Animation* builtin) {
+        for (size_t i = 0; i < BUILTIN_COUNT; i++) {
+            if (Animation::BUILTINS[i] == builtin) {
+                return overridden[i] ? &overrides[i] : builtin;
+            }
+        }
+        return builtin;
+    }
+
+    static bool read_ms(const cJSON* item, uint8_t& out) {
+        if (!cJSON_IsNumber(item)) {
+            return false;
+        }
+        double ms = cJSON_GetNumberValue(item);
+        if (ms < 0 || ms > UINT8_MAX * Animation::TIME_UNIT_MS) {
+            return false;
+        }
+        out = (uint8_t)(ms / Animation::TIME_UNIT_MS);
+        return true;
+    }
+
+    // [[p, p, p, p], hold_ms, fade_ms], timings optional
+    static bool read_frame(const cJSON* def, Animation::Frame& frame) {
+        const cJSON* pixels = cJSON_GetArrayItem(def, 0);
+        if (!cJSON_IsArray(def) || !cJSON_IsArray(pixels) || cJSON_GetArraySize(pixels) != 4) {
+            return false;
+        }
+        frame = Animation::Frame({0, 0, 0, 0});
+        for (int i = 0; i < 4; i++) {
+            const cJSON* p = cJSON_GetArrayItem(pixels, i);
+            if (!cJSON_IsNumber(p) || cJSON_GetNumberValue(p) < 0 || cJSON_GetNumberValue(p) > UINT8_MAX) {
+                return false;
+            }
+            frame.pixels[i] = (uint8_t)cJSON_GetNumberValue(p);
+        }
+        int size = cJSON_GetArraySize(def);
+        if (size > 1 && !read_ms(cJSON_GetArrayItem(def, 1), frame.hold)) {
+            return false;
+        }
+        if (size > 2 && !read_ms(cJSON_GetArrayItem(def, 2), frame.fade)) {
+            return false;
+        }
+        return true;
+    }
+
+    // Packs the JSON form into out, which holds MAX_PACK_BYTES. Returns the length or 0 if it doesn't fit or make sense.
+    static size_t encode(const cJSON* pack, uint8_t* out) {
+        const cJSON* palette_obj = cJSON_GetObjectItem(pack, "Palette");
+        const cJSON* animations_obj = cJSON_GetObjectItem(pack, "Animations");
+        if (!cJSON_IsArray(palette_obj) || !cJSON_IsObject(animations_obj)) {
+            ESP_LOGW(TAG, "Animation pack needs a Palette array and Animations object");
+            return 0;
+        }
+
+        Header header = {
+            .version = FORMAT_VERSION,
+            .palette_len = (uint8_t)cJSON_GetArraySize(palette_obj),
+            .count = (uint8_t)cJSON_GetArraySize(animations_obj),
+            .reserved = 0,
+        };
+        if ((size_t)cJSON_GetArraySize(palette_obj) > MAX_PALETTE ||
+            (size_t)cJSON_GetArraySize(animations_obj) > BUILTIN_COUNT) {
+            ESP_LOGW(TAG, "Animation pack is too big");
+            return 0;
+        }
+        size_t pos = 0;
+        memcpy(out, &header, sizeof(header));
+        pos += sizeof(header);
+
+        const cJSON* color = NULL;
+        cJSON_ArrayForEach(color, palette_obj) {
+            if (cJSON_GetArraySize(color) != 3) {
+                ESP_LOGW(TAG, "Palette entries are [r, g, b]");
+                return 0;
+            }
+            for (int c = 0; c < 3; c++) {
+                const cJSON* channel = cJSON_GetArrayItem(color, c);
+                if (!cJSON_IsNumber(channel) || cJSON_GetNumberValue(channel) < 0 ||
+                    cJSON_GetNumberValue(channel) > UINT8_MAX) {
+                    ESP_LOGW(TAG, "Palette channels are 0-255");
+                    return 0;
+                }
+                out[pos++] = (uint8_t)cJSON_GetNumberValue(channel);
+            }
+        }
+
+        const cJSON* animation = NULL;
+        cJSON_ArrayForEach(animation, animations_obj) {
+            int index = builtin_index(animation->string);
+            int length = cJSON_GetArraySize(animation);
+            if (index < 0) {
+                ESP_LOGW(TAG, "No built-in animation called %s", animation->string);
+                return 0;
+            }
+            if (!cJSON_IsArray(animation) || length == 0 || length > UINT8_MAX ||
+                pos + 2 + length * sizeof(Animation::Frame) > MAX_PACK_BYTES) {
+                ESP_LOGW(TAG, "Bad frame list for %s", animation->string);
+                return 0;
+            }
+            out[pos++] = (uint8_t)index;
+            out[pos++] = (uint8_t)length;
+
+            const cJSON* def = NULL;
+            cJSON_ArrayForEach(def, animation) {
+                Animation::Frame frame;
+                if (!read_frame(def, frame)) {
+                    ESP_LOGW(TAG, "Bad frame in %s", animation->string);
+                    return 0;
+                }
+                memcpy(out + pos, &frame, sizeof(frame));
+                pos += sizeof(frame);
+            }
+        }
+        return pos;
+    }
+
+    bool install(const cJSON* pack) {
+        // Only an explicit empty object clears the pack, a missing or mistyped key is rejected by encode
+        const cJSON* animations_obj = cJSON_GetObjectItem(pack, "Animations");
+        if (cJSON_IsObject(animations_obj) && cJSON_GetArraySize(animations_obj) == 0) {
+            ESP_LOGI(TAG, "Removing animation pack, built-ins from next boot");
+            return FlashRegion::clear(FlashRegion::Region::ANIMATIONS);
+        }
+
+        uint8_t* encoded = (uint8_t*)malloc(MAX_PACK_BYTES);
+        if (encoded == nullptr) {
+            ESP_LOGE(TAG, "No memory to encode the animation pack");
+            return false;
+        }
+        size_t len = encode(pack, encoded);
+        size_t frame_count = 0;
+        bool ok = len != 0 && parse(encoded, len, false, frame_count);
+        if (!ok) {
+            ESP_LOGW(TAG, "Rejected animation pack");
+        } else if (!FlashRegion::write(FlashRegion::Region::ANIMATIONS, encoded, len)) {
+            ESP_LOGE(TAG, "Couldn't store animation pack");
+            ok = false;
+        }
+        free(encoded);
+
+        if (ok) {
+            ESP_LOGI(TAG, "Stored %u byte animation pack, applies from next boot", (unsigned)len);
+        }
+        return ok;
+    }
+} // namespace AnimationPack
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "cJSON.h"
+#include "io/LEDAnimations.hpp"
+
+// Site specific replacements for the built-in animations, pushed by the
+// server and kept in flash. Packs use the same frame format as the built-ins
+// with their own palette.
+namespace AnimationPack {
+    // Loads the stored pack, if any. Call before the LED task starts.
+    int init();
+
+    // The pack's version of a built-in animation, or the built-in itself
+    const Animation::Animation* resolve(const Animation::Animation* builtin);
+
+    /**
+     * Checks and stores a pack from the server, which takes effect on the next
+     * boot. A pack without animations removes the stored one.
+     * {"Palette": [[r, g, b], ...], "Animations": {"IDLE": [[[p, p, p, p], hold_ms, fade_ms], ...], ...}}
+     * @return true if the pack was stored
+     */
+    bool install(const cJSON* pack);
+} // namespace AnimationPack
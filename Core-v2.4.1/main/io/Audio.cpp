@@ -0,0 +1,443 @@
+#include "Audio.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cstring>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <string>
+
+#include "common/flash_region.hpp"
+#include "common/pins.hpp"
+#include "common/power.hpp"
+#include "common/queues.hpp"
+#include "driver/i2s_std.h"
+#include "esp_log.h"
+#include "io/Buzzer.hpp"
+#include "network/http_manager.hpp"
+#include "network/network.hpp"
+#include "network/storage.hpp"
+
+static const char* TAG = "audio";
+
+namespace Audio {
+    // Two DMA buffers of 256 samples, 16 ms each at 16 kHz. The task refills
+    // one from flash while the other plays.
+    static constexpr size_t DMA_BUFFERS = 2;
+    static constexpr size_t DMA_FRAMES = 256;
+    // Same as the buzzer, above every application task so a refill is never
+    // held up behind the network or card reader
+    static constexpr UBaseType_t AUDIO_TASK_PRIORITY = 2;
+    static constexpr uint32_t DEFAULT_RATE = 16000;
+
+    struct Clip {
+        bool ready;
+        uint32_t hash;
+        uint32_t rate;
+        uint8_t bytes_per_sample; // 1 is unsigned 8 bit, 2 is signed 16 bit
+        size_t data_offset;
+        size_t samples;
+    };
+
+    // A clip of NO_CLIP asks the task to stop unless what plays is more important
+    struct Request {
+        uint8_t clip;
+        SoundEffect::Priority priority;
+    };
+
+    // Priority of the clip playing, or NOT_PLAYING
+    static constexpr int NOT_PLAYING = -1;
+    static std::atomic<int> playing_level{NOT_PLAYING};
+
+    // Owns a download while it is in flight
+    struct Download {
+        std::string url;
+        uint8_t clip;
+        FlashRegion::Writer writer;
+        bool failed;
+    };
+
+    static i2s_chan_handle_t tx_chan = NULL;
+    static Queues::Queue<Request> request_queue;
+    static TaskHandle_t audio_thread = NULL;
+    static Power::Lock audio_power_lock;
+
+    static portMUX_TYPE clips_lock = portMUX_INITIALIZER_UNLOCKED;
+    static Clip clips[MAX_CLIPS] = {};
+    static size_t clip_count = 0;
+
+    static uint8_t raw[DMA_FRAMES * 2];
+    static int16_t pcm[DMA_FRAMES];
+
+    static std::atomic<uint32_t> started{0};
+    static std::atomic<uint32_t> underruns{0};
+    static std::atomic<uint32_t> preempted{0};
+    static std::atomic<uint32_t> dropped{0};
+
+    static bool get_clip(uint8_t id, Clip& out) {
+        if (id >= clip_count) {
+            return false;
+        }
+        taskENTER_CRITICAL(&clips_lock);
+        out = clips[id];
+        taskEXIT_CRITICAL(&clips_lock);
+        return out.ready;
+    }
+
+    static void set_clip(uint8_t id, const Clip& clip) {
+        taskENTER_CRITICAL(&clips_lock);
+        clips[id] = clip;
+        taskEXIT_CRITICAL(&clips_lock);
+    }
+
+    static uint32_t read_u32(const uint8_t* p) {
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+    static uint16_t read_u16(const uint8_t* p) {
+        return p[0] | (p[1] << 8);
+    }
+
+    // Checks the stored file and finds its samples. Only plain mono PCM is
+    // taken, anything else is converted on the server.
+    static bool load_clip(uint8_t id) {
+        Clip clip = {};
+        size_t len = 0;
+        if (!FlashRegion::stat(FlashRegion::Region::CLIPS, id, len, clip.hash)) {
+            return false;
+        }
+
+        uint8_t header[12];
+        if (len < sizeof(header) || !FlashRegion::read_at(FlashRegion::Region::CLIPS, id, 0, header, sizeof(header)) ||
+            memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0) {
+            ESP_LOGW(TAG, "Clip %u isn't a WAV file", id);
+            return false;
+        }
+
+        bool have_format = false;
+        size_t pos = sizeof(header);
+        while (pos + 8 <= len && clip.samples == 0) {
+            uint8_t chunk[8];
+            if (!FlashRegion::read_at(FlashRegion::Region::CLIPS, id, pos, chunk, sizeof(chunk))) {
+                return false;
+            }
+            uint32_t size = read_u32(chunk + 4);
+            pos += sizeof(chunk);
+
+            if (memcmp(chunk, "fmt ", 4) == 0 && size >= 16) {
+                uint8_t fmt[16];
+                if (!FlashRegion::read_at(FlashRegion::Region::CLIPS, id, pos, fmt, sizeof(fmt))) {
+                    return false;
+                }
+                uint16_t format = read_u16(fmt);
+                uint16_t channels = read_u16(fmt + 2);
+                uint16_t bits = read_u16(fmt + 14);
+                clip.rate = read_u32(fmt + 4);
+                clip.bytes_per_sample = bits / 8;
+                if (format != 1 || channels != 1 || (bits != 8 && bits != 16) || clip.rate < 8000 ||
+                    clip.rate > 48000) {
+                    ESP_LOGW(TAG, "Clip %u must be 8 or 16 bit mono PCM at 8-48 kHz", id);
+                    return false;
+                }
+                have_format = true;
+            } else if (memcmp(chunk, "data", 4) == 0 && have_format) {
+                clip.data_offset = pos;
+                clip.samples = std::min<size_t>(size, len - pos) / clip.bytes_per_sample;
+            }
+            pos += size + (size & 1); // chunks are padded to even lengths
+        }
+        if (clip.samples == 0) {
+            ESP_LOGW(TAG, "Clip %u has no samples", id);
+            return false;
+        }
+
+        clip.ready = true;
+        set_clip(id, clip);
+        return true;
+    }
+
+    // Converts the next block of samples into pcm, returns how many
+    static size_t fill(uint8_t id, const Clip& clip, size_t pos) {
+        size_t count = std::min(DMA_FRAMES, clip.samples - pos);
+        size_t offset = clip.data_offset + pos * clip.bytes_per_sample;
+        if (count == 0 ||
+            !FlashRegion::read_at(FlashRegion::Region::CLIPS, id, offset, raw, count * clip.bytes_per_sample)) {
+            return 0;
+        }
+        if (clip.bytes_per_sample == 1) {
+            for (size_t i = 0; i < count; i++) {
+                pcm[i] = (int16_t)((raw[i] - 128) * 256);
+            }
+        } else {
+            memcpy(pcm, raw, count * sizeof(int16_t));
+        }
+        return count;
+    }
+
+    // Runs in the I2S ISR when the DMA loops round to a buffer nobody refilled
+    static bool IRAM_ATTR on_underrun(i2s_chan_handle_t, i2s_event_data_t*, void*) {
+        underruns.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // Fills both DMA buffers before the clock starts so playback doesn't open
+    // on an underrun. Returns where streaming picks up.
+    static size_t start_clip(uint8_t id, const Clip& clip) {
+        i2s_std_clk_config_t clk_cfg = I2S_STD_CLK_DEFAULT_CONFIG(clip.rate);
+        esp_err_t err = i2s_channel_reconfig_std_clock(tx_chan, &clk_cfg);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to set %" PRIu32 " Hz: %s", clip.rate, esp_err_to_name(err));
+        }
+
+        size_t pos = 0;
+        while (true) {
+            size_t count = fill(id, clip, pos);
+            size_t loaded = 0;
+            if (count == 0 || i2s_channel_preload_data(tx_chan, pcm, count * sizeof(int16_t), &loaded) != ESP_OK) {
+                break;
+            }
+            pos += loaded / sizeof(int16_t);
+            if (loaded < count * sizeof(int16_t)) {
+                break; // DMA buffers are full
+            }
+        }
+
+        i2s_channel_enable(tx_chan);
+        started.fetch_add(1, std::memory_order_relaxed);
+        return pos;
+    }
+
+    // Pushes out silence so the last samples clear the DMA buffers, then stops
+    // the clock
+    static void stop_clip() {
+        memset(pcm, 0, sizeof(pcm));
+        for (size_t i = 0; i < DMA_BUFFERS; i++) {
+            size_t written = 0;
+            i2s_channel_write(tx_chan, pcm, sizeof(pcm), &written, pdMS_TO_TICKS(100));
+        }
+        i2s_channel_disable(tx_chan);
+    }
+
+    static void audio_task_fn(void*) {
+        bool playing = false;
+        SoundEffect::Priority playing_priority = SoundEffect::Priority::DECORATIVE;
+        uint8_t id = 0;
+        Clip clip = {};
+        size_t pos = 0;
+
+        while (true) {
+            // Block while idle, only check for something more important while playing
+            Request request;
+            while (request_queue.receive(request, playing ? 0 : portMAX_DELAY)) {
+                if (request.clip == SoundEffect::NO_CLIP) {
+                    if (playing && request.priority >= playing_priority) {
+                        preempted.fetch_add(1, std::memory_order_relaxed);
+                        stop_clip();
+                        audio_power_lock.release();
+                        playing = false;
+                        playing_level.store(NOT_PLAYING);
+                    }
+                    continue;
+                }
+                Clip next;
+                if (!get_clip(request.clip, next)) {
+                    continue;
+                }
+                if ((playing && request.priority < playing_priority) || Buzzer::busy_above(request.priority)) {
+                    dropped.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+                Buzzer::yield_to(request.priority);
+                if (playing) {
+                    preempted.fetch_add(1, std::memory_order_relaxed);
+                    i2s_channel_disable(tx_chan);
+                } else {
+                    audio_power_lock.acquire();
+                }
+                id = request.clip;
+                clip = next;
+                playing = true;
+                playing_priority = request.priority;
+                playing_level.store((int)request.priority);
+                pos = start_clip(id, clip);
+            }
+
+            // A clip being replaced stops at the next buffer
+            Clip current;
+            size_t count = get_clip(id, current) && current.hash == clip.hash ? fill(id, clip, pos) : 0;
+            if (count == 0) {
+                stop_clip();
+                audio_power_lock.release();
+                playing = false;
+                playing_level.store(NOT_PLAYING);
+                continue;
+            }
+
+            // Blocks until the DMA frees a buffer
+            size_t written = 0;
+            i2s_channel_write(tx_chan, pcm, count * sizeof(int16_t), &written, pdMS_TO_TICKS(100));
+            pos += written / sizeof(int16_t);
+        }
+    }
+
+    int init() {
+        clip_count = std::min(FlashRegion::slots(FlashRegion::Region::CLIPS), MAX_CLIPS);
+        size_t installed = 0;
+        for (size_t i = 0; i < clip_count; i++) {
+            installed += load_clip(i);
+        }
+        ESP_LOGI(TAG, "%u audio clips installed", (unsigned)installed);
+
+        i2s_chan_config_t chan_cfg = I2S_CHANNEL_DEFAULT_CONFIG(I2S_NUM_0, I2S_ROLE_MASTER);
+        chan_cfg.dma_desc_num = DMA_BUFFERS;
+        chan_cfg.dma_frame_num = DMA_FRAMES;
+        chan_cfg.auto_clear = true; // an underrun plays silence rather than the stale buffer
+        esp_err_t err = i2s_new_channel(&chan_cfg, &tx_chan, NULL);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to create I2S channel: %s", esp_err_to_name(err));
+            return 1;
+        }
+
+        i2s_std_config_t std_cfg = {
+            .clk_cfg = I2S_STD_CLK_DEFAULT_CONFIG(DEFAULT_RATE),
+            .slot_cfg = I2S_STD_PHILIPS_SLOT_DEFAULT_CONFIG(I2S_DATA_BIT_WIDTH_16BIT, I2S_SLOT_MODE_MONO),
+            .gpio_cfg =
+                {
+                    .mclk = I2S_GPIO_UNUSED,
+                    .bclk = I2SBCLK,
+                    .ws = I2SLRCLK,
+                    .dout = I2SDIN,
+                    .din = I2S_GPIO_UNUSED,
+                    .invert_flags =
+                        {
+                            .mclk_inv = false,
+                            .bclk_inv = false,
+                            .ws_inv = false,
+                        },
+                },
+        };
+        err = i2s_channel_init_std_mode(tx_chan, &std_cfg);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to set up I2S: %s", esp_err_to_name(err));
+            return 1;
+        }
+
+        i2s_event_callbacks_t callbacks = {
+            .on_recv = NULL,
+            .on_recv_q_ovf = NULL,
+            .on_sent = NULL,
+            .on_send_q_ovf = on_underrun,
+        };
+        i2s_channel_register_event_callback(tx_chan, &callbacks, NULL);
+
+        request_queue.create("audio_requests", 4);
+        audio_power_lock.create("audio");
+        xTaskCreate(audio_task_fn, "audio", CONFIG_AUDIO_TASK_STACK_SIZE, NULL, AUDIO_TASK_PRIORITY, &audio_thread);
+        return 0;
+    }
+
+    bool play(uint8_t clip, SoundEffect::Priority priority) {
+        Clip info;
+        if (tx_chan == NULL || !get_clip(clip, info)) {
+            return false;
+        }
+        return request_queue.send({.clip = clip, .priority = priority}, pdMS_TO_TICKS(100));
+    }
+
+    bool busy_above(SoundEffect::Priority priority) {
+        return playing_level.load() > (int)priority;
+    }
+
+    void yield_to(SoundEffect::Priority priority) {
+        int level = playing_level.load();
+        if (level != NOT_PLAYING && level <= (int)priority) {
+            request_queue.send({.clip = SoundEffect::NO_CLIP, .priority = priority}, pdMS_TO_TICKS(100));
+        }
+    }
+
+    static void report(const std::string& text) {
+        Network::send_log(LogMessageType::ERROR, text.c_str());
+    }
+
+    bool install(uint8_t clip, const char* path) {
+        if (clip >= clip_count) {
+            ESP_LOGW(TAG, "No clip slot %u", clip);
+            return false;
+        }
+        // Stops playback of the old version and keeps play() off it until the download lands
+        set_clip(clip, {});
+        if (path == NULL || path[0] == '\0') {
+            ESP_LOGI(TAG, "Removing clip %u", clip);
+            return FlashRegion::clear(FlashRegion::Region::CLIPS, clip);
+        }
+
+#ifdef DEV_SERVER
+        std::string url = std::string("http://") + DEV_SERVER + ":3000" + path;
+#else
+        std::string url = "http://" + Storage::get_server() + path;
+#endif
+        Download* download = new Download{.url = url, .clip = clip, .writer = {}, .failed = false};
+
+        HTTPManager::Transfer xfer = {
+            .type = HTTPManager::OperationType::GET,
+            .start =
+                [](void* vp_download, const char** url) {
+                    Download* download = (Download*)vp_download;
+                    if (!FlashRegion::begin_write(download->writer, FlashRegion::Region::CLIPS, download->clip)) {
+                        return ESP_FAIL;
+                    }
+                    *url = download->url.c_str();
+                    return ESP_OK;
+                },
+            .data =
+                [](void* vp_download, uint8_t* data, size_t* len) {
+                    Download* download = (Download*)vp_download;
+                    if (*len > 0 && !FlashRegion::append(download->writer, data, *len)) {
+                        ESP_LOGW(TAG, "Clip %u doesn't fit, cancelling", download->clip);
+                        return ESP_ERR_NO_MEM;
+                    }
+                    return ESP_OK;
+                },
+            .finish =
+                [](void* vp_download, esp_err_t err) {
+                    Download* download = (Download*)vp_download;
+                    if (err != ESP_OK || !FlashRegion::finish(download->writer) || !load_clip(download->clip)) {
+                        FlashRegion::clear(FlashRegion::Region::CLIPS, download->clip);
+                        report("Failed to install audio clip " + std::to_string(download->clip));
+                    } else {
+                        ESP_LOGI(TAG, "Installed clip %u, %u bytes", download->clip,
+                                 (unsigned)download->writer.length);
+                    }
+                    delete download;
+                },
+            .user_data = (void*)download,
+        };
+        if (!HTTPManager::queue_transfer(xfer)) {
+            delete download;
+            return false;
+        }
+        return true;
+    }
+
+    size_t list(ClipInfo* out, size_t max) {
+        size_t count = 0;
+        taskENTER_CRITICAL(&clips_lock);
+        for (size_t i = 0; i < clip_count && count < max; i++) {
+            if (clips[i].ready) {
+                out[count++] = {.id = (uint8_t)i, .hash = clips[i].hash};
+            }
+        }
+        taskEXIT_CRITICAL(&clips_lock);
+        return count;
+    }
+
+    Stats get_stats() {
+        return {
+            .clips = started.load(std::memory_order_relaxed),
+            .underruns = underruns.load(std::memory_order_relaxed),
+            .preempted = preempted.load(std::memory_order_relaxed),
+            .dropped = dropped.load(std::memory_order_relaxed),
+        };
+    }
+} // namespace Audio
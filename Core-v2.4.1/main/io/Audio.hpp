@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "BuzzerSounds.hpp"
+
+// Speaker output through the I2S amp. Clips are mono PCM WAV files kept in
+// flash and streamed through a pair of DMA buffers, so they can be far bigger
+// than RAM. Effects name a clip slot and fall back to the buzzer without one.
+// The speaker and buzzer play one sound between them, a sound of equal or
+// higher priority cuts off the other output and a lower one is dropped.
+namespace Audio {
+    static constexpr size_t MAX_CLIPS = 8;
+
+    struct Stats {
+        uint32_t clips;     // clips started
+        uint32_t underruns; // DMA buffers that ran dry and went out as silence
+        uint32_t preempted;
+        uint32_t dropped;
+    };
+
+    struct ClipInfo {
+        uint8_t id;
+        uint32_t hash; // CRC-32 of the WAV file
+    };
+
+    int init();
+
+    // False if the clip isn't installed, so the caller can use the buzzer
+    bool play(uint8_t clip, SoundEffect::Priority priority);
+
+    /**
+     * Downloads a WAV from the server into a clip slot, replacing what was
+     * there. An empty path removes the clip.
+     * @return true if the download was queued
+     */
+    bool install(uint8_t clip, const char* path);
+
+    // True while a clip more important than priority is playing
+    bool busy_above(SoundEffect::Priority priority);
+    // Stops the clip playing unless it is more important than priority
+    void yield_to(SoundEffect::Priority priority);
+
+    // Copies out up to max installed clips, returns how many
+    size_t list(ClipInfo* out, size_t max);
+    Stats get_stats();
+} // namespace Audio
@@ -20,6 +20,21 @@ bool Button::is_held() {
     return !gpio_get_level(BUTTON_PIN);
 }
 
+// Level triggered so it also wakes the chip from light sleep. The ISR masks
+// itself and the thread re-arms it once the button is back up.
+static void IRAM_ATTR button_isr(void*) {
+    BaseType_t woken = pdFALSE;
+    gpio_intr_disable(BUTTON_PIN);
+    vTaskNotifyGiveFromISR(button_thread, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+static void wait_for_press() {
+    gpio_wakeup_enable(BUTTON_PIN, GPIO_INTR_LOW_LEVEL);
+    gpio_intr_enable(BUTTON_PIN);
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+}
+
 void button_thread_fn(void*) {
     int iterations_held = 0;
     int restart_threshold = 60; // 3 seconds
@@ -60,7 +75,11 @@ void button_thread_fn(void*) {
             }
         }
 
-        vTaskDelay(pdMS_TO_TICKS(50));
+        if (iterations_held == 0 && !held) {
+            wait_for_press();
+        } else {
+            vTaskDelay(pdMS_TO_TICKS(50));
+        }
     };
 }
 
@@ -70,6 +89,12 @@ int Button::init() {
         // TODO: Crash
     }
 
+    // Stays masked until the thread arms it
+    gpio_intr_disable(BUTTON_PIN);
+    if (gpio_isr_handler_add(BUTTON_PIN, button_isr, NULL) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to add button interrupt");
+    }
+
     xTaskCreate(button_thread_fn, "button", CONFIG_BUTTON_TASK_STACK_SIZE, NULL, 0, &button_thread);
 
     return 0;
@@ -1,20 +1,66 @@
 #include "Buzzer.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
 #include <freertos/task.h>
 
 #include "common/pins.hpp"
+#include "common/power.hpp"
+#include "common/queues.hpp"
+#include "io/Audio.hpp"
 #include "driver/gpio.h"
 #include "driver/ledc.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 TaskHandle_t buzzer_thread;
 #define BUZZER_TASK_STACK_SIZE 2000
-QueueHandle_t effect_queue;
+static Queues::Queue<SoundEffect::Effect> effect_queue;
 
 static const char* TAG = "buzzer";
 
+// LEDC runs off APB, hold it at full speed and out of light sleep while a tone plays
+static Power::Lock buzzer_power_lock;
+
+// Note boundaries are timed by esp_timer against absolute deadlines, so they
+// land within microseconds and rounding never accumulates across a song.
+// Above every application task so the wake up isn't held behind them.
+static constexpr UBaseType_t BUZZER_TASK_PRIORITY = 2;
+static constexpr size_t MAX_NOTES = 128;
+static constexpr size_t EFFECT_QUEUE_LENGTH = 4;
+
+struct CompiledNote {
+    uint32_t frequency;
+    uint32_t duration_us;
+};
+
+// Effects are copied in when they start, the sender's notes can go away mid song
+static CompiledNote sequence[MAX_NOTES];
+
+// Notes sent with send_copy, one buffer per queue slot. A buffer is handed back
+// once its effect has started or been dropped.
+static SoundEffect::Note copies[EFFECT_QUEUE_LENGTH][MAX_NOTES];
+static bool copy_used[EFFECT_QUEUE_LENGTH] = {};
+static portMUX_TYPE copies_lock = portMUX_INITIALIZER_UNLOCKED;
+static size_t sequence_length = 0;
+static size_t next_note = 0;
+static int64_t next_deadline_us = 0; // when the next note (or the final stop) is due
+static bool playing = false;
+static SoundEffect::Priority playing_priority = SoundEffect::Priority::DECORATIVE;
+// playing_priority for other tasks, or NOT_PLAYING
+static constexpr int NOT_PLAYING = -1;
+static std::atomic<int> playing_level{NOT_PLAYING};
+static esp_timer_handle_t note_timer = NULL;
+
+static std::atomic<uint32_t> boundaries{0};
+static std::atomic<uint32_t> jitter_total_us{0};
+static std::atomic<uint32_t> jitter_max_us{0};
+static std::atomic<uint32_t> preempted{0};
+static std::atomic<uint32_t> dropped{0};
+
 const ledc_channel_t ledc_channel = LEDC_CHANNEL_0;
 const ledc_mode_t speed_mode = LEDC_LOW_SPEED_MODE;
 const ledc_timer_t timer_num = LEDC_TIMER_0;
@@ -56,34 +102,109 @@ void stop() {
     }
 }
 
-void play_effect(SoundEffect::Effect effect) {
-    stop();
-    for (int i = 0; i < effect.length; i++) {
-        if (effect.notes[i].frequency == 0) {
-            stop();
-        } else {
-            start(effect.notes[i].frequency);
+static void release_copy(const SoundEffect::Note* notes) {
+    for (size_t i = 0; i < EFFECT_QUEUE_LENGTH; i++) {
+        if (notes == copies[i]) {
+            taskENTER_CRITICAL(&copies_lock);
+            copy_used[i] = false;
+            taskEXIT_CRITICAL(&copies_lock);
+            return;
         }
+    }
+}
 
-        SoundEffect::Effect _;
-        if (xQueuePeek(effect_queue, &_, pdMS_TO_TICKS(effect.notes[i].duration))) {
-            break;
-        }
-        stop();
+static void note_timer_fn(void*) {
+    xTaskNotifyGive(buzzer_thread);
+}
+
+static void record_jitter(int64_t late_us) {
+    uint32_t late = (uint32_t)std::max<int64_t>(late_us, 0);
+    boundaries.fetch_add(1, std::memory_order_relaxed);
+    jitter_total_us.fetch_add(late, std::memory_order_relaxed);
+    if (late > jitter_max_us.load(std::memory_order_relaxed)) {
+        jitter_max_us.store(late, std::memory_order_relaxed);
+    }
+}
+
+void begin_effect(const SoundEffect::Effect& effect) {
+    if (playing) {
+        preempted.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        buzzer_power_lock.acquire();
+    }
+    esp_timer_stop(note_timer);
+
+    if (effect.length > MAX_NOTES) {
+        ESP_LOGW(TAG, "Effect of %u notes cut to %u", (unsigned)effect.length, (unsigned)MAX_NOTES);
     }
+    sequence_length = std::min<size_t>(effect.length, MAX_NOTES);
+    for (size_t i = 0; i < sequence_length; i++) {
+        sequence[i] = {
+            .frequency = effect.notes[i].frequency,
+            .duration_us = effect.notes[i].duration * 1000u,
+        };
+    }
+
     stop();
+    playing = true;
+    playing_priority = effect.priority;
+    playing_level.store((int)effect.priority);
+    next_note = 0;
+    next_deadline_us = esp_timer_get_time();
+}
+
+// Starts the next note, or goes quiet after the last one
+void step_effect(int64_t now) {
+    record_jitter(now - next_deadline_us);
+
+    if (next_note >= sequence_length) {
+        stop();
+        playing = false;
+        playing_level.store(NOT_PLAYING);
+        buzzer_power_lock.release();
+        return;
+    }
+
+    const CompiledNote& note = sequence[next_note++];
+    if (note.frequency == 0) {
+        stop();
+    } else {
+        start(note.frequency);
+    }
+    next_deadline_us += note.duration_us;
 }
 
 void buzzer_task_fn(void*) {
     stop();
 
-    SoundEffect::Effect current_effect;
+    SoundEffect::Effect effect;
 
     while (true) {
-        if (xQueueReceive(effect_queue, &current_effect, portMAX_DELAY) != pdTRUE) {
-            continue;
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        while (effect_queue.receive(effect, 0)) {
+            if (effect.length == 0) {
+                // From yield_to, cuts off what plays without starting anything
+                if (playing && effect.priority >= playing_priority) {
+                    begin_effect(effect);
+                }
+            } else if ((playing && effect.priority < playing_priority) || Audio::busy_above(effect.priority)) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                Audio::yield_to(effect.priority);
+                begin_effect(effect);
+            }
+            release_copy(effect.notes);
+        }
+
+        int64_t now = esp_timer_get_time();
+        while (playing && now >= next_deadline_us) {
+            step_effect(now);
+            now = esp_timer_get_time();
+        }
+        if (playing) {
+            esp_timer_start_once(note_timer, next_deadline_us - now);
         }
-        play_effect(current_effect);
     }
 }
 
@@ -114,7 +235,20 @@ void setup() {
 
 int Buzzer::init() {
 
-    effect_queue = xQueueCreate(1, sizeof(SoundEffect::Effect));
+    effect_queue.create("buzzer_effects", EFFECT_QUEUE_LENGTH);
+    buzzer_power_lock.create("buzzer");
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = note_timer_fn,
+        .arg = NULL,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "buzzer_note",
+        .skip_unhandled_events = true,
+    };
+    if (esp_timer_create(&timer_args, &note_timer) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create note timer");
+        return 1;
+    }
 
     gpio_config_t conf = {
         .pin_bit_mask = 1ULL << BUZZER_PIN,
@@ -128,10 +262,73 @@ int Buzzer::init() {
 
     setup();
 
-    xTaskCreate(buzzer_task_fn, "buzzer", CONFIG_BUZZER_TASK_STACK_SIZE, NULL, 0, &buzzer_thread);
+    xTaskCreate(buzzer_task_fn, "buzzer", CONFIG_BUZZER_TASK_STACK_SIZE, NULL, BUZZER_TASK_PRIORITY, &buzzer_thread);
     return 0;
 }
 
+static bool queue_effect(const SoundEffect::Effect& effect) {
+    if (!effect_queue.send(effect, pdMS_TO_TICKS(100))) {
+        return false;
+    }
+    xTaskNotifyGive(buzzer_thread);
+    return true;
+}
+
 bool Buzzer::send_effect(SoundEffect::Effect effect) {
-    return xQueueSend(effect_queue, &effect, pdTICKS_TO_MS(100));
+    // Effects with an installed clip go to the speaker instead
+    if (effect.clip != SoundEffect::NO_CLIP && Audio::play(effect.clip, effect.priority)) {
+        return true;
+    }
+    return queue_effect(effect);
+}
+
+bool Buzzer::send_copy(SoundEffect::Effect effect) {
+    if (effect.clip != SoundEffect::NO_CLIP && Audio::play(effect.clip, effect.priority)) {
+        return true;
+    }
+
+    int slot = -1;
+    taskENTER_CRITICAL(&copies_lock);
+    for (size_t i = 0; i < EFFECT_QUEUE_LENGTH; i++) {
+        if (!copy_used[i]) {
+            copy_used[i] = true;
+            slot = i;
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&copies_lock);
+    if (slot < 0) {
+        return false;
+    }
+
+    effect.length = std::min<size_t>(effect.length, MAX_NOTES);
+    memcpy(copies[slot], effect.notes, effect.length * sizeof(SoundEffect::Note));
+    effect.notes = copies[slot];
+    if (!queue_effect(effect)) {
+        release_copy(effect.notes);
+        return false;
+    }
+    return true;
+}
+
+bool Buzzer::busy_above(SoundEffect::Priority priority) {
+    return playing_level.load() > (int)priority;
+}
+
+void Buzzer::yield_to(SoundEffect::Priority priority) {
+    int level = playing_level.load();
+    if (level != NOT_PLAYING && level <= (int)priority) {
+        queue_effect({.length = 0, .notes = NULL, .priority = priority});
+    }
+}
+
+Buzzer::Stats Buzzer::get_stats() {
+    uint32_t count = boundaries.load(std::memory_order_relaxed);
+    return {
+        .notes = count,
+        .jitter_avg_us = count == 0 ? 0 : jitter_total_us.load(std::memory_order_relaxed) / count,
+        .jitter_max_us = jitter_max_us.load(std::memory_order_relaxed),
+        .preempted = preempted.load(std::memory_order_relaxed),
+        .dropped = dropped.load(std::memory_order_relaxed),
+    };
 }
\ No newline at end of file
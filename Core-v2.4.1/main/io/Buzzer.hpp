@@ -3,6 +3,24 @@
 #include "BuzzerSounds.hpp"
 
 namespace Buzzer {
+    // Note timing, lateness is measured at every note boundary
+    struct Stats {
+        uint32_t notes;
+        uint32_t jitter_avg_us;
+        uint32_t jitter_max_us;
+        uint32_t preempted; // effects cut off by one of equal or higher priority
+        uint32_t dropped;   // effects ignored because something more important was playing
+    };
+
     int init();
+    // The notes must stay valid until the effect has played, true for the built-in effects
     bool send_effect(SoundEffect::Effect);
+    // Copies the notes before returning so the caller can reuse its buffer
+    bool send_copy(SoundEffect::Effect);
+    Stats get_stats();
+
+    // True while an effect more important than priority is playing
+    bool busy_above(SoundEffect::Priority priority);
+    // Stops the effect playing unless it is more important than priority
+    void yield_to(SoundEffect::Priority priority);
 } // namespace Buzzer
\ No newline at end of file
@@ -8,9 +8,22 @@ namespace SoundEffect {
         uint16_t duration; // in MS
     };
 
+    // Higher priorities cut off whatever is playing, lower ones are dropped
+    // while it plays
+    enum class Priority : uint8_t {
+        DECORATIVE,
+        FEEDBACK,
+        ALERT,
+    };
+
+    // Clip ids are slots in the audio clip library
+    static constexpr uint8_t NO_CLIP = 0xff;
+
     struct Effect {
         uint16_t length;
         const Note* notes;
+        Priority priority = Priority::DECORATIVE;
+        uint8_t clip = NO_CLIP; // played through the speaker instead, when installed
     };
 
     /*******************************
@@ -103,21 +116,29 @@ namespace SoundEffect {
     const Effect ACCEPTED = {
         .length = 2,
         .notes = detail::ACCEPTED_NOTES,
+        .priority = Priority::FEEDBACK,
+        .clip = 0,
     };
 
     const Effect DENIED = {
         .length = 2,
         .notes = detail::DENIED_NOTES,
+        .priority = Priority::ALERT,
+        .clip = 1,
     };
 
     const Effect LOCKOUT = {
         .length = 3,
         .notes = detail::LOCKOUT_NOTES,
+        .priority = Priority::FEEDBACK,
+        .clip = 2,
     };
 
     const Effect FAULT = {
         .length = 6,
         .notes = detail::FAULT_NOTES,
+        .priority = Priority::ALERT,
+        .clip = 3,
     };
 
     const Effect IDENTIFY = {
@@ -127,5 +148,6 @@ namespace SoundEffect {
     const Effect MARIO_VICTORY = {
         .length = 32,
         .notes = detail::MARIO_VICTORY,
+        .priority = Priority::DECORATIVE,
     };
 } // namespace SoundEffect
\ No newline at end of file
@@ -159,6 +159,34 @@ bool switcheroo(CardTagID new_tag) {
     }
 };
 
+// The detect switches are level triggered so they can also wake the chip from
+// light sleep. The ISR masks both pins and the thread re-arms them for the
+// opposite of whatever level they are sitting at.
+static void IRAM_ATTR card_switch_isr(void*) {
+    BaseType_t woken = pdFALSE;
+    gpio_intr_disable(CARD_DET1);
+    gpio_intr_disable(CARD_DET2);
+    vTaskNotifyGiveFromISR(card_thread, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+static void arm_switch(gpio_num_t pin) {
+    gpio_wakeup_enable(pin, gpio_get_level(pin) ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL);
+    gpio_intr_enable(pin);
+}
+
+static void wait_for_switches() {
+    if (!switches_required) {
+        vTaskDelay(pdMS_TO_TICKS(200));
+        return;
+    }
+
+    arm_switch(CARD_DET1);
+    arm_switch(CARD_DET2);
+    // Keep sampling while the switches disagree so a stuck one still faults
+    ulTaskNotifyTake(pdTRUE, switch_error > 0 ? pdMS_TO_TICKS(200) : portMAX_DELAY);
+}
+
 void card_reader_thread_fn(void*) {
     uint8_t detect_allowed = 0;
     while (true) {
@@ -253,7 +281,7 @@ void card_reader_thread_fn(void*) {
             vTaskDelay(pdMS_TO_TICKS(50));
         }
 
-        vTaskDelay(pdMS_TO_TICKS(200));
+        wait_for_switches();
     }
 }
 
@@ -307,6 +335,12 @@ void CardReader::init() {
 
     gpio_input_enable(CARD_DET1);
     gpio_input_enable(CARD_DET2);
+    gpio_intr_disable(CARD_DET1);
+    gpio_intr_disable(CARD_DET2);
+    if (gpio_isr_handler_add(CARD_DET1, card_switch_isr, NULL) != ESP_OK ||
+        gpio_isr_handler_add(CARD_DET2, card_switch_isr, NULL) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to add card switch interrupts");
+    }
 
     if (spi_bus_initialize(spi_host, &spi_bus_config, SPI_DMA_CH_AUTO) != ESP_OK) {
         ESP_LOGE(TAG, "Failed to initialize SPI bus");
@@ -1,52 +1,116 @@
 #include "IO.hpp"
 
+#include <atomic>
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
 #include <freertos/semphr.h>
 #include <freertos/task.h>
-#include <freertos/timers.h>
 
+#include "common/audit_log.hpp"
 #include "common/pins.hpp"
+#include "common/queues.hpp"
+#include "common/timer_wheel.hpp"
 #include "driver/gpio.h"
 #include "esp_log.h"
+#include "io/Audio.hpp"
 #include "io/Button.hpp"
 #include "io/Buzzer.hpp"
 #include "io/CardReader.hpp"
 #include "io/LEDControl.hpp"
+#include "io/SongLibrary.hpp"
 #include "io/Temperature.hpp"
 #include "network/network.hpp"
 
 static const char* TAG = "io";
 
-QueueHandle_t event_queue;
+static Queues::Queue<IOEvent> event_queue;
 TaskHandle_t io_thread;
 
-static IOState state = IOState::STARTUP;
-static IOState prior_request_state;
-static SemaphoreHandle_t animation_mutex;
+// State is published with a seqlock so readers on other tasks never block.
+// Writers are serialized with a critical section, which on the single core
+// S2 also means a reader can never observe a half finished write.
+static portMUX_TYPE state_write_lock = portMUX_INITIALIZER_UNLOCKED;
+static std::atomic<uint32_t> state_seq{0};
+static std::atomic<IOState> state{IOState::STARTUP};
+static std::atomic<IOState> prior_request_state{IOState::IDLE};
+static std::atomic<TickType_t> last_transition{0};
+
+// A fault that found the event queue full. The IO task is then about to
+// receive, and checks this before each event so the fault is never lost.
+static std::atomic<bool> fault_pending{false};
+static std::atomic<FaultReason> pending_fault_reason{FaultReason::SOFTWARE_ERROR};
+
+static std::atomic<uint32_t> state_publishes{0};
+static std::atomic<uint32_t> state_read_retries{0};
+static std::atomic<uint32_t> state_read_timeouts{0};
+
+static constexpr int MAX_SNAPSHOT_ATTEMPTS = 8;
+
+static void publish_state(std::optional<IOState> new_state, std::optional<IOState> new_prior) {
+    taskENTER_CRITICAL(&state_write_lock);
+    uint32_t seq = state_seq.load(std::memory_order_relaxed);
+    state_seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    if (new_state.has_value()) {
+        state.store(new_state.value(), std::memory_order_relaxed);
+        last_transition.store(xTaskGetTickCount(), std::memory_order_relaxed);
+    }
+    if (new_prior.has_value()) {
+        prior_request_state.store(new_prior.value(), std::memory_order_relaxed);
+    }
+
+    state_seq.store(seq + 2, std::memory_order_release);
+    taskEXIT_CRITICAL(&state_write_lock);
+    state_publishes.fetch_add(1, std::memory_order_relaxed);
+}
 
 bool IO::get_state(IOState& send_state) {
-    if (xSemaphoreTake(animation_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
-        send_state = state;
-        xSemaphoreGive(animation_mutex);
-        return true;
-    } else {
-        return false;
+    // A single word, no need to go through the seqlock
+    send_state = state.load(std::memory_order_acquire);
+    return true;
+}
+
+bool IO::get_snapshot(StateSnapshot& snapshot) {
+    for (int attempt = 0; attempt < MAX_SNAPSHOT_ATTEMPTS; attempt++) {
+        uint32_t begin = state_seq.load(std::memory_order_acquire);
+        if (begin & 1) {
+            state_read_retries.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+
+        snapshot.state = state.load(std::memory_order_relaxed);
+        snapshot.prior_request_state = prior_request_state.load(std::memory_order_relaxed);
+        snapshot.last_transition = last_transition.load(std::memory_order_relaxed);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (state_seq.load(std::memory_order_relaxed) == begin) {
+            return true;
+        }
+        state_read_retries.fetch_add(1, std::memory_order_relaxed);
     }
+    state_read_timeouts.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+IO::StateStats IO::get_state_stats() {
+    return {
+        .publishes = state_publishes.load(std::memory_order_relaxed),
+        .read_retries = state_read_retries.load(std::memory_order_relaxed),
+        .read_timeouts = state_read_timeouts.load(std::memory_order_relaxed),
+    };
 }
 
 bool IO::send_event(IOEvent event) {
-    return xQueueSend(event_queue, &(event), pdMS_TO_TICKS(100)) == pdTRUE;
+    return event_queue.send(event, pdMS_TO_TICKS(100));
 }
 
-bool set_state(IOState new_state) {
-    if (xSemaphoreTake(animation_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
-        state = new_state;
-        xSemaphoreGive(animation_mutex);
-        return true;
-    } else {
-        return false;
-    }
+void set_state(IOState new_state) {
+    publish_state(new_state, {});
+}
+
+void set_prior_request_state(IOState new_prior) {
+    publish_state({}, new_prior);
 }
 
 void go_to_state(IOState next_state) {
@@ -132,28 +196,31 @@ void go_to_state(IOState next_state) {
             return;
     }
 
-    if (!set_state(next_state)) {
-        ESP_LOGI(TAG, "Failed to update the stored state");
-        IO::fault(FaultReason::SOFTWARE_ERROR);
-    }
+    set_state(next_state);
 }
 
-TimerHandle_t waiting_timer;
+static constexpr TickType_t WAITING_TIMEOUT = pdMS_TO_TICKS(5000);
+static constexpr TickType_t IDENTIFY_TIMEOUT = pdMS_TO_TICKS(9630);
+static constexpr TickType_t DENIED_TIMEOUT = pdMS_TO_TICKS(1500);
 
-void waiting_timer_callback(TimerHandle_t timer) {
-    go_to_state(prior_request_state);
-};
+// Indexed by IOTimer. Expiries come back through the event queue so every
+// transition happens on the IO task.
+static TimerWheel::Timer io_timers[3];
+
+TimerWheel::Timer& io_timer(IOTimer timer) {
+    return io_timers[(size_t)timer];
+}
+
+// Runs on the timer task, never blocks so a full queue just gets retried
+bool post_timeout(uint32_t id, uint32_t generation) {
+    return event_queue.try_send({
+        .type = IOEventType::TIMEOUT,
+        .timeout = {.timer = (IOTimer)id, .generation = generation},
+    });
+}
 
 void timer_refresh() {
-    if (xTimerIsTimerActive(waiting_timer) == pdFALSE) {
-        if (xTimerStart(waiting_timer, pdMS_TO_TICKS(100)) == pdFAIL) {
-            IO::fault(FaultReason::SOFTWARE_ERROR);
-        }
-    } else {
-        if (xTimerReset(waiting_timer, pdMS_TO_TICKS(100)) == pdFAIL) {
-            IO::fault(FaultReason::SOFTWARE_ERROR);
-        }
-    }
+    TimerWheel::arm(io_timer(IOTimer::WAITING), WAITING_TIMEOUT);
 }
 
 void handle_button_clicked() {
@@ -191,7 +258,7 @@ void handle_button_clicked() {
             go_to_state(IOState::LOCKOUT_WAITING);
             break;
         default:
-            prior_request_state = current_state;
+            set_prior_request_state(current_state);
             go_to_state(IOState::LOCKOUT_WAITING);
             break;
     }
@@ -206,7 +273,7 @@ void handle_card_detected(IOEvent event) {
 
     switch (current_state) {
         case IOState::IDLE:
-            prior_request_state = IOState::IDLE;
+            set_prior_request_state(IOState::IDLE);
             go_to_state(IOState::AWAIT_AUTH);
             Network::send_event({
                 .type = NetworkEventType::AuthRequest,
@@ -218,7 +285,7 @@ void handle_card_detected(IOEvent event) {
             });
             break;
         case IOState::LOCKOUT_WAITING:
-            xTimerStop(waiting_timer, pdMS_TO_TICKS(100));
+            TimerWheel::cancel(io_timer(IOTimer::WAITING));
             go_to_state(IOState::AWAIT_AUTH);
             Network::send_event({
                 .type = NetworkEventType::AuthRequest,
@@ -230,7 +297,7 @@ void handle_card_detected(IOEvent event) {
             });
             break;
         case IOState::IDLE_WAITING:
-            xTimerStop(waiting_timer, pdMS_TO_TICKS(100));
+            TimerWheel::cancel(io_timer(IOTimer::WAITING));
             go_to_state(IOState::AWAIT_AUTH);
             Network::send_event({.type = NetworkEventType::AuthRequest,
                                  .auth_request = {
@@ -239,7 +306,7 @@ void handle_card_detected(IOEvent event) {
                                  }});
             break;
         case IOState::ALWAYS_ON_WAITING:
-            xTimerStop(waiting_timer, pdMS_TO_TICKS(100));
+            TimerWheel::cancel(io_timer(IOTimer::WAITING));
             go_to_state(IOState::AWAIT_AUTH);
             Network::send_event({
                 .type = NetworkEventType::AuthRequest,
@@ -254,7 +321,7 @@ void handle_card_detected(IOEvent event) {
             Buzzer::send_effect(SoundEffect::LOCKOUT);
             break;
         case IOState::WELCOMING:
-            prior_request_state = IOState::WELCOMING;
+            set_prior_request_state(IOState::WELCOMING);
             go_to_state(IOState::AWAIT_AUTH);
             Network::send_event({
                 .type = NetworkEventType::AuthRequest,
@@ -305,7 +372,7 @@ void handle_card_removed(IOEvent cur_event) {
             go_to_state(IOState::IDLE);
             break;
         case IOState::AWAIT_AUTH:
-            go_to_state(prior_request_state);
+            go_to_state(prior_request_state.load());
             break;
         case IOState::WELCOMED:
             go_to_state(IOState::WELCOMING);
@@ -315,9 +382,8 @@ void handle_card_removed(IOEvent cur_event) {
     }
 }
 
-TimerHandle_t identify_timer;
-
-void identify_timer_callback(TimerHandle_t timer) {
+// Puts back whatever the current state shows once identify is over
+void restore_state_animation() {
     IOState current_state;
     IO::get_state(current_state);
 
@@ -370,18 +436,29 @@ void identify_timer_callback(TimerHandle_t timer) {
 void handle_identify() {
     LED::set_animation(&Animation::IDENTIFY);
     Buzzer::send_effect(SoundEffect::MARIO_VICTORY);
-    xTimerStart(identify_timer, pdMS_TO_TICKS(100));
-}
-
-TimerHandle_t denied_timer;
-
-void denied_timer_callback(TimerHandle_t timer) {
-    go_to_state(prior_request_state);
+    TimerWheel::arm(io_timer(IOTimer::IDENTIFY), IDENTIFY_TIMEOUT);
 }
 
 void handle_denied() {
     go_to_state(IOState::DENIED);
-    xTimerStart(denied_timer, pdMS_TO_TICKS(100));
+    TimerWheel::arm(io_timer(IOTimer::DENIED), DENIED_TIMEOUT);
+}
+
+void handle_timeout(TimeoutEvent timeout) {
+    if (!TimerWheel::is_current(io_timer(timeout.timer), timeout.generation)) {
+        ESP_LOGD(TAG, "Dropping stale %s timeout", io_timer_to_string(timeout.timer));
+        return;
+    }
+
+    switch (timeout.timer) {
+        case IOTimer::WAITING:
+        case IOTimer::DENIED:
+            go_to_state(prior_request_state.load());
+            break;
+        case IOTimer::IDENTIFY:
+            restore_state_animation();
+            break;
+    }
 }
 
 void handle_network_command(IOEvent current_event) {
@@ -464,9 +541,33 @@ void handle_network_command(IOEvent current_event) {
     }
 }
 
+// Runs on the IO task, like every other transition
+void handle_fault(FaultReason reason) {
+    IOState cur_state;
+    IO::get_state(cur_state);
+    if (cur_state == IOState::FAULT) {
+        return;
+    }
+    AuditLog::record_fault(cur_state, reason);
+
+    go_to_state(IOState::FAULT);
+
+    Network::send_event({
+        .type = NetworkEventType::StateChange,
+        .state_change =
+            {
+                .from = cur_state,
+                .to = IOState::FAULT,
+                .reason = fault_reason_to_state_change_reason(reason),
+                .who = {},
+            },
+    });
+}
+
 bool allowed_fault_event(IOEvent event) {
     return (event.type == IOEventType::BUTTON_PRESSED ||
-            (event.type == IOEventType::NETWORK_COMMAND && event.network_command.commanded_state == IOState::RESTART));
+            (event.type == IOEventType::NETWORK_COMMAND && event.network_command.commanded_state == IOState::RESTART) ||
+            (event.type == IOEventType::TIMEOUT && event.timeout.timer == IOTimer::IDENTIFY));
 }
 
 void io_thread_fn(void*) {
@@ -474,9 +575,12 @@ void io_thread_fn(void*) {
     IOEvent current_event = {};
 
     while (true) {
-        if (xQueueReceive(event_queue, &current_event, portMAX_DELAY) != pdTRUE) {
+        if (!event_queue.receive(current_event, portMAX_DELAY)) {
             continue;
         }
+        if (fault_pending.exchange(false)) {
+            handle_fault(pending_fault_reason.load());
+        }
 
         IOState current_state;
         if (IO::get_state(current_state) && current_state == IOState::FAULT) {
@@ -519,6 +623,14 @@ void io_thread_fn(void*) {
                 handle_network_command(current_event);
                 break;
 
+            case IOEventType::TIMEOUT:
+                handle_timeout(current_event.timeout);
+                break;
+
+            case IOEventType::FAULT:
+                handle_fault(current_event.fault.reason);
+                break;
+
             default:
                 ESP_LOGI(TAG, "Unexpected event type recieved");
                 break;
@@ -527,14 +639,13 @@ void io_thread_fn(void*) {
 }
 
 int IO::init() {
-    event_queue = xQueueCreate(8, sizeof(IOEvent));
-    animation_mutex = xSemaphoreCreateMutex();
-    waiting_timer = xTimerCreate("waiting", pdMS_TO_TICKS(5000), pdFALSE, (void*)0, waiting_timer_callback);
-    identify_timer = xTimerCreate("identify", pdMS_TO_TICKS(9630), pdFALSE, (void*)0, identify_timer_callback);
-    denied_timer = xTimerCreate("denied", pdMS_TO_TICKS(1500), pdFALSE, (void*)0, denied_timer_callback);
-
-    if (event_queue == 0 || animation_mutex == NULL) {
-        ESP_LOGE(TAG, "Failed ot intialize IO queue or mutex, restarting...");
+    for (size_t i = 0; i < sizeof(io_timers) / sizeof(io_timers[0]); i++) {
+        io_timers[i].post = post_timeout;
+        io_timers[i].id = i;
+    }
+
+    if (!event_queue.create("io_events", 8)) {
+        ESP_LOGE(TAG, "Failed ot intialize IO queue, restarting...");
         vTaskDelay(pdMS_TO_TICKS(1000));
         esp_restart();
     }
@@ -553,6 +664,8 @@ int IO::init() {
     Button::init();
     CardReader::init();
     Buzzer::init();
+    SongLibrary::init();
+    Audio::init();
     Temperature::init();
 
     xTaskCreate(io_thread_fn, "io", CONFIG_IO_TASK_STACK_SIZE, NULL, 0, &io_thread);
@@ -560,23 +673,17 @@ int IO::init() {
 }
 
 void IO::fault(FaultReason reason) {
-    IOState cur_state;
-    IO::get_state(cur_state);
-
     if (reason == FaultReason::START_FAIL) {
+        IOState cur_state;
+        IO::get_state(cur_state);
+        AuditLog::record_fault(cur_state, reason);
         return; // TODO: figure out what to do
     }
 
-    go_to_state(IOState::FAULT);
-
-    Network::send_event({
-        .type = NetworkEventType::StateChange,
-        .state_change =
-            {
-                .from = cur_state,
-                .to = IOState::FAULT,
-                .reason = fault_reason_to_state_change_reason(reason),
-                .who = {},
-            },
-    });
+    // Called from the temperature and card tasks too, so the transition is
+    // left to the IO task, ahead of anything already queued
+    if (!event_queue.try_send({.type = IOEventType::FAULT, .fault = {.reason = reason}}, true)) {
+        pending_fault_reason = reason;
+        fault_pending = true;
+    }
 };
@@ -1,9 +1,26 @@
 #pragma once
 #include "common/types.hpp"
+#include <freertos/FreeRTOS.h>
 
 namespace IO {
+    // Consistent view of the state machine, published by the IO side
+    struct StateSnapshot {
+        IOState state;
+        IOState prior_request_state;
+        TickType_t last_transition; // tick count of the last state change
+    };
+
+    // Counters for the state publication seqlock
+    struct StateStats {
+        uint32_t publishes;     // number of state writes
+        uint32_t read_retries;  // snapshot reads that raced a writer and had to retry
+        uint32_t read_timeouts; // snapshot reads that gave up
+    };
+
     int init();
     bool get_state(IOState& send_state);
+    bool get_snapshot(StateSnapshot& snapshot);
+    StateStats get_state_stats();
     bool send_event(IOEvent event);
     void fault(FaultReason reason);
-}; // namespace IO
\ No newline at end of file
+}; // namespace IO
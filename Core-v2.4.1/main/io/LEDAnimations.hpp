@@ -1,209 +1,205 @@
 #pragma once
 
 #include <array>
+#include <cstddef>
 #include <cstdint>
 
 namespace Animation {
-    using RGB = std::array<uint32_t, 3>;
+    using RGB = std::array<uint8_t, 3>;
 
-    using Frame = std::array<RGB, 4>;
+    using Pixels = std::array<RGB, 4>;
 
-    struct Animation {
-        uint8_t length;
-        std::array<Frame, 16> frames;
+    // *********************************
+    // COLORS
+    // *********************************
 
-        bool operator==(const Animation& other) const {
-            if (length != other.length) {
-                return false;
-            }
+    // Frames store an index into a palette per LED, these name the built-in one
+    enum Color : uint8_t {
+        OFF,
+        WHITE,
+        RED,
+        RED_DIM,
+        GREEN,
+        GREEN_DIM,
+        BLUE,
+        ORANGE,
+        ORANGE_DIM,
+    };
+
+    inline constexpr RGB PALETTE[] = {
+        {0, 0, 0},    // OFF
+        {15, 15, 15}, // WHITE
+        {15, 0, 0},   // RED
+        {5, 0, 0},    // RED_DIM
+        {0, 15, 0},   // GREEN
+        {0, 5, 0},    // GREEN_DIM
+        {0, 0, 15},   // BLUE
+        {15, 10, 0},  // ORANGE
+        {5, 4, 0},    // ORANGE_DIM
+    };
+
+    // How long frames stay up unless they say otherwise
+    static constexpr uint16_t DEFAULT_HOLD_MS = 350;
+    // Frame timing is stored in these units, up to 2.55 s
+    static constexpr uint16_t TIME_UNIT_MS = 10;
+
+    // 6 bytes, also the layout frames have in animation packs
+    struct Frame {
+        std::array<uint8_t, 4> pixels = {}; // palette indices
+        uint8_t hold = 0;                   // how long the frame is up, in TIME_UNIT_MS
+        uint8_t fade = 0;                   // blend in from the previous frame over this much of hold
+
+        constexpr Frame() = default;
+        constexpr Frame(std::array<uint8_t, 4> pixels, uint16_t hold_ms = DEFAULT_HOLD_MS, uint16_t fade_ms = 0)
+            : pixels(pixels), hold(hold_ms / TIME_UNIT_MS), fade(fade_ms / TIME_UNIT_MS) {}
+
+        constexpr uint16_t hold_ms() const {
+            return hold * TIME_UNIT_MS;
+        }
+        constexpr uint16_t fade_ms() const {
+            return fade * TIME_UNIT_MS;
+        }
+    };
 
-            for (int i = 0; i < length; i++) {
-                if (frames[i] != other.frames[i]) {
-                    return false;
-                }
-            }
+    struct Animation {
+        const char* name; // what animation packs call it
+        const RGB* palette;
+        const Frame* frames;
+        uint8_t length;
 
-            return true;
+        RGB color(const Frame& frame, size_t led) const {
+            return palette[frame.pixels[led]];
         }
     };
 
-    // *********************************
-    // COLORS
-    // *********************************
-
-    static const RGB WHITE = {15, 15, 15};
-    static const RGB OFF = {0, 0, 0};
-    static const RGB RED = {15, 0, 0};
-    static const RGB RED_DIM = {5, 0, 0};
-    static const RGB GREEN = {0, 15, 0};
-    static const RGB GREEN_DIM = {0, 5, 0};
-    static const RGB BLUE = {0, 0, 15};
-    static const RGB ORANGE = {15, 10, 0};
-    static const RGB ORANGE_DIM = {5, 4, 0};
+    template <size_t N> constexpr Animation make(const char* name, const Frame (&frames)[N]) {
+        static_assert(N > 0 && N <= UINT8_MAX, "animations need 1-255 frames");
+        return Animation{.name = name, .palette = PALETTE, .frames = frames, .length = N};
+    }
 
     // *********************************
     // ANIMATIONS
     // *********************************
 
-    const Animation IDLE{
-        .length = 2,
-        .frames =
-            {
-                Frame{ORANGE, ORANGE, ORANGE, ORANGE},
-                Frame{ORANGE, ORANGE, ORANGE, ORANGE},
-            },
-    };
-
-    const Animation LOCKOUT{
-        .length = 2,
-        .frames =
-            {
-                Frame{RED, RED, RED, RED},
-                Frame{RED, RED, RED, RED},
-            },
-    };
-
-    const Animation UNLOCKED{
-        .length = 2,
-        .frames =
-            {
-                Frame{GREEN, GREEN, GREEN, GREEN},
-                Frame{GREEN, GREEN, GREEN, GREEN},
-            },
-    };
-
-    const Animation ALWAYS_ON{
-        .length = 8,
-        .frames =
-            {
-                Frame{GREEN, GREEN_DIM, GREEN, GREEN_DIM},
-                Frame{GREEN, GREEN_DIM, GREEN, GREEN_DIM},
-                Frame{GREEN, GREEN_DIM, GREEN, GREEN_DIM},
-                Frame{GREEN, GREEN_DIM, GREEN, GREEN_DIM},
-                Frame{GREEN_DIM, GREEN, GREEN_DIM, GREEN},
-                Frame{GREEN_DIM, GREEN, GREEN_DIM, GREEN},
-                Frame{GREEN_DIM, GREEN, GREEN_DIM, GREEN},
-                Frame{GREEN_DIM, GREEN, GREEN_DIM, GREEN},
-            },
-    };
-
-    const Animation DENIED{
-        .length = 2,
-        .frames =
-            {
-                Frame{RED, RED, RED, RED},
-                Frame{RED_DIM, RED_DIM, RED_DIM, RED_DIM},
-            },
-    };
-
-    const Animation STARTUP{
-        .length = 3,
-        .frames =
-            {
-                Frame{RED, RED, RED, RED},
-                Frame{GREEN, GREEN, GREEN, GREEN},
-                Frame{BLUE, BLUE, BLUE, BLUE},
-            },
-    };
-
-    const Animation IDLE_WAITING{
-        .length = 2,
-        .frames =
-            {
-                Frame{OFF, ORANGE, ORANGE, OFF},
-                Frame{OFF, OFF, OFF, OFF},
-            },
-    };
-
-    const Animation ALWAYS_ON_WAITING{
-        .length = 2,
-        .frames =
-            {
-                Frame{OFF, GREEN, GREEN, OFF},
-                Frame{OFF, OFF, OFF, OFF},
-            },
-    };
-
-    const Animation LOCKOUT_WAITING{
-        .length = 2,
-        .frames =
-            {
-                Frame{OFF, RED, RED, OFF},
-                Frame{OFF, OFF, OFF, OFF},
-            },
-    };
-
-    const Animation RESTART{
-        .length = 3,
-        .frames =
-            {
-                Frame{RED, GREEN, BLUE, RED},
-                Frame{BLUE, RED, GREEN, BLUE},
-                Frame{GREEN, BLUE, RED, GREEN},
-            },
-    };
-
-    const Animation FAULT{
-        .length = 2,
-        .frames =
-            {
-                Frame{RED, RED, RED, RED},
-                Frame{OFF, OFF, OFF, OFF},
-            },
-    };
-
-    const Animation AWAIT_AUTH{
-        .length = 6,
-        .frames =
-            {
-                Frame{ORANGE, ORANGE_DIM, ORANGE_DIM, ORANGE_DIM},
-                Frame{ORANGE_DIM, ORANGE, ORANGE_DIM, ORANGE_DIM},
-                Frame{ORANGE_DIM, ORANGE_DIM, ORANGE, ORANGE_DIM},
-                Frame{ORANGE_DIM, ORANGE_DIM, ORANGE_DIM, ORANGE},
-                Frame{ORANGE_DIM, ORANGE_DIM, ORANGE, ORANGE_DIM},
-                Frame{ORANGE_DIM, ORANGE, ORANGE_DIM, ORANGE_DIM},
-            },
-    };
-
-    const Animation IDENTIFY{
-        .length = 2,
-        .frames =
-            {
-                Frame{BLUE, BLUE, BLUE, BLUE},
-                Frame{OFF, OFF, OFF, OFF},
-            },
-    };
-
-    const Animation WELCOMING{
-        .length = 4,
-        .frames =
-            {
-                Frame{OFF, OFF, OFF, OFF},
-                Frame{OFF, OFF, OFF, OFF},
-                Frame{OFF, OFF, OFF, OFF},
-                Frame{ORANGE, OFF, OFF, OFF},
-            },
-    };
-
-    const Animation WELCOMED{
-        .length = 2,
-        .frames =
-            {
-                Frame{GREEN, OFF, OFF, OFF},
-                Frame{GREEN, OFF, OFF, OFF},
-            },
-    };
-
-    const Animation NEXT_CARD{
-        .length = 6,
-        .frames =
-            {
-                Frame{GREEN, ORANGE, ORANGE, ORANGE},
-                Frame{ORANGE, GREEN, ORANGE, ORANGE},
-                Frame{ORANGE, ORANGE, GREEN, ORANGE},
-                Frame{ORANGE, ORANGE, ORANGE, GREEN},
-                Frame{ORANGE, ORANGE, GREEN, ORANGE},
-                Frame{ORANGE, GREEN, ORANGE, ORANGE},
-            },
-    };
-} // namespace Animation
\ No newline at end of file
+    inline constexpr Frame IDLE_FRAMES[] = {
+        Frame({ORANGE, ORANGE, ORANGE, ORANGE}),
+    };
+    inline constexpr Animation IDLE = make("IDLE", IDLE_FRAMES);
+
+    inline constexpr Frame LOCKOUT_FRAMES[] = {
+        Frame({RED, RED, RED, RED}),
+    };
+    inline constexpr Animation LOCKOUT = make("LOCKOUT", LOCKOUT_FRAMES);
+
+    inline constexpr Frame UNLOCKED_FRAMES[] = {
+        Frame({GREEN, GREEN, GREEN, GREEN}),
+    };
+    inline constexpr Animation UNLOCKED = make("UNLOCKED", UNLOCKED_FRAMES);
+
+    inline constexpr Frame ALWAYS_ON_FRAMES[] = {
+        Frame({GREEN, GREEN_DIM, GREEN, GREEN_DIM}, 1400, 300),
+        Frame({GREEN_DIM, GREEN, GREEN_DIM, GREEN}, 1400, 300),
+    };
+    inline constexpr Animation ALWAYS_ON = make("ALWAYS_ON", ALWAYS_ON_FRAMES);
+
+    inline constexpr Frame DENIED_FRAMES[] = {
+        Frame({RED, RED, RED, RED}, DEFAULT_HOLD_MS, 150),
+        Frame({RED_DIM, RED_DIM, RED_DIM, RED_DIM}, DEFAULT_HOLD_MS, 150),
+    };
+    inline constexpr Animation DENIED = make("DENIED", DENIED_FRAMES);
+
+    inline constexpr Frame STARTUP_FRAMES[] = {
+        Frame({RED, RED, RED, RED}),
+        Frame({GREEN, GREEN, GREEN, GREEN}),
+        Frame({BLUE, BLUE, BLUE, BLUE}),
+    };
+    inline constexpr Animation STARTUP = make("STARTUP", STARTUP_FRAMES);
+
+    inline constexpr Frame IDLE_WAITING_FRAMES[] = {
+        Frame({OFF, ORANGE, ORANGE, OFF}),
+        Frame({OFF, OFF, OFF, OFF}),
+    };
+    inline constexpr Animation IDLE_WAITING = make("IDLE_WAITING", IDLE_WAITING_FRAMES);
+
+    inline constexpr Frame ALWAYS_ON_WAITING_FRAMES[] = {
+        Frame({OFF, GREEN, GREEN, OFF}),
+        Frame({OFF, OFF, OFF, OFF}),
+    };
+    inline constexpr Animation ALWAYS_ON_WAITING = make("ALWAYS_ON_WAITING", ALWAYS_ON_WAITING_FRAMES);
+
+    inline constexpr Frame LOCKOUT_WAITING_FRAMES[] = {
+        Frame({OFF, RED, RED, OFF}),
+        Frame({OFF, OFF, OFF, OFF}),
+    };
+    inline constexpr Animation LOCKOUT_WAITING = make("LOCKOUT_WAITING", LOCKOUT_WAITING_FRAMES);
+
+    inline constexpr Frame RESTART_FRAMES[] = {
+        Frame({RED, GREEN, BLUE, RED}),
+        Frame({BLUE, RED, GREEN, BLUE}),
+        Frame({GREEN, BLUE, RED, GREEN}),
+    };
+    inline constexpr Animation RESTART = make("RESTART", RESTART_FRAMES);
+
+    inline constexpr Frame FAULT_FRAMES[] = {
+        Frame({RED, RED, RED, RED}),
+        Frame({OFF, OFF, OFF, OFF}),
+    };
+    inline constexpr Animation FAULT = make("FAULT", FAULT_FRAMES);
+
+    inline constexpr Frame AWAIT_AUTH_FRAMES[] = {
+        Frame({ORANGE, ORANGE_DIM, ORANGE_DIM, ORANGE_DIM}, 150, 100),
+        Frame({ORANGE_DIM, ORANGE, ORANGE_DIM, ORANGE_DIM}, 150, 100),
+        Frame({ORANGE_DIM, ORANGE_DIM, ORANGE, ORANGE_DIM}, 150, 100),
+        Frame({ORANGE_DIM, ORANGE_DIM, ORANGE_DIM, ORANGE}, 150, 100),
+        Frame({ORANGE_DIM, ORANGE_DIM, ORANGE, ORANGE_DIM}, 150, 100),
+        Frame({ORANGE_DIM, ORANGE, ORANGE_DIM, ORANGE_DIM}, 150, 100),
+    };
+    inline constexpr Animation AWAIT_AUTH = make("AWAIT_AUTH", AWAIT_AUTH_FRAMES);
+
+    inline constexpr Frame IDENTIFY_FRAMES[] = {
+        Frame({BLUE, BLUE, BLUE, BLUE}),
+        Frame({OFF, OFF, OFF, OFF}),
+    };
+    inline constexpr Animation IDENTIFY = make("IDENTIFY", IDENTIFY_FRAMES);
+
+    inline constexpr Frame WELCOMING_FRAMES[] = {
+        Frame({OFF, OFF, OFF, OFF}, 1050),
+        Frame({ORANGE, OFF, OFF, OFF}),
+    };
+    inline constexpr Animation WELCOMING = make("WELCOMING", WELCOMING_FRAMES);
+
+    inline constexpr Frame WELCOMED_FRAMES[] = {
+        Frame({GREEN, OFF, OFF, OFF}),
+    };
+    inline constexpr Animation WELCOMED = make("WELCOMED", WELCOMED_FRAMES);
+
+    inline constexpr Frame NEXT_CARD_FRAMES[] = {
+        Frame({GREEN, ORANGE, ORANGE, ORANGE}, 250, 100),
+        Frame({ORANGE, GREEN, ORANGE, ORANGE}, 250, 100),
+        Frame({ORANGE, ORANGE, GREEN, ORANGE}, 250, 100),
+        Frame({ORANGE, ORANGE, ORANGE, GREEN}, 250, 100),
+        Frame({ORANGE, ORANGE, GREEN, ORANGE}, 250, 100),
+        Frame({ORANGE, GREEN, ORANGE, ORANGE}, 250, 100),
+    };
+    inline constexpr Animation NEXT_CARD = make("NEXT_CARD", NEXT_CARD_FRAMES);
+
+    // Everything an animation pack can replace
+    inline constexpr const Animation* BUILTINS[] = {
+        &IDLE,
+        &LOCKOUT,
+        &UNLOCKED,
+        &ALWAYS_ON,
+        &DENIED,
+        &STARTUP,
+        &IDLE_WAITING,
+        &ALWAYS_ON_WAITING,
+        &LOCKOUT_WAITING,
+        &RESTART,
+        &FAULT,
+        &AWAIT_AUTH,
+        &IDENTIFY,
+        &WELCOMING,
+        &WELCOMED,
+        &NEXT_CARD,
+    };
+} // namespace Animation
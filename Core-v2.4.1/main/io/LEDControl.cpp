@@ -1,8 +1,10 @@
 #include "LEDControl.hpp"
 
 #include "network/network.hpp"
+#include <algorithm>
 #include <array>
 #include <chrono>
+#include <cmath>
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
 #include <freertos/task.h>
@@ -11,7 +13,9 @@
 #include "common/hardware.hpp"
 #include "common/pins.hpp"
 #include "common/types.hpp"
+#include "driver/gpio.h"
 #include "esp_log.h"
+#include "io/AnimationPack.hpp"
 #include "io/LEDAnimations.hpp"
 #include "led_strip.h"
 
@@ -58,27 +62,99 @@ led_strip_handle_t configure_led(void) {
     // LED Strip object handle
     led_strip_handle_t led_strip;
     ESP_ERROR_CHECK(led_strip_new_rmt_device(&strip_config, &rmt_config, &led_strip));
-    ESP_LOGI(TAG, "Created LED strip object with RMT backend");
+    ESP_LOGD(TAG, "Created LED strip object with RMT backend");
     return led_strip;
 }
 
-void advance_frame(const Animation::Animation* animation, led_strip_handle_t& strip, uint8_t& current_frame) {
-    if (current_frame + 1 >= animation->length) {
-        current_frame = 0;
-    } else {
-        current_frame++;
+// The RMT channel holds a power lock for as long as it exists, so the strip is
+// torn down while nothing is animating. The WS2812s latch their last colors as
+// long as the data line is held low.
+void release_led(led_strip_handle_t& strip) {
+    led_strip_del(strip);
+    strip = NULL;
+    gpio_set_direction((gpio_num_t)LED_PIN, GPIO_MODE_OUTPUT);
+    gpio_set_level((gpio_num_t)LED_PIN, 0);
+}
+
+// Offline marker, pixel 0 blinks white at this rate over whatever is playing
+static constexpr uint32_t OFFLINE_BLINK_MS = 350;
+// Crossfade when the animation changes
+static constexpr uint16_t TRANSITION_MS = 100;
+// Redraw rate while a fade is in progress
+static constexpr uint32_t FADE_STEP_MS = 20;
+
+// Perceived brightness is roughly linear in duty^(1/2.2), fades step through
+// this so they look even instead of rushing through the bright end
+static uint8_t gamma_table[256];
+
+static void build_gamma_table() {
+    for (int i = 0; i < 256; i++) {
+        gamma_table[i] = (uint8_t)lroundf(powf(i / 255.0f, 2.2f) * 255.0f);
+    }
+}
+
+static uint32_t blend(uint32_t from, uint32_t to, uint8_t progress) {
+    // Mirror the curve when dimming so both directions start out gently
+    int32_t weight = to >= from ? gamma_table[progress] : 255 - gamma_table[255 - progress];
+    return (uint32_t)((int32_t)from + ((int32_t)to - (int32_t)from) * weight / 255);
+}
+
+static Animation::Pixels blend(const Animation::Pixels& from, const Animation::Pixels& to, uint8_t progress) {
+    Animation::Pixels out;
+    for (size_t i = 0; i < out.size(); i++) {
+        for (size_t c = 0; c < 3; c++) {
+            out[i][c] = blend(from[i][c], to[i][c], progress);
+        }
+    }
+    return out;
+}
+
+// True if every frame matches the first, nothing to redraw until something changes
+static bool is_static(const Animation::Animation* animation) {
+    for (int i = 1; i < animation->length; i++) {
+        if (animation->frames[i].pixels != animation->frames[0].pixels) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static Animation::Pixels frame_pixels(const Animation::Animation* animation, const Animation::Frame& frame) {
+    Animation::Pixels out;
+    for (size_t i = 0; i < out.size(); i++) {
+        out[i] = animation->color(frame, i);
     }
+    return out;
+}
 
-    for (int i = 0; i < 4; i++) {
-        auto [r, g, b] = animation->frames[current_frame][i];
+static void push_pixels(led_strip_handle_t& strip, const Animation::Pixels& pixels) {
+    if (strip == NULL) {
+        strip = configure_led();
+        if (strip == NULL) {
+            ESP_LOGI(TAG, "Failed to intialize LEDs");
+            // TODO: Crash out
+            return;
+        }
+    }
+
+    for (size_t i = 0; i < pixels.size(); i++) {
+        auto [r, g, b] = pixels[i];
         led_strip_set_pixel(strip, i, r, g, b);
     }
+    led_strip_refresh(strip);
+}
+
+void LED::refresh() {
+    if (led_thread != NULL) {
+        xTaskNotifyGive(led_thread);
+    }
 }
 
 bool LED::set_animation(const Animation::Animation* animation) {
     if (xSemaphoreTake(animation_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
-        current_animation = animation;
+        current_animation = AnimationPack::resolve(animation);
         xSemaphoreGive(animation_mutex);
+        LED::refresh();
         return true;
     } else {
         return false;
@@ -100,37 +176,88 @@ bool get_animation(Animation::Animation const** next_animation) {
     }
 };
 
+// Works out what the strip should show right now and only pushes a frame
+// over RMT when that differs from what is already lit
 void led_thread_fn(void*) {
-    led_strip_handle_t strip = configure_led();
-    if (strip == NULL) {
-        ESP_LOGI(TAG, "Failed to intialize LEDs");
-        // TODO: Crash out
-    }
+    led_strip_handle_t strip = NULL;
 
     const Animation::Animation* thread_animation = &Animation::STARTUP;
-    bool network_good = false;
     uint8_t current_frame = 0;
+    TickType_t frame_start = xTaskGetTickCount();
+    uint16_t fade_ms = 0;
+    Animation::Pixels fade_from = {};
+
+    Animation::Pixels rendered = {}; // animation output, without the offline marker
+    Animation::Pixels shown = {};
+    bool pushed = false;
 
     while (true) {
+        TickType_t now = xTaskGetTickCount();
+        bool animated = !is_static(thread_animation);
+
         if (get_animation(&thread_animation)) {
             current_frame = 0;
+            frame_start = now;
+            fade_from = rendered;
+            fade_ms = pushed ? TRANSITION_MS : 0;
+            animated = !is_static(thread_animation);
+        } else if (animated) {
+            // Catch up on every frame that ended while we slept
+            while (pdTICKS_TO_MS(now - frame_start) >= thread_animation->frames[current_frame].hold_ms()) {
+                const Animation::Frame& ended = thread_animation->frames[current_frame];
+                frame_start += pdMS_TO_TICKS(ended.hold_ms());
+                current_frame = current_frame + 1 >= thread_animation->length ? 0 : current_frame + 1;
+                fade_from = frame_pixels(thread_animation, ended);
+                fade_ms = thread_animation->frames[current_frame].fade_ms();
+            }
         }
 
-        advance_frame(thread_animation, strip, current_frame);
+        const Animation::Frame& frame = thread_animation->frames[current_frame];
+        uint32_t elapsed_ms = pdTICKS_TO_MS(now - frame_start);
+        bool fading = elapsed_ms < fade_ms;
+        Animation::Pixels target = frame_pixels(thread_animation, frame);
+        rendered = fading ? blend(fade_from, target, elapsed_ms * 255 / fade_ms) : target;
 
-        network_good = Network::is_online();
+        Animation::Pixels next = rendered;
+        bool network_good = Network::is_online();
+        uint32_t now_ms = pdTICKS_TO_MS(now);
+        if (!network_good && (now_ms / OFFLINE_BLINK_MS) % 2 == 0) {
+            next[0] = Animation::PALETTE[Animation::WHITE];
+        }
 
-        if (!network_good && (current_frame % 2 == 0)) {
-            led_strip_set_pixel(strip, 0, Animation::WHITE[0], Animation::WHITE[0], Animation::WHITE[0]);
-            led_strip_set_pixel(strip, 0, Animation::WHITE[0], Animation::WHITE[0], Animation::WHITE[0]);
+        if (!pushed || next != shown) {
+            push_pixels(strip, next);
+            shown = next;
+            pushed = true;
         }
 
-        led_strip_refresh(strip);
-        vTaskDelay(pdMS_TO_TICKS(350));
+        // Sleep until the next thing that changes the picture
+        uint32_t wait_ms = UINT32_MAX;
+        if (fading) {
+            wait_ms = FADE_STEP_MS;
+        } else if (animated) {
+            wait_ms = frame.hold_ms() - elapsed_ms;
+        }
+        if (!network_good) {
+            wait_ms = std::min(wait_ms, OFFLINE_BLINK_MS - now_ms % OFFLINE_BLINK_MS);
+        }
+
+        TickType_t wait = portMAX_DELAY;
+        if (wait_ms == UINT32_MAX) {
+            if (strip != NULL) {
+                release_led(strip);
+            }
+        } else {
+            wait = std::max<TickType_t>(pdMS_TO_TICKS(wait_ms), 1);
+        }
+        ulTaskNotifyTake(pdTRUE, wait);
     };
 };
 
 int LED::init() {
+    build_gamma_table();
+    AnimationPack::init();
+    current_animation = AnimationPack::resolve(&Animation::STARTUP);
     animation_mutex = xSemaphoreCreateMutex();
 
     if (animation_mutex == NULL) {
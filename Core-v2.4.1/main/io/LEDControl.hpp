@@ -8,4 +8,6 @@ namespace LED {
     /// @param animation a pointer to a valid animation defined in LEDAnimations.hpp 
     /// @return true if the animation was set, false on error
     bool set_animation(const Animation::Animation *animation);
+    /// @brief wake the led thread to redraw, call when anything the frame depends on changes
+    void refresh();
 };
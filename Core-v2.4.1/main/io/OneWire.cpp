@@ -0,0 +1,264 @@
+#include "OneWire.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include "common/pins.hpp"
+#include "common/queues.hpp"
+#include "esp_log.h"
+#include "onewire_bus.h"
+#include "onewire_device.h"
+
+static const char* TAG = "onewire";
+
+namespace OneWire {
+    static constexpr size_t MAX_ATTEMPTS = 3;
+    // Above the idle task it would otherwise time slice with, and above the
+    // temperature task that waits on it. The RMT does the bit timing.
+    static constexpr UBaseType_t BUS_TASK_PRIORITY = 1;
+    // Keep the bus up this long after the queue empties, or after a transaction's
+    // hold_ms, so a burst of reads doesn't open and close it each time
+    static constexpr TickType_t IDLE_CLOSE = pdMS_TO_TICKS(50);
+
+    enum class Kind : uint8_t {
+        TRANSFER,
+        SEARCH,
+    };
+
+    struct Request {
+        Kind kind;
+        Transaction transaction;
+        // SEARCH only
+        Address* found;
+        size_t max;
+        size_t* count;
+        SemaphoreHandle_t finished;
+    };
+
+    static onewire_bus_handle_t bus = NULL;
+    static Queues::Queue<Request> request_queue;
+    static TaskHandle_t bus_thread = NULL;
+
+    static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+    static DeviceStats stats[MAX_DEVICES] = {};
+    static size_t stats_count = 0;
+
+    // The RMT channels behind the bus hold a power lock for as long as they
+    // exist, so the bus only exists while there is work queued
+    static bool open_bus() {
+        onewire_bus_config_t bus_config = {
+            .bus_gpio_num = TEMP_PIN,
+            .flags = {.en_pull_up = 1},
+        };
+
+        onewire_bus_rmt_config_t rmt_config = {
+            .max_rx_bytes = 10,
+        };
+
+        if (onewire_new_bus_rmt(&bus_config, &rmt_config, &bus) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to create onewire bus");
+            bus = NULL;
+            return false;
+        }
+        return true;
+    }
+
+    static void close_bus() {
+        onewire_bus_del(bus);
+        bus = NULL;
+    }
+
+    static void record(Address address, const Result& result) {
+        if (address == SKIP_ROM) {
+            return;
+        }
+        taskENTER_CRITICAL(&stats_lock);
+        DeviceStats* device = NULL;
+        for (size_t i = 0; i < stats_count; i++) {
+            if (stats[i].address == address) {
+                device = &stats[i];
+                break;
+            }
+        }
+        if (device == NULL && stats_count < MAX_DEVICES) {
+            device = &stats[stats_count++];
+            *device = {.address = address, .transactions = 0, .crc_errors = 0, .failures = 0};
+        }
+        if (device != NULL) {
+            device->transactions++;
+            device->crc_errors += result.crc_errors;
+            device->failures += result.err != ESP_OK;
+        }
+        taskEXIT_CRITICAL(&stats_lock);
+    }
+
+    static esp_err_t transfer_once(const Transaction& transaction, uint8_t* rx) {
+        uint8_t tx[1 + sizeof(Address) + MAX_TX];
+        size_t len = 0;
+        if (transaction.address == SKIP_ROM) {
+            tx[len++] = ONEWIRE_CMD_SKIP_ROM;
+        } else {
+            tx[len++] = ONEWIRE_CMD_MATCH_ROM;
+            memcpy(tx + len, &transaction.address, sizeof(Address));
+            len += sizeof(Address);
+        }
+        memcpy(tx + len, transaction.tx, transaction.tx_len);
+        len += transaction.tx_len;
+
+        esp_err_t err = onewire_bus_reset(bus);
+        if (err == ESP_OK) {
+            err = onewire_bus_write_bytes(bus, tx, len);
+        }
+        if (err == ESP_OK && transaction.rx_len > 0) {
+            err = onewire_bus_read_bytes(bus, rx, transaction.rx_len);
+        }
+        if (err == ESP_OK && transaction.check_crc &&
+            onewire_crc8(0, rx, transaction.rx_len - 1) != rx[transaction.rx_len - 1]) {
+            err = ESP_ERR_INVALID_CRC;
+        }
+        return err;
+    }
+
+    static void run_transfer(const Transaction& transaction) {
+        Result result = {.err = ESP_FAIL, .rx = {}, .attempts = 0, .crc_errors = 0};
+        // Only a bad CRC is worth another go, no presence pulse won't fix itself
+        do {
+            result.attempts++;
+            result.err = transfer_once(transaction, result.rx);
+            if (result.err == ESP_ERR_INVALID_CRC) {
+                result.crc_errors++;
+            }
+        } while (result.err == ESP_ERR_INVALID_CRC && result.attempts < MAX_ATTEMPTS);
+
+        record(transaction.address, result);
+        if (transaction.done != nullptr) {
+            transaction.done(result, transaction.ctx);
+        }
+    }
+
+    static void run_search(const Request& request) {
+        onewire_device_iter_handle_t iter = NULL;
+        *request.count = 0;
+        if (onewire_new_device_iter(bus, &iter) == ESP_OK) {
+            onewire_device_t device;
+            while (*request.count < request.max && onewire_device_iter_get_next(iter, &device) == ESP_OK) {
+                request.found[(*request.count)++] = device.address;
+            }
+            onewire_del_device_iter(iter);
+        }
+        xSemaphoreGive(request.finished);
+    }
+
+    static void bus_task_fn(void*) {
+        Request request;
+        TickType_t close_at = 0;
+        while (true) {
+            TickType_t wait = portMAX_DELAY;
+            if (bus != NULL) {
+                TickType_t left = close_at - xTaskGetTickCount();
+                wait = (int32_t)left > 0 ? left : 0;
+            }
+            if (!request_queue.receive(request, wait)) {
+                close_bus();
+                continue;
+            }
+            if (bus == NULL && !open_bus()) {
+                // Fail it rather than leave the submitter waiting
+                if (request.kind == Kind::SEARCH) {
+                    *request.count = 0;
+                    xSemaphoreGive(request.finished);
+                } else if (request.transaction.done != nullptr) {
+                    Result result = {.err = ESP_ERR_INVALID_STATE, .rx = {}, .attempts = 0, .crc_errors = 0};
+                    request.transaction.done(result, request.transaction.ctx);
+                }
+                continue;
+            }
+
+            TickType_t hold = IDLE_CLOSE;
+            if (request.kind == Kind::SEARCH) {
+                run_search(request);
+            } else {
+                run_transfer(request.transaction);
+                hold += pdMS_TO_TICKS(request.transaction.hold_ms);
+            }
+            TickType_t until = xTaskGetTickCount() + hold;
+            if ((int32_t)(until - close_at) > 0) {
+                close_at = until;
+            }
+        }
+    }
+
+    int init() {
+        request_queue.create("onewire", 16);
+        if (xTaskCreate(bus_task_fn, "onewire", CONFIG_ONEWIRE_TASK_STACK_SIZE, NULL, BUS_TASK_PRIORITY,
+                        &bus_thread) != pdPASS) {
+            ESP_LOGE(TAG, "Failed to start bus task");
+            return 1;
+        }
+        return 0;
+    }
+
+    bool submit(const Transaction& transaction, TickType_t wait) {
+        Request request = {
+            .kind = Kind::TRANSFER,
+            .transaction = transaction,
+            .found = NULL,
+            .max = 0,
+            .count = NULL,
+            .finished = NULL,
+        };
+        return request_queue.send(request, wait);
+    }
+
+    struct Waiter {
+        SemaphoreHandle_t finished;
+        Result* result;
+    };
+
+    Result run(const Transaction& transaction) {
+        StaticSemaphore_t storage;
+        Result result = {.err = ESP_ERR_TIMEOUT, .rx = {}, .attempts = 0, .crc_errors = 0};
+        Waiter waiter = {.finished = xSemaphoreCreateBinaryStatic(&storage), .result = &result};
+
+        Transaction wrapped = transaction;
+        wrapped.ctx = &waiter;
+        wrapped.done = [](const Result& result, void* ctx) {
+            Waiter* waiter = (Waiter*)ctx;
+            *waiter->result = result;
+            xSemaphoreGive(waiter->finished);
+        };
+        if (submit(wrapped, portMAX_DELAY)) {
+            xSemaphoreTake(waiter.finished, portMAX_DELAY);
+        }
+        vSemaphoreDelete(waiter.finished);
+        return result;
+    }
+
+    size_t search(Address* out, size_t max) {
+        StaticSemaphore_t storage;
+        size_t count = 0;
+        Request request = {
+            .kind = Kind::SEARCH,
+            .transaction = {},
+            .found = out,
+            .max = max,
+            .count = &count,
+            .finished = xSemaphoreCreateBinaryStatic(&storage),
+        };
+        if (request_queue.send(request, portMAX_DELAY)) {
+            xSemaphoreTake(request.finished, portMAX_DELAY);
+        }
+        vSemaphoreDelete(request.finished);
+        return count;
+    }
+
+    size_t get_stats(DeviceStats* out, size_t max) {
+        taskENTER_CRITICAL(&stats_lock);
+        size_t count = std::min(stats_count, max);
+        memcpy(out, stats, count * sizeof(DeviceStats));
+        taskEXIT_CRITICAL(&stats_lock);
+        return count;
+    }
+} // namespace OneWire
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <freertos/FreeRTOS.h>
+
+#include "esp_err.h"
+
+// Owns the 1-Wire bus. Work is queued as transactions that the bus task runs
+// in order, each finishing with a callback on that task, so only the bus task
+// ever waits on the wire. Reads with a CRC are retried before they fail.
+namespace OneWire {
+    using Address = uint64_t;
+    static constexpr Address SKIP_ROM = 0; // every device on the bus at once
+    static constexpr size_t MAX_TX = 8;
+    static constexpr size_t MAX_RX = 9;
+    static constexpr size_t MAX_DEVICES = 64; // devices with their own stats
+
+    struct Result {
+        esp_err_t err; // ESP_ERR_INVALID_CRC once the retries run out
+        uint8_t rx[MAX_RX];
+        uint8_t attempts;
+        uint8_t crc_errors; // attempts that read back a bad CRC
+    };
+
+    // Runs on the bus task, keep it short
+    using Callback = void (*)(const Result& result, void* ctx);
+
+    struct Transaction {
+        Address address;
+        uint8_t tx[MAX_TX]; // sent after the ROM command
+        uint8_t tx_len;
+        uint8_t rx_len;
+        bool check_crc; // last rx byte is a CRC8 of the others
+        Callback done;  // may be null
+        void* ctx;
+        uint16_t hold_ms; // keep the bus up this much longer afterwards, e.g. for a conversion
+    };
+
+    struct DeviceStats {
+        Address address;
+        uint32_t transactions;
+        uint32_t crc_errors; // every bad attempt, including ones a retry recovered
+        uint32_t failures;   // transactions that gave up
+    };
+
+    int init();
+
+    bool submit(const Transaction& transaction, TickType_t wait);
+
+    // Blocks the calling task until the transaction is done, done and ctx are ignored
+    Result run(const Transaction& transaction);
+
+    // Blocking ROM search, returns how many devices were found
+    size_t search(Address* out, size_t max);
+
+    // Copies out up to max devices that have seen traffic, returns how many
+    size_t get_stats(DeviceStats* out, size_t max);
+} // namespace OneWire
@@ -0,0 +1,248 @@
+#include "SongLibrary.hpp"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include "common/flash_region.hpp"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "io/Buzzer.hpp"
+
+static const char* TAG = "songs";
+
+namespace SongLibrary {
+    // Stored layout: header, then length notes of {u16 frequency, u16 duration}
+    struct Header {
+        uint16_t id;
+        uint16_t length;
+        uint32_t hash;
+    };
+
+    static constexpr size_t PACKED_NOTE_BYTES = 4;
+    static constexpr size_t MAX_SONG_BYTES = sizeof(Header) + MAX_NOTES * PACKED_NOTE_BYTES;
+
+    struct Slot {
+        Entry entry;
+        bool used;
+    };
+
+    static portMUX_TYPE slots_lock = portMUX_INITIALIZER_UNLOCKED;
+    static Slot slots[MAX_SLOTS] = {};
+    static size_t slot_count = 0;
+
+    // song_buf and notes are shared by store and play, buf_lock guards both.
+    // The buzzer takes its own copy of the notes before play returns.
+    static SemaphoreHandle_t buf_lock = NULL;
+    static uint8_t song_buf[MAX_SONG_BYTES];
+    static SoundEffect::Note notes[MAX_NOTES];
+
+    static uint32_t hash_notes(const uint8_t* packed, size_t length) {
+        return esp_rom_crc32_le(0, packed, length * PACKED_NOTE_BYTES);
+    }
+
+    static uint16_t read_u16(const uint8_t* p) {
+        return p[0] | (p[1] << 8);
+    }
+
+    static void write_u16(uint8_t* p, uint16_t v) {
+        p[0] = v & 0xff;
+        p[1] = v >> 8;
+    }
+
+    // Header of a stored song, false unless it is whole and matches its hash
+    static bool load(size_t slot, Header& header) {
+        size_t len = 0;
+        if (!FlashRegion::read(FlashRegion::Region::SONGS, song_buf, sizeof(song_buf), len, slot) ||
+            len < sizeof(header)) {
+            return false;
+        }
+        memcpy(&header, song_buf, sizeof(header));
+        const uint8_t* packed = song_buf + sizeof(header);
+        return header.length <= MAX_NOTES && len == sizeof(header) + header.length * PACKED_NOTE_BYTES &&
+               hash_notes(packed, header.length) == header.hash;
+    }
+
+    // Slot holding id, or -1
+    static int find(uint16_t id) {
+        int found = -1;
+        taskENTER_CRITICAL(&slots_lock);
+        for (size_t i = 0; i < slot_count; i++) {
+            if (slots[i].used && slots[i].entry.id == id) {
+                found = i;
+                break;
+            }
+        }
+        taskEXIT_CRITICAL(&slots_lock);
+        return found;
+    }
+
+    static void set_slot(size_t slot, const Slot& value) {
+        taskENTER_CRITICAL(&slots_lock);
+        slots[slot] = value;
+        taskEXIT_CRITICAL(&slots_lock);
+    }
+
+    int init() {
+        buf_lock = xSemaphoreCreateMutex();
+        if (buf_lock == NULL) {
+            ESP_LOGE(TAG, "Couldn't create song buffer lock");
+            return 1;
+        }
+        slot_count = std::min(FlashRegion::slots(FlashRegion::Region::SONGS), MAX_SLOTS);
+        size_t count = 0;
+        for (size_t slot = 0; slot < slot_count; slot++) {
+            Header header;
+            if (!load(slot, header)) {
+                continue;
+            }
+            set_slot(slot, {.entry = {.id = header.id, .length = header.length, .hash = header.hash}, .used = true});
+            count++;
+        }
+        ESP_LOGI(TAG, "%u songs in library", (unsigned)count);
+        return 0;
+    }
+
+    // Packs the notes into song_buf after the header, returns the count or -1
+    static int encode(const cJSON* notes_obj) {
+        if (!cJSON_IsArray(notes_obj) || (size_t)cJSON_GetArraySize(notes_obj) > MAX_NOTES) {
+            ESP_LOGW(TAG, "Song notes must be an array of at most %u", (unsigned)MAX_NOTES);
+            return -1;
+        }
+
+        uint8_t* pos = song_buf + sizeof(Header);
+        const cJSON* notedef = NULL;
+        cJSON_ArrayForEach(notedef, notes_obj) {
+            const cJSON* freq_obj = cJSON_GetArrayItem(notedef, 0);
+            const cJSON* len_obj = cJSON_GetArrayItem(notedef, 1);
+            if (cJSON_GetArraySize(notedef) != 2 || !cJSON_IsNumber(freq_obj) || !cJSON_IsNumber(len_obj)) {
+                ESP_LOGW(TAG, "Song notes are [freq_hz, duration_ms]");
+                return -1;
+            }
+            double freq = cJSON_GetNumberValue(freq_obj);
+            double duration = cJSON_GetNumberValue(len_obj);
+            if (freq < 0 || freq > UINT16_MAX || duration < 0 || duration > UINT16_MAX) {
+                ESP_LOGW(TAG, "Song note out of range");
+                return -1;
+            }
+            write_u16(pos, (uint16_t)freq);
+            write_u16(pos + 2, (uint16_t)duration);
+            pos += PACKED_NOTE_BYTES;
+        }
+        return cJSON_GetArraySize(notes_obj);
+    }
+
+    static bool store_song(const cJSON* song) {
+        const cJSON* id_obj = cJSON_GetObjectItem(song, "Id");
+        if (id_obj != NULL && (!cJSON_IsNumber(id_obj) || cJSON_GetNumberValue(id_obj) < 0 ||
+                               cJSON_GetNumberValue(id_obj) > UINT16_MAX)) {
+            ESP_LOGW(TAG, "Song id must be 0-65535");
+            return false;
+        }
+        uint16_t id = id_obj ? (uint16_t)cJSON_GetNumberValue(id_obj) : 0;
+        int existing = find(id);
+
+        const cJSON* notes_obj = cJSON_GetObjectItem(song, "Notes");
+        if (cJSON_GetArraySize(notes_obj) == 0) {
+            if (existing < 0) {
+                return true;
+            }
+            ESP_LOGI(TAG, "Removing song %u", id);
+            set_slot(existing, {});
+            return FlashRegion::clear(FlashRegion::Region::SONGS, existing);
+        }
+
+        int length = encode(notes_obj);
+        if (length < 0) {
+            ESP_LOGW(TAG, "Rejected song %u", id);
+            return false;
+        }
+        Header header = {
+            .id = id,
+            .length = (uint16_t)length,
+            .hash = hash_notes(song_buf + sizeof(Header), length),
+        };
+        memcpy(song_buf, &header, sizeof(header));
+
+        int slot = existing;
+        for (size_t i = 0; slot < 0 && i < slot_count; i++) {
+            if (!slots[i].used) {
+                slot = i;
+            }
+        }
+        if (slot < 0) {
+            ESP_LOGW(TAG, "Song library is full, not storing song %u", id);
+            return false;
+        }
+        if (existing >= 0 && slots[existing].entry.hash == header.hash) {
+            return true; // already have this version
+        }
+
+        // Drop the old entry first so a failed write doesn't leave it pointing at garbage
+        set_slot(slot, {});
+        if (!FlashRegion::write(FlashRegion::Region::SONGS, song_buf,
+                                sizeof(header) + length * PACKED_NOTE_BYTES, slot)) {
+            ESP_LOGE(TAG, "Couldn't store song %u", id);
+            return false;
+        }
+        set_slot(slot, {.entry = {.id = id, .length = header.length, .hash = header.hash}, .used = true});
+        ESP_LOGI(TAG, "Stored song %u, %u notes, hash %08" PRIx32, id, header.length, header.hash);
+        return true;
+    }
+
+    static bool play_song(uint16_t id, uint32_t hash) {
+        int slot = find(id);
+        if (slot < 0 || (hash != 0 && slots[slot].entry.hash != hash)) {
+            return false;
+        }
+
+        Header header;
+        if (!load(slot, header) || header.id != id) {
+            ESP_LOGE(TAG, "Song %u is unreadable, dropping it", id);
+            set_slot(slot, {});
+            return false;
+        }
+
+        const uint8_t* packed = song_buf + sizeof(header);
+        for (uint16_t i = 0; i < header.length; i++) {
+            notes[i] = {
+                .frequency = read_u16(packed),
+                .duration = read_u16(packed + 2),
+            };
+            packed += PACKED_NOTE_BYTES;
+        }
+
+        if (!Buzzer::send_copy({.length = header.length, .notes = notes})) {
+            ESP_LOGW(TAG, "Buzzer busy, song %u not played", id);
+        }
+        return true;
+    }
+
+    bool store(const cJSON* song) {
+        xSemaphoreTake(buf_lock, portMAX_DELAY);
+        bool stored = store_song(song);
+        xSemaphoreGive(buf_lock);
+        return stored;
+    }
+
+    bool play(uint16_t id, uint32_t hash) {
+        xSemaphoreTake(buf_lock, portMAX_DELAY);
+        bool played = play_song(id, hash);
+        xSemaphoreGive(buf_lock);
+        return played;
+    }
+
+    size_t list(Entry* out, size_t max) {
+        size_t count = 0;
+        taskENTER_CRITICAL(&slots_lock);
+        for (size_t i = 0; i < slot_count && count < max; i++) {
+            if (slots[i].used) {
+                out[count++] = slots[i].entry;
+            }
+        }
+        taskEXIT_CRITICAL(&slots_lock);
+        return count;
+    }
+} // namespace SongLibrary
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "cJSON.h"
+
+// Songs pushed by the server, kept in flash so they survive a reboot. Each one
+// has a server chosen id and a content hash, the server only uploads a song
+// when the unit doesn't list it with the right hash. The hash is the CRC-32
+// (as zlib computes it) of the notes packed as little endian u16 frequency,
+// u16 duration pairs.
+namespace SongLibrary {
+    static constexpr size_t MAX_NOTES = 128;
+    static constexpr size_t MAX_SLOTS = 16;
+
+    struct Entry {
+        uint16_t id;
+        uint16_t length;
+        uint32_t hash;
+    };
+
+    // Indexes the stored songs. Call before anything plays one.
+    int init();
+
+    /**
+     * Checks and stores a song from the server, replacing any song with the
+     * same id. A song without notes removes it.
+     * {"Id": 3, "Notes": [[freq_hz, duration_ms], ...]}, Id defaults to 0
+     * @return true if the song was stored
+     */
+    bool store(const cJSON* song);
+
+    // False if the library doesn't have the song, or has a different version
+    // of it when hash isn't 0
+    bool play(uint16_t id, uint32_t hash = 0);
+
+    // Copies out up to max entries, returns how many
+    size_t list(Entry* out, size_t max);
+} // namespace SongLibrary
@@ -1,22 +1,47 @@
 #include "io/Temperature.hpp"
 
+#include <algorithm>
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
 #include <freertos/task.h>
 
-#include "common/pins.hpp"
-#include "ds18b20.h"
 #include "esp_log.h"
 #include "io/IO.hpp"
+#include "io/OneWire.hpp"
 #include "network/storage.hpp"
-#include "onewire_bus.h"
-#include "onewire_device.h"
 
-#define MAX_ONEWIRE_DEVICES 64
-onewire_bus_handle_t onewire_bus;
+using Temperature::MAX_ONEWIRE_DEVICES;
 uint8_t num_ds_detcted = 0;
-ds18b20_device_handle_t s_ds18b20s[MAX_ONEWIRE_DEVICES];
+static OneWire::Address s_addresses[MAX_ONEWIRE_DEVICES];
 static float s_temperature[MAX_ONEWIRE_DEVICES];
+// Samples in a row each sensor has missed, whether the conversion, the read or
+// its CRC failed. A cut probe wire or dead bus keeps the last value in
+// s_temperature, so past MAX_MISSED_SAMPLES the sensor counts as faulted.
+static uint8_t s_missed[MAX_ONEWIRE_DEVICES];
+static constexpr uint8_t MAX_MISSED_SAMPLES = 3;
+
+// One sample a second per sensor. Readings stay in the DS18B20's native
+// 1/16 C steps so the running sums are exact and never drift. Cycles with many
+// probes run long, so the slope is fitted against when each sample was taken.
+// A missed sample leaves a gap the window doesn't span, it restarts instead.
+static constexpr uint32_t SAMPLE_PERIOD_MS = 1000;
+static constexpr TickType_t MAX_SAMPLE_GAP = pdMS_TO_TICKS(SAMPLE_PERIOD_MS * 3 / 2);
+static constexpr size_t TREND_WINDOW = 32;
+static constexpr float EWMA_ALPHA = 0.2f;
+
+struct Trend {
+    int16_t ring[TREND_WINDOW];
+    TickType_t at[TREND_WINDOW]; // when each sample in ring was taken
+    uint8_t oldest;
+    uint8_t count;
+    int32_t sum; // of the samples in the window
+    float ewma;
+    int16_t min; // since the last report
+    int16_t max;
+    TickType_t last_at; // when the newest sample was taken
+    bool started;
+};
+static Trend* s_trends = NULL; // one per detected sensor
 
 SemaphoreHandle_t temp_mutex;
 static float cur_temp = 0.0;
@@ -26,96 +51,281 @@ TaskHandle_t temp_thread;
 
 static const char* TAG = "temp";
 
+static constexpr uint8_t DS18B20_FAMILY_CODE = 0x28;
+static constexpr uint8_t DS18B20_CMD_CONVERT_TEMP = 0x44;
+static constexpr uint8_t DS18B20_CMD_WRITE_SCRATCHPAD = 0x4E;
+static constexpr uint8_t DS18B20_CMD_READ_SCRATCHPAD = 0xBE;
+static constexpr size_t DS18B20_SCRATCHPAD_SIZE = 9;
+
 void sensor_detect() {
-    int onewire_device_found = 0;
-    onewire_device_iter_handle_t iter = NULL;
-    onewire_device_t next_onewire_device;
-    esp_err_t search_result = ESP_OK;
+    OneWire::Address found[MAX_ONEWIRE_DEVICES];
+    size_t count = OneWire::search(found, MAX_ONEWIRE_DEVICES);
 
-    onewire_new_device_iter(onewire_bus, &iter);
+    for (size_t i = 0; i < count; i++) {
+        if ((found[i] & 0xFF) == DS18B20_FAMILY_CODE) {
+            s_addresses[num_ds_detcted++] = found[i];
+        } else {
+            ESP_LOGI(TAG, "Found an unknown device, address: %016llX", found[i]);
+        }
+    }
+}
+
+// Resolution lives in RAM on the sensor and resets at power up, so it is set
+// every time. TH and TL are only used for alarm search, which we don't do.
+static OneWire::Transaction set_resolution(uint8_t bits) {
+    return {
+        .address = OneWire::SKIP_ROM,
+        .tx = {DS18B20_CMD_WRITE_SCRATCHPAD, 0x7F, 0x80, (uint8_t)(((bits - 9) << 5) | 0x1F)},
+        .tx_len = 4,
+        .rx_len = 0,
+        .check_crc = false,
+        .done = nullptr,
+        .ctx = nullptr,
+        .hold_ms = 0,
+    };
+}
 
-    while (search_result == ESP_OK) {
-        search_result = onewire_device_iter_get_next(iter, &next_onewire_device);
+static int16_t decode_scratchpad(const uint8_t* scratchpad, uint8_t bits) {
+    // Bits below the resolution are undefined
+    uint8_t lsb = scratchpad[0] & ~((1 << (12 - bits)) - 1);
+    return (int16_t)((scratchpad[1] << 8) | lsb);
+}
 
-        if (search_result == ESP_OK) {
-            ds18b20_config_t ds_cfg = {};
+// O(1) per sample: the oldest reading leaves the sum as the new one enters
+static void trend_add(Trend& trend, int16_t raw, TickType_t now) {
+    if (!trend.started) {
+        trend.started = true;
+        trend.ewma = raw;
+        trend.min = raw;
+        trend.max = raw;
+    } else if (now - trend.last_at > MAX_SAMPLE_GAP) {
+        trend.oldest = 0;
+        trend.count = 0;
+        trend.sum = 0;
+    }
+    trend.last_at = now;
+    trend.ewma += EWMA_ALPHA * (raw - trend.ewma);
+    trend.min = std::min(trend.min, raw);
+    trend.max = std::max(trend.max, raw);
 
-            if (ds18b20_new_device(&next_onewire_device, &ds_cfg, &s_ds18b20s[num_ds_detcted]) == ESP_OK) {
-                num_ds_detcted++;
-            } else {
-                ESP_LOGI(TAG, "Found an unknown device, address: %016llX", next_onewire_device.address);
-            }
+    if (trend.count < TREND_WINDOW) {
+        size_t slot = (trend.oldest + trend.count) % TREND_WINDOW;
+        trend.ring[slot] = raw;
+        trend.at[slot] = now;
+        trend.sum += raw;
+        trend.count++;
+        return;
+    }
+    int16_t dropped = trend.ring[trend.oldest];
+    trend.ring[trend.oldest] = raw;
+    trend.at[trend.oldest] = now;
+    trend.oldest = (trend.oldest + 1) % TREND_WINDOW;
+    trend.sum += raw - dropped;
+}
 
-            onewire_device_found++;
-            if (onewire_device_found >= MAX_ONEWIRE_DEVICES) {
-                break;
-            }
-        }
+// Least squares slope over the window against each sample's tick, in C per
+// minute. Times are taken from the oldest sample so the products stay small.
+static float trend_slope(const Trend& trend) {
+    int64_t n = trend.count;
+    if (n < 2) {
+        return 0;
+    }
+    TickType_t base = trend.at[trend.oldest];
+    int64_t sum_x = 0;
+    int64_t sum_xx = 0;
+    int64_t sum_xy = 0;
+    for (size_t i = 0; i < trend.count; i++) {
+        size_t slot = (trend.oldest + i) % TREND_WINDOW;
+        int64_t x = pdTICKS_TO_MS(trend.at[slot] - base);
+        sum_x += x;
+        sum_xx += x * x;
+        sum_xy += x * trend.ring[slot];
+    }
+    int64_t den = n * sum_xx - sum_x * sum_x;
+    if (den == 0) {
+        return 0;
     }
+    int64_t num = n * sum_xy - sum_x * trend.sum;
+    return (float)num / den / 16.0f * 60000.0f;
 }
 
+// Reads are tagged with the cycle that queued them and the resolution it
+// asked for. A read that lands after its cycle gave up is ignored, so it can't
+// count towards the next cycle or decode with the wrong resolution.
+static constexpr uint32_t CYCLE_MASK = 0xFFFFF;
+static uint32_t read_cycle = 0; // guarded by temp_mutex
+static int pending_reads = 0;   // guarded by temp_mutex
+
+static void* read_tag(uint32_t cycle, uint8_t bits, size_t sensor) {
+    return (void*)(uintptr_t)(((cycle & CYCLE_MASK) << 12) | ((bits - 9) << 8) | sensor);
+}
+
+// Runs on the bus task as each sensor's scratchpad comes back
+static void on_scratchpad(const OneWire::Result& result, void* ctx) {
+    uintptr_t tag = (uintptr_t)ctx;
+    size_t i = tag & 0xFF;
+    uint8_t bits = 9 + ((tag >> 8) & 0xF);
+    uint32_t cycle = (tag >> 12) & CYCLE_MASK;
+
+    if (xSemaphoreTake(temp_mutex, pdMS_TO_TICKS(50)) != pdTRUE) {
+        return; // the temp task times out this cycle
+    }
+    if (cycle != (read_cycle & CYCLE_MASK)) {
+        xSemaphoreGive(temp_mutex);
+        ESP_LOGD(TAG, "Late read from sensor %016llX, ignoring it", s_addresses[i]);
+        return;
+    }
+    if (result.err == ESP_OK) {
+        int16_t raw = decode_scratchpad(result.rx, bits);
+        s_temperature[i] = raw / 16.0f;
+        s_missed[i] = 0;
+        trend_add(s_trends[i], raw, xTaskGetTickCount());
+    }
+    bool last = --pending_reads == 0;
+    xSemaphoreGive(temp_mutex);
+
+    if (result.err != ESP_OK) {
+        ESP_LOGW(TAG, "Bad read from sensor %016llX: %s", s_addresses[i],
+                 esp_err_to_name(result.err));
+    }
+    if (last) {
+        xTaskNotifyGive(temp_thread);
+    }
+}
+
+// One broadcast conversion for the whole bus then a scratchpad read per
+// sensor, so a sample costs one conversion time however many probes there are.
+// The reads are queued on the bus task, this task only waits for the last one.
 void sensor_read() {
-    float temp_temp = 0.0;
+    if (num_ds_detcted == 0) {
+        return;
+    }
+
+    // Every sensor missed this sample until its read comes back good
+    xSemaphoreTake(temp_mutex, portMAX_DELAY);
     for (int i = 0; i < num_ds_detcted; i++) {
-        ds18b20_trigger_temperature_conversion(s_ds18b20s[i]);
-        ds18b20_get_temperature(s_ds18b20s[i], &temp_temp);
-        s_temperature[i] = temp_temp;
+        if (s_missed[i] < UINT8_MAX) {
+            s_missed[i]++;
+        }
+    }
+    xSemaphoreGive(temp_mutex);
+
+    uint8_t bits = Storage::get_temp_resolution();
+    // 93.75 ms at 9 bits, doubling with each extra bit
+    uint16_t conversion_ms = 94 << (bits - 9);
+    OneWire::Transaction convert = {
+        .address = OneWire::SKIP_ROM,
+        .tx = {DS18B20_CMD_CONVERT_TEMP},
+        .tx_len = 1,
+        .rx_len = 0,
+        .check_crc = false,
+        .done = nullptr,
+        .ctx = nullptr,
+        .hold_ms = conversion_ms, // the bus stays up until the reads are queued
+    };
+    if (!OneWire::submit(set_resolution(bits), pdMS_TO_TICKS(100)) || OneWire::run(convert).err != ESP_OK) {
+        ESP_LOGW(TAG, "No sensors answered the conversion");
+        return;
+    }
+    vTaskDelay(pdMS_TO_TICKS(conversion_ms));
+
+    xSemaphoreTake(temp_mutex, portMAX_DELAY);
+    uint32_t cycle = ++read_cycle;
+    pending_reads = num_ds_detcted;
+    xSemaphoreGive(temp_mutex);
+    ulTaskNotifyTake(pdTRUE, 0);
+
+    int submitted = 0;
+    for (int i = 0; i < num_ds_detcted; i++) {
+        OneWire::Transaction read = {
+            .address = s_addresses[i],
+            .tx = {DS18B20_CMD_READ_SCRATCHPAD},
+            .tx_len = 1,
+            .rx_len = DS18B20_SCRATCHPAD_SIZE,
+            .check_crc = true,
+            .done = on_scratchpad,
+            .ctx = read_tag(cycle, bits, i),
+            .hold_ms = 0,
+        };
+        submitted += OneWire::submit(read, pdMS_TO_TICKS(500));
+    }
+
+    xSemaphoreTake(temp_mutex, portMAX_DELAY);
+    pending_reads -= num_ds_detcted - submitted;
+    bool waiting = pending_reads > 0;
+    xSemaphoreGive(temp_mutex);
+    if (waiting) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(SAMPLE_PERIOD_MS));
     }
 }
 extern bool ok_to_rmt_read;
 void temp_thread_fn(void*) {
+    TickType_t last_wake = xTaskGetTickCount();
     while (true) {
+        // Fixed cadence, a sample is a safety check rather than something that can be woken by an event
+        xTaskDelayUntil(&last_wake, pdMS_TO_TICKS(SAMPLE_PERIOD_MS));
         if (!ok_to_rmt_read) {
-            vTaskDelay(pdMS_TO_TICKS(1000));
             continue;
         }
         sensor_read();
 
         float max = 1.0;
         float min = 100.0f;
+        float steepest = 0;
+        bool window_full = false;
+        int stale = -1;
 
-        for (int i = 0; i < num_ds_detcted; i++) {
-            if (s_temperature[i] > max) {
-                max = s_temperature[i];
-            }
+        if (xSemaphoreTake(temp_mutex, pdMS_TO_TICKS(50)) == pdTRUE) {
+            for (int i = 0; i < num_ds_detcted; i++) {
+                if (s_missed[i] >= MAX_MISSED_SAMPLES) {
+                    stale = i;
+                }
 
-            if (s_temperature[i] < min) {
-                min = s_temperature[i];
-            }
-        }
+                if (s_temperature[i] > max) {
+                    max = s_temperature[i];
+                }
 
-        if (xSemaphoreTake(temp_mutex, pdMS_TO_TICKS(50)) == pdTRUE) {
+                if (s_temperature[i] < min) {
+                    min = s_temperature[i];
+                }
+
+                // Too few samples early on, a single noisy read would look like a steep rise
+                if (s_trends[i].count == TREND_WINDOW) {
+                    window_full = true;
+                    steepest = std::max(steepest, trend_slope(s_trends[i]));
+                }
+            }
             cur_temp = max;
             xSemaphoreGive(temp_mutex);
         } // If we fail to get the mutex just drop the new data, not a big deal
 
+        if (stale >= 0) {
+            ESP_LOGE(TAG, "Sensor %016llX missed %u samples in a row", s_addresses[stale], (unsigned)s_missed[stale]);
+            IO::fault(FaultReason::TEMP_ERROR);
+        }
+
+        uint8_t max_rise = Storage::get_max_temp_rise();
+        if (max_rise != 0 && window_full && steepest >= max_rise) {
+            ESP_LOGE(TAG, "Rising %.1f C/min, limit %u", steepest, max_rise);
+            IO::fault(FaultReason::TEMP_ERROR);
+        }
+
         if (max >= Storage::get_max_temp() || min <= 0) {
             ESP_LOGE(TAG, "MAX: %f | MIN: %f", max, min);
             IO::fault(FaultReason::TEMP_ERROR);
         }
-
-        vTaskDelay(pdMS_TO_TICKS(1000));
     }
 }
 
 int Temperature::init() {
 
-    onewire_bus_config_t bus_config = {
-        .bus_gpio_num = TEMP_PIN,
-        .flags = {.en_pull_up = 1},
-    };
-
-    onewire_bus_rmt_config_t rmt_config = {
-        .max_rx_bytes = 10,
-    };
-
     esp_log_level_set(TAG, ESP_LOG_DEBUG);
 
-    onewire_new_bus_rmt(&bus_config, &rmt_config, &onewire_bus);
-
     temp_mutex = xSemaphoreCreateMutex();
 
+    OneWire::init();
     sensor_detect();
+    s_trends = new Trend[num_ds_detcted]();
 
     for (int i = 0; i < MAX_ONEWIRE_DEVICES; i++) {
         s_temperature[i] = 1.0f;
@@ -133,4 +343,30 @@ bool Temperature::get_temp(float& ret_temp) {
     } else {
         return false;
     }
-}
\ No newline at end of file
+}
+
+size_t Temperature::get_sensor_stats(SensorStats* out, size_t max) {
+    if (xSemaphoreTake(temp_mutex, pdMS_TO_TICKS(100)) != pdTRUE) {
+        return 0;
+    }
+    size_t count = 0;
+    for (int i = 0; i < num_ds_detcted && count < max; i++) {
+        Trend& trend = s_trends[i];
+        if (trend.count == 0) {
+            out[count++] = {.address = s_addresses[i], .samples = 0};
+            continue;
+        }
+        out[count++] = {
+            .address = s_addresses[i],
+            .samples = trend.count,
+            .min = trend.min / 16.0f,
+            .max = trend.max / 16.0f,
+            .average = trend.ewma / 16.0f,
+            .slope_per_min = trend_slope(trend),
+        };
+        trend.min = trend.ring[(trend.oldest + trend.count - 1) % TREND_WINDOW];
+        trend.max = trend.min;
+    }
+    xSemaphoreGive(temp_mutex);
+    return count;
+}
@@ -1,6 +1,25 @@
 #pragma once
 
+#include <cstddef>
+
+#include "io/OneWire.hpp"
+
 namespace Temperature {
+    static constexpr size_t MAX_ONEWIRE_DEVICES = 64;
+
+    struct SensorStats {
+        OneWire::Address address;
+        uint8_t samples; // in the trend window, min/max/average/slope are 0 without any
+        float min;       // since the previous call
+        float max;
+        float average; // exponentially weighted
+        float slope_per_min;
+    };
+
     int init();
     bool get_temp(float& ret_temp);
+
+    // Copies out up to max sensors, including ones with no good reading yet,
+    // and starts a new min/max period
+    size_t get_sensor_stats(SensorStats* out, size_t max);
 } // namespace Temperature
\ No newline at end of file
@@ -1,5 +1,10 @@
+#include "common/audit_log.hpp"
+#include "common/flash_region.hpp"
 #include "common/hardware.hpp"
 #include "common/pins.hpp"
+#include "common/power.hpp"
+#include "common/task_stats.hpp"
+#include "common/timer_wheel.hpp"
 #include "common/types.hpp"
 #include "esp_heap_trace.h"
 #include "freertos/FreeRTOS.h"
@@ -21,8 +26,13 @@ void set_log_levels() {
 extern "C" void app_main(void) {
     set_log_levels();
     Hardware::init();
+    Power::init();
     USB::init();
+    TaskStats::init();
+    TimerWheel::init();
     Storage::init();
+    FlashRegion::init();
+    AuditLog::init();
     IO::init();
     Network::init();
 }
@@ -0,0 +1,275 @@
+#include "ca_store.hpp"
+
+#include <cstdlib>
+#include <cstring>
+
+#include "common/flash_region.hpp"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_tls.h"
+#include "mbedtls/base64.h"
+#include "mbedtls/x509_crt.h"
+#include "storage.hpp"
+
+static const char* TAG = "ca-store";
+
+namespace CAStore {
+    static constexpr FlashRegion::Region REGION = FlashRegion::Region::CERTS;
+
+    // Let's Encrypt R12, signed by ISRG Root X1. Used until the server pushes a bundle.
+    static const uint8_t BUILT_IN[] = {
+        0x30, 0x82, 0x05, 0x06, 0x30, 0x82, 0x02, 0xee, 0xa0, 0x03, 0x02, 0x01, 0x02, 0x02, 0x11, 0x00,
+        0xc2, 0x12, 0x32, 0x4b, 0x70, 0xa9, 0xb4, 0x91, 0x71, 0xdc, 0x40, 0xf7, 0xe2, 0x85, 0x26, 0x3c,
+        0x30, 0x0d, 0x06, 0x09, 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x01, 0x0b, 0x05, 0x00, 0x30,
+        0x4f, 0x31, 0x0b, 0x30, 0x09, 0x06, 0x03, 0x55, 0x04, 0x06, 0x13, 0x02, 0x55, 0x53, 0x31, 0x29,
+        0x30, 0x27, 0x06, 0x03, 0x55, 0x04, 0x0a, 0x13, 0x20, 0x49, 0x6e, 0x74, 0x65, 0x72, 0x6e, 0x65,
+        0x74, 0x20, 0x53, 0x65, 0x63, 0x75, 0x72, 0x69, 0x74, 0x79, 0x20, 0x52, 0x65, 0x73, 0x65, 0x61,
+        0x72, 0x63, 0x68, 0x20, 0x47, 0x72, 0x6f, 0x75, 0x70, 0x31, 0x15, 0x30, 0x13, 0x06, 0x03, 0x55,
+        0x04, 0x03, 0x13, 0x0c, 0x49, 0x53, 0x52, 0x47, 0x20, 0x52, 0x6f, 0x6f, 0x74, 0x20, 0x58, 0x31,
+        0x30, 0x1e, 0x17, 0x0d, 0x32, 0x34, 0x30, 0x33, 0x31, 0x33, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30,
+        0x5a, 0x17, 0x0d, 0x32, 0x37, 0x30, 0x33, 0x31, 0x32, 0x32, 0x33, 0x35, 0x39, 0x35, 0x39, 0x5a,
+        0x30, 0x33, 0x31, 0x0b, 0x30, 0x09, 0x06, 0x03, 0x55, 0x04, 0x06, 0x13, 0x02, 0x55, 0x53, 0x31,
+        0x16, 0x30, 0x14, 0x06, 0x03, 0x55, 0x04, 0x0a, 0x13, 0x0d, 0x4c, 0x65, 0x74, 0x27, 0x73, 0x20,
+        0x45, 0x6e, 0x63, 0x72, 0x79, 0x70, 0x74, 0x31, 0x0c, 0x30, 0x0a, 0x06, 0x03, 0x55, 0x04, 0x03,
+        0x13, 0x03, 0x52, 0x31, 0x32, 0x30, 0x82, 0x01, 0x22, 0x30, 0x0d, 0x06, 0x09, 0x2a, 0x86, 0x48,
+        0x86, 0xf7, 0x0d, 0x01, 0x01, 0x01, 0x05, 0x00, 0x03, 0x82, 0x01, 0x0f, 0x00, 0x30, 0x82, 0x01,
+        0x0a, 0x02, 0x82, 0x01, 0x01, 0x00, 0xda, 0x98, 0x28, 0x74, 0xad, 0xbe, 0x94, 0xfe, 0x3b, 0xe0,
+        0x1e, 0xe2, 0xe5, 0x4b, 0x75, 0xab, 0x2c, 0x12, 0x7f, 0xed, 0xa7, 0x03, 0x32, 0x7e, 0x36, 0x97,
+        0xec, 0xe8, 0x31, 0x8f, 0xa5, 0x13, 0x8d, 0x0b, 0x99, 0x2e, 0x1e, 0xcd, 0x01, 0x51, 0x3d, 0x4c,
+        0xe5, 0x28, 0x6e, 0x09, 0x55, 0x31, 0xaa, 0xa5, 0x22, 0x5d, 0x72, 0xf4, 0x2d, 0x07, 0xc2, 0x4d,
+        0x40, 0x3c, 0xdf, 0x01, 0x23, 0xb9, 0x78, 0x37, 0xf5, 0x1a, 0x65, 0x32, 0x34, 0xe6, 0x86, 0x71,
+        0x9d, 0x04, 0xef, 0x84, 0x08, 0x5b, 0xbd, 0x02, 0x1a, 0x99, 0xeb, 0xa6, 0x01, 0x00, 0x9a, 0x73,
+        0x90, 0x6d, 0x8f, 0xa2, 0x07, 0xa0, 0xd0, 0x97, 0xd3, 0xda, 0x45, 0x61, 0x81, 0x35, 0x3d, 0x14,
+        0xf9, 0xc4, 0xc0, 0x5f, 0x6a, 0xdc, 0x0b, 0x96, 0x1a, 0xb0, 0x9f, 0xe3, 0x2a, 0xea, 0xbd, 0x2a,
+        0xd6, 0x98, 0xc7, 0x9b, 0x71, 0xab, 0x3b, 0x74, 0x0f, 0x3c, 0xdb, 0xb2, 0x60, 0xbe, 0x5a, 0x4b,
+        0x4e, 0x18, 0xe9, 0xdb, 0x2a, 0x73, 0x5c, 0x89, 0x61, 0x65, 0x9e, 0xfe, 0xed, 0x3c, 0xa6, 0xcb,
+        0x4e, 0x6f, 0xe4, 0x9e, 0xf9, 0x00, 0x46, 0xb3, 0xff, 0x19, 0x4d, 0x2a, 0x63, 0xb3, 0x8e, 0x66,
+        0xc6, 0x18, 0x85, 0x70, 0xc7, 0x50, 0x65, 0x6f, 0x3b, 0x74, 0xe5, 0x48, 0x83, 0x0f, 0x08, 0x58,
+        0x5d, 0x2d, 0x23, 0x9d, 0x5e, 0xa3, 0xfe, 0xe8, 0xdb, 0x00, 0xa1, 0xd2, 0xf4, 0xe3, 0x19, 0x4d,
+        0xf2, 0xee, 0x7a, 0xf6, 0x27, 0x9e, 0xe5, 0xcd, 0x9c, 0x2d, 0xa2, 0xf2, 0x7f, 0x9c, 0x17, 0xad,
+        0xef, 0x13, 0x37, 0x39, 0xd1, 0xb4, 0xc8, 0x2c, 0x41, 0xd6, 0x86, 0xc0, 0xe9, 0xec, 0x21, 0xf8,
+        0x59, 0x1b, 0x7f, 0xb9, 0x3a, 0x7c, 0x9f, 0x5c, 0x01, 0x9d, 0x62, 0x04, 0xc2, 0x28, 0xbd, 0x0a,
+        0xad, 0x3c, 0xca, 0x10, 0xec, 0x1b, 0x02, 0x03, 0x01, 0x00, 0x01, 0xa3, 0x81, 0xf8, 0x30, 0x81,
+        0xf5, 0x30, 0x0e, 0x06, 0x03, 0x55, 0x1d, 0x0f, 0x01, 0x01, 0xff, 0x04, 0x04, 0x03, 0x02, 0x01,
+        0x86, 0x30, 0x1d, 0x06, 0x03, 0x55, 0x1d, 0x25, 0x04, 0x16, 0x30, 0x14, 0x06, 0x08, 0x2b, 0x06,
+        0x01, 0x05, 0x05, 0x07, 0x03, 0x02, 0x06, 0x08, 0x2b, 0x06, 0x01, 0x05, 0x05, 0x07, 0x03, 0x01,
+        0x30, 0x12, 0x06, 0x03, 0x55, 0x1d, 0x13, 0x01, 0x01, 0xff, 0x04, 0x08, 0x30, 0x06, 0x01, 0x01,
+        0xff, 0x02, 0x01, 0x00, 0x30, 0x1d, 0x06, 0x03, 0x55, 0x1d, 0x0e, 0x04, 0x16, 0x04, 0x14, 0x00,
+        0xb5, 0x29, 0xf2, 0x2d, 0x8e, 0x6f, 0x31, 0xe8, 0x9b, 0x4c, 0xad, 0x78, 0x3e, 0xfa, 0xdc, 0xe9,
+        0x0c, 0xd1, 0xd2, 0x30, 0x1f, 0x06, 0x03, 0x55, 0x1d, 0x23, 0x04, 0x18, 0x30, 0x16, 0x80, 0x14,
+        0x79, 0xb4, 0x59, 0xe6, 0x7b, 0xb6, 0xe5, 0xe4, 0x01, 0x73, 0x80, 0x08, 0x88, 0xc8, 0x1a, 0x58,
+        0xf6, 0xe9, 0x9b, 0x6e, 0x30, 0x32, 0x06, 0x08, 0x2b, 0x06, 0x01, 0x05, 0x05, 0x07, 0x01, 0x01,
+        0x04, 0x26, 0x30, 0x24, 0x30, 0x22, 0x06, 0x08, 0x2b, 0x06, 0x01, 0x05, 0x05, 0x07, 0x30, 0x02,
+        0x86, 0x16, 0x68, 0x74, 0x74, 0x70, 0x3a, 0x2f, 0x2f, 0x78, 0x31, 0x2e, 0x69, 0x2e, 0x6c, 0x65,
+        0x6e, 0x63, 0x72, 0x2e, 0x6f, 0x72, 0x67, 0x2f, 0x30, 0x13, 0x06, 0x03, 0x55, 0x1d, 0x20, 0x04,
+        0x0c, 0x30, 0x0a, 0x30, 0x08, 0x06, 0x06, 0x67, 0x81, 0x0c, 0x01, 0x02, 0x01, 0x30, 0x27, 0x06,
+        0x03, 0x55, 0x1d, 0x1f, 0x04, 0x20, 0x30, 0x1e, 0x30, 0x1c, 0xa0, 0x1a, 0xa0, 0x18, 0x86, 0x16,
+        0x68, 0x74, 0x74, 0x70, 0x3a, 0x2f, 0x2f, 0x78, 0x31, 0x2e, 0x63, 0x2e, 0x6c, 0x65, 0x6e, 0x63,
+        0x72, 0x2e, 0x6f, 0x72, 0x67, 0x2f, 0x30, 0x0d, 0x06, 0x09, 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d,
+        0x01, 0x01, 0x0b, 0x05, 0x00, 0x03, 0x82, 0x02, 0x01, 0x00, 0x8f, 0x75, 0xd0, 0x09, 0xcf, 0x6a,
+        0x76, 0x48, 0x65, 0x32, 0x92, 0xde, 0xb5, 0x44, 0xc8, 0x85, 0x76, 0xf4, 0x15, 0x84, 0x8c, 0x02,
+        0xbf, 0x76, 0xeb, 0xb3, 0xf1, 0xe2, 0xf9, 0x6e, 0x84, 0xa8, 0x56, 0x91, 0xe1, 0x92, 0x4b, 0xf7,
+        0xe1, 0xea, 0x00, 0x78, 0x48, 0x8f, 0x75, 0x92, 0xe3, 0xe4, 0x46, 0x7b, 0x1b, 0x60, 0x2b, 0x20,
+        0xaf, 0xa0, 0xce, 0x14, 0xe5, 0x45, 0x0d, 0x6a, 0xe0, 0x52, 0x86, 0xa4, 0xf3, 0xda, 0x14, 0x14,
+        0xa9, 0xa9, 0x5f, 0xf1, 0x6d, 0x46, 0xf9, 0x52, 0x50, 0x17, 0x40, 0xe9, 0xe4, 0x1e, 0x7d, 0xe6,
+        0x15, 0x58, 0xfe, 0xa9, 0x8b, 0xfc, 0xef, 0xf5, 0x9e, 0x63, 0xe0, 0x66, 0xe2, 0xc3, 0x77, 0x3b,
+        0x1f, 0x01, 0x87, 0x26, 0x94, 0xed, 0x40, 0x10, 0xdc, 0xb7, 0x99, 0xec, 0xdd, 0x57, 0xd3, 0x5c,
+        0x71, 0x41, 0xee, 0x30, 0x20, 0x00, 0x04, 0xdc, 0x95, 0x4b, 0x50, 0x28, 0x87, 0x99, 0x92, 0xfe,
+        0xaa, 0x80, 0x94, 0xb6, 0x06, 0x08, 0x14, 0xf8, 0x1c, 0x83, 0x7e, 0x74, 0x40, 0xc5, 0x08, 0x5a,
+        0x0c, 0x4f, 0x5c, 0xd1, 0x84, 0x9d, 0xc4, 0xfd, 0xdb, 0x59, 0xde, 0xee, 0x79, 0x6e, 0x23, 0x4d,
+        0x95, 0xf2, 0x92, 0xd4, 0x98, 0x29, 0x6a, 0x5c, 0xeb, 0x02, 0xc1, 0x42, 0xf0, 0xf8, 0xf5, 0x4e,
+        0x64, 0x20, 0x7b, 0xa8, 0xe3, 0x31, 0xc4, 0xc0, 0x68, 0x09, 0x47, 0x8b, 0xd8, 0xb9, 0x78, 0xa0,
+        0xca, 0x4e, 0x4a, 0xbe, 0x69, 0x24, 0x2a, 0x4b, 0x37, 0x7b, 0x51, 0x03, 0x6b, 0x3a, 0x3f, 0x52,
+        0x8b, 0xb3, 0xd4, 0xd2, 0xad, 0x58, 0x4e, 0x93, 0xee, 0xcb, 0x5f, 0x6f, 0x0d, 0x31, 0x49, 0x48,
+        0xba, 0xc4, 0x3f, 0x9f, 0x12, 0xc9, 0x20, 0x3d, 0x11, 0x84, 0x07, 0x85, 0xb4, 0xf8, 0xf2, 0x38,
+        0x23, 0xac, 0x71, 0x00, 0x40, 0xe7, 0x7f, 0x8d, 0x46, 0x34, 0x82, 0x6a, 0x4e, 0xcf, 0xe0, 0x0e,
+        0x63, 0x5f, 0xba, 0x69, 0x9a, 0x47, 0x09, 0x10, 0x22, 0xfe, 0x4b, 0x48, 0xb7, 0x91, 0x75, 0x54,
+        0xcb, 0x93, 0x1e, 0xe4, 0x16, 0xeb, 0x53, 0xcf, 0x7b, 0xde, 0x36, 0x4d, 0xbf, 0xf6, 0xb1, 0xeb,
+        0xe6, 0x4a, 0xe9, 0x33, 0x3c, 0x8d, 0x69, 0xa2, 0x98, 0xbe, 0xa8, 0x7f, 0xa3, 0xab, 0x5f, 0xb6,
+        0x54, 0xe8, 0x4d, 0x96, 0xa9, 0xac, 0xf3, 0xb0, 0x5a, 0xcb, 0x1b, 0x7a, 0x36, 0x93, 0x24, 0x9b,
+        0xce, 0x58, 0x52, 0x80, 0x9f, 0x35, 0x0a, 0x5e, 0x2d, 0xbf, 0x74, 0x9b, 0x62, 0x26, 0x17, 0x9c,
+        0x91, 0x31, 0x29, 0x0b, 0xf3, 0x7f, 0xcd, 0xc3, 0x62, 0x8b, 0x68, 0xc7, 0x77, 0xf4, 0x7f, 0x0b,
+        0xfb, 0xc6, 0x59, 0xf5, 0x03, 0x66, 0x4b, 0xa6, 0x50, 0x9b, 0xd0, 0xef, 0xa5, 0xfc, 0x02, 0xb4,
+        0x60, 0x4d, 0x03, 0x4b, 0x61, 0x4f, 0xc5, 0x20, 0x07, 0x8b, 0x48, 0xb0, 0x31, 0xf5, 0xb6, 0x9c,
+        0xd1, 0xc9, 0xad, 0x77, 0x18, 0xdc, 0xb2, 0xc7, 0x0f, 0xbe, 0xe0, 0x46, 0x08, 0xde, 0xe0, 0x4b,
+        0xde, 0xb9, 0xb8, 0xb6, 0xc7, 0x16, 0xbe, 0x36, 0x69, 0x3f, 0x86, 0x68, 0x4b, 0x74, 0x81, 0x13,
+        0x89, 0x50, 0xc5, 0x6a, 0x7a, 0x02, 0xac, 0xc5, 0x48, 0xa5, 0x0e, 0x7d, 0x5d, 0x61, 0xe4, 0xcd,
+        0xd1, 0x66, 0xa0, 0x75, 0xc7, 0x05, 0x5e, 0xe8, 0x89, 0xb5, 0x63, 0x19, 0x23, 0xbb, 0x50, 0xb4,
+        0x90, 0xec, 0xc2, 0x75, 0x37, 0x3e, 0x75, 0xa6, 0x1b, 0x83, 0x25, 0x28, 0x00, 0x21, 0x4e, 0xc0,
+        0xd3, 0x3a, 0xcb, 0x9c, 0xea, 0xc0, 0x8f, 0xf7, 0x5f, 0xae, 0x51, 0x16, 0x46, 0x10, 0xaf, 0x02,
+        0x06, 0xee, 0xc0, 0xb6, 0x57, 0xd4, 0x0d, 0xac, 0x8c, 0xd8, 0xd7, 0xa0, 0xf3, 0x87, 0x6e, 0xc3,
+        0xe2, 0xcb, 0xe9, 0x4e, 0xd4, 0xa1, 0x7c, 0xfd, 0x76, 0x3b,
+    };
+
+    // Handshakes in a row the stored bundle may fail before it is set aside
+    static constexpr uint8_t MAX_FAILURES = 3;
+
+    static Stats stats = {};
+    static uint8_t failures = 0;
+    // A newer bundle is waiting for the next boot, the live one no longer matters
+    static bool replaced = false;
+
+    // Length of the DER certificate at data, 0 if it isn't one. Only the
+    // SEQUENCE header is checked, mbedtls checks the rest.
+    static size_t der_length(const uint8_t* data, size_t len) {
+        if (len < 2 || data[0] != 0x30) {
+            return 0;
+        }
+        size_t header = 2;
+        size_t body = data[1];
+        if (data[1] & 0x80) {
+            size_t bytes = data[1] & 0x7f;
+            if (bytes == 0 || bytes > 3 || len < 2 + bytes) {
+                return 0;
+            }
+            body = 0;
+            for (size_t i = 0; i < bytes; i++) {
+                body = (body << 8) | data[2 + i];
+            }
+            header += bytes;
+        }
+        return header + body <= len ? header + body : 0;
+    }
+
+    // Parses every certificate in the bundle into chain, returns how many or 0 if any failed
+    static uint32_t parse_bundle(mbedtls_x509_crt* chain, const uint8_t* data, size_t len) {
+        uint32_t count = 0;
+        while (len > 0) {
+            size_t cert_len = der_length(data, len);
+            if (cert_len == 0) {
+                return 0;
+            }
+            int ret = mbedtls_x509_crt_parse_der(chain, data, cert_len);
+            if (ret != 0) {
+                ESP_LOGE(TAG, "Certificate %u failed to parse: -0x%04x", (unsigned)count, (unsigned)-ret);
+                return 0;
+            }
+            data += cert_len;
+            len -= cert_len;
+            count++;
+        }
+        return count;
+    }
+
+    static uint32_t load(const uint8_t* data, size_t len) {
+        if (esp_tls_init_global_ca_store() != ESP_OK) {
+            return 0;
+        }
+        uint32_t count = parse_bundle(esp_tls_get_global_ca_store(), data, len);
+        if (count == 0) {
+            esp_tls_free_global_ca_store();
+        }
+        return count;
+    }
+
+    int init() {
+        int64_t start = esp_timer_get_time();
+        uint32_t heap_before = esp_get_free_heap_size();
+
+        size_t capacity = FlashRegion::capacity(REGION);
+        uint8_t* stored = (uint8_t*)malloc(capacity);
+        size_t len = 0;
+        failures = Storage::get_ca_failures();
+        if (stored != NULL && FlashRegion::read(REGION, stored, capacity, len)) {
+            if (failures >= MAX_FAILURES) {
+                ESP_LOGW(TAG, "Stored CA bundle failed %u handshakes, not using it", (unsigned)failures);
+                stats.fell_back = true;
+            } else {
+                stats.certs = load(stored, len);
+                stats.from_flash = stats.certs != 0;
+            }
+        }
+        free(stored);
+        if (stats.certs == 0) {
+            stats.certs = load(BUILT_IN, sizeof(BUILT_IN));
+        }
+        if (stats.certs == 0) {
+            ESP_LOGE(TAG, "No usable CA certificates, TLS will fail");
+            return 1;
+        }
+
+        stats.parse_us = (uint32_t)(esp_timer_get_time() - start);
+        uint32_t heap_after = esp_get_free_heap_size();
+        stats.heap_bytes = heap_before > heap_after ? heap_before - heap_after : 0;
+        ESP_LOGI(TAG, "%u CA certs from %s, %u bytes, parsed in %u us", (unsigned)stats.certs,
+                 stats.from_flash ? "flash" : "firmware", (unsigned)stats.heap_bytes, (unsigned)stats.parse_us);
+        return 0;
+    }
+
+    bool install(const char* base64) {
+        if (base64 == NULL) {
+            return false;
+        }
+        size_t base64_len = strlen(base64);
+        size_t capacity = FlashRegion::capacity(REGION);
+        if (base64_len / 4 * 3 > capacity) {
+            ESP_LOGE(TAG, "Bundle too big for flash");
+            return false;
+        }
+
+        uint8_t* bundle = (uint8_t*)malloc(capacity);
+        if (bundle == NULL) {
+            return false;
+        }
+        size_t len = 0;
+        bool ok = mbedtls_base64_decode(bundle, capacity, &len, (const uint8_t*)base64, base64_len) == 0;
+
+        // Parse into a scratch chain first so a bad bundle never reaches flash
+        if (ok) {
+            mbedtls_x509_crt check;
+            mbedtls_x509_crt_init(&check);
+            ok = parse_bundle(&check, bundle, len) != 0;
+            mbedtls_x509_crt_free(&check);
+        }
+        if (ok) {
+            ok = FlashRegion::write(REGION, bundle, len);
+        }
+        free(bundle);
+
+        if (ok) {
+            // The new bundle gets its own chances
+            replaced = true;
+            failures = 0;
+            Storage::set_ca_failures(0);
+            ESP_LOGI(TAG, "Stored %u byte CA bundle, used from the next boot", (unsigned)len);
+        } else {
+            ESP_LOGE(TAG, "Rejected CA bundle");
+        }
+        return ok;
+    }
+
+    void on_handshake(int tls_stack_err) {
+        // esp-tls reports mbedtls errors negated. Other failures say nothing about the bundle.
+        if (!stats.from_flash || replaced ||
+            (tls_stack_err != 0 && tls_stack_err != -MBEDTLS_ERR_X509_CERT_VERIFY_FAILED)) {
+            return;
+        }
+        if (tls_stack_err == 0) {
+            if (failures != 0) {
+                failures = 0;
+                Storage::set_ca_failures(0);
+            }
+            return;
+        }
+        failures++;
+        Storage::set_ca_failures(failures);
+        ESP_LOGW(TAG, "Server certificate failed to verify against the stored bundle (%u/%u)", (unsigned)failures,
+                 (unsigned)MAX_FAILURES);
+        if (failures < MAX_FAILURES) {
+            return;
+        }
+
+        // Added to the live store rather than swapped in, a connection still
+        // setting up with the old store keeps valid certificates under it
+        uint32_t added = parse_bundle(esp_tls_get_global_ca_store(), BUILT_IN, sizeof(BUILT_IN));
+        ESP_LOGE(TAG, "Setting the stored CA bundle aside, trusting the built-in one again");
+        stats.certs += added;
+        stats.from_flash = false;
+        stats.fell_back = true;
+    }
+
+    Stats get_stats() {
+        return stats;
+    }
+} // namespace CAStore
@@ -0,0 +1,30 @@
+#pragma once
+#include <cstdint>
+
+// Trust anchors for every TLS connection, parsed once at boot into the esp-tls
+// global CA store that the websocket and HTTP clients share. Certificates are
+// kept as DER, a bundle is just certificates back to back.
+namespace CAStore {
+    struct Stats {
+        uint32_t certs;
+        uint32_t heap_bytes; // held by the parsed store
+        uint32_t parse_us;
+        bool from_flash; // false if running on the built-in bundle
+        bool fell_back;  // the stored bundle failed too many handshakes and was set aside
+    };
+
+    // Loads the bundle the server last pushed, or the built-in one
+    int init();
+
+    // Checks a base64 bundle from the server and stores it for the next boot.
+    // Connections hold on to the live store, so it is never swapped under them.
+    bool install(const char* base64);
+
+    // Called from the websocket task with each connection attempt's TLS stack
+    // error, 0 once connected. If the stored bundle fails to verify the server
+    // a few times in a row the built-in one is trusted again, now and on later
+    // boots, until the server installs a new bundle.
+    void on_handshake(int tls_stack_err);
+
+    Stats get_stats();
+} // namespace CAStore
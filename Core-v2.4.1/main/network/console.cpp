@@ -0,0 +1,390 @@
+#include "console.hpp"
+
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "common/audit_log.hpp"
+#include "common/log_ring.hpp"
+#include "common/queues.hpp"
+#include "common/task_stats.hpp"
+#include "common/timer_wheel.hpp"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "io/IO.hpp"
+#include "log_shipper.hpp"
+#include "network.hpp"
+#include "storage.hpp"
+
+static const char* TAG = "console";
+
+namespace Console {
+    // Audit records Trace sends when no start is given
+    static constexpr uint32_t DEFAULT_TRACE_RECORDS = 32;
+
+    // Collects text lines into response frames, sending a More frame whenever
+    // the next line would not fit
+    class Reply {
+      public:
+        Reply(uint8_t sequence, SendFn send) : send(send) {
+            buf[0] = RESPONSE_RECORD;
+            buf[1] = sequence;
+        }
+
+        void line(const char* fmt, ...) {
+            for (int attempt = 0; attempt < 2; attempt++) {
+                va_list args;
+                va_start(args, fmt);
+                int written = vsnprintf((char*)buf + len, MAX_FRAME + 1 - len, fmt, args);
+                va_end(args);
+                if (written < 0) {
+                    return;
+                }
+                if (len + written + 1 <= MAX_FRAME) {
+                    len += written;
+                    buf[len++] = '\n';
+                    return;
+                }
+                if (len == HEADER || attempt == 1) {
+                    // Longer than a whole frame, keep what fits
+                    len = MAX_FRAME;
+                    buf[MAX_FRAME - 1] = '\n';
+                    return;
+                }
+                finish(Status::More);
+            }
+        }
+
+        void finish(Status status) {
+            buf[2] = (uint8_t)status;
+            send(buf, len);
+            len = HEADER;
+        }
+
+      private:
+        static constexpr size_t HEADER = 3;
+        SendFn send;
+        uint8_t buf[MAX_FRAME + 1];
+        size_t len = HEADER;
+    };
+
+    // Payload as a NUL terminated string, requests are at most MAX_FRAME bytes
+    static void payload_string(const uint8_t* payload, size_t len, char* out) {
+        memcpy(out, payload, len);
+        out[len] = '\0';
+    }
+
+    static bool parse_u8(const char* text, uint8_t& out) {
+        char* end;
+        unsigned long value = strtoul(text, &end, 10);
+        if (end == text || *end != '\0' || value > UINT8_MAX) {
+            return false;
+        }
+        out = value;
+        return true;
+    }
+
+    template <size_t N> static bool to_array(const char* text, std::array<uint8_t, N>& out) {
+        size_t len = strlen(text);
+        if (len > N) {
+            return false;
+        }
+        out = {};
+        memcpy(out.data(), text, len);
+        return true;
+    }
+
+    static bool is_setting(const char* name, const char* wanted) {
+        return name[0] == '\0' || strcmp(name, wanted) == 0;
+    }
+
+    // Secrets only say whether they are set
+    static void get_config(const char* name, Reply& reply) {
+        bool any = false;
+        if (is_setting(name, "ssid")) {
+            WifiSSID ssid = Storage::get_network_ssid();
+            reply.line("ssid=%.*s", (int)strnlen((char*)ssid.data(), ssid.size()), (char*)ssid.data());
+            any = true;
+        }
+        if (is_setting(name, "password")) {
+            reply.line("password=%s", Storage::get_network_password()[0] != 0 ? "<set>" : "");
+            any = true;
+        }
+        if (is_setting(name, "server")) {
+            reply.line("server=%s", Storage::get_server().c_str());
+            any = true;
+        }
+        if (is_setting(name, "key")) {
+            reply.line("key=%s", Storage::get_key().empty() ? "" : "<set>");
+            any = true;
+        }
+        if (is_setting(name, "max_temp")) {
+            reply.line("max_temp=%u", Storage::get_max_temp());
+            any = true;
+        }
+        if (is_setting(name, "temp_resolution")) {
+            reply.line("temp_resolution=%u", Storage::get_temp_resolution());
+            any = true;
+        }
+        if (is_setting(name, "max_temp_rise")) {
+            reply.line("max_temp_rise=%u", Storage::get_max_temp_rise());
+            any = true;
+        }
+
+        if (!any) {
+            reply.line("unknown setting %s", name);
+            reply.finish(Status::BadArgument);
+            return;
+        }
+        reply.finish(Status::Ok);
+    }
+
+    static bool set_one(const char* name, const char* value) {
+        uint8_t number;
+        if (strcmp(name, "ssid") == 0) {
+            WifiSSID ssid;
+            return to_array(value, ssid) && Storage::set_network_ssid(ssid);
+        } else if (strcmp(name, "password") == 0) {
+            WifiPassword password;
+            return to_array(value, password) && Storage::set_network_password(password);
+        } else if (strcmp(name, "server") == 0) {
+            return Storage::set_server(value);
+        } else if (strcmp(name, "key") == 0) {
+            return Storage::set_key(value);
+        } else if (strcmp(name, "max_temp") == 0) {
+            return parse_u8(value, number) && Storage::set_max_temp(number);
+        } else if (strcmp(name, "temp_resolution") == 0) {
+            return parse_u8(value, number) && Storage::set_temp_resolution(number);
+        } else if (strcmp(name, "max_temp_rise") == 0) {
+            return parse_u8(value, number) && Storage::set_max_temp_rise(number);
+        }
+        return false;
+    }
+
+    // All or nothing, a bad line leaves every setting as it was
+    static void set_config(char* lines, Reply& reply) {
+        if (!Storage::begin(pdMS_TO_TICKS(1000))) {
+            reply.line("config busy");
+            reply.finish(Status::Failed);
+            return;
+        }
+
+        char* save;
+        for (char* line = strtok_r(lines, "\n", &save); line != nullptr; line = strtok_r(nullptr, "\n", &save)) {
+            char* value = strchr(line, '=');
+            if (value == nullptr) {
+                Storage::abort();
+                reply.line("expected name=value, got %s", line);
+                reply.finish(Status::BadArgument);
+                return;
+            }
+            *value++ = '\0';
+            if (!set_one(line, value)) {
+                Storage::abort();
+                reply.line("bad value for %s", line);
+                reply.finish(Status::BadArgument);
+                return;
+            }
+        }
+
+        if (!Storage::commit()) {
+            reply.line("flash write failed");
+            reply.finish(Status::Failed);
+            return;
+        }
+        ESP_LOGI(TAG, "Config changed over USB");
+        reply.finish(Status::Ok);
+    }
+
+    static void state_stats(Reply& reply) {
+        IO::StateSnapshot snapshot;
+        if (IO::get_snapshot(snapshot)) {
+            reply.line("state=%s", io_state_to_string(snapshot.state));
+            reply.line("prior_request_state=%s", io_state_to_string(snapshot.prior_request_state));
+            uint32_t in_state_ms = pdTICKS_TO_MS(xTaskGetTickCount() - snapshot.last_transition);
+            reply.line("in_state_ms=%" PRIu32, in_state_ms);
+        }
+        reply.line("online=%d", Network::is_online());
+        reply.line("uptime_s=%" PRIu32, (uint32_t)(esp_timer_get_time() / 1000000));
+        reply.line("boot=%" PRIu32, Storage::get_boot_count());
+        reply.line("heap_free=%" PRIu32, esp_get_free_heap_size());
+        reply.line("heap_min=%" PRIu32, esp_get_minimum_free_heap_size());
+    }
+
+    static void task_stats(Reply& reply) {
+        // CPU share since the last Stats command, the server reports keep their own window
+        static TaskStats::Window window;
+        static TaskStats::TaskInfo tasks[TaskStats::MAX_TASKS];
+        size_t count = TaskStats::collect(window, tasks, TaskStats::MAX_TASKS);
+        reply.line("%-16s %4s %6s %10s %8s", "task", "prio", "cpu%", "stack_free", "heap");
+        for (size_t i = 0; i < count; i++) {
+            reply.line("%-16s %4u %4" PRIu32 ".%" PRIu32 " %10" PRIu32 " %8" PRIu32 "%s", tasks[i].name,
+                       (unsigned)tasks[i].priority, tasks[i].cpu_permille / 10, tasks[i].cpu_permille % 10,
+                       tasks[i].stack_free, tasks[i].heap_bytes,
+                       tasks[i].stack_free < TaskStats::LOW_STACK_BYTES ? " LOW STACK" : "");
+        }
+    }
+
+    static void queue_stats(Reply& reply) {
+        static Queues::Stats stats[Queues::MAX_QUEUES];
+        size_t count = Queues::get_stats(stats, Queues::MAX_QUEUES);
+        reply.line("%-12s %5s %5s %8s %5s %5s %5s %6s %6s", "queue", "cap", "high", "sent", "tmo", "drop", "full",
+                   "avg_ms", "max_ms");
+        for (size_t i = 0; i < count; i++) {
+            reply.line("%-12s %5" PRIu32 " %5" PRIu32 " %8" PRIu32 " %5" PRIu32 " %5" PRIu32 " %5" PRIu32
+                       " %6" PRIu32 " %6" PRIu32,
+                       stats[i].name, stats[i].capacity, stats[i].high_water, stats[i].sent, stats[i].timeouts,
+                       stats[i].drops, stats[i].full_probes, stats[i].latency_avg_ms, stats[i].latency_max_ms);
+        }
+    }
+
+    static void latency_stats(Reply& reply) {
+        Network::AuthStats auth = Network::get_auth_stats();
+        reply.line("auth_requests=%" PRIu32, auth.requests);
+        reply.line("auth_answered=%" PRIu32, auth.answered);
+        reply.line("auth_timeouts=%" PRIu32, auth.timeouts);
+        reply.line("auth_last_ms=%" PRIu32, auth.last_ms);
+        reply.line("auth_avg_ms=%" PRIu32, auth.avg_ms);
+        reply.line("auth_max_ms=%" PRIu32, auth.max_ms);
+
+        IO::StateStats state = IO::get_state_stats();
+        reply.line("state_read_retries=%" PRIu32, state.read_retries);
+        reply.line("state_read_timeouts=%" PRIu32, state.read_timeouts);
+
+        TimerWheel::Stats timers = TimerWheel::get_stats();
+        reply.line("timer_late_max_ms=%" PRIu32, timers.late_max_ms);
+        reply.line("timer_post_retries=%" PRIu32, timers.post_retries);
+    }
+
+    static void log_stats(Reply& reply) {
+        LogRing::Stats log = LogRing::get_stats();
+        reply.line("log_rings_used=%" PRIu32, log.rings_used);
+        reply.line("log_records=%" PRIu32, log.records);
+        reply.line("log_dropped=%" PRIu32, log.dropped);
+        reply.line("log_text_fallbacks=%" PRIu32, log.fallbacks);
+
+        LogShipper::Stats shipped = LogShipper::get_stats();
+        reply.line("server_log_queued=%" PRIu32, shipped.queued);
+        reply.line("server_log_sent=%" PRIu32, shipped.sent);
+        reply.line("server_log_suppressed=%" PRIu32, shipped.suppressed);
+        reply.line("server_log_overflowed=%" PRIu32, shipped.overflowed);
+        reply.line("server_log_batches=%" PRIu32, shipped.batches);
+
+        AuditLog::Stats audit = AuditLog::get_stats();
+        reply.line("audit_oldest=%" PRIu32, audit.oldest);
+        reply.line("audit_next=%" PRIu32, audit.next);
+        reply.line("audit_pending=%" PRIu32, audit.pending);
+        reply.line("audit_dropped=%" PRIu32, audit.dropped);
+    }
+
+    static void stats(const char* section, Reply& reply) {
+        struct Section {
+            const char* name;
+            void (*fn)(Reply&);
+        };
+        static constexpr Section SECTIONS[] = {
+            {"state", state_stats},     {"tasks", task_stats}, {"queues", queue_stats},
+            {"latency", latency_stats}, {"logs", log_stats},
+        };
+
+        bool any = false;
+        for (const Section& s : SECTIONS) {
+            if (is_setting(section, s.name)) {
+                s.fn(reply);
+                any = true;
+            }
+        }
+        if (!any) {
+            reply.line("unknown section %s", section);
+            reply.finish(Status::BadArgument);
+            return;
+        }
+        reply.finish(Status::Ok);
+    }
+
+    static const char* kind_to_string(AuditLog::Kind kind) {
+        switch (kind) {
+            case AuditLog::Kind::StateChange:
+                return "state";
+            case AuditLog::Kind::AuthGranted:
+                return "granted";
+            case AuditLog::Kind::AuthDenied:
+                return "denied";
+            case AuditLog::Kind::Fault:
+                return "fault";
+        }
+        return "?";
+    }
+
+    static void trace(const char* args, Reply& reply) {
+        AuditLog::Stats stats = AuditLog::get_stats();
+        uint32_t count = DEFAULT_TRACE_RECORDS;
+        uint32_t from = stats.next > count ? stats.next - count : 0;
+        if (args[0] != '\0') {
+            char* end;
+            from = strtoul(args, &end, 10);
+            count = *end != '\0' ? strtoul(end, nullptr, 10) : UINT32_MAX;
+        }
+
+        AuditLog::Cursor cursor = AuditLog::first(from);
+        AuditLog::Record record;
+        for (uint32_t sent = 0; sent < count && AuditLog::next(cursor, record); sent++) {
+            CardTagID tag;
+            tag.type = (CardTagType)record.tag_length;
+            memcpy(tag.value.data(), record.tag, sizeof(record.tag));
+            const char* reason = record.kind == AuditLog::Kind::Fault
+                                     ? fault_reason_to_string((FaultReason)record.reason)
+                                     : "";
+            reply.line("#%" PRIu32 " %" PRIu32 "%s boot %u %s %s -> %s %s %s", record.sequence, record.time,
+                       (record.flags & AuditLog::FLAG_WALL_CLOCK) ? "" : "s up", record.boot,
+                       kind_to_string(record.kind), io_state_to_string((IOState)record.from),
+                       io_state_to_string((IOState)record.to), reason,
+                       record.tag_length ? tag.to_string().c_str() : "");
+        }
+        reply.finish(Status::Ok);
+    }
+
+    void handle(const uint8_t* request, size_t len, SendFn send) {
+        if (len < 2 || len > MAX_FRAME) {
+            return; // nothing to answer to
+        }
+
+        Reply reply(request[1], send);
+        char payload[MAX_FRAME];
+        payload_string(request + 2, len - 2, payload);
+
+        switch ((Command)request[0]) {
+            case Command::GetConfig:
+                get_config(payload, reply);
+                break;
+            case Command::SetConfig:
+                set_config(payload, reply);
+                break;
+            case Command::Stats:
+                stats(payload, reply);
+                break;
+            case Command::Identify:
+                if (IO::send_event({
+                        .type = IOEventType::NETWORK_COMMAND,
+                        .network_command =
+                            {
+                                .type = NetworkCommandEventType::IDENTIFY,
+                            },
+                    })) {
+                    reply.finish(Status::Ok);
+                } else {
+                    reply.finish(Status::Failed);
+                }
+                break;
+            case Command::Trace:
+                trace(payload, reply);
+                break;
+            default:
+                reply.finish(Status::UnknownCommand);
+                break;
+        }
+    }
+} // namespace Console
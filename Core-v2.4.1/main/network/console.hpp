@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Commands over the USB CDC port, for provisioning and diagnostics in the
+// field. Requests and responses are COBS frames delimited by a zero byte, the
+// same framing as the binary log, and tools/console.py is the host side.
+//
+// Request:  command, sequence, payload
+// Response: RESPONSE_RECORD, sequence, status, payload
+//
+// Payloads are text, one key=value or table row per line. Long answers come
+// as several More responses closed by one with the final status.
+namespace Console {
+    enum class Command : uint8_t {
+        GetConfig = 1, // payload: setting name, or empty for all
+        SetConfig,     // payload: name=value lines, applied in one transaction
+        Stats,         // payload: state, tasks, queues, latency or logs, empty for all
+        Identify,
+        Trace, // payload: [first sequence [count]], streams the audit log
+    };
+
+    enum class Status : uint8_t {
+        Ok,
+        More,
+        UnknownCommand,
+        BadArgument,
+        Failed,
+    };
+
+    // Record type of responses, next to LogRing::RecordType in the same stream
+    static constexpr uint8_t RESPONSE_RECORD = 0x10;
+
+    // Requests longer than this are dropped, responses never exceed it
+    static constexpr size_t MAX_FRAME = 255;
+
+    using SendFn = void (*)(const uint8_t* record, size_t len);
+
+    // Runs one decoded request and answers through send, on the usb task
+    void handle(const uint8_t* request, size_t len, SendFn send);
+} // namespace Console
@@ -0,0 +1,166 @@
+#include "coredump.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+
+#include "common/hardware.hpp"
+#include "esp_core_dump.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "http_manager.hpp"
+#include "network.hpp"
+#include "storage.hpp"
+
+namespace Coredump {
+    static const char* TAG = "coredump";
+
+    static constexpr size_t CHUNK_SIZE = HTTPManager::MAX_POST_SIZE;
+    // Between chunks, so the upload trickles out behind everything else
+    static constexpr TickType_t CHUNK_PERIOD = pdMS_TO_TICKS(2 * 1000);
+    // After a failed chunk, doubling per failure up to RETRY_MAX
+    static constexpr TickType_t RETRY_MIN = pdMS_TO_TICKS(10 * 1000);
+    static constexpr TickType_t RETRY_MAX = pdMS_TO_TICKS(10 * 60 * 1000);
+
+    static const esp_partition_t* partition = NULL;
+    static size_t image_offset = 0; // from the start of the partition
+    static uint32_t image_size = 0;
+    static uint32_t image_crc = 0;
+
+    // Written by the finish callback on the HTTP task
+    static std::atomic<bool> pending{false};
+    static std::atomic<bool> in_flight{false};
+    static std::atomic<uint32_t> acked{0};
+    static std::atomic<uint32_t> failures{0};
+
+    // The chunk in flight, only touched again once it finishes
+    static struct {
+        uint32_t offset;
+        uint32_t length;
+        char url[320];
+    } chunk;
+
+    static bool crc_range(size_t offset, size_t len, uint32_t& crc) {
+        uint8_t buf[256];
+        crc = 0;
+        for (size_t pos = 0; pos < len; pos += sizeof(buf)) {
+            size_t n = std::min(sizeof(buf), len - pos);
+            if (esp_partition_read(partition, image_offset + offset + pos, buf, n) != ESP_OK) {
+                return false;
+            }
+            crc = esp_rom_crc32_le(crc, buf, n);
+        }
+        return true;
+    }
+
+    void init() {
+        if (esp_core_dump_image_check() != ESP_OK) {
+            return;
+        }
+        size_t address = 0;
+        size_t size = 0;
+        partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_COREDUMP, NULL);
+        if (partition == NULL || esp_core_dump_image_get(&address, &size) != ESP_OK) {
+            ESP_LOGE(TAG, "Coredump reported but not readable");
+            return;
+        }
+        image_offset = address - partition->address;
+        image_size = size;
+        if (!crc_range(0, image_size, image_crc)) {
+            ESP_LOGE(TAG, "Failed to read coredump");
+            return;
+        }
+
+        uint32_t uploaded = Storage::get_coredump_progress(image_crc);
+        acked = uploaded < image_size ? uploaded : 0;
+        pending = true;
+        ESP_LOGW(TAG, "Coredump %08" PRIx32 " of %" PRIu32 " bytes waiting, %" PRIu32 " already uploaded", image_crc,
+                 image_size, acked.load());
+    }
+
+    TickType_t next_chunk_delay() {
+        if (!pending || in_flight) {
+            return 0;
+        }
+        uint32_t failed = failures;
+        if (failed == 0) {
+            return CHUNK_PERIOD;
+        }
+        return std::min<TickType_t>(RETRY_MIN << std::min<uint32_t>(failed - 1, 16), RETRY_MAX);
+    }
+
+    static void on_finish(void*, esp_err_t err) {
+        if (err == ESP_OK) {
+            acked = chunk.offset + chunk.length;
+            failures = 0;
+            Storage::set_coredump_progress(image_crc, acked);
+            if (acked >= image_size) {
+                ESP_LOGI(TAG, "Coredump %08" PRIx32 " uploaded, erasing it", image_crc);
+                esp_core_dump_image_erase();
+                Storage::set_coredump_progress(0, 0);
+                pending = false;
+            }
+        } else {
+            failures++;
+            ESP_LOGW(TAG, "Coredump chunk at %" PRIu32 " failed: %s", chunk.offset, esp_err_to_name(err));
+        }
+        in_flight = false;
+        Network::send_internal_event(Network::InternalEventType::CoredumpChunkDone);
+    }
+
+    bool send_next_chunk() {
+        if (!pending || in_flight.exchange(true)) {
+            return false;
+        }
+
+        chunk.offset = acked;
+        chunk.length = std::min<uint32_t>(CHUNK_SIZE, image_size - chunk.offset);
+        uint32_t chunk_crc = 0;
+        if (!crc_range(chunk.offset, chunk.length, chunk_crc)) {
+            in_flight = false;
+            return false;
+        }
+        // The image is a copy of RAM, keys and all, so outside dev it only goes over TLS. The client's
+        // shlug-sn/shlug-key headers authenticate it like every other request, sn here files it by device.
+#ifdef DEV_SERVER
+        int url_len = snprintf(chunk.url, sizeof(chunk.url), "http://%s:3000", DEV_SERVER);
+#else
+        int url_len = snprintf(chunk.url, sizeof(chunk.url), "https://%s", Storage::get_server().c_str());
+#endif
+        url_len += snprintf(chunk.url + url_len, sizeof(chunk.url) - std::min<size_t>(url_len, sizeof(chunk.url)),
+                            "/api/files/coredump?sn=%s&image=%08" PRIx32 "&offset=%" PRIu32 "&total=%" PRIu32
+                            "&crc=%08" PRIx32,
+                            Hardware::get_serial_number(), image_crc, chunk.offset, image_size, chunk_crc);
+        if (url_len >= (int)sizeof(chunk.url)) {
+            ESP_LOGE(TAG, "Coredump URL too long");
+            in_flight = false;
+            return false;
+        }
+
+        HTTPManager::Transfer xfer = {
+            .type = HTTPManager::OperationType::POST,
+            .start =
+                [](void*, const char** url) {
+                    *url = chunk.url;
+                    return ESP_OK;
+                },
+            .data =
+                [](void*, uint8_t* data, size_t* len) {
+                    if (*len < chunk.length) {
+                        return ESP_ERR_INVALID_SIZE;
+                    }
+                    *len = chunk.length;
+                    return esp_partition_read(partition, image_offset + chunk.offset, data, chunk.length);
+                },
+            .finish = on_finish,
+            .user_data = NULL,
+        };
+        if (!HTTPManager::queue_transfer(xfer)) {
+            in_flight = false;
+            return false;
+        }
+        return true;
+    }
+} // namespace Coredump
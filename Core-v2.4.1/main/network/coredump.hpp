@@ -0,0 +1,17 @@
+#pragma once
+#include <freertos/FreeRTOS.h>
+
+// Streams the coredump left by a panic to the server one chunk at a time. The
+// acknowledged offset survives reboots, and the partition is erased once the
+// server has the whole image.
+namespace Coredump {
+    // Looks for a valid coredump and how much of it a previous boot uploaded
+    void init();
+
+    // Wait before the next chunk, 0 if nothing is waiting to go
+    TickType_t next_chunk_delay();
+
+    // Queues the next chunk, InternalEventType::CoredumpChunkDone follows once
+    // the server answers. False if it couldn't be queued. Network task only.
+    bool send_next_chunk();
+} // namespace Coredump
@@ -33,6 +33,12 @@ namespace Hardware {
             edition_string = "Unknown Hardware Type";
         }
 
+        // Shared by the button and card switch interrupts
+        esp_err_t err = gpio_install_isr_service(0);
+        if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+            return 1;
+        }
+
         return 0;
     }
 
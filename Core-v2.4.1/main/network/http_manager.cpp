@@ -1,5 +1,6 @@
 #include "http_manager.hpp"
 #include "common/hardware.hpp"
+#include "common/queues.hpp"
 #include "esp_http_client.h"
 #include "esp_log.h"
 #include "esp_ota_ops.h"
@@ -18,12 +19,15 @@ namespace HTTPManager {
 
     static TaskHandle_t http_thread = NULL;
     static TaskHandle_t performer_thread = NULL;
-    static QueueHandle_t transfer_request_queue = NULL;
-    static QueueHandle_t http_control_queue = NULL;
-    static StreamBufferHandle_t http_data_buf = NULL;
+    static Queues::Queue<Transfer> transfer_request_queue;
+    static Queues::Queue<control_message> http_control_queue;
+    static Queues::StreamBuffer http_data_buf;
 
     static esp_http_client_handle_t client = NULL;
 
+    // Downloaded data lands here before the data callback, uploads are built here
+    static uint8_t transfer_buf[4096] = {0};
+
     esp_err_t _http_event_handle(esp_http_client_event_t* evt) {
         static int recv = 0;
 
@@ -34,7 +38,7 @@ namespace HTTPManager {
                 break;
             case HTTP_EVENT_ON_CONNECTED:
                 ESP_LOGI(TAG, "HTTP_EVENT_ON_CONNECTED");
-                xQueueSend(http_control_queue, &start, pdMS_TO_TICKS(100));
+                http_control_queue.send(start, pdMS_TO_TICKS(100));
                 break;
             case HTTP_EVENT_HEADER_SENT:
                 ESP_LOGI(TAG, "HTTP_EVENT_HEADER_SENT");
@@ -46,7 +50,7 @@ namespace HTTPManager {
                 break;
             case HTTP_EVENT_ON_DATA:
                 if (!esp_http_client_is_chunked_response(evt->client)) {
-                    int sent = xStreamBufferSend(http_data_buf, evt->data, evt->data_len, portMAX_DELAY);
+                    http_data_buf.send(evt->data, evt->data_len, portMAX_DELAY);
                     recv += evt->data_len;
                 }
                 break;
@@ -56,7 +60,7 @@ namespace HTTPManager {
             case HTTP_EVENT_DISCONNECTED: {
                 ESP_LOGI(TAG, "HTTP_EVENT_DISCONNECTED");
                 control_message cm = control_message::Finished;
-                xQueueSend(http_control_queue, &cm, pdMS_TO_TICKS(1));
+                http_control_queue.send(cm, pdMS_TO_TICKS(1));
             } break;
             default:
                 ESP_LOGE(TAG, "UNKNOWN EVENT ID FOR HTTTPS");
@@ -65,10 +69,9 @@ namespace HTTPManager {
         return ESP_OK;
     }
 
-    QueueHandle_t perf_q = NULL;
+    static Queues::Queue<int> perf_q;
     bool start_performing() {
-        int val = 1;
-        return xQueueSend(perf_q, (void*)&val, pdMS_TO_TICKS(1000)) == pdTRUE;
+        return perf_q.send(1, pdMS_TO_TICKS(1000));
     }
 
     esp_err_t execute_get(Transfer xfer) {
@@ -93,7 +96,7 @@ namespace HTTPManager {
 
         static control_message cm = control_message::Finished;
         for (int attempts = 0; attempts < 10; attempts++) {
-            if (xQueueReceive(http_control_queue, &cm, pdMS_TO_TICKS(500)) != pdTRUE) {
+            if (!http_control_queue.receive(cm, pdMS_TO_TICKS(500))) {
                 continue;
             }
             if (cm == control_message::Start) {
@@ -107,15 +110,14 @@ namespace HTTPManager {
 
         ESP_LOGI(TAG, "Starting to listen");
         while (true) {
-            static uint8_t buf[4096] = {0};
-            if (xQueueReceive(http_control_queue, &cm, pdMS_TO_TICKS(1)) == pdTRUE) {
+            if (http_control_queue.receive(cm, pdMS_TO_TICKS(1))) {
                 ESP_LOGW(TAG, "Received stop message from queue");
                 // finished
                 break;
             }
-            size_t read = xStreamBufferReceive(http_data_buf, buf, 4096, pdMS_TO_TICKS(500));
+            size_t read = http_data_buf.receive(transfer_buf, sizeof(transfer_buf), pdMS_TO_TICKS(500));
             // ESP_LOGI(TAG, "REad %d bs", (int)read);
-            esp_err_t err = xfer.data(xfer.user_data, buf, &read);
+            esp_err_t err = xfer.data(xfer.user_data, transfer_buf, &read);
             if (err != ESP_OK) {
                 // bail early, will call finish with error for clean up
                 return err;
@@ -124,10 +126,88 @@ namespace HTTPManager {
         return ESP_OK;
     }
 
+    // Waits for the performer to connect and then finish, the response body is dropped
+    static esp_err_t wait_for_response() {
+        control_message cm = control_message::Finished;
+        bool connected = false;
+        for (int attempts = 0; attempts < 20; attempts++) {
+            // Keep the event handler from blocking on a full buffer
+            uint8_t discard[64];
+            while (http_data_buf.receive(discard, sizeof(discard), 0) > 0) {
+            }
+            if (!http_control_queue.receive(cm, pdMS_TO_TICKS(500))) {
+                continue;
+            }
+            if (cm == control_message::Start) {
+                connected = true;
+            } else if (connected) {
+                break;
+            }
+        }
+        if (!connected || cm != control_message::Finished) {
+            ESP_LOGE(TAG, "No response to upload");
+            return ESP_ERR_TIMEOUT;
+        }
+        int status = esp_http_client_get_status_code(client);
+        if (status < 200 || status >= 300) {
+            ESP_LOGE(TAG, "Upload refused with status %d", status);
+            return ESP_FAIL;
+        }
+        return ESP_OK;
+    }
+
+    esp_err_t execute_post(Transfer xfer) {
+        const char* url = NULL;
+        esp_err_t err = xfer.start(xfer.user_data, &url);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to start transfer: %s", esp_err_to_name(err));
+            return err;
+        }
+        size_t len = MAX_POST_SIZE;
+        err = xfer.data(xfer.user_data, transfer_buf, &len);
+        if (err != ESP_OK) {
+            return err;
+        }
+        ESP_LOGI(TAG, "Uploading %u bytes to %s", (unsigned)len, url ? url : "NULL URL");
+
+        err = esp_http_client_set_url(client, url);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to set http client URL: %s", esp_err_to_name(err));
+            return err;
+        }
+        esp_http_client_set_method(client, HTTP_METHOD_POST);
+        esp_http_client_set_header(client, "Content-Type", "application/octet-stream");
+        esp_http_client_set_post_field(client, (const char*)transfer_buf, len);
+
+        if (!start_performing()) {
+            ESP_LOGE(TAG, "Couldnt start http processing");
+            err = ESP_FAIL;
+        } else {
+            err = wait_for_response();
+        }
+
+        // The client is shared, don't let the body leak into the next GET
+        esp_http_client_set_post_field(client, NULL, 0);
+        esp_http_client_delete_header(client, "Content-Type");
+        return err;
+    }
+
+    // Every request carries who we are, refreshed per transfer in case the key was changed since boot
+    static void set_identity_headers() {
+        esp_http_client_set_header(client, "shlug-sn", Hardware::get_serial_number());
+#ifdef DEV_SERVER
+        std::string key =
+            "a51d88105fd1dd678c8789809184a0f19ba52eec2bf681adccd12f8fa6dbef936c1492d67d65084337b9f4b9522228fc";
+#else
+        std::string key = Storage::get_key();
+#endif
+        esp_http_client_set_header(client, "shlug-key", key.c_str());
+    }
+
     void http_performer(void*) {
         while (true) {
             int i = 0;
-            if (xQueueReceive(perf_q, &i, portMAX_DELAY) != pdTRUE) {
+            if (!perf_q.receive(i, portMAX_DELAY)) {
                 continue;
             }
             esp_http_client_perform(client);
@@ -136,20 +216,26 @@ namespace HTTPManager {
     void thread_fn(void*) {
         while (true) {
             Transfer xfer = {};
-            if (xQueueReceive(transfer_request_queue, (void*)&xfer, portMAX_DELAY) != pdTRUE) {
+            if (!transfer_request_queue.receive(xfer, portMAX_DELAY)) {
                 // noting asked for
                 continue;
             };
+            set_identity_headers();
 
             if (xfer.type == OperationType::GET) {
-                xQueueReset(http_control_queue);
-                xStreamBufferReset(http_data_buf);
+                http_control_queue.reset();
+                http_data_buf.reset();
                 esp_err_t err = execute_get(xfer);
                 if (err != ESP_OK) {
                     ESP_LOGI(TAG, "Stopped transfer due to execute error");
                 }
                 xfer.finish(xfer.user_data, err);
                 ok_to_rmt_read = true;
+            } else if (xfer.type == OperationType::POST) {
+                http_control_queue.reset();
+                http_data_buf.reset();
+                esp_err_t err = execute_post(xfer);
+                xfer.finish(xfer.user_data, err);
             }
         }
     }
@@ -160,38 +246,31 @@ namespace HTTPManager {
             return false;
         }
 
-        return xQueueSend(transfer_request_queue, &xfer, pdMS_TO_TICKS(100)) == pdTRUE;
+        return transfer_request_queue.send(xfer, pdMS_TO_TICKS(100));
     }
 
     void init() {
 
         esp_http_client_config_t config = {
             .url = "https://make.rit.edu/", // will be reset to actual target before any actual requests
+            .event_handler = _http_event_handle,
 #ifndef DEV_SERVER
-            .cert_pem = Storage::get_server_certs(),
-            .cert_len = 0, // will strlen it
+            .use_global_ca_store = true, // parsed once by CAStore
 #endif
-            .event_handler = _http_event_handle,
         };
         client = esp_http_client_init(&config);
 
-        esp_http_client_set_header(client, "shlug-sn", Hardware::get_serial_number());
-#ifdef DEV_SERVER
-        std::string key =
-            "a51d88105fd1dd678c8789809184a0f19ba52eec2bf681adccd12f8fa6dbef936c1492d67d65084337b9f4b9522228fc";
-#else
-        std::string key = Storage::get_key();
-#endif
-        esp_http_client_set_header(client, "shlug-key", key.c_str());
+        set_identity_headers();
 
-        perf_q = xQueueCreate(1, sizeof(int)); // to signal to http executor to start going
+        perf_q.create("http_perform", 1); // to signal to http executor to start going
 
-        transfer_request_queue = xQueueCreate(2, sizeof(Transfer)); // to request a OTA download
-        http_control_queue = xQueueCreate(2, sizeof(control_message));
-        http_data_buf = xStreamBufferCreate(4096, 3584); // transfers real data from network to its destination
-        xTaskCreate(thread_fn, "http_loader", 4096, client, 0, &http_thread);
+        transfer_request_queue.create("http_transfers", 2); // to request a OTA download
+        http_control_queue.create("http_control", 2);
+        http_data_buf.create("http_data", 4096, 3584); // transfers real data from network to its destination
+        xTaskCreate(thread_fn, "http_loader", CONFIG_HTTP_LOADER_TASK_STACK_SIZE, client, 0, &http_thread);
 
-        xTaskCreate(http_performer, "http_performer", 4096, NULL, 0, &performer_thread);
+        xTaskCreate(http_performer, "http_performer", CONFIG_HTTP_PERFORMER_TASK_STACK_SIZE, NULL, 0,
+                    &performer_thread);
     }
 
 } // namespace HTTPManager
\ No newline at end of file
@@ -1,19 +1,24 @@
 #include "esp_err.h"
+#include <cstddef>
+#include <cstdint>
 namespace HTTPManager {
     // Init HTTP to one server in particular
     // (we're not made of memory)
     void init();
     enum class OperationType{
         GET,
-        // POST,
+        POST,
     };
+    // Most a POST body can hold, it goes out in a single request
+    static constexpr size_t MAX_POST_SIZE = 4096;
     // if this doesnt return ESP_OK, the operation will be cancelled
     // lifetime of memory at url_to_fill must be maintained until finish_cb is called
     using start_cb_t = esp_err_t(*)(void *user_data, const char **url_to_fill);
 
     // called when new data has come from the network on GET or when we need data to upload POST
     // when downloading, *len is length of data
-    // when uploading set *len to length of data
+    // when uploading *len starts as the room in data (MAX_POST_SIZE), set it to the length of the body
+    // a POST only finishes with ESP_OK if the server answered 2xx
     using data_cb_t = esp_err_t (*)(void *user_data, uint8_t* data, size_t* len);
 
     // if err != ESP_OK something bad happened, called on good or bad finish
@@ -0,0 +1,178 @@
+#include "log_shipper.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <freertos/task.h>
+
+#include "cJSON.h"
+#include "wsacs.hpp"
+
+namespace LogShipper {
+    static constexpr size_t MAX_ENTRIES = 24;
+    static constexpr size_t MAX_TEXT = 120; // longer lines are cut
+    // A batch goes out once this many lines are pending...
+    static constexpr size_t FLUSH_ENTRIES = 12;
+    // ...or the oldest has waited this long, errors get less patience
+    static constexpr TickType_t FLUSH_AFTER = pdMS_TO_TICKS(5 * 1000);
+    static constexpr TickType_t ERROR_FLUSH_AFTER = pdMS_TO_TICKS(1000);
+    // Keeps one batch inside a single TLS record
+    static constexpr size_t BATCH_ENTRIES = 16;
+
+    static constexpr size_t LEVELS = 3;
+
+    // Token bucket, burst lines at once then one more every refill
+    struct Limit {
+        uint32_t burst;
+        TickType_t refill;
+    };
+    // Indexed by LogMessageType
+    static constexpr Limit LIMITS[LEVELS] = {
+        {.burst = 10, .refill = pdMS_TO_TICKS(2 * 1000)},  // NORMAL
+        {.burst = 5, .refill = pdMS_TO_TICKS(10 * 1000)},  // DEBUG
+        {.burst = 10, .refill = pdMS_TO_TICKS(1 * 1000)},  // ERROR
+    };
+
+    struct Bucket {
+        uint32_t used; // tokens taken, so a zeroed bucket starts full
+        TickType_t refilled_at;
+        uint32_t suppressed; // since the last batch
+    };
+
+    struct Entry {
+        LogMessageType type;
+        TickType_t at;
+        char text[MAX_TEXT];
+    };
+
+    // Guards everything below, held only for copies
+    static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+    static Entry entries[MAX_ENTRIES];
+    static size_t first = 0;
+    static size_t count = 0;
+    static TickType_t due = 0; // when the pending batch goes out, only valid while count > 0
+    static Bucket buckets[LEVELS];
+    static Stats stats = {};
+
+    static void refill(Bucket& bucket, const Limit& limit, TickType_t now) {
+        uint32_t tokens = (now - bucket.refilled_at) / limit.refill;
+        if (tokens == 0) {
+            return;
+        }
+        bucket.used = bucket.used > tokens ? bucket.used - tokens : 0;
+        bucket.refilled_at = bucket.used == 0 ? now : bucket.refilled_at + tokens * limit.refill;
+    }
+
+    bool add(LogMessageType type, const char* text, TickType_t& flush_in) {
+        flush_in = 0;
+        size_t level = (size_t)type < LEVELS ? (size_t)type : (size_t)LogMessageType::NORMAL;
+        size_t len = strnlen(text, MAX_TEXT - 1);
+        TickType_t now = xTaskGetTickCount();
+
+        taskENTER_CRITICAL(&lock);
+        Bucket& bucket = buckets[level];
+        refill(bucket, LIMITS[level], now);
+        if (bucket.used >= LIMITS[level].burst) {
+            bucket.suppressed++;
+            stats.suppressed++;
+            taskEXIT_CRITICAL(&lock);
+            return false;
+        }
+        if (count == MAX_ENTRIES) {
+            stats.overflowed++;
+            taskEXIT_CRITICAL(&lock);
+            return false;
+        }
+
+        bucket.used++;
+        Entry& entry = entries[(first + count) % MAX_ENTRIES];
+        entry.type = type;
+        entry.at = now;
+        memcpy(entry.text, text, len);
+        entry.text[len] = '\0';
+        count++;
+        stats.queued++;
+
+        TickType_t deadline = now + (type == LogMessageType::ERROR ? ERROR_FLUSH_AFTER : FLUSH_AFTER);
+        if (count >= FLUSH_ENTRIES) {
+            deadline = now;
+        }
+        if (count == 1 || (int32_t)(deadline - due) < 0) {
+            due = deadline;
+            flush_in = std::max<TickType_t>(deadline - now, 1);
+        }
+        taskEXIT_CRITICAL(&lock);
+        return true;
+    }
+
+    TickType_t next_flush_delay() {
+        TickType_t now = xTaskGetTickCount();
+        taskENTER_CRITICAL(&lock);
+        TickType_t delay = 0;
+        if (count > 0) {
+            delay = (int32_t)(due - now) > 0 ? due - now : 1;
+        }
+        taskEXIT_CRITICAL(&lock);
+        return delay;
+    }
+
+    void flush() {
+        static Entry batch[BATCH_ENTRIES];
+        uint32_t suppressed[LEVELS];
+        TickType_t now = xTaskGetTickCount();
+
+        taskENTER_CRITICAL(&lock);
+        size_t taken = std::min(count, BATCH_ENTRIES);
+        for (size_t i = 0; i < taken; i++) {
+            batch[i] = entries[(first + i) % MAX_ENTRIES];
+        }
+        first = (first + taken) % MAX_ENTRIES;
+        count -= taken;
+        if (count > 0) {
+            due = now; // the rest follows straight away
+        }
+        bool any_suppressed = false;
+        for (size_t level = 0; level < LEVELS; level++) {
+            suppressed[level] = buckets[level].suppressed;
+            buckets[level].suppressed = 0;
+            any_suppressed |= suppressed[level] != 0;
+        }
+        taskEXIT_CRITICAL(&lock);
+
+        if (taken == 0 && !any_suppressed) {
+            return;
+        }
+
+        cJSON* msg = cJSON_CreateObject();
+        cJSON* logs = cJSON_AddArrayToObject(msg, "Logs");
+        for (size_t i = 0; i < taken; i++) {
+            cJSON* entry = cJSON_CreateObject();
+            cJSON_AddStringToObject(entry, "Level", log_message_type_to_string(batch[i].type));
+            cJSON_AddNumberToObject(entry, "AgeMs", (double)pdTICKS_TO_MS(now - batch[i].at));
+            cJSON_AddStringToObject(entry, "Text", batch[i].text);
+            cJSON_AddItemToArray(logs, entry);
+        }
+        if (any_suppressed) {
+            cJSON* counts = cJSON_AddObjectToObject(msg, "Suppressed");
+            for (size_t level = 0; level < LEVELS; level++) {
+                if (suppressed[level] != 0) {
+                    cJSON_AddNumberToObject(counts, log_message_type_to_string((LogMessageType)level),
+                                            (double)suppressed[level]);
+                }
+            }
+        }
+        WSACS::send_cjson(msg);
+        cJSON_Delete(msg);
+
+        taskENTER_CRITICAL(&lock);
+        stats.sent += taken;
+        stats.batches++;
+        taskEXIT_CRITICAL(&lock);
+    }
+
+    Stats get_stats() {
+        taskENTER_CRITICAL(&lock);
+        Stats copy = stats;
+        taskEXIT_CRITICAL(&lock);
+        return copy;
+    }
+} // namespace LogShipper
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <freertos/FreeRTOS.h>
+
+#include "common/types.hpp"
+
+// Log lines for the server. Lines are buffered and go out together as one
+// {"Logs": [...]} message once enough are pending or the oldest has waited
+// long enough. Every severity has its own rate limit, lines over it are only
+// counted, so a fault storm can't crowd auth traffic off the link.
+namespace LogShipper {
+    struct Stats {
+        uint32_t queued;
+        uint32_t sent;
+        uint32_t suppressed; // over the rate limit
+        uint32_t overflowed; // no room left in the buffer
+        uint32_t batches;
+    };
+
+    // Copies text into the pending batch, safe from any task. False if the
+    // severity is over its rate or there is no room. flush_in is set to when
+    // the batch should go out, or 0 if an earlier deadline still holds.
+    bool add(LogMessageType type, const char* text, TickType_t& flush_in);
+
+    // Ticks until the pending batch is due, 0 if nothing is pending
+    TickType_t next_flush_delay();
+
+    // Sends one batch. Network task only, it owns the websocket.
+    void flush();
+
+    Stats get_stats();
+} // namespace LogShipper
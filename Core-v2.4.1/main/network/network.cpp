@@ -1,11 +1,18 @@
 #include "network.hpp"
+#include "common/audit_log.hpp"
+#include "common/queues.hpp"
+#include "common/timer_wheel.hpp"
 #include "esp_err.h"
 #include "esp_log.h"
 #include "esp_wifi.h"
 #include "io/Button.hpp"
 #include "io/IO.hpp"
+#include "io/LEDControl.hpp"
 
+#include "ca_store.hpp"
+#include "coredump.hpp"
 #include "http_manager.hpp"
+#include "log_shipper.hpp"
 #include "ota.hpp"
 #include "sdkconfig.h"
 #include "storage.hpp"
@@ -17,13 +24,14 @@
 
 #include "io/LEDControl.hpp"
 
+#include <atomic>
 #include <chrono>
 #include <thread>
 
 static const char* TAG = "network";
 
 static TaskHandle_t network_task;
-static QueueHandle_t network_event_queue;
+static Queues::Queue<Network::InternalEvent> network_event_queue;
 
 static SemaphoreHandle_t is_online_mutex;
 static bool is_online_value = false;
@@ -34,8 +42,12 @@ static int wsacs_successive_failures = 0;
 
 void set_is_networked(bool new_online) {
     if (xSemaphoreTake(is_online_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
+        bool changed = is_online_value != new_online;
         is_online_value = new_online;
         xSemaphoreGive(is_online_mutex);
+        if (changed) {
+            LED::refresh();
+        }
     }
 }
 
@@ -108,6 +120,8 @@ void wifi_init_sta(void) {
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
     ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
     ESP_ERROR_CHECK(esp_wifi_start());
+    // Lets the radio sleep between DTIM beacons, needed for light sleep while associated
+    esp_wifi_set_ps(WIFI_PS_MIN_MODEM);
 }
 
 const char* reset_reason_to_str(esp_reset_reason_t res) {
@@ -157,50 +171,74 @@ void consider_reset_reason() {
     esp_reset_reason_t reason = esp_reset_reason();
     ESP_LOGI(TAG, "Reset cause: %s", reset_reason_to_str(reason));
     if (reason == ESP_RST_PANIC) {
-        ESP_LOGE(TAG, "Upload coredump");
+        ESP_LOGE(TAG, "Panic reset, any coredump will be uploaded");
     }
     std::string str = "Restart Reason ";
     str += reset_reason_to_str(reason);
-    char* msg = new char[str.size() + 1];
-    strcpy(msg, str.c_str());
-    if (!Network::send_event({.type = NetworkEventType::Message, .message = msg})) {
-        delete[] msg; // if couldnt send to thread, it gets dropped
-    }
+    Network::send_log(reason == ESP_RST_PANIC ? LogMessageType::ERROR : LogMessageType::NORMAL, str.c_str());
 }
 
 static std::optional<AuthRequest> outstanding_auth = {};
 
-static TimerHandle_t wsacs_timeout_timer_handle = NULL;
-static TimerHandle_t watchdog_timer_handle = NULL;
-static TimerHandle_t keep_alive_timer = NULL;
+// Written on the network task when a request goes out, answered on the websocket task
+static std::atomic<TickType_t> auth_sent_at{0};
+static std::atomic<uint32_t> auth_requests{0};
+static std::atomic<uint32_t> auth_answered{0};
+static std::atomic<uint32_t> auth_timeouts{0};
+static std::atomic<uint32_t> auth_total_ms{0};
+static std::atomic<uint32_t> auth_last_ms{0};
+static std::atomic<uint32_t> auth_max_ms{0};
+
+static constexpr TickType_t KEEPALIVE_PERIOD = pdMS_TO_TICKS(10 * 1000);
+static constexpr TickType_t WSACS_TIMEOUT = pdMS_TO_TICKS(3 * 1000);
+static constexpr TickType_t WATCHDOG_TIMEOUT = pdMS_TO_TICKS(30 * 1000);
+// A log batch that comes due while an auth is out waits this long
+static constexpr TickType_t LOG_FLUSH_RETRY = pdMS_TO_TICKS(250);
+
+// ids are the InternalEventType each timer posts
+static TimerWheel::Timer keep_alive_timer;
+static TimerWheel::Timer wsacs_timeout_timer;
+static TimerWheel::Timer watchdog_timer;
+static TimerWheel::Timer coredump_timer;
+static TimerWheel::Timer log_flush_timer;
+static TimerWheel::Timer queue_stats_timer;
 
 namespace Network {
+    // Runs on the timer task, never blocks so a full queue just gets retried
+    static bool post_timer_event(uint32_t id, uint32_t generation) {
+        return network_event_queue.try_send({.type = (InternalEventType)id, .timer_generation = generation});
+    }
+
     // TODO make this think about things harder and do stuff if we're falling offline
     void network_watchdog_feed() {
-        xTimerReset(watchdog_timer_handle, pdMS_TO_TICKS(100));
-    }
-    void network_watchdog_expiry_fn(TimerHandle_t) {
-        send_internal_event(InternalEventType::ServerDown);
+        TimerWheel::arm(watchdog_timer, WATCHDOG_TIMEOUT);
     }
 
     void handle_external_event(NetworkEvent event) {
         switch (event.type) {
             case NetworkEventType::AuthRequest:
                 outstanding_auth = event.auth_request;
-                xTimerStart(wsacs_timeout_timer_handle, pdMS_TO_TICKS(100));
+                auth_sent_at.store(xTaskGetTickCount() | 1, std::memory_order_relaxed); // 0 means none out
+                auth_requests.fetch_add(1, std::memory_order_relaxed);
+                TimerWheel::arm(wsacs_timeout_timer, WSACS_TIMEOUT, WSACS_TIMEOUT);
                 WSACS::send_auth_request(event.auth_request);
                 break;
 
-            case NetworkEventType::Message:
-                WSACS::send_message(event.message);
-                break;
-
             case NetworkEventType::PleaseRestart:
                 ESP_LOGE(TAG, "going kaboom");
+                AuditLog::flush();
                 vTaskDelay(pdMS_TO_TICKS(1000));
                 esp_restart();
                 break;
 
+            case NetworkEventType::SongMissing:
+                WSACS::send_song_missing(event.song_id);
+                break;
+
+            case NetworkEventType::CABundleResult:
+                WSACS::send_ca_bundle_result(event.ca_bundle_installed);
+                break;
+
             case NetworkEventType::StateChange:
                 if (event.state_change.from == event.state_change.to) {
                     break;
@@ -209,21 +247,70 @@ namespace Network {
                 str += io_state_to_string(event.state_change.from);
                 str += " -> ";
                 str += io_state_to_string(event.state_change.to);
-                char* msg = new char[str.size() + 1];
-                strcpy(msg, str.c_str());
-                WSACS::send_message(msg);
+                send_log(LogMessageType::NORMAL, str.c_str());
                 break;
         }
     }
+    // Nothing to do if there is no coredump or a chunk is already out
+    static void schedule_coredump_chunk() {
+        TickType_t delay = Coredump::next_chunk_delay();
+        if (delay != 0) {
+            TimerWheel::arm(coredump_timer, delay);
+        }
+    }
+
+    // Once online, the pending batch goes out when it comes due
+    static void schedule_log_flush() {
+        TickType_t delay = LogShipper::next_flush_delay();
+        if (delay != 0) {
+            TimerWheel::arm(log_flush_timer, delay);
+        }
+    }
+
+    bool send_log(LogMessageType type, const char* text) {
+        TickType_t flush_in;
+        if (!LogShipper::add(type, text, flush_in)) {
+            return false;
+        }
+        if (flush_in != 0) {
+            TimerWheel::arm(log_flush_timer, flush_in);
+        }
+        return true;
+    }
+
     void mark_wsacs_request_complete() {
         outstanding_auth = {};
+
+        TickType_t sent = auth_sent_at.exchange(0, std::memory_order_relaxed);
+        if (sent == 0) {
+            return; // not ours, or it already timed out
+        }
+        uint32_t ms = pdTICKS_TO_MS(xTaskGetTickCount() - sent);
+        auth_answered.fetch_add(1, std::memory_order_relaxed);
+        auth_total_ms.fetch_add(ms, std::memory_order_relaxed);
+        auth_last_ms.store(ms, std::memory_order_relaxed);
+        if (ms > auth_max_ms.load(std::memory_order_relaxed)) {
+            auth_max_ms.store(ms, std::memory_order_relaxed);
+        }
+    }
+
+    AuthStats get_auth_stats() {
+        uint32_t answered = auth_answered.load(std::memory_order_relaxed);
+        return {
+            .requests = auth_requests.load(std::memory_order_relaxed),
+            .answered = answered,
+            .timeouts = auth_timeouts.load(std::memory_order_relaxed),
+            .last_ms = auth_last_ms.load(std::memory_order_relaxed),
+            .avg_ms = answered == 0 ? 0 : auth_total_ms.load(std::memory_order_relaxed) / answered,
+            .max_ms = auth_max_ms.load(std::memory_order_relaxed),
+        };
     }
     void network_thread_fn(void* p) {
         wifi_init_sta();
 
         while (true) {
             Network::InternalEvent event{InternalEventType::ExternalEvent}; // always overwritten
-            if (xQueueReceive(network_event_queue, (void*)&event, portMAX_DELAY) == pdFALSE) {
+            if (!network_event_queue.receive(event, portMAX_DELAY)) {
                 continue;
             }
             switch (event.type) {
@@ -239,8 +326,13 @@ namespace Network {
                 case InternalEventType::TryConnect:
                     WSACS::try_connect();
                     break;
+                case InternalEventType::WatchdogTimedOut:
+                    if (!TimerWheel::is_current(watchdog_timer, event.timer_generation)) {
+                        break; // fed after this expiry was posted
+                    }
+                    [[fallthrough]];
                 case InternalEventType::ServerDown:
-                    is_online_value = false;
+                    set_is_networked(false);
                     wsacs_successive_failures += 1;
                     // Quick falloff, might be able to recover
                     if (wsacs_successive_failures < 10) {
@@ -255,9 +347,11 @@ namespace Network {
                     WSACS::send_opening_message();
                     break;
                 case InternalEventType::ServerAuthed:
-                    is_online_value = true;
+                    set_is_networked(true);
                     consider_reset_reason(); // upload it
-                    xTimerStart(watchdog_timer_handle, pdMS_TO_TICKS(100));
+                    schedule_coredump_chunk();
+                    schedule_log_flush();
+                    TimerWheel::arm(watchdog_timer, WATCHDOG_TIMEOUT);
 
                     wsacs_successive_failures = 0;
                     if (waiting_for_initial_connect) {
@@ -265,15 +359,46 @@ namespace Network {
                         OTA::mark_valid();
                     }
                     break;
+                case InternalEventType::CoredumpChunkDue:
+                    if (!TimerWheel::is_current(coredump_timer, event.timer_generation) || !is_online_value) {
+                        break; // ServerAuthed picks it back up
+                    }
+                    // Auth traffic goes first, try again once it is answered
+                    if (outstanding_auth.has_value() || !Coredump::send_next_chunk()) {
+                        schedule_coredump_chunk();
+                    }
+                    break;
+                case InternalEventType::CoredumpChunkDone:
+                    if (is_online_value) {
+                        schedule_coredump_chunk();
+                    }
+                    break;
+                case InternalEventType::LogFlushDue:
+                    if (!TimerWheel::is_current(log_flush_timer, event.timer_generation) || !is_online_value) {
+                        break; // ServerAuthed picks it back up
+                    }
+                    if (outstanding_auth.has_value()) {
+                        TimerWheel::arm(log_flush_timer, LOG_FLUSH_RETRY);
+                        break;
+                    }
+                    LogShipper::flush();
+                    schedule_log_flush();
+                    break;
+                case InternalEventType::QueueStatsDue:
+                    Queues::log_stats();
+                    break;
                 case InternalEventType::KeepAliveTime:
                     if (is_online_value) {
                         WSACS::send_status_message();
                     }
                     break;
                 case InternalEventType::WSACSTimedOut:
+                    if (!TimerWheel::is_current(wsacs_timeout_timer, event.timer_generation)) {
+                        break; // restarted or stopped after this expiry was posted
+                    }
                     if (waiting_for_initial_connect) {
                         waiting_for_initial_connect = false;
-                        is_online_value = false;
+                        set_is_networked(false);
                         // TODO LOAD FROM FLASH
                         IO::send_event({.type = IOEventType::NETWORK_COMMAND,
                                         .network_command = {
@@ -284,8 +409,10 @@ namespace Network {
                                         }});
                     } else if (outstanding_auth.has_value()) {
                         // do it from storage
-                        xTimerStop(wsacs_timeout_timer_handle, pdMS_TO_TICKS(100));
+                        TimerWheel::cancel(wsacs_timeout_timer);
                         outstanding_auth = {};
+                        auth_sent_at.store(0, std::memory_order_relaxed);
+                        auth_timeouts.fetch_add(1, std::memory_order_relaxed);
                         IO::send_event({
                             .type = IOEventType::NETWORK_COMMAND,
                             .network_command =
@@ -325,24 +452,22 @@ namespace Network {
     }
 
     bool send_internal_event(InternalEvent ev) {
-        return xQueueSend(network_event_queue, &ev, pdMS_TO_TICKS(100)) == pdTRUE;
+        return network_event_queue.send(ev, pdMS_TO_TICKS(100));
     }
     bool send_internal_event(InternalEventType evtyp) {
         return send_internal_event({.type = evtyp, .netif_up_ip = {0}});
     }
 
     bool send_event(NetworkEvent ev) {
+        // Kept locally even if the queue is full or the server is down
+        if (ev.type == NetworkEventType::StateChange && ev.state_change.from != ev.state_change.to) {
+            AuditLog::record(ev.state_change);
+        }
         return send_internal_event(InternalEvent{
             .type = InternalEventType::ExternalEvent,
             .external_event = ev,
         });
     }
-    bool send_message(char* msg) {
-        return send_event(NetworkEvent{
-            .type = NetworkEventType::Message,
-            .message = msg,
-        });
-    }
     bool send_event(NetworkEventType ev) {
         return send_event({.type = ev, ._ = 0});
     }
@@ -354,39 +479,41 @@ namespace Network {
         esp_log_level_set("transport_ws",
                           ESP_LOG_INFO); // enable INFO logs from DHCP client
 
-        network_event_queue = xQueueCreate(5, sizeof(Network::InternalEvent));
+        network_event_queue.create("network_events", 5);
 
-        auto keepalive_func = [](TimerHandle_t) {
-            Network::send_internal_event({Network::InternalEventType::KeepAliveTime});
-        };
-
-        keep_alive_timer = xTimerCreate("wsacs keepalive", pdMS_TO_TICKS(10 * 1000), true, NULL, keepalive_func);
-        if (xTimerStart(keep_alive_timer, pdMS_TO_TICKS(100)) == pdFAIL) {
-            ESP_LOGE(TAG, "Couldnt start keepalive timer");
-            // todo crash
-            return -1;
-        }
-
-        if (keep_alive_timer == NULL) {
-            ESP_LOGE(TAG, "Fail and die timer edition");
-            // todo crash
-            return -1;
-        }
+        keep_alive_timer.post = post_timer_event;
+        keep_alive_timer.id = (uint32_t)InternalEventType::KeepAliveTime;
+        TimerWheel::arm(keep_alive_timer, KEEPALIVE_PERIOD, KEEPALIVE_PERIOD);
 
         is_online_mutex = xSemaphoreCreateMutex();
         OTA::init();
+        CAStore::init();
         WSACS::init();
         HTTPManager::init();
 
         // Timeout when we ask the server things
-        wsacs_timeout_timer_handle =
-            xTimerCreate("wsacs_timeout", pdMS_TO_TICKS(3 * 1000), pdTRUE, NULL,
-                         [](TimerHandle_t) { send_internal_event(InternalEventType::WSACSTimedOut); });
-        xTimerStart(wsacs_timeout_timer_handle, pdMS_TO_TICKS(100));
+        wsacs_timeout_timer.post = post_timer_event;
+        wsacs_timeout_timer.id = (uint32_t)InternalEventType::WSACSTimedOut;
+        TimerWheel::arm(wsacs_timeout_timer, WSACS_TIMEOUT, WSACS_TIMEOUT);
 
         // timeout for ping ponging
-        watchdog_timer_handle =
-            xTimerCreate("watchdog_timeout", pdMS_TO_TICKS(30 * 1000), pdFALSE, NULL, network_watchdog_expiry_fn);
+        watchdog_timer.post = post_timer_event;
+        watchdog_timer.id = (uint32_t)InternalEventType::WatchdogTimedOut;
+
+        coredump_timer.post = post_timer_event;
+        coredump_timer.id = (uint32_t)InternalEventType::CoredumpChunkDue;
+        Coredump::init();
+
+        // Lines logged before this still go out, ServerAuthed schedules them
+        log_flush_timer.post = post_timer_event;
+        log_flush_timer.id = (uint32_t)InternalEventType::LogFlushDue;
+
+        if (CONFIG_QUEUE_STATS_LOG_PERIOD != 0) {
+            TickType_t period = pdMS_TO_TICKS(CONFIG_QUEUE_STATS_LOG_PERIOD * 1000);
+            queue_stats_timer.post = post_timer_event;
+            queue_stats_timer.id = (uint32_t)InternalEventType::QueueStatsDue;
+            TimerWheel::arm(queue_stats_timer, period, period);
+        }
 
         xTaskCreate(network_thread_fn, "network", CONFIG_NETWORK_TASK_STACK_SIZE, nullptr, 0, &network_task);
 
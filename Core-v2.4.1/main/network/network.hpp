@@ -15,8 +15,9 @@ namespace Network {
     bool send_event(NetworkEvent ev);
     // shorthand for content less eventtype
     bool send_event(NetworkEventType ev);
-    // shorthand for sent event type message
-    bool send_message(char *);
+    // Queues a line for the next log batch to the server, copies text.
+    // False if the line was rate limited or dropped.
+    bool send_log(LogMessageType type, const char* text);
     /**
      * @return true if we're connected to the server
      * @return false if not
@@ -28,6 +29,17 @@ namespace Network {
 
     // mark as complete so we dont time out and deny
     void mark_wsacs_request_complete();
+
+    // Card tap to server answer, the part of a slow tap the network adds
+    struct AuthStats {
+        uint32_t requests;
+        uint32_t answered;
+        uint32_t timeouts;
+        uint32_t last_ms;
+        uint32_t avg_ms; // over answered requests
+        uint32_t max_ms;
+    };
+    AuthStats get_auth_stats();
     // Used only by tasks on the network side of things to
     // communicate with the main network handler
     enum class InternalEventType {
@@ -44,10 +56,17 @@ namespace Network {
 
         // From timer
         WSACSTimedOut,
+        WatchdogTimedOut,
 
         KeepAliveTime,
         OtaUpdate,
 
+        CoredumpChunkDue,  // from timer, throttles the upload
+        CoredumpChunkDone, // from the HTTP task, the server answered
+
+        LogFlushDue,   // from timer, a log batch is ready
+        QueueStatsDue, // from timer, CONFIG_QUEUE_STATS_LOG_PERIOD
+
         PollRestart,
         // From weirdos in IO
         ExternalEvent,
@@ -59,6 +78,7 @@ namespace Network {
             IOState server_set_state;
             uint64_t server_set_time;
             OTATag ota_tag;
+            uint32_t timer_generation;
 
             NetworkEvent external_event;
         };
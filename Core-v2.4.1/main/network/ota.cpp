@@ -27,7 +27,7 @@ namespace OTA {
 
     void begin(OTATag tag) {
         if (std::string{tag.data(), tag.size()} == active_version){
-            Network::send_message(new char []("Not OTA updating to equal version"));
+            Network::send_log(LogMessageType::NORMAL, "Not OTA updating to equal version");
         }
 
         // pause time sensitive temperature
@@ -96,9 +96,7 @@ namespace OTA {
                         next_version = "!" + next_version; // will show !> version to show error on pending version
                         std::string smsg = std::string("Failed to download OTA update: ") + esp_err_to_name(err);
                         ESP_LOGE(TAG, "%s", smsg.c_str());
-                        char* msg = new char[smsg.size()];
-                        strcpy(msg, smsg.data());
-                        Network::send_message(msg);
+                        Network::send_log(LogMessageType::ERROR, smsg.c_str());
                         return;
                     }
                     err = esp_ota_end(ota_handle);
@@ -106,9 +104,7 @@ namespace OTA {
                         next_version = "!" + next_version; // will show !> version to show error on pending version
                         std::string smsg = std::string("Failed to install OTA update: ") + esp_err_to_name(err);
                         ESP_LOGE(TAG, "%s", smsg.c_str());
-                        char* msg = new char[smsg.size()];
-                        strcpy(msg, smsg.data());
-                        Network::send_message(msg);
+                        Network::send_log(LogMessageType::ERROR, smsg.c_str());
                         return;
                     }
                     const esp_partition_t* running_part = esp_ota_get_running_partition();
@@ -139,7 +135,7 @@ namespace OTA {
             ESP_LOGW(TAG, "Unable to mark app as valid?: %s", esp_err_to_name(err));
         } else {
             ESP_LOGI(TAG, "Marked OTA as valid");
-            Network::send_message(new char[]("Successfully reached server. Marking OTA valid"));
+            Network::send_log(LogMessageType::NORMAL, "Successfully reached server. Marking OTA valid");
         }
     }
 
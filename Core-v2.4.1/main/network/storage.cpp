@@ -1,11 +1,19 @@
 #include "storage.hpp"
 #include "esp_err.h"
 #include "esp_log.h"
+#include "freertos/semphr.h"
 #include "nvs_flash.h"
 
+#include <cstring>
+
 #include "common/pins.hpp"
 
 namespace Storage {
+    static constexpr const char* NVS_CONFIG_TAG = "config";
+    static constexpr const char* NVS_COREDUMP_TAG = "coredump";
+    static constexpr const char* NVS_CA_FAILURES_TAG = "ca_failures";
+
+    // Pre-blob firmware kept one key per setting, read once to migrate
     static constexpr const char* NVS_SERVER_ADDR_TAG = "server_addr";
     static constexpr const char* NVS_SERVER_KEY_TAG = "server_key";
 
@@ -13,17 +21,42 @@ namespace Storage {
     static constexpr const char* NVS_NETWORK_PASS_TAG = "network_pass";
 
     static constexpr const char* NVS_MAX_TEMP_TAG = "max_temp";
+    static constexpr const char* NVS_TEMP_RESOLUTION_TAG = "temp_res";
+    static constexpr const char* NVS_MAX_TEMP_RISE_TAG = "max_rise";
+
+    static constexpr const char* LEGACY_TAGS[] = {
+        NVS_SERVER_ADDR_TAG, NVS_SERVER_KEY_TAG,      NVS_NETWORK_SSID_TAG,  NVS_NETWORK_PASS_TAG,
+        NVS_MAX_TEMP_TAG,    NVS_TEMP_RESOLUTION_TAG, NVS_MAX_TEMP_RISE_TAG,
+    };
+
+    // Every setting lives in one blob, so a provisioning pass is one flash
+    // write and boot is one read. Fields are only ever appended: bump
+    // CONFIG_VERSION and add a step to migrate() when adding one.
+    static constexpr uint16_t CONFIG_VERSION = 1;
+
+    struct Config {
+        uint16_t version = CONFIG_VERSION;
+        WifiSSID network_ssid = {0};
+        WifiPassword network_pass = {0};
+        char server_addr[128] = {0};
+        char server_key[128] = {0};
+        uint8_t max_temp = 40;
+        uint8_t temp_resolution = 12;
+        uint8_t max_temp_rise = 0;
+    };
 
     static const char* TAG = "storage";
     nvs_handle_t storage_nvs_handle;
 
-    WifiSSID cached_network_ssid = {0};
-    WifiPassword cached_network_pass = {0};
-
-    std::string cached_server_key = "";
-    std::string cached_server_addr = "";
+    // active is what the getters see, staged collects a transaction's changes
+    static Config active;
+    static Config staged;
+    static SemaphoreHandle_t config_lock;      // guards active, held briefly
+    static SemaphoreHandle_t transaction_lock; // recursive, held from begin() to the outermost commit()
+    static int transaction_depth = 0;
+    static bool transaction_aborted = false;
 
-    uint8_t cached_max_temp = 40;
+    static uint32_t boot_count = 0;
 
     esp_err_t update_bootcount() {
 
@@ -46,55 +79,123 @@ namespace Storage {
         boot_counter++;
         ESP_ERROR_CHECK_WITHOUT_ABORT(nvs_set_i32(storage_nvs_handle, "boot_counter", boot_counter));
         ESP_ERROR_CHECK_WITHOUT_ABORT(nvs_commit(storage_nvs_handle));
+        boot_count = boot_counter;
 
         return ESP_OK;
     }
-    bool commit() {
-        esp_err_t e = nvs_commit(storage_nvs_handle);
-        if (e != ESP_OK) {
-            ESP_LOGE(TAG, "Could not commit to NVS: %s", esp_err_to_name(e));
+
+    static bool write_config(const Config& config) {
+        esp_err_t err = nvs_set_blob(storage_nvs_handle, NVS_CONFIG_TAG, &config, sizeof(config));
+        if (err == ESP_OK) {
+            err = nvs_commit(storage_nvs_handle);
+        }
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Could not write config to NVS: %s", esp_err_to_name(err));
         }
-        return e == ESP_OK;
+        return err == ESP_OK;
     }
 
-    void load_initial_values() {
+    // A missing legacy key just leaves the default, anything else is a failed read
+    static bool legacy_read_ok(const char* tag, esp_err_t err) {
+        if (err == ESP_OK || err == ESP_ERR_NVS_NOT_FOUND) {
+            return true;
+        }
+        ESP_LOGE(TAG, "Failed to read legacy %s: %s", tag, esp_err_to_name(err));
+        return false;
+    }
+
+    // Version 0, the separate keys written before the config blob existed.
+    // Returns false if any key couldn't be read, it may not fit the blob.
+    static bool load_legacy(Config& config) {
+        bool ok = true;
         size_t len = sizeof(WifiSSID);
+        ok &= legacy_read_ok(NVS_NETWORK_SSID_TAG, nvs_get_blob(storage_nvs_handle, NVS_NETWORK_SSID_TAG,
+                                                                config.network_ssid.data(), &len));
+        len = sizeof(WifiPassword);
+        ok &= legacy_read_ok(NVS_NETWORK_PASS_TAG, nvs_get_blob(storage_nvs_handle, NVS_NETWORK_PASS_TAG,
+                                                                config.network_pass.data(), &len));
+        len = sizeof(config.server_addr);
+        ok &= legacy_read_ok(NVS_SERVER_ADDR_TAG,
+                             nvs_get_str(storage_nvs_handle, NVS_SERVER_ADDR_TAG, config.server_addr, &len));
+        len = sizeof(config.server_key);
+        ok &= legacy_read_ok(NVS_SERVER_KEY_TAG,
+                             nvs_get_str(storage_nvs_handle, NVS_SERVER_KEY_TAG, config.server_key, &len));
+        ok &= legacy_read_ok(NVS_MAX_TEMP_TAG, nvs_get_u8(storage_nvs_handle, NVS_MAX_TEMP_TAG, &config.max_temp));
+        ok &= legacy_read_ok(NVS_TEMP_RESOLUTION_TAG,
+                             nvs_get_u8(storage_nvs_handle, NVS_TEMP_RESOLUTION_TAG, &config.temp_resolution));
+        ok &= legacy_read_ok(NVS_MAX_TEMP_RISE_TAG,
+                             nvs_get_u8(storage_nvs_handle, NVS_MAX_TEMP_RISE_TAG, &config.max_temp_rise));
+        return ok;
+    }
 
-        esp_err_t err = nvs_get_blob(storage_nvs_handle, NVS_NETWORK_SSID_TAG, cached_network_ssid.data(), &len);
-        if (len != sizeof(WifiSSID) || err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to load network SSID from NVS: %s", esp_err_to_name(err));
+    // Brings an older config up to CONFIG_VERSION. Fields newer than the
+    // stored version already hold their defaults. Returns false if the old
+    // settings couldn't all be read, they must then be kept.
+    static bool migrate(Config& config) {
+        bool ok = true;
+        switch (config.version) {
+            case 0:
+                ok = load_legacy(config);
+                break;
+            default:
+                break;
         }
-        len = sizeof(WifiPassword);
-        err = nvs_get_blob(storage_nvs_handle, NVS_NETWORK_PASS_TAG, cached_network_pass.data(), &len);
-        if (len != sizeof(WifiPassword) || err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to load network password from NVS: %s", esp_err_to_name(err));
-        }
-        static char reading_buf[512] = {0};
-        len = sizeof(reading_buf);
-        err = nvs_get_str(storage_nvs_handle, NVS_SERVER_ADDR_TAG, reading_buf, &len);
-        if (len == 0 || err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to load server address from NVS: %s", esp_err_to_name(err));
-        } else {
-            cached_server_addr = reading_buf;
-        }
-        len = sizeof(reading_buf);
-        err = nvs_get_str(storage_nvs_handle, NVS_SERVER_KEY_TAG, reading_buf, &len);
-        if (len == 0 || err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to load server key from NVS: %s", esp_err_to_name(err));
-        } else {
-            cached_server_key = reading_buf;
-        }
-
-        uint8_t temp_int;
-        err = nvs_get_u8(storage_nvs_handle, NVS_MAX_TEMP_TAG, &temp_int);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to load max temp from NVS: %s", esp_err_to_name(err));
-        } else {
-            cached_max_temp = temp_int;
+        config.version = CONFIG_VERSION;
+
+        if (config.temp_resolution < 9 || config.temp_resolution > 12) {
+            config.temp_resolution = 12;
+        }
+        config.server_addr[sizeof(config.server_addr) - 1] = 0;
+        config.server_key[sizeof(config.server_key) - 1] = 0;
+        return ok;
+    }
+
+    void load_initial_values() {
+        Config config;
+        size_t len = sizeof(config);
+        esp_err_t err = nvs_get_blob(storage_nvs_handle, NVS_CONFIG_TAG, &config, &len);
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            config.version = 0;
+        } else if (err == ESP_ERR_NVS_INVALID_LENGTH) {
+            // Written by newer firmware, keep the fields we know about
+            nvs_get_blob(storage_nvs_handle, NVS_CONFIG_TAG, NULL, &len);
+            uint8_t* raw = (uint8_t*)malloc(len);
+            if (raw != NULL && nvs_get_blob(storage_nvs_handle, NVS_CONFIG_TAG, raw, &len) == ESP_OK) {
+                memcpy(&config, raw, sizeof(config));
+            }
+            free(raw);
+            ESP_LOGW(TAG, "Config version %u is newer than %u", config.version, CONFIG_VERSION);
+            config.version = CONFIG_VERSION;
+        } else if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to load config from NVS: %s", esp_err_to_name(err));
         }
+
+        uint16_t stored_version = config.version;
+        if (stored_version < CONFIG_VERSION) {
+            if (!migrate(config)) {
+                // Nothing is written or erased, the next boot tries again from the same keys
+                ESP_LOGE(TAG, "Couldn't migrate config from version %u, keeping the old settings", stored_version);
+            } else if (write_config(config)) {
+                ESP_LOGI(TAG, "Migrated config from version %u to %u", stored_version, CONFIG_VERSION);
+                if (stored_version == 0) {
+                    for (const char* tag : LEGACY_TAGS) {
+                        nvs_erase_key(storage_nvs_handle, tag);
+                    }
+                    nvs_commit(storage_nvs_handle);
+                }
+            }
+        }
+        active = config;
     }
 
     int init() {
+        config_lock = xSemaphoreCreateMutex();
+        transaction_lock = xSemaphoreCreateRecursiveMutex();
+        if (config_lock == NULL || transaction_lock == NULL) {
+            ESP_LOGE(TAG, "Failed to create config locks");
+            return 1;
+        }
+
         // Initialize NVS
         esp_err_t err = nvs_flash_init();
         if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
@@ -118,119 +219,205 @@ namespace Storage {
         return 0;
     }
 
+    uint32_t get_boot_count() {
+        return boot_count;
+    }
+
+    struct CoredumpProgress {
+        uint32_t image_crc;
+        uint32_t offset;
+    };
+
+    uint32_t get_coredump_progress(uint32_t image_crc) {
+        CoredumpProgress progress;
+        size_t len = sizeof(progress);
+        esp_err_t err = nvs_get_blob(storage_nvs_handle, NVS_COREDUMP_TAG, &progress, &len);
+        if (err != ESP_OK || len != sizeof(progress) || progress.image_crc != image_crc) {
+            return 0;
+        }
+        return progress.offset;
+    }
+
+    bool set_coredump_progress(uint32_t image_crc, uint32_t offset) {
+        CoredumpProgress progress = {.image_crc = image_crc, .offset = offset};
+        esp_err_t err = nvs_set_blob(storage_nvs_handle, NVS_COREDUMP_TAG, &progress, sizeof(progress));
+        if (err == ESP_OK) {
+            err = nvs_commit(storage_nvs_handle);
+        }
+        return err == ESP_OK;
+    }
+
+    uint8_t get_ca_failures() {
+        uint8_t failures = 0;
+        nvs_get_u8(storage_nvs_handle, NVS_CA_FAILURES_TAG, &failures);
+        return failures;
+    }
+
+    bool set_ca_failures(uint8_t failures) {
+        esp_err_t err = nvs_set_u8(storage_nvs_handle, NVS_CA_FAILURES_TAG, failures);
+        if (err == ESP_OK) {
+            err = nvs_commit(storage_nvs_handle);
+        }
+        return err == ESP_OK;
+    }
+
+    bool begin(TickType_t wait) {
+        if (xSemaphoreTakeRecursive(transaction_lock, wait) != pdTRUE) {
+            return false;
+        }
+        if (transaction_depth++ == 0) {
+            xSemaphoreTake(config_lock, portMAX_DELAY);
+            staged = active;
+            xSemaphoreGive(config_lock);
+            transaction_aborted = false;
+        }
+        return true;
+    }
+
+    static bool same_config(const Config& a, const Config& b) {
+        // Field by field, memcmp would also compare the struct's padding
+        return a.version == b.version && a.network_ssid == b.network_ssid && a.network_pass == b.network_pass &&
+               strncmp(a.server_addr, b.server_addr, sizeof(a.server_addr)) == 0 &&
+               strncmp(a.server_key, b.server_key, sizeof(a.server_key)) == 0 && a.max_temp == b.max_temp &&
+               a.temp_resolution == b.temp_resolution && a.max_temp_rise == b.max_temp_rise;
+    }
+
+    static bool end(bool keep) {
+        if (transaction_depth == 0) {
+            // The transaction lock isn't ours to give back
+            ESP_LOGE(TAG, "%s without begin()", keep ? "commit()" : "abort()");
+            return false;
+        }
+        if (!keep) {
+            transaction_aborted = true;
+        }
+        bool ok = !transaction_aborted;
+        if (--transaction_depth == 0 && ok) {
+            // Nothing changed, spare the flash
+            if (!same_config(staged, active)) {
+                ok = write_config(staged);
+            }
+            if (ok) {
+                xSemaphoreTake(config_lock, portMAX_DELAY);
+                active = staged;
+                xSemaphoreGive(config_lock);
+            }
+        }
+        xSemaphoreGiveRecursive(transaction_lock);
+        return ok;
+    }
+
+    bool commit() {
+        return end(true);
+    }
+
+    void abort() {
+        end(false);
+    }
+
+    // Copies one field of the active config
+    template <typename T> static T read(T Config::* field) {
+        xSemaphoreTake(config_lock, portMAX_DELAY);
+        T value = active.*field;
+        xSemaphoreGive(config_lock);
+        return value;
+    }
+
+    static std::string read_string(const char (Config::*field)[128]) {
+        xSemaphoreTake(config_lock, portMAX_DELAY);
+        std::string value = active.*field;
+        xSemaphoreGive(config_lock);
+        return value;
+    }
+
+    // Stages one field, on its own it is a one write transaction
+    template <typename T> static bool write(T Config::* field, const T& value) {
+        if (!begin()) {
+            return false;
+        }
+        staged.*field = value;
+        return commit();
+    }
+
+    static bool write_string(char (Config::*field)[128], const std::string& value) {
+        if (!begin()) {
+            return false;
+        }
+        if (value.size() >= sizeof(staged.*field)) {
+            ESP_LOGE(TAG, "Config string too long (%u bytes)", (unsigned)value.size());
+            abort();
+            return false;
+        }
+        memset(staged.*field, 0, sizeof(staged.*field));
+        memcpy(staged.*field, value.c_str(), value.size());
+        return commit();
+    }
+
     WifiSSID get_network_ssid() {
-        return cached_network_ssid;
+        return read(&Config::network_ssid);
     }
 
     WifiPassword get_network_password() {
-        return cached_network_pass;
+        return read(&Config::network_pass);
     }
 
     std::string get_server() {
-        return cached_server_addr;
-    }
-
-    const char* get_server_certs() {
-        return "-----BEGIN CERTIFICATE-----\n"
-               "MIIFBjCCAu6gAwIBAgIRAMISMktwqbSRcdxA9+KFJjwwDQYJKoZIhvcNAQELBQAw\n"
-               "TzELMAkGA1UEBhMCVVMxKTAnBgNVBAoTIEludGVybmV0IFNlY3VyaXR5IFJlc2Vh\n"
-               "cmNoIEdyb3VwMRUwEwYDVQQDEwxJU1JHIFJvb3QgWDEwHhcNMjQwMzEzMDAwMDAw\n"
-               "WhcNMjcwMzEyMjM1OTU5WjAzMQswCQYDVQQGEwJVUzEWMBQGA1UEChMNTGV0J3Mg\n"
-               "RW5jcnlwdDEMMAoGA1UEAxMDUjEyMIIBIjANBgkqhkiG9w0BAQEFAAOCAQ8AMIIB\n"
-               "CgKCAQEA2pgodK2+lP474B7i5Ut1qywSf+2nAzJ+Npfs6DGPpRONC5kuHs0BUT1M\n"
-               "5ShuCVUxqqUiXXL0LQfCTUA83wEjuXg39RplMjTmhnGdBO+ECFu9AhqZ66YBAJpz\n"
-               "kG2Pogeg0JfT2kVhgTU9FPnEwF9q3AuWGrCf4yrqvSrWmMebcas7dA8827JgvlpL\n"
-               "Thjp2ypzXIlhZZ7+7Tymy05v5J75AEaz/xlNKmOzjmbGGIVwx1Blbzt05UiDDwhY\n"
-               "XS0jnV6j/ujbAKHS9OMZTfLuevYnnuXNnC2i8n+cF63vEzc50bTILEHWhsDp7CH4\n"
-               "WRt/uTp8n1wBnWIEwii9Cq08yhDsGwIDAQABo4H4MIH1MA4GA1UdDwEB/wQEAwIB\n"
-               "hjAdBgNVHSUEFjAUBggrBgEFBQcDAgYIKwYBBQUHAwEwEgYDVR0TAQH/BAgwBgEB\n"
-               "/wIBADAdBgNVHQ4EFgQUALUp8i2ObzHom0yteD763OkM0dIwHwYDVR0jBBgwFoAU\n"
-               "ebRZ5nu25eQBc4AIiMgaWPbpm24wMgYIKwYBBQUHAQEEJjAkMCIGCCsGAQUFBzAC\n"
-               "hhZodHRwOi8veDEuaS5sZW5jci5vcmcvMBMGA1UdIAQMMAowCAYGZ4EMAQIBMCcG\n"
-               "A1UdHwQgMB4wHKAaoBiGFmh0dHA6Ly94MS5jLmxlbmNyLm9yZy8wDQYJKoZIhvcN\n"
-               "AQELBQADggIBAI910AnPanZIZTKS3rVEyIV29BWEjAK/duuz8eL5boSoVpHhkkv3\n"
-               "4eoAeEiPdZLj5EZ7G2ArIK+gzhTlRQ1q4FKGpPPaFBSpqV/xbUb5UlAXQOnkHn3m\n"
-               "FVj+qYv87/WeY+Bm4sN3Ox8BhyaU7UAQ3LeZ7N1X01xxQe4wIAAE3JVLUCiHmZL+\n"
-               "qoCUtgYIFPgcg350QMUIWgxPXNGEncT921ne7nluI02V8pLUmClqXOsCwULw+PVO\n"
-               "ZCB7qOMxxMBoCUeL2Ll4oMpOSr5pJCpLN3tRA2s6P1KLs9TSrVhOk+7LX28NMUlI\n"
-               "usQ/nxLJID0RhAeFtPjyOCOscQBA53+NRjSCak7P4A5jX7ppmkcJECL+S0i3kXVU\n"
-               "y5Me5BbrU8973jZNv/ax6+ZK6TM8jWmimL6of6OrX7ZU6E2WqazzsFrLG3o2kySb\n"
-               "zlhSgJ81Cl4tv3SbYiYXnJExKQvzf83DYotox3f0fwv7xln1A2ZLplCb0O+l/AK0\n"
-               "YE0DS2FPxSAHi0iwMfW2nNHJrXcY3LLHD77gRgje4Eveubi2xxa+Nmk/hmhLdIET\n"
-               "iVDFanoCrMVIpQ59XWHkzdFmoHXHBV7oibVjGSO7ULSQ7MJ1Nz51phuDJSgAIU7A\n"
-               "0zrLnOrAj/dfrlEWRhCvAgbuwLZX1A2sjNjXoPOHbsPiy+lO1KF8/XY7\n"
-               "-----END CERTIFICATE-----\n";
+        return read_string(&Config::server_addr);
     }
 
     std::string get_key() {
 #ifdef DEV_SERVER
         return "07edfd78f2a97d0d2c46c1cb4504fbe343a9bb6ec7f2a64b41d2c7d4f6fcca7f63f78220b70230e3f022e395fe0eb436";
 #else
-        return cached_server_key;
+        return read_string(&Config::server_key);
 #endif
     }
 
     uint8_t get_max_temp() {
-        return cached_max_temp;
+        return read(&Config::max_temp);
+    }
+
+    uint8_t get_temp_resolution() {
+        return read(&Config::temp_resolution);
+    }
+
+    uint8_t get_max_temp_rise() {
+        return read(&Config::max_temp_rise);
     }
 
     bool set_network_ssid(WifiSSID ssid) {
-        esp_err_t err = nvs_set_blob(storage_nvs_handle, NVS_NETWORK_SSID_TAG, ssid.data(), sizeof(ssid));
-        if (err != ESP_OK) {
-            return false;
-        }
-        bool ok = commit();
-        if (ok) {
-            cached_network_ssid = ssid;
-        }
-        return ok;
+        return write(&Config::network_ssid, ssid);
     }
 
     bool set_network_password(WifiPassword password) {
-        esp_err_t err = nvs_set_blob(storage_nvs_handle, NVS_NETWORK_PASS_TAG, password.data(), sizeof(password));
-        if (err != ESP_OK) {
-            return false;
-        }
-        bool ok = commit();
-        if (ok) {
-            cached_network_pass = password;
-        }
-        return ok;
+        return write(&Config::network_pass, password);
     }
 
     bool set_server(std::string server) {
-        esp_err_t err = nvs_set_str(storage_nvs_handle, NVS_SERVER_ADDR_TAG, server.c_str());
-        if (err != ESP_OK) {
-            return false;
-        }
-        bool ok = commit();
-        if (ok) {
-            cached_server_addr = server;
-        }
-        return ok;
+        return write_string(&Config::server_addr, server);
     }
+
     bool set_key(std::string key) {
-        esp_err_t err = nvs_set_str(storage_nvs_handle, NVS_SERVER_KEY_TAG, key.c_str());
-        if (err != ESP_OK) {
-            return false;
-        }
-        bool ok = commit();
-        if (ok) {
-            cached_server_key = key;
-        }
-        return ok;
+        return write_string(&Config::server_key, key);
     }
 
     bool set_max_temp(uint8_t max_temp) {
-        esp_err_t err = nvs_set_u8(storage_nvs_handle, NVS_MAX_TEMP_TAG, max_temp);
-        if (err != ESP_OK) {
+        return write(&Config::max_temp, max_temp);
+    }
+
+    bool set_temp_resolution(uint8_t bits) {
+        if (bits < 9 || bits > 12) {
+            // Fails the whole transaction, not just this field
+            if (begin()) {
+                abort();
+            }
             return false;
         }
-        bool ok = commit();
-        if (ok) {
-            cached_max_temp = max_temp;
-        }
-        return ok;
+        return write(&Config::temp_resolution, bits);
+    }
+
+    bool set_max_temp_rise(uint8_t per_minute) {
+        return write(&Config::max_temp_rise, per_minute);
     }
 
 } // namespace Storage
\ No newline at end of file
@@ -1,24 +1,47 @@
 #include "common/types.hpp"
 #include <cstdint>
+#include <freertos/FreeRTOS.h>
 #include <string>
 
 namespace Storage {
 
     int init();
 
+    uint32_t get_boot_count();
+
+    // Bytes of the coredump with this CRC the server has acknowledged, 0 for
+    // any other dump. Kept apart from the config blob, it changes per chunk.
+    uint32_t get_coredump_progress(uint32_t image_crc);
+    bool set_coredump_progress(uint32_t image_crc, uint32_t offset);
+
+    // TLS handshakes in a row the stored CA bundle failed to verify, see CAStore
+    uint8_t get_ca_failures();
+    bool set_ca_failures(uint8_t failures);
+
     std::string get_key();
     WifiSSID get_network_ssid();
     WifiPassword get_network_password();
     std::string get_server();
-    const char* get_server_certs();
     uint8_t get_max_temp();
+    uint8_t get_temp_resolution(); // DS18B20 bits, 9-12
+    uint8_t get_max_temp_rise();   // C per minute, 0 to disable
 
+    // Setters called between begin() and commit() are staged and written
+    // together in one flash write, a failed setter or abort() drops them all.
+    // Transactions nest, only the outermost commit() writes. Other tasks'
+    // setters wait for the transaction to finish.
+    bool begin(TickType_t wait = portMAX_DELAY);
+    bool commit();
+    void abort();
 
+    // Each is a transaction of its own when called outside begin()/commit()
     bool set_key(std::string key);
     bool set_network_ssid(WifiSSID ssid);
     bool set_network_password(WifiPassword password);
     bool set_server(std::string server);
     bool set_max_temp(uint8_t max_temp);
+    bool set_temp_resolution(uint8_t bits);
+    bool set_max_temp_rise(uint8_t per_minute);
 
     int check_perms(const CardTagID& uid, bool& can_change_state, bool& can_access);
 
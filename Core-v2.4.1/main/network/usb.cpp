@@ -1,34 +1,94 @@
 #include "usb.hpp"
 
+#include <cinttypes>
+#include <cstring>
+
 #include "common/hardware.hpp"
+#include "common/log_ring.hpp"
+#include "common/power.hpp"
+#include "common/queues.hpp"
+#include "console.hpp"
 #include "esp_log.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
-#include "freertos/semphr.h"
 #include "freertos/task.h"
 #include "sdkconfig.h"
 #include "soc/rtc_cntl_reg.h"
 #include "storage.hpp"
 #include "tinyusb.h"
+#include "tusb.h"
 #include "tusb_cdc_acm.h"
 
 #define LOG_CDC_ITF ((tinyusb_cdcacm_itf_t)0)
-#define MAX_DEBUG_SIZE 3072
-#define DEBUG_STREAM_BUF_SIZE (2 * MAX_DEBUG_SIZE)
 
 static const char* TAG = "usb";
 
-static SemaphoreHandle_t stream_buffer_lock;
-static StreamBufferHandle_t debug_stream_buffer;
+// Light sleep stops the USB peripheral, so stay awake while a host is attached.
+// Without VBUS sensing we go by enumeration, suspend and RTS, and give a host
+// USB_HOST_GRACE after boot to show up. Only the usb task touches the lock.
+static Power::Lock usb_power_lock;
+static bool usb_power_held = false;
+static constexpr TickType_t USB_HOST_GRACE = pdMS_TO_TICKS(10 * 1000);
+
+TaskHandle_t usb_thread;
+
+// Console requests, decoded in the RX callback and answered on the usb task
+struct ConsoleRequest {
+    uint16_t len;
+    uint8_t data[Console::MAX_FRAME];
+};
+static Queues::Queue<ConsoleRequest> console_queue;
 
-int write_to_usb_task(const unsigned char* buf, size_t buf_len) {
-    if (!xSemaphoreTake(stream_buffer_lock, pdMS_TO_TICKS(100))) {
-        return -1;
+// Undoes the stuffing of one frame, without its delimiter. Returns the decoded
+// size, or 0 if the frame is malformed or does not fit in max.
+static size_t cobs_decode(const uint8_t* in, size_t len, uint8_t* out, size_t max) {
+    size_t out_len = 0;
+    size_t i = 0;
+    while (i < len) {
+        uint8_t code = in[i++];
+        if (code == 0 || i + code - 1 > len || out_len + code - 1 > max) {
+            return 0;
+        }
+        memcpy(out + out_len, in + i, code - 1);
+        out_len += code - 1;
+        i += code - 1;
+        if (code != 0xFF && i < len) {
+            if (out_len >= max) {
+                return 0;
+            }
+            out[out_len++] = 0;
+        }
     }
+    return out_len;
+}
+
+// Splits the incoming bytes into frames. Anything that is not a frame, like
+// keys typed into a terminal, comes to nothing.
+static void console_receive(const uint8_t* data, size_t len) {
+    static uint8_t frame[Console::MAX_FRAME + Console::MAX_FRAME / 254 + 1];
+    static size_t frame_len = 0;
+    static bool overflow = false;
 
-    size_t written = xStreamBufferSend(debug_stream_buffer, (void*)buf, buf_len, pdMS_TO_TICKS(100));
-    xSemaphoreGive(stream_buffer_lock);
-    return written;
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] != 0) {
+            if (frame_len < sizeof(frame)) {
+                frame[frame_len++] = data[i];
+            } else {
+                overflow = true;
+            }
+            continue;
+        }
+
+        ConsoleRequest request;
+        if (!overflow && frame_len > 0) {
+            request.len = cobs_decode(frame, frame_len, request.data, sizeof(request.data));
+            if (request.len > 0 && console_queue.send(request, 0) && usb_thread != NULL) {
+                xTaskNotifyGive(usb_thread);
+            }
+        }
+        frame_len = 0;
+        overflow = false;
+    }
 }
 
 /**
@@ -48,7 +108,7 @@ void tinyusb_cdc_rx_callback(int itf, cdcacm_event_t* event) {
     esp_err_t ret =
         tinyusb_cdcacm_read(static_cast<tinyusb_cdcacm_itf_t>(itf), rx_buf, CONFIG_TINYUSB_CDC_RX_BUFSIZE, &rx_size);
     if (ret == ESP_OK) {
-        write_to_usb_task(rx_buf, rx_size);
+        console_receive(rx_buf, rx_size);
     } else {
         // Had an error (don't log tho or infinite loop of logging)
     }
@@ -81,48 +141,173 @@ void tinyusb_cdc_line_state_changed_callback(int itf, cdcacm_event_t* event) {
 
     dtr = new_dtr;
     rts = new_rts;
+    if (usb_thread != NULL) {
+        xTaskNotifyGive(usb_thread);
+    }
+}
+
+// TinyUSB device callbacks, run on the tinyusb task. The usb task works out
+// whether to hold the power lock.
+extern "C" void tud_mount_cb(void) {
+    if (usb_thread != NULL) {
+        xTaskNotifyGive(usb_thread);
+    }
+}
+
+extern "C" void tud_umount_cb(void) {
+    if (usb_thread != NULL) {
+        xTaskNotifyGive(usb_thread);
+    }
+}
+
+extern "C" void tud_suspend_cb(bool remote_wakeup_en) {
+    if (usb_thread != NULL) {
+        xTaskNotifyGive(usb_thread);
+    }
+}
+
+extern "C" void tud_resume_cb(void) {
+    if (usb_thread != NULL) {
+        xTaskNotifyGive(usb_thread);
+    }
 }
 
-static unsigned char* mike_buf = nullptr;
+// A host that unplugs without VBUS sensing just looks suspended
+static void update_power_lock(bool in_grace) {
+    bool want = in_grace || rts > 0 || (tud_mounted() && !tud_suspended());
+    if (want == usb_power_held) {
+        return;
+    }
+    usb_power_held = want;
+    if (want) {
+        usb_power_lock.acquire();
+        ESP_LOGI(TAG, "USB host attached, holding off light sleep");
+    } else {
+        usb_power_lock.release();
+        ESP_LOGI(TAG, "No USB host, allowing light sleep");
+    }
+}
 
+// Runs on whichever task logged. With binary logging nothing is formatted here,
+// tools/decode_log.py does that on the host.
 extern "C" int usb_log_vprintf(const char* fmt, va_list args) {
+#ifdef CONFIG_USB_BINARY_LOG
+    return LogRing::vlog(fmt, args);
+#else
+    return LogRing::vtext(fmt, args);
+#endif
+}
 
-    size_t mike_buflen = vsnprintf((char*)mike_buf, MAX_DEBUG_SIZE, fmt, args);
-    mike_buf[mike_buflen] = '\r';
-    mike_buf[mike_buflen + 1] = 0;
+// Consistent overhead byte stuffing, the frame holds no zero bytes so a zero
+// delimits frames and the host can pick the stream up mid way. out needs room
+// for len + len / 254 + 1 bytes.
+static size_t cobs_encode(const uint8_t* in, size_t len, uint8_t* out) {
+    size_t code_at = 0;
+    size_t out_len = 1;
+    uint8_t code = 1;
+    for (size_t i = 0; i < len; i++) {
+        if (in[i] != 0) {
+            out[out_len++] = in[i];
+            code++;
+        }
+        if (in[i] == 0 || code == 0xFF) {
+            out[code_at] = code;
+            code_at = out_len++;
+            code = 1;
+        }
+    }
+    out[code_at] = code;
+    return out_len;
+}
 
-    return write_to_usb_task(mike_buf, mike_buflen + 1);
+// False if the host stopped reading, whatever is left of data is dropped
+static bool usb_write(const uint8_t* data, size_t len) {
+    while (len > 0) {
+        size_t queued = tinyusb_cdcacm_write_queue(LOG_CDC_ITF, data, len);
+        data += queued;
+        len -= queued;
+        if (len > 0 && tinyusb_cdcacm_write_flush(LOG_CDC_ITF, pdMS_TO_TICKS(100)) != ESP_OK) {
+            return false;
+        }
+    }
+    return true;
 }
 
-#define USB_TASK_STACK_SIZE 4000
-TaskHandle_t usb_thread;
+static void send_frame(const uint8_t* record, size_t len) {
+    static_assert(Console::MAX_FRAME == LogRing::MAX_RECORD, "Frames share one buffer");
+    // Leading delimiter ends whatever text came before
+    static uint8_t frame[1 + LogRing::MAX_RECORD + LogRing::MAX_RECORD / 254 + 2] = {0};
+    size_t frame_len = 1 + cobs_encode(record, len, frame + 1);
+    frame[frame_len++] = 0;
+#ifdef CONFIG_USB_BINARY_LOG
+    usb_write(frame + 1, frame_len - 1);
+#else
+    usb_write(frame, frame_len);
+#endif
+}
 
-void usb_thread_fn(void*) {
-    static unsigned char usb_buf[CONFIG_TINYUSB_CDC_RX_BUFSIZE] = {0};
-    while (!rts_ever) {
-        vTaskDelay(pdMS_TO_TICKS(100));
+static void send_record(const uint8_t* record, size_t len) {
+#ifdef CONFIG_USB_BINARY_LOG
+    send_frame(record, len);
+#else
+    switch ((LogRing::RecordType)record[0]) {
+        case LogRing::RecordType::Text:
+            if (usb_write(record + 1, len - 1)) {
+                usb_write((const uint8_t*)"\r", 1);
+            }
+            break;
+        case LogRing::RecordType::Dropped: {
+            uint32_t dropped;
+            memcpy(&dropped, record + 1, sizeof(dropped));
+            char line[40];
+            int line_len = snprintf(line, sizeof(line), "(%" PRIu32 " log lines dropped)\n\r", dropped);
+            usb_write((const uint8_t*)line, line_len);
+            break;
+        }
+        default:
+            break;
     }
+#endif
+}
+
+void usb_thread_fn(void*) {
+    static uint8_t record[LogRing::MAX_RECORD];
+    static ConsoleRequest request;
+    TickType_t started = xTaskGetTickCount();
+    bool in_grace = true;
 
     while (1) {
-        size_t read = xStreamBufferReceive(debug_stream_buffer, (void*)usb_buf, CONFIG_TINYUSB_CDC_RX_BUFSIZE,
-                                           pdMS_TO_TICKS(100));
-        if (read > 0) {
-            tinyusb_cdcacm_write_queue(LOG_CDC_ITF, usb_buf, read);
-            esp_err_t err = tinyusb_cdcacm_write_flush(LOG_CDC_ITF, pdMS_TO_TICKS(100));
-            if (err != ESP_OK) {
-                xStreamBufferReset(debug_stream_buffer);
-            }
+        TickType_t since_start = xTaskGetTickCount() - started;
+        if (in_grace && (rts_ever || since_start >= USB_HOST_GRACE)) {
+            in_grace = false;
         }
+        update_power_lock(in_grace);
+        if (!rts_ever) {
+            ulTaskNotifyTake(pdTRUE, in_grace ? USB_HOST_GRACE - since_start : portMAX_DELAY);
+            continue;
+        }
+
+        if (console_queue.receive(request, 0)) {
+            Console::handle(request.data, request.len, send_frame);
+            continue;
+        }
+
+        size_t len = LogRing::read(record, sizeof(record));
+        if (len > 0) {
+            send_record(record, len);
+            continue;
+        }
+        tinyusb_cdcacm_write_flush(LOG_CDC_ITF, pdMS_TO_TICKS(100));
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
     }
 }
 
 esp_err_t USB::init() {
-    stream_buffer_lock = xSemaphoreCreateMutex();
-    debug_stream_buffer = xStreamBufferCreate(DEBUG_STREAM_BUF_SIZE, 32);
-    mike_buf = (unsigned char*)malloc(MAX_DEBUG_SIZE);
-
-    assert(stream_buffer_lock);
-    assert(debug_stream_buffer);
+    usb_power_lock.create("usb");
+    usb_power_lock.acquire();
+    usb_power_held = true;
+    console_queue.create("console", 2);
+    assert(console_queue.valid());
     esp_log_set_vprintf(usb_log_vprintf);
 
     ESP_LOGI(TAG, "USB initialization begin");
@@ -165,6 +350,8 @@ esp_err_t USB::init() {
     ESP_LOGI(TAG, "USB initialization DONE");
 
     xTaskCreate(usb_thread_fn, "usb", CONFIG_USB_TASK_STACK_SIZE, NULL, 0, &usb_thread);
+    // Anything logged until now is already waiting in the rings
+    LogRing::init(usb_thread);
 
     return 0;
 }
@@ -1,20 +1,29 @@
 #include "wsacs.hpp"
-#include "io/BuzzerSounds.hpp"
 
 #include "cJSON.h"
+#include "common/audit_log.hpp"
 #include "common/hardware.hpp"
+#include "common/power.hpp"
+#include "common/queues.hpp"
+#include "common/task_stats.hpp"
+#include "common/timer_wheel.hpp"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_websocket_client.h"
+#include "io/AnimationPack.hpp"
+#include "io/Audio.hpp"
 #include "io/Buzzer.hpp"
 #include "io/IO.hpp"
+#include "io/OneWire.hpp"
+#include "io/SongLibrary.hpp"
 #include "io/Temperature.hpp"
+#include "ca_store.hpp"
 #include "network.hpp"
 #include "network/network.hpp"
 #include "storage.hpp"
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
 #include <freertos/task.h>
-#include <freertos/timers.h>
 #include "ota.hpp"
 
 static const char* TAG = "wsacs";
@@ -22,12 +31,15 @@ static const char* TAG = "wsacs";
 esp_websocket_client_handle_t ws_handle = NULL;
 esp_websocket_client_config_t cfg{};
 static bool has_sent_opening_msg = false;
-SoundEffect::Effect network_song = {.length = 0, .notes = NULL};
 
 namespace WSACS {
     static bool received_first_message = false;
     static bool already_got_state_from_server_for_this_boot = false;
 
+    // From try_connect() to the websocket opening, TLS handshake included
+    static int64_t connect_started_us = 0;
+    static uint32_t last_connect_ms = 0;
+
     uint64_t seqnum = 0;
     uint64_t get_next_seqnum() {
         uint64_t i = seqnum;
@@ -70,6 +82,9 @@ namespace WSACS {
         ESP_LOGI(TAG, "Handling auth response: %s - %d: %s - %s", auth, verified,
                  io_state_to_string(outstanding_tostate), error ? error : "no error");
         Network::mark_wsacs_request_complete();
+        if (requester.has_value()) {
+            AuditLog::record_auth(requester.value(), outstanding_tostate, verified);
+        }
         if (verified) {
             IO::send_event({
                 .type = IOEventType::NETWORK_COMMAND,
@@ -92,42 +107,75 @@ namespace WSACS {
         }
     }
 
-    void handle_song_request(cJSON* song) {
-        if (!cJSON_HasObjectItem(song, "Notes")) {
-            ESP_LOGW(TAG, "Song request had incorrect keys");
+    // PlaySong is an id, {"Id": id, "Hash": hash} to insist on a version, or true for song 0
+    void handle_play_song_request(const cJSON* request) {
+        uint16_t id = 0;
+        uint32_t hash = 0;
+        if (cJSON_IsNumber(request)) {
+            id = (uint16_t)cJSON_GetNumberValue(request);
+        } else if (cJSON_IsObject(request)) {
+            const cJSON* id_obj = cJSON_GetObjectItem(request, "Id");
+            const cJSON* hash_obj = cJSON_GetObjectItem(request, "Hash");
+            if (!cJSON_IsNumber(id_obj)) {
+                ESP_LOGW(TAG, "PlaySong needs an Id");
+                return;
+            }
+            id = (uint16_t)cJSON_GetNumberValue(id_obj);
+            if (cJSON_IsNumber(hash_obj)) {
+                hash = (uint32_t)cJSON_GetNumberValue(hash_obj);
+            }
+        } else if (!cJSON_IsTrue(request)) {
             return;
         }
-        cJSON* notes_obj = cJSON_GetObjectItem(song, "Notes");
-        if (!(notes_obj->type & cJSON_Array)) {
-            ESP_LOGW(TAG, "Wrong type for song notes");
+
+        if (!SongLibrary::play(id, hash)) {
+            ESP_LOGI(TAG, "Don't have song %u, asking for it", id);
+            Network::send_event({.type = NetworkEventType::SongMissing, .song_id = id});
+        }
+    }
+
+    // {"Id": slot, "Path": "/path/on/server.wav"}, no Path removes the clip
+    void handle_audio_clip_request(const cJSON* request) {
+        const cJSON* id_obj = cJSON_GetObjectItem(request, "Id");
+        if (!cJSON_IsNumber(id_obj) || cJSON_GetNumberValue(id_obj) < 0 || cJSON_GetNumberValue(id_obj) > UINT8_MAX) {
+            ESP_LOGW(TAG, "AudioClip needs an Id");
             return;
         }
-        size_t length = cJSON_GetArraySize(notes_obj);
-        SoundEffect::Note* notes = new SoundEffect::Note[length];
+        Audio::install((uint8_t)cJSON_GetNumberValue(id_obj),
+                       cJSON_GetStringValue(cJSON_GetObjectItem(request, "Path")));
+    }
 
-        cJSON* notedef = NULL;
-        size_t i = 0;
-        cJSON_ArrayForEach(notedef, notes_obj) {
-            if (cJSON_GetArraySize(notedef) != 2) {
-                ESP_LOGW(TAG, "Wrong number of items in array");
-                delete[] notes;
-                return;
-            }
-            cJSON* freq_obj = cJSON_GetArrayItem(notedef, 0);
-            cJSON* len_obj = cJSON_GetArrayItem(notedef, 1);
-            notes[i] = SoundEffect::Note{
-                .frequency = (uint32_t)cJSON_GetNumberValue(freq_obj),
-                .duration = (uint16_t)cJSON_GetNumberValue(len_obj),
-            };
-            i++;
+    static bool config_u8(const cJSON* request, const char* name, bool (*set)(uint8_t)) {
+        const cJSON* item = cJSON_GetObjectItem(request, name);
+        if (item == NULL) {
+            return true;
         }
+        if (!cJSON_IsNumber(item) || cJSON_GetNumberValue(item) < 0 || cJSON_GetNumberValue(item) > UINT8_MAX) {
+            ESP_LOGW(TAG, "Config %s must be 0-255", name);
+            return false;
+        }
+        return set((uint8_t)cJSON_GetNumberValue(item));
+    }
 
-        network_song.length = length;
-        if (network_song.notes != NULL) {
-            delete[] network_song.notes;
+    // {"MaxTemp": c, "TempResolution": bits, "MaxTempRise": c_per_minute}, any of them,
+    // applied all or nothing. The temperature task picks them up on its next sample.
+    void handle_config_request(const cJSON* request) {
+        if (!cJSON_IsObject(request) || !Storage::begin(pdMS_TO_TICKS(1000))) {
+            ESP_LOGW(TAG, "Couldn't apply config from server");
+            return;
         }
-        network_song.notes = notes;
-        ESP_LOGI(TAG, "Parsed song of %u notes", network_song.length);
+        if (!config_u8(request, "MaxTemp", Storage::set_max_temp) ||
+            !config_u8(request, "TempResolution", Storage::set_temp_resolution) ||
+            !config_u8(request, "MaxTempRise", Storage::set_max_temp_rise)) {
+            Storage::abort();
+            ESP_LOGW(TAG, "Rejected config from server");
+            return;
+        }
+        if (!Storage::commit()) {
+            ESP_LOGE(TAG, "Couldn't store config from server");
+            return;
+        }
+        ESP_LOGI(TAG, "Config changed by server");
     }
 
     void handle_incoming_ws_text(const char* data, size_t len) {
@@ -174,12 +222,23 @@ namespace WSACS {
             });
         }
         if (cJSON_HasObjectItem(obj, "Song")) {
-            handle_song_request(cJSON_GetObjectItem(obj, "Song"));
+            SongLibrary::store(cJSON_GetObjectItem(obj, "Song"));
         }
         if (cJSON_HasObjectItem(obj, "PlaySong")) {
-            if (cJSON_IsTrue(cJSON_GetObjectItem(obj, "PlaySong"))) {
-                Buzzer::send_effect(network_song);
-            }
+            handle_play_song_request(cJSON_GetObjectItem(obj, "PlaySong"));
+        }
+        if (cJSON_HasObjectItem(obj, "AudioClip")) {
+            handle_audio_clip_request(cJSON_GetObjectItem(obj, "AudioClip"));
+        }
+        if (cJSON_HasObjectItem(obj, "CABundle")) {
+            bool installed = CAStore::install(cJSON_GetStringValue(cJSON_GetObjectItem(obj, "CABundle")));
+            Network::send_event({.type = NetworkEventType::CABundleResult, .ca_bundle_installed = installed});
+        }
+        if (cJSON_HasObjectItem(obj, "Config")) {
+            handle_config_request(cJSON_GetObjectItem(obj, "Config"));
+        }
+        if (cJSON_HasObjectItem(obj, "AnimationPack")) {
+            AnimationPack::install(cJSON_GetObjectItem(obj, "AnimationPack"));
         }
         if (cJSON_HasObjectItem(obj, "OTATag")) {
             cJSON* ota_ver = cJSON_GetObjectItem(obj, "OTATag");
@@ -232,6 +291,85 @@ namespace WSACS {
                 return false;
         }
     }
+    void add_queue_stats(cJSON* msg) {
+        Queues::Stats stats[Queues::MAX_QUEUES];
+        size_t count = Queues::get_stats(stats, Queues::MAX_QUEUES);
+
+        cJSON* queues = cJSON_AddArrayToObject(msg, "Queues");
+        for (size_t i = 0; i < count; i++) {
+            cJSON* q = cJSON_CreateObject();
+            cJSON_AddStringToObject(q, "Name", stats[i].name);
+            cJSON_AddNumberToObject(q, "Capacity", (double)stats[i].capacity);
+            cJSON_AddNumberToObject(q, "HighWater", (double)stats[i].high_water);
+            cJSON_AddNumberToObject(q, "Timeouts", (double)stats[i].timeouts);
+            cJSON_AddNumberToObject(q, "Drops", (double)stats[i].drops);
+            cJSON_AddNumberToObject(q, "FullProbes", (double)stats[i].full_probes);
+            cJSON_AddNumberToObject(q, "LatencyAvgMs", (double)stats[i].latency_avg_ms);
+            cJSON_AddNumberToObject(q, "LatencyMaxMs", (double)stats[i].latency_max_ms);
+            cJSON_AddItemToArray(queues, q);
+        }
+    }
+
+    void send_task_stats() {
+        // CPU share over the report period, console Stats commands in between don't shorten it
+        static TaskStats::Window window;
+        static TaskStats::TaskInfo tasks[TaskStats::MAX_TASKS];
+        size_t count = TaskStats::collect(window, tasks, TaskStats::MAX_TASKS);
+        if (count == 0) {
+            return;
+        }
+
+        cJSON* msg = cJSON_CreateObject();
+        cJSON* list = cJSON_AddArrayToObject(msg, "TaskStats");
+        for (size_t i = 0; i < count; i++) {
+            cJSON* t = cJSON_CreateObject();
+            cJSON_AddStringToObject(t, "Name", tasks[i].name);
+            cJSON_AddNumberToObject(t, "Priority", (double)tasks[i].priority);
+            cJSON_AddNumberToObject(t, "CPU", tasks[i].cpu_permille / 10.0);
+            cJSON_AddNumberToObject(t, "StackFree", (double)tasks[i].stack_free);
+            cJSON_AddNumberToObject(t, "Heap", (double)tasks[i].heap_bytes);
+            cJSON_AddItemToArray(list, t);
+        }
+        send_cjson(msg);
+        cJSON_Delete(msg);
+    }
+
+    void add_sensor_stats(cJSON* msg) {
+        static Temperature::SensorStats sensors[Temperature::MAX_ONEWIRE_DEVICES];
+        size_t count = Temperature::get_sensor_stats(sensors, Temperature::MAX_ONEWIRE_DEVICES);
+        cJSON* arr = cJSON_AddArrayToObject(msg, "Sensors");
+        for (size_t i = 0; i < count; i++) {
+            char address[17];
+            snprintf(address, sizeof(address), "%016llX", (unsigned long long)sensors[i].address);
+            cJSON* sensor = cJSON_CreateObject();
+            cJSON_AddStringToObject(sensor, "Address", address);
+            cJSON_AddNumberToObject(sensor, "Samples", sensors[i].samples);
+            if (sensors[i].samples > 0) {
+                cJSON_AddNumberToObject(sensor, "Min", (double)sensors[i].min);
+                cJSON_AddNumberToObject(sensor, "Max", (double)sensors[i].max);
+                cJSON_AddNumberToObject(sensor, "Avg", (double)sensors[i].average);
+                cJSON_AddNumberToObject(sensor, "SlopePerMin", (double)sensors[i].slope_per_min);
+            }
+            cJSON_AddItemToArray(arr, sensor);
+        }
+    }
+
+    void add_onewire_stats(cJSON* msg) {
+        static OneWire::DeviceStats devices[OneWire::MAX_DEVICES];
+        size_t count = OneWire::get_stats(devices, OneWire::MAX_DEVICES);
+        cJSON* arr = cJSON_AddArrayToObject(msg, "OneWire");
+        for (size_t i = 0; i < count; i++) {
+            char address[17];
+            snprintf(address, sizeof(address), "%016llX", (unsigned long long)devices[i].address);
+            cJSON* device = cJSON_CreateObject();
+            cJSON_AddStringToObject(device, "Address", address);
+            cJSON_AddNumberToObject(device, "Transactions", (double)devices[i].transactions);
+            cJSON_AddNumberToObject(device, "CrcErrors", (double)devices[i].crc_errors);
+            cJSON_AddNumberToObject(device, "Failures", (double)devices[i].failures);
+            cJSON_AddItemToArray(arr, device);
+        }
+    }
+
     void send_status_message() {
         cJSON* msg = NULL;
         if (ws_handle == NULL) {
@@ -240,11 +378,15 @@ namespace WSACS {
             return;
         }
 
-        IOState state = IOState::IDLE;
-        if (!IO::get_state(state)) {
-            ESP_LOGE(TAG, "Couldn't get state for status message");
-            return;
+        // State, prior request and transition time come from one seqlock
+        // read, so they always describe the same moment
+        IO::StateSnapshot snapshot;
+        bool have_snapshot = IO::get_snapshot(snapshot);
+        if (!have_snapshot) {
+            // Writers kept racing us, the state word alone is still exact
+            IO::get_state(snapshot.state);
         }
+        IOState state = snapshot.state;
         if (is_serverable_state(state)) {
             last_valid_state = state;
         }
@@ -255,12 +397,43 @@ namespace WSACS {
 
         cJSON_AddStringToObject(msg, "State", io_state_to_string(last_valid_state));
         cJSON_AddNumberToObject(msg, "Temp", (double)temp);
+        if (have_snapshot) {
+            cJSON_AddStringToObject(msg, "PriorState", io_state_to_string(snapshot.prior_request_state));
+            cJSON_AddNumberToObject(msg, "StateAgeMs",
+                                    (double)pdTICKS_TO_MS(xTaskGetTickCount() - snapshot.last_transition));
+        }
+        add_sensor_stats(msg);
+        add_onewire_stats(msg);
+        IO::StateStats state_stats = IO::get_state_stats();
+        cJSON_AddNumberToObject(msg, "StateRetries", (double)state_stats.read_retries);
+        cJSON_AddNumberToObject(msg, "StateTimeouts", (double)state_stats.read_timeouts);
+        add_queue_stats(msg);
+        Buzzer::Stats buzzer_stats = Buzzer::get_stats();
+        cJSON_AddNumberToObject(msg, "BuzzerJitterAvgUs", (double)buzzer_stats.jitter_avg_us);
+        cJSON_AddNumberToObject(msg, "BuzzerJitterMaxUs", (double)buzzer_stats.jitter_max_us);
+        cJSON_AddNumberToObject(msg, "AudioUnderruns", (double)Audio::get_stats().underruns);
+        TimerWheel::Stats timer_stats = TimerWheel::get_stats();
+        cJSON_AddNumberToObject(msg, "TimerLateMaxMs", (double)timer_stats.late_max_ms);
+        cJSON_AddNumberToObject(msg, "TimerRetries", (double)timer_stats.post_retries);
+        Power::Estimate power;
+        if (Power::estimate(power)) {
+            cJSON_AddNumberToObject(msg, "IdlePermille", (double)power.idle_permille);
+            cJSON_AddNumberToObject(msg, "EstCurrentUa", (double)power.sleep_ua);
+        }
         if (OTA::next_app_version()!=""){
             cJSON_AddStringToObject(msg, "FEVer", OTA::next_app_version().c_str());
         }
         send_cjson(msg);
 
         cJSON_Delete(msg);
+
+        static TickType_t last_task_stats = 0;
+        TickType_t now = xTaskGetTickCount();
+        if (CONFIG_TASK_STATS_REPORT_PERIOD > 0 &&
+            now - last_task_stats >= pdMS_TO_TICKS(CONFIG_TASK_STATS_REPORT_PERIOD * 1000)) {
+            last_task_stats = now;
+            send_task_stats();
+        }
     }
 
     void send_opening_message() {
@@ -286,6 +459,16 @@ namespace WSACS {
         cJSON_AddStringToObject(msg, "FEVer", OTA::next_app_version().c_str());
         cJSON_AddStringToObject(msg, "FWVersion", OTA::running_app_version().c_str());
 
+        // Connection setup cost, to compare CA bundles in the field
+        CAStore::Stats ca = CAStore::get_stats();
+        cJSON* ca_obj = cJSON_AddObjectToObject(msg, "CAStore");
+        cJSON_AddNumberToObject(ca_obj, "Certs", ca.certs);
+        cJSON_AddNumberToObject(ca_obj, "HeapBytes", ca.heap_bytes);
+        cJSON_AddNumberToObject(ca_obj, "ParseUs", ca.parse_us);
+        cJSON_AddBoolToObject(ca_obj, "FromFlash", ca.from_flash);
+        cJSON_AddBoolToObject(ca_obj, "FellBack", ca.fell_back);
+        cJSON_AddNumberToObject(msg, "ConnectMs", last_connect_ms);
+
         cJSON* req_arr = cJSON_AddArrayToObject(msg, "Request");
         cJSON* req0 = cJSON_CreateString("Time");
         cJSON_AddItemToArray(req_arr, req0);
@@ -298,14 +481,42 @@ namespace WSACS {
             cJSON_AddItemToArray(req_arr, req2);
         }
 
+        // So the server knows which songs it still has to upload
+        SongLibrary::Entry songs[SongLibrary::MAX_SLOTS];
+        size_t song_count = SongLibrary::list(songs, SongLibrary::MAX_SLOTS);
+        cJSON* songs_arr = cJSON_AddArrayToObject(msg, "Songs");
+        for (size_t i = 0; i < song_count; i++) {
+            cJSON* song = cJSON_CreateObject();
+            cJSON_AddNumberToObject(song, "Id", songs[i].id);
+            cJSON_AddNumberToObject(song, "Hash", songs[i].hash);
+            cJSON_AddItemToArray(songs_arr, song);
+        }
+        Audio::ClipInfo clips[Audio::MAX_CLIPS];
+        size_t clip_count = Audio::list(clips, Audio::MAX_CLIPS);
+        cJSON* clips_arr = cJSON_AddArrayToObject(msg, "Clips");
+        for (size_t i = 0; i < clip_count; i++) {
+            cJSON* clip = cJSON_CreateObject();
+            cJSON_AddNumberToObject(clip, "Id", clips[i].id);
+            cJSON_AddNumberToObject(clip, "Hash", clips[i].hash);
+            cJSON_AddItemToArray(clips_arr, clip);
+        }
+
         send_cjson(msg);
         cJSON_Delete(msg);
     }
 
-    esp_err_t send_message(char* msg) {
-        cJSON* obj = cJSON_CreateObject();
-        cJSON_AddStringToObject(obj, "Message", msg);
-        return send_cjson(obj);
+    void send_song_missing(uint16_t id) {
+        cJSON* msg = cJSON_CreateObject();
+        cJSON_AddNumberToObject(msg, "SongMissing", id);
+        send_cjson(msg);
+        cJSON_Delete(msg);
+    }
+
+    void send_ca_bundle_result(bool installed) {
+        cJSON* msg = cJSON_CreateObject();
+        cJSON_AddBoolToObject(msg, "CABundleInstalled", installed);
+        send_cjson(msg);
+        cJSON_Delete(msg);
     }
 
     void send_auth_request(const AuthRequest& request) {
@@ -330,6 +541,11 @@ namespace WSACS {
             case WEBSOCKET_EVENT_BEGIN:
                 break;
             case WEBSOCKET_EVENT_CONNECTED:
+                last_connect_ms = (uint32_t)((esp_timer_get_time() - connect_started_us) / 1000);
+                ESP_LOGI(TAG, "Connected in %u ms", (unsigned)last_connect_ms);
+#ifndef DEV_SERVER
+                CAStore::on_handshake(0);
+#endif
                 Network::send_internal_event(Network::InternalEventType::ServerUp);
                 break;
             case WEBSOCKET_EVENT_DISCONNECTED:
@@ -366,6 +582,9 @@ namespace WSACS {
                     ESP_LOGE(TAG, "reported from tls stack: %d", data->error_handle.esp_tls_stack_err);
                     ESP_LOGE(TAG, "captured as transport's socket errno: %d",
                              data->error_handle.esp_transport_sock_errno);
+#ifndef DEV_SERVER
+                    CAStore::on_handshake(data->error_handle.esp_tls_stack_err);
+#endif
                 }
                 Network::send_internal_event(Network::InternalEventType::ServerDown);
                 break;
@@ -376,6 +595,7 @@ namespace WSACS {
     }
 
     esp_err_t try_connect() {
+        connect_started_us = esp_timer_get_time();
         seqnum = 0;
         received_first_message = false;
         if (esp_websocket_client_is_connected(ws_handle)) {
@@ -401,8 +621,7 @@ namespace WSACS {
         std::string server_url = Storage::get_server();
         std::string websocket_url = "wss://" + server_url + "/api/ws";
         cfg.uri = websocket_url.c_str();
-        cfg.cert_pem = Storage::get_server_certs();
-        cfg.cert_len = 0; // use strlen
+        cfg.use_global_ca_store = true; // parsed once by CAStore
 #endif
         cfg.network_timeout_ms = 10000;
         cfg.reconnect_timeout_ms = 3000;
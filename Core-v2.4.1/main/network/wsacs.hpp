@@ -8,9 +8,10 @@ namespace WSACS {
     void send_opening_message();
     void send_status_message();
 
-    esp_err_t send_message(char*);
     esp_err_t send_cjson(cJSON*);
     void send_auth_request(const AuthRequest&);
+    void send_song_missing(uint16_t id);
+    void send_ca_bundle_result(bool installed);
 
     esp_err_t init();
 
@@ -0,0 +1,508 @@
+#include "driver/gpio.h"
+#include "driver/ledc.h"
+#include "esp_timer.h"
+#include "esp_websocket_client.h"
+#include "esp_wifi.h"
+#include "led_strip.h"
+#include "nvs_flash.h"
+#include "sim_hooks.hpp"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <string.h>
+
+/************************************************
+ * GPIO
+ ***********************************************/
+
+static std::array<int, GPIO_NUM_MAX> gpio_levels = {0};
+
+esp_err_t gpio_config(const gpio_config_t*) {
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level) {
+    if (gpio_num < 0 || gpio_num >= GPIO_NUM_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    gpio_levels[gpio_num] = level;
+    return ESP_OK;
+}
+
+int gpio_get_level(gpio_num_t gpio_num) {
+    if (gpio_num < 0 || gpio_num >= GPIO_NUM_MAX) {
+        return 0;
+    }
+    return gpio_levels[gpio_num];
+}
+
+esp_err_t gpio_set_direction(gpio_num_t, gpio_mode_t) {
+    return ESP_OK;
+}
+
+esp_err_t gpio_input_enable(gpio_num_t) {
+    return ESP_OK;
+}
+
+int Sim::gpio_level(int pin) {
+    return gpio_get_level((gpio_num_t)pin);
+}
+
+/************************************************
+ * LEDC (buzzer)
+ ***********************************************/
+
+static uint32_t ledc_duty = 0;
+static uint32_t ledc_freq = 0;
+
+esp_err_t ledc_timer_config(const ledc_timer_config_t* timer_conf) {
+    ledc_freq = timer_conf->freq_hz;
+    return ESP_OK;
+}
+
+esp_err_t ledc_channel_config(const ledc_channel_config_t* ledc_conf) {
+    ledc_duty = ledc_conf->duty;
+    return ESP_OK;
+}
+
+esp_err_t ledc_set_duty(ledc_mode_t, ledc_channel_t, uint32_t duty) {
+    ledc_duty = duty;
+    return ESP_OK;
+}
+
+esp_err_t ledc_update_duty(ledc_mode_t, ledc_channel_t) {
+    return ESP_OK;
+}
+
+esp_err_t ledc_set_freq(ledc_mode_t, ledc_timer_t, uint32_t freq_hz) {
+    ledc_freq = freq_hz;
+    return ESP_OK;
+}
+
+esp_err_t ledc_stop(ledc_mode_t, ledc_channel_t, uint32_t) {
+    ledc_duty = 0;
+    return ESP_OK;
+}
+
+uint32_t Sim::buzzer_frequency() {
+    return ledc_duty == 0 ? 0 : ledc_freq;
+}
+
+/************************************************
+ * esp_timer, callbacks are dispatched from one task like the real esp_timer task
+ ***********************************************/
+
+// ESP_TASK_TIMER_PRIO on target, above every firmware task
+static constexpr UBaseType_t TIMER_TASK_PRIORITY = 22;
+
+struct fake_esp_timer {
+    esp_timer_create_args_t args;
+    bool armed;
+    Sim::Clock::time_point deadline;
+};
+
+static const Sim::Clock::time_point timer_epoch = Sim::Clock::now();
+static std::mutex timers_lock;
+static std::vector<esp_timer_handle_t> timers;
+static TaskHandle_t timer_task = NULL;
+
+static void fake_timer_task(void*) {
+    while (true) {
+        esp_timer_handle_t due = NULL;
+        TickType_t wait = portMAX_DELAY;
+        {
+            std::lock_guard<std::mutex> guard(timers_lock);
+            Sim::Clock::time_point now = Sim::Clock::now();
+            for (esp_timer_handle_t timer : timers) {
+                if (!timer->armed) {
+                    continue;
+                }
+                if (timer->deadline <= now) {
+                    timer->armed = false;
+                    due = timer;
+                    break;
+                }
+                // Round up so we never wake before the deadline
+                auto left = std::chrono::ceil<std::chrono::milliseconds>(timer->deadline - now).count();
+                wait = std::min<TickType_t>(wait, pdMS_TO_TICKS(left));
+            }
+        }
+        if (due != NULL) {
+            due->args.callback(due->args.arg);
+            continue;
+        }
+        ulTaskNotifyTake(pdTRUE, wait);
+    }
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* create_args, esp_timer_handle_t* out_handle) {
+    esp_timer_handle_t timer = new fake_esp_timer{.args = *create_args, .armed = false};
+    {
+        std::lock_guard<std::mutex> guard(timers_lock);
+        timers.push_back(timer);
+    }
+    if (timer_task == NULL) {
+        xTaskCreate(fake_timer_task, "esp_timer", 16384, NULL, TIMER_TASK_PRIORITY, &timer_task);
+    }
+    *out_handle = timer;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+    {
+        std::lock_guard<std::mutex> guard(timers_lock);
+        if (timer->armed) {
+            return ESP_ERR_INVALID_STATE;
+        }
+        timer->armed = true;
+        timer->deadline = Sim::Clock::now() + std::chrono::microseconds(timeout_us);
+    }
+    xTaskNotifyGive(timer_task);
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+    std::lock_guard<std::mutex> guard(timers_lock);
+    if (!timer->armed) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->armed = false;
+    return ESP_OK;
+}
+
+int64_t esp_timer_get_time(void) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(Sim::Clock::now() - timer_epoch).count();
+}
+
+/************************************************
+ * LED strip
+ ***********************************************/
+
+struct fake_led_strip_t {
+    std::array<Sim::Pixel, 4> pending;
+    std::array<Sim::Pixel, 4> shown;
+    uint32_t refreshes;
+};
+
+static fake_led_strip_t fake_strip = {};
+static std::mutex strip_lock;
+
+esp_err_t led_strip_new_rmt_device(const led_strip_config_t*, const led_strip_rmt_config_t*,
+                                   led_strip_handle_t* ret_strip) {
+    *ret_strip = &fake_strip;
+    return ESP_OK;
+}
+
+esp_err_t led_strip_set_pixel(led_strip_handle_t strip, uint32_t index, uint32_t red, uint32_t green, uint32_t blue) {
+    if (index >= strip->pending.size()) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    std::lock_guard<std::mutex> guard(strip_lock);
+    strip->pending[index] = {(uint8_t)red, (uint8_t)green, (uint8_t)blue};
+    return ESP_OK;
+}
+
+esp_err_t led_strip_refresh(led_strip_handle_t strip) {
+    std::lock_guard<std::mutex> guard(strip_lock);
+    strip->shown = strip->pending;
+    strip->refreshes++;
+    return ESP_OK;
+}
+
+// Like the real WS2812s, the last refresh stays lit after the strip is released
+esp_err_t led_strip_del(led_strip_handle_t) {
+    return ESP_OK;
+}
+
+std::array<Sim::Pixel, 4> Sim::led_pixels() {
+    std::lock_guard<std::mutex> guard(strip_lock);
+    return fake_strip.shown;
+}
+
+uint32_t Sim::led_refresh_count() {
+    std::lock_guard<std::mutex> guard(strip_lock);
+    return fake_strip.refreshes;
+}
+
+/************************************************
+ * WiFi, netif and the default event loop
+ * Connecting always succeeds immediately
+ ***********************************************/
+
+esp_event_base_t const WIFI_EVENT = "WIFI_EVENT";
+esp_event_base_t const IP_EVENT = "IP_EVENT";
+
+struct EventHandler {
+    esp_event_base_t base;
+    int32_t id;
+    esp_event_handler_t handler;
+    void* arg;
+};
+static std::vector<EventHandler> event_handlers;
+
+static void dispatch_event(esp_event_base_t base, int32_t id, void* data) {
+    for (const EventHandler& h : event_handlers) {
+        if (h.base == base && (h.id == ESP_EVENT_ANY_ID || h.id == id)) {
+            h.handler(h.arg, base, id, data);
+        }
+    }
+}
+
+esp_err_t esp_netif_init(void) {
+    return ESP_OK;
+}
+
+void* esp_netif_create_default_wifi_sta(void) {
+    return NULL;
+}
+
+esp_err_t esp_event_loop_create_default(void) {
+    return ESP_OK;
+}
+
+esp_err_t esp_event_handler_instance_register(esp_event_base_t event_base, int32_t event_id,
+                                              esp_event_handler_t event_handler, void* event_handler_arg,
+                                              esp_event_handler_instance_t* instance) {
+    event_handlers.push_back({event_base, event_id, event_handler, event_handler_arg});
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_init(const wifi_init_config_t*) {
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_mode(wifi_mode_t) {
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_config(wifi_interface_t, wifi_config_t*) {
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_start(void) {
+    dispatch_event(WIFI_EVENT, WIFI_EVENT_STA_START, NULL);
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_connect(void) {
+    ip_event_got_ip_t got_ip = {};
+    got_ip.ip_info.ip.addr = 0x0100007f; // 127.0.0.1
+    dispatch_event(IP_EVENT, IP_EVENT_STA_GOT_IP, &got_ip);
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_ps(wifi_ps_type_t) {
+    return ESP_OK;
+}
+
+esp_reset_reason_t esp_reset_reason(void) {
+    return ESP_RST_POWERON;
+}
+
+/************************************************
+ * Websocket client
+ * Events are delivered from a dedicated task like the real client
+ ***********************************************/
+
+struct WSInbound {
+    esp_websocket_event_id_t id;
+    std::string* text; // owned by the receiver, only for WEBSOCKET_EVENT_DATA
+};
+
+struct fake_websocket_client {
+    esp_event_handler_t handler;
+    void* handler_arg;
+    bool connected;
+    QueueHandle_t inbound;
+    TaskHandle_t task;
+};
+
+static fake_websocket_client fake_ws = {};
+static std::mutex sent_lock;
+static std::vector<Sim::SentMessage> sent_messages;
+
+static void fake_ws_task(void*) {
+    while (true) {
+        WSInbound in;
+        if (xQueueReceive(fake_ws.inbound, &in, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        esp_websocket_event_data_t data = {};
+        data.client = &fake_ws;
+        if (in.id == WEBSOCKET_EVENT_DATA) {
+            data.op_code = 0x1;
+            data.data_ptr = in.text->data();
+            data.data_len = in.text->size();
+            data.payload_len = in.text->size();
+            data.fin = true;
+        }
+        if (fake_ws.handler != NULL) {
+            fake_ws.handler(fake_ws.handler_arg, "WEBSOCKET_EVENTS", in.id, &data);
+        }
+        delete in.text;
+    }
+}
+
+esp_websocket_client_handle_t esp_websocket_client_init(const esp_websocket_client_config_t*) {
+    fake_ws.inbound = xQueueCreate(16, sizeof(WSInbound));
+    xTaskCreate(fake_ws_task, "fake_ws", 16384, NULL, 0, &fake_ws.task);
+    return &fake_ws;
+}
+
+esp_err_t esp_websocket_register_events(esp_websocket_client_handle_t client, esp_websocket_event_id_t,
+                                        esp_event_handler_t event_handler, void* event_handler_arg) {
+    client->handler = event_handler;
+    client->handler_arg = event_handler_arg;
+    return ESP_OK;
+}
+
+esp_err_t esp_websocket_client_start(esp_websocket_client_handle_t client) {
+    client->connected = true;
+    WSInbound in = {.id = WEBSOCKET_EVENT_CONNECTED, .text = NULL};
+    xQueueSend(client->inbound, &in, portMAX_DELAY);
+    return ESP_OK;
+}
+
+esp_err_t esp_websocket_client_stop(esp_websocket_client_handle_t client) {
+    client->connected = false;
+    return ESP_OK;
+}
+
+bool esp_websocket_client_is_connected(esp_websocket_client_handle_t client) {
+    return client != NULL && client->connected;
+}
+
+int esp_websocket_client_send_text(esp_websocket_client_handle_t client, const char* data, int len, TickType_t) {
+    if (!client->connected) {
+        return -1;
+    }
+    std::lock_guard<std::mutex> guard(sent_lock);
+    sent_messages.push_back({Sim::Clock::now(), std::string(data, len)});
+    return len;
+}
+
+bool Sim::ws_connected() {
+    return fake_ws.connected;
+}
+
+void Sim::ws_receive_text(const std::string& text) {
+    WSInbound in = {.id = WEBSOCKET_EVENT_DATA, .text = new std::string(text)};
+    xQueueSend(fake_ws.inbound, &in, portMAX_DELAY);
+}
+
+std::vector<Sim::SentMessage> Sim::ws_sent_since(Clock::time_point since) {
+    std::lock_guard<std::mutex> guard(sent_lock);
+    std::vector<SentMessage> out;
+    for (const SentMessage& msg : sent_messages) {
+        if (msg.when >= since) {
+            out.push_back(msg);
+        }
+    }
+    return out;
+}
+
+/************************************************
+ * NVS, kept in memory and empty at boot
+ ***********************************************/
+
+static std::map<std::string, std::vector<uint8_t>> nvs_values;
+static std::mutex nvs_lock;
+
+esp_err_t nvs_flash_init(void) {
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void) {
+    std::lock_guard<std::mutex> guard(nvs_lock);
+    nvs_values.clear();
+    return ESP_OK;
+}
+
+esp_err_t nvs_open(const char*, nvs_open_mode_t, nvs_handle_t* out_handle) {
+    *out_handle = 1;
+    return ESP_OK;
+}
+
+esp_err_t nvs_commit(nvs_handle_t) {
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t, const char* key) {
+    std::lock_guard<std::mutex> guard(nvs_lock);
+    return nvs_values.erase(key) ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+static esp_err_t nvs_set(const char* key, const void* value, size_t length) {
+    std::lock_guard<std::mutex> guard(nvs_lock);
+    const uint8_t* bytes = (const uint8_t*)value;
+    nvs_values[key] = std::vector<uint8_t>(bytes, bytes + length);
+    return ESP_OK;
+}
+
+static esp_err_t nvs_get(const char* key, void* out_value, size_t* length) {
+    std::lock_guard<std::mutex> guard(nvs_lock);
+    auto it = nvs_values.find(key);
+    if (it == nvs_values.end()) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if (out_value == NULL) {
+        *length = it->second.size();
+        return ESP_OK;
+    }
+    if (*length < it->second.size()) {
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+    memcpy(out_value, it->second.data(), it->second.size());
+    *length = it->second.size();
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_u8(nvs_handle_t, const char* key, uint8_t value) {
+    return nvs_set(key, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_u8(nvs_handle_t, const char* key, uint8_t* out_value) {
+    size_t len = sizeof(*out_value);
+    return nvs_get(key, out_value, &len);
+}
+
+esp_err_t nvs_set_i32(nvs_handle_t, const char* key, int32_t value) {
+    return nvs_set(key, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_i32(nvs_handle_t, const char* key, int32_t* out_value) {
+    size_t len = sizeof(*out_value);
+    return nvs_get(key, out_value, &len);
+}
+
+esp_err_t nvs_set_u32(nvs_handle_t, const char* key, uint32_t value) {
+    return nvs_set(key, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_u32(nvs_handle_t, const char* key, uint32_t* out_value) {
+    size_t len = sizeof(*out_value);
+    return nvs_get(key, out_value, &len);
+}
+
+esp_err_t nvs_set_str(nvs_handle_t, const char* key, const char* value) {
+    return nvs_set(key, value, strlen(value) + 1);
+}
+
+esp_err_t nvs_get_str(nvs_handle_t, const char* key, char* out_value, size_t* length) {
+    return nvs_get(key, out_value, length);
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t, const char* key, const void* value, size_t length) {
+    return nvs_set(key, value, length);
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t, const char* key, void* out_value, size_t* length) {
+    return nvs_get(key, out_value, length);
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_event.h"
+#include "freertos/FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fake_websocket_client* esp_websocket_client_handle_t;
+
+typedef enum {
+    WEBSOCKET_EVENT_ANY = -1,
+    WEBSOCKET_EVENT_ERROR = 0,
+    WEBSOCKET_EVENT_CONNECTED,
+    WEBSOCKET_EVENT_DISCONNECTED,
+    WEBSOCKET_EVENT_DATA,
+    WEBSOCKET_EVENT_CLOSED,
+    WEBSOCKET_EVENT_BEFORE_CONNECT,
+    WEBSOCKET_EVENT_BEGIN,
+    WEBSOCKET_EVENT_FINISH,
+} esp_websocket_event_id_t;
+
+typedef enum {
+    WEBSOCKET_ERROR_TYPE_NONE = 0,
+    WEBSOCKET_ERROR_TYPE_TCP_TRANSPORT,
+} esp_websocket_error_type_t;
+
+typedef struct {
+    esp_err_t esp_tls_last_esp_err;
+    int esp_tls_stack_err;
+    int esp_tls_cert_verify_flags;
+    esp_websocket_error_type_t error_type;
+    int esp_ws_handshake_status_code;
+    int esp_transport_sock_errno;
+} esp_websocket_error_codes_t;
+
+typedef struct {
+    const char* data_ptr;
+    int data_len;
+    bool fin;
+    uint8_t op_code;
+    esp_websocket_client_handle_t client;
+    void* user_context;
+    int payload_len;
+    int payload_offset;
+    esp_websocket_error_codes_t error_handle;
+} esp_websocket_event_data_t;
+
+typedef struct {
+    const char* uri;
+    int port;
+    const char* cert_pem;
+    size_t cert_len;
+    bool use_global_ca_store;
+    int network_timeout_ms;
+    int reconnect_timeout_ms;
+} esp_websocket_client_config_t;
+
+esp_websocket_client_handle_t esp_websocket_client_init(const esp_websocket_client_config_t* config);
+esp_err_t esp_websocket_register_events(esp_websocket_client_handle_t client, esp_websocket_event_id_t event,
+                                        esp_event_handler_t event_handler, void* event_handler_arg);
+esp_err_t esp_websocket_client_start(esp_websocket_client_handle_t client);
+esp_err_t esp_websocket_client_stop(esp_websocket_client_handle_t client);
+bool esp_websocket_client_is_connected(esp_websocket_client_handle_t client);
+int esp_websocket_client_send_text(esp_websocket_client_handle_t client, const char* data, int len,
+                                   TickType_t timeout);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,34 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Hooks into the fake drivers so the replay engine can drive inputs
+// and observe outputs of the firmware under test
+namespace Sim {
+    using Clock = std::chrono::steady_clock;
+
+    struct SentMessage {
+        Clock::time_point when;
+        std::string text;
+    };
+
+    using Pixel = std::array<uint8_t, 3>;
+
+    // GPIO
+    int gpio_level(int pin);
+
+    // LED strip, as of the last refresh
+    std::array<Pixel, 4> led_pixels();
+    uint32_t led_refresh_count();
+
+    // Buzzer, 0 when silent
+    uint32_t buzzer_frequency();
+
+    // Websocket
+    bool ws_connected();
+    void ws_receive_text(const std::string& text);
+    std::vector<SentMessage> ws_sent_since(Clock::time_point since);
+} // namespace Sim
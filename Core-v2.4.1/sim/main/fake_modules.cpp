@@ -0,0 +1,227 @@
+#include "fake_modules.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <mutex>
+
+#include "common/hardware.hpp"
+#include "io/Audio.hpp"
+#include "io/Button.hpp"
+#include "io/CardReader.hpp"
+#include "io/OneWire.hpp"
+#include "network/ca_store.hpp"
+#include "network/coredump.hpp"
+#include "network/http_manager.hpp"
+#include "network/ota.hpp"
+#include "sim_hooks.hpp"
+
+static std::mutex card_lock;
+static std::optional<CardTagID> current_card = {};
+static std::atomic<bool> button_held{false};
+// Temperature follows a ramp from when it was last set
+static std::mutex temp_lock;
+static float temperature = 25.0f;
+static float temp_rate_per_min = 0;
+static Sim::Clock::time_point temp_set_at = Sim::Clock::now();
+static std::atomic<bool> require_switches{true};
+
+void Sim::set_card(std::optional<CardTagID> card) {
+    std::lock_guard<std::mutex> guard(card_lock);
+    current_card = card;
+}
+
+void Sim::set_button_held(bool held) {
+    button_held = held;
+}
+
+void Sim::set_temperature(float temp, float rate_per_min) {
+    std::lock_guard<std::mutex> guard(temp_lock);
+    temperature = temp;
+    temp_rate_per_min = rate_per_min;
+    temp_set_at = Clock::now();
+}
+
+static float current_temperature() {
+    std::lock_guard<std::mutex> guard(temp_lock);
+    std::chrono::duration<float, std::ratio<60>> elapsed = Sim::Clock::now() - temp_set_at;
+    return temperature + temp_rate_per_min * elapsed.count();
+}
+
+namespace CardReader {
+    void init() {}
+
+    bool get_card_tag(CardTagID& ret_tag) {
+        std::lock_guard<std::mutex> guard(card_lock);
+        ret_tag = current_card.value_or(CardTagID{});
+        return true;
+    }
+
+    bool card_present() {
+        std::lock_guard<std::mutex> guard(card_lock);
+        return current_card.has_value();
+    }
+
+    void set_require_switches(bool require_state) {
+        require_switches = require_state;
+    }
+} // namespace CardReader
+
+namespace Button {
+    int init() {
+        return 0;
+    }
+
+    bool is_held() {
+        return button_held;
+    }
+} // namespace Button
+
+// One DS18B20 on the bus, the real Temperature module drives it. Transactions
+// complete straight away on the caller's task.
+namespace OneWire {
+    static constexpr Address SENSOR = 0x0000000000000028;
+    static constexpr uint8_t READ_SCRATCHPAD = 0xBE;
+
+    int init() {
+        return 0;
+    }
+
+    static Result execute(const Transaction& transaction) {
+        Result result = {.err = ESP_OK, .rx = {}, .attempts = 1, .crc_errors = 0};
+        if (transaction.address != SKIP_ROM && transaction.address != SENSOR) {
+            result.err = ESP_ERR_NOT_FOUND;
+        } else if (transaction.tx[0] == READ_SCRATCHPAD) {
+            int16_t raw = (int16_t)lroundf(current_temperature() * 16);
+            result.rx[0] = raw & 0xFF;
+            result.rx[1] = (raw >> 8) & 0xFF;
+        }
+        return result;
+    }
+
+    bool submit(const Transaction& transaction, TickType_t) {
+        Result result = execute(transaction);
+        if (transaction.done != nullptr) {
+            transaction.done(result, transaction.ctx);
+        }
+        return true;
+    }
+
+    Result run(const Transaction& transaction) {
+        return execute(transaction);
+    }
+
+    size_t search(Address* out, size_t max) {
+        if (max == 0) {
+            return 0;
+        }
+        out[0] = SENSOR;
+        return 1;
+    }
+
+    size_t get_stats(DeviceStats*, size_t) {
+        return 0;
+    }
+} // namespace OneWire
+
+namespace Hardware {
+    int init() {
+        return 0;
+    }
+
+    const char* get_serial_number() {
+        return "51A10000000000000000000000000000";
+    }
+
+    HardwareEdition get_edition() {
+        return HardwareEdition::STANDARD;
+    }
+
+    const char* get_edition_string() {
+        return "ACS 2.4.1 Core (simulated)";
+    }
+} // namespace Hardware
+
+namespace OTA {
+    void begin(OTATag) {}
+    void mark_valid() {}
+    void init() {}
+
+    std::string running_app_version() {
+        return "sim";
+    }
+
+    std::string next_app_version() {
+        return "";
+    }
+} // namespace OTA
+
+// No TLS in the sim
+namespace CAStore {
+    int init() {
+        return 0;
+    }
+
+    bool install(const char*) {
+        return false;
+    }
+
+    void on_handshake(int) {}
+
+    Stats get_stats() {
+        return {};
+    }
+} // namespace CAStore
+
+// No panics to report
+namespace Coredump {
+    void init() {}
+
+    TickType_t next_chunk_delay() {
+        return 0;
+    }
+
+    bool send_next_chunk() {
+        return false;
+    }
+} // namespace Coredump
+
+// Never cleared, there are no downloads to keep the temperature task off the bus for
+bool ok_to_rmt_read = true;
+
+namespace HTTPManager {
+    void init() {}
+
+    bool queue_transfer(Transfer) {
+        return false;
+    }
+} // namespace HTTPManager
+
+// No speaker, every effect falls back to the buzzer
+namespace Audio {
+    int init() {
+        return 0;
+    }
+
+    bool play(uint8_t, SoundEffect::Priority) {
+        return false;
+    }
+
+    bool install(uint8_t, const char*) {
+        return false;
+    }
+
+    bool busy_above(SoundEffect::Priority) {
+        return false;
+    }
+
+    void yield_to(SoundEffect::Priority) {}
+
+    size_t list(ClipInfo*, size_t) {
+        return 0;
+    }
+
+    Stats get_stats() {
+        return {};
+    }
+} // namespace Audio
@@ -0,0 +1,10 @@
+#pragma once
+#include "common/types.hpp"
+
+// Controls for the modules that fake_modules.cpp stands in for
+namespace Sim {
+    void set_card(std::optional<CardTagID> card);
+    void set_button_held(bool held);
+    // rate_per_min keeps it climbing (or falling) from temp
+    void set_temperature(float temp, float rate_per_min);
+} // namespace Sim
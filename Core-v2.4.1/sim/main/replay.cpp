@@ -0,0 +1,246 @@
+#include "replay.hpp"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "common/pins.hpp"
+#include "common/types.hpp"
+#include "esp_log.h"
+#include "fake_modules.hpp"
+#include "io/IO.hpp"
+#include "sim_hooks.hpp"
+
+static const char* TAG = "replay";
+
+namespace Replay {
+    using Sim::Clock;
+
+    struct LatencyStats {
+        uint32_t count = 0;
+        double total_ms = 0;
+        double max_ms = 0;
+    };
+
+    struct Run {
+        int line_no = 0;
+        int failures = 0;
+        Clock::time_point last_stimulus;
+        std::string last_stimulus_name = "boot";
+        std::optional<CardTagID> inserted = {};
+        std::map<std::string, LatencyStats> latencies;
+    };
+
+    static double ms_since(Clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    }
+
+    // Polls check until it holds or timeout_ms after the last stimulus passes
+    template <typename F> static bool wait_for(Run& run, int timeout_ms, F check) {
+        auto deadline = run.last_stimulus + std::chrono::milliseconds(timeout_ms);
+        while (true) {
+            if (check()) {
+                double latency = ms_since(run.last_stimulus);
+                LatencyStats& stats = run.latencies[run.last_stimulus_name];
+                stats.count++;
+                stats.total_ms += latency;
+                if (latency > stats.max_ms) {
+                    stats.max_ms = latency;
+                }
+                return true;
+            }
+            if (Clock::now() >= deadline) {
+                return false;
+            }
+            vTaskDelay(1);
+        }
+    }
+
+    static void stimulus(Run& run, const std::string& name) {
+        run.last_stimulus = Clock::now();
+        run.last_stimulus_name = name;
+    }
+
+    static bool do_button(Run& run, const std::string& kind) {
+        ButtonEventType type;
+        if (kind == "click") {
+            type = ButtonEventType::CLICK;
+        } else if (kind == "held") {
+            type = ButtonEventType::HELD;
+            Sim::set_button_held(true);
+        } else if (kind == "released") {
+            type = ButtonEventType::RELEASED;
+            Sim::set_button_held(false);
+        } else {
+            return false;
+        }
+        stimulus(run, "button " + kind);
+        return IO::send_event({.type = IOEventType::BUTTON_PRESSED, .button = {.type = type}});
+    }
+
+    static bool do_card(Run& run, std::istringstream& args) {
+        std::string kind;
+        args >> kind;
+        if (kind == "insert") {
+            std::string uid;
+            args >> uid;
+            std::optional<CardTagID> tag = CardTagID::from_string(uid.c_str());
+            if (!tag.has_value()) {
+                return false;
+            }
+            run.inserted = tag;
+            Sim::set_card(tag);
+            stimulus(run, "card insert");
+            return IO::send_event({.type = IOEventType::CARD_DETECTED, .card_detected = {.card_tag_id = tag.value()}});
+        } else if (kind == "remove") {
+            CardTagID old_tag = run.inserted.value_or(CardTagID{});
+            run.inserted = {};
+            Sim::set_card({});
+            stimulus(run, "card remove");
+            return IO::send_event({.type = IOEventType::CARD_REMOVED, .card_removed = {.card_tag_id = old_tag}});
+        } else if (kind == "error") {
+            stimulus(run, "card error");
+            return IO::send_event({.type = IOEventType::CARD_READ_ERROR});
+        }
+        return false;
+    }
+
+    static bool do_expect(Run& run, std::istringstream& args) {
+        std::string what;
+        int timeout_ms = 0;
+        args >> what >> timeout_ms;
+        std::string rest;
+        std::getline(args >> std::ws, rest);
+
+        if (what == "state") {
+            std::optional<IOState> want = parse_iostate(rest.c_str());
+            if (!want.has_value()) {
+                ESP_LOGE(TAG, "line %d: unknown state %s", run.line_no, rest.c_str());
+                return false;
+            }
+            bool ok = wait_for(run, timeout_ms, [&]() {
+                IOState state;
+                return IO::get_state(state) && state == want.value();
+            });
+            if (!ok) {
+                IOState state;
+                IO::get_state(state);
+                ESP_LOGE(TAG, "line %d: expected state %s, still %s", run.line_no, rest.c_str(),
+                         io_state_to_string(state));
+            }
+            return ok;
+        } else if (what == "sent") {
+            Clock::time_point since = run.last_stimulus;
+            bool ok = wait_for(run, timeout_ms, [&]() {
+                for (const Sim::SentMessage& msg : Sim::ws_sent_since(since)) {
+                    if (msg.text.find(rest) != std::string::npos) {
+                        return true;
+                    }
+                }
+                return false;
+            });
+            if (!ok) {
+                ESP_LOGE(TAG, "line %d: no message containing '%s' was sent", run.line_no, rest.c_str());
+            }
+            return ok;
+        } else if (what == "switch") {
+            int level = std::stoi(rest);
+            bool ok = wait_for(run, timeout_ms, [&]() { return Sim::gpio_level(SWITCH_CNTRL) == level; });
+            if (!ok) {
+                ESP_LOGE(TAG, "line %d: expected switch %d", run.line_no, level);
+            }
+            return ok;
+        } else if (what == "led") {
+            std::istringstream px(rest);
+            int index, r, g, b;
+            px >> index >> r >> g >> b;
+            Sim::Pixel want = {(uint8_t)r, (uint8_t)g, (uint8_t)b};
+            bool ok = wait_for(run, timeout_ms, [&]() { return Sim::led_pixels().at(index) == want; });
+            if (!ok) {
+                ESP_LOGE(TAG, "line %d: expected led %d to be %d %d %d", run.line_no, index, r, g, b);
+            }
+            return ok;
+        } else if (what == "buzzer") {
+            uint32_t frequency = std::stoul(rest);
+            bool ok = wait_for(run, timeout_ms, [&]() { return Sim::buzzer_frequency() == frequency; });
+            if (!ok) {
+                ESP_LOGE(TAG, "line %d: expected buzzer at %u Hz, is at %u Hz", run.line_no, (unsigned)frequency,
+                         (unsigned)Sim::buzzer_frequency());
+            }
+            return ok;
+        }
+        ESP_LOGE(TAG, "line %d: unknown expectation %s", run.line_no, what.c_str());
+        return false;
+    }
+
+    static bool do_step(Run& run, const std::string& line) {
+        std::istringstream args(line);
+        std::string cmd;
+        args >> cmd;
+
+        if (cmd == "wait") {
+            int ms = 0;
+            args >> ms;
+            vTaskDelay(pdMS_TO_TICKS(ms));
+            return true;
+        } else if (cmd == "button") {
+            std::string kind;
+            args >> kind;
+            return do_button(run, kind);
+        } else if (cmd == "card") {
+            return do_card(run, args);
+        } else if (cmd == "temp") {
+            float temp = 0;
+            float rate_per_min = 0;
+            args >> temp;
+            args >> rate_per_min;
+            stimulus(run, "temp");
+            Sim::set_temperature(temp, rate_per_min);
+            return true;
+        } else if (cmd == "server") {
+            std::string json;
+            std::getline(args >> std::ws, json);
+            stimulus(run, "server");
+            Sim::ws_receive_text(json);
+            return true;
+        } else if (cmd == "expect") {
+            return do_expect(run, args);
+        }
+        ESP_LOGE(TAG, "line %d: unknown step %s", run.line_no, cmd.c_str());
+        return false;
+    }
+
+    bool run(const char* trace_path, Clock::time_point boot) {
+        std::ifstream trace(trace_path);
+        if (!trace.is_open()) {
+            ESP_LOGE(TAG, "Couldn't open trace %s", trace_path);
+            return false;
+        }
+
+        Run run;
+        run.last_stimulus = boot;
+        std::string line;
+        while (std::getline(trace, line)) {
+            run.line_no++;
+            size_t start = line.find_first_not_of(" \t");
+            if (start == std::string::npos || line[start] == '#') {
+                continue;
+            }
+            if (!do_step(run, line.substr(start))) {
+                run.failures++;
+            }
+        }
+
+        ESP_LOGI(TAG, "%s: %d step(s) failed", trace_path, run.failures);
+        for (const auto& [name, stats] : run.latencies) {
+            ESP_LOGI(TAG, "  %-16s n=%lu avg=%.2fms max=%.2fms", name.c_str(), (unsigned long)stats.count,
+                     stats.total_ms / stats.count, stats.max_ms);
+        }
+        return run.failures == 0;
+    }
+} // namespace Replay
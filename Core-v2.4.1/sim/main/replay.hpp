@@ -0,0 +1,31 @@
+#pragma once
+#include "sim_hooks.hpp"
+
+/**
+ * Deterministic replay of recorded event traces against the simulated firmware.
+ *
+ * A trace is a text file with one step per line. Blank lines and lines starting
+ * with # are ignored. Stimulus steps:
+ *   wait <ms>
+ *   button click|held|released
+ *   card insert <uid hex>
+ *   card remove
+ *   card error
+ *   temp <celsius>
+ *   server <json text>
+ * Expectation steps, which pass as soon as the condition holds and fail if it
+ * does not within <ms> of the latest stimulus:
+ *   expect state <ms> <IOState name as sent to the server>
+ *   expect sent <ms> <substring of an outgoing websocket message>
+ *   expect switch <ms> <0|1>
+ *   expect led <ms> <index> <r> <g> <b>
+ *   expect buzzer <ms> <hz, 0 for silent>
+ *
+ * The time from each stimulus to each expectation passing is recorded as that
+ * event's processing latency and summarized at the end of the run. Expectations
+ * before the first stimulus are timed from boot.
+ */
+namespace Replay {
+    // Returns true if every expectation in the trace passed
+    bool run(const char* trace_path, Sim::Clock::time_point boot);
+} // namespace Replay
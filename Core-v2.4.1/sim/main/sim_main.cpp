@@ -0,0 +1,34 @@
+#include "common/audit_log.hpp"
+#include "common/flash_region.hpp"
+#include "common/hardware.hpp"
+#include "common/timer_wheel.hpp"
+#include "esp_log.h"
+#include "io/IO.hpp"
+#include "network/network.hpp"
+#include "network/storage.hpp"
+#include "replay.hpp"
+
+#include <stdlib.h>
+
+static const char* TAG = "sim";
+
+extern "C" void app_main(void) {
+    const char* trace_path = getenv("SIM_TRACE");
+    if (trace_path == NULL) {
+        ESP_LOGE(TAG, "Set SIM_TRACE to the trace file to replay");
+        exit(2);
+    }
+
+    Sim::Clock::time_point boot = Sim::Clock::now();
+
+    // Same bring-up order as the firmware, minus USB
+    Hardware::init();
+    TimerWheel::init();
+    Storage::init();
+    FlashRegion::init();
+    AuditLog::init();
+    IO::init();
+    Network::init();
+
+    exit(Replay::run(trace_path, boot) ? 0 : 1);
+}
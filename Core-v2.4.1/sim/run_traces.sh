@@ -0,0 +1,11 @@
+#!/bin/sh
+# Replays every trace in traces/ against a fresh simulator process
+cd "$(dirname "$0")"
+failed=0
+for trace in traces/*.trace; do
+    if ! SIM_TRACE="$trace" ./build/sim.elf; then
+        echo "FAILED: $trace"
+        failed=1
+    fi
+done
+exit $failed
@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+"""Talks to the USB console (main/network/console.hpp) of a board.
+
+    tools/console.py /dev/ttyACM0 get [name]
+    tools/console.py /dev/ttyACM0 set server=example.org max_temp=45
+    tools/console.py /dev/ttyACM0 stats [state|tasks|queues|latency|logs]
+    tools/console.py /dev/ttyACM0 identify
+    tools/console.py /dev/ttyACM0 trace [first [count]]
+
+Log records that arrive meanwhile are printed too when --elf is given.
+"""
+
+import argparse
+import os
+import random
+import select
+import sys
+import termios
+import time
+import tty
+
+import decode_log
+
+COMMANDS = {"get": 1, "set": 2, "stats": 3, "identify": 4, "trace": 5}
+RESPONSE_RECORD = 0x10
+OK, MORE = 0, 1
+STATUS_NAMES = {2: "unknown command", 3: "bad argument", 4: "failed"}
+MAX_FRAME = 255
+
+
+def cobs_encode(data):
+    out = bytearray()
+    block = bytearray()
+    for byte in data:
+        if byte == 0:
+            out += bytes([len(block) + 1]) + block
+            block.clear()
+        else:
+            block.append(byte)
+            if len(block) == 0xFE:
+                out += b"\xff" + block
+                block.clear()
+    out += bytes([len(block) + 1]) + block
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("port")
+    parser.add_argument("command", choices=COMMANDS)
+    parser.add_argument("args", nargs="*")
+    parser.add_argument("--elf", help="firmware ELF, to decode log records in between")
+    parser.add_argument("--timeout", type=float, default=5, help="seconds to wait for each response")
+    args = parser.parse_args()
+
+    if args.command == "set":
+        payload = "\n".join(args.args)
+    else:
+        payload = " ".join(args.args)
+    sequence = random.randrange(256)
+    request = bytes([COMMANDS[args.command], sequence]) + payload.encode()
+    if len(request) > MAX_FRAME:
+        sys.exit(f"request is {len(request)} bytes, the console takes at most {MAX_FRAME}")
+
+    elf = decode_log.Elf(args.elf) if args.elf else None
+    fd = os.open(args.port, os.O_RDWR | os.O_NOCTTY)
+    if os.isatty(fd):
+        tty.setraw(fd)
+        termios.tcflush(fd, termios.TCIFLUSH)
+    # Leading delimiter drops anything half sent before us
+    os.write(fd, b"\0" + cobs_encode(request) + b"\0")
+
+    pending = bytearray()
+    deadline = time.monotonic() + args.timeout
+    while True:
+        remaining = deadline - time.monotonic()
+        if remaining <= 0:
+            sys.exit("no response")
+        if not select.select([fd], [], [], remaining)[0]:
+            continue
+        pending += os.read(fd, 4096)
+
+        while (end := pending.find(b"\0")) >= 0:
+            frame = bytes(pending[:end])
+            del pending[:end + 1]
+            record = decode_log.cobs_decode(frame) if frame else None
+            if not record:
+                continue
+            if record[0] != RESPONSE_RECORD:
+                if elf:
+                    sys.stderr.buffer.write(decode_log.decode_record(elf, record))
+                    sys.stderr.flush()
+                continue
+            if len(record) < 3 or record[1] != sequence:
+                continue
+
+            status = record[2]
+            sys.stdout.buffer.write(record[3:])
+            sys.stdout.flush()
+            if status == MORE:
+                deadline = time.monotonic() + args.timeout
+                continue
+            if status != OK:
+                sys.exit(STATUS_NAMES.get(status, f"status {status}"))
+            return
+
+
+if __name__ == "__main__":
+    main()
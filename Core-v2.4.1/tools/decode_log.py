@@ -0,0 +1,248 @@
+#!/usr/bin/env python3
+"""Turns the binary USB log (CONFIG_USB_BINARY_LOG) back into text.
+
+Records carry the flash address of their format string, so the ELF has to be
+the one the board is running, normally build/Core.elf.
+
+    tools/decode_log.py build/Core.elf /dev/ttyACM0
+    tools/decode_log.py build/Core.elf capture.bin
+
+The record layout is described in main/common/log_ring.cpp.
+"""
+
+import argparse
+import struct
+import sys
+
+LOG, TRUNCATED, TEXT, DROPPED = 1, 2, 3, 4
+FLASH_STRING = 0xFF
+
+SHT_NOBITS = 8
+SHF_ALLOC = 2
+
+
+class Elf:
+    """Just enough ELF to read constant strings by address"""
+
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            self.data = f.read()
+        if self.data[:4] != b"\x7fELF":
+            raise ValueError(f"{path} is not an ELF file")
+        wide = self.data[4] == 2
+        endian = "<" if self.data[5] == 1 else ">"
+
+        if wide:
+            shoff, = struct.unpack_from(endian + "Q", self.data, 0x28)
+            shentsize, shnum = struct.unpack_from(endian + "HH", self.data, 0x3A)
+            section = endian + "IIQQQQ"
+        else:
+            shoff, = struct.unpack_from(endian + "I", self.data, 0x20)
+            shentsize, shnum = struct.unpack_from(endian + "HH", self.data, 0x2E)
+            section = endian + "IIIIII"
+
+        self.sections = []
+        for i in range(shnum):
+            _, sh_type, flags, addr, offset, size = struct.unpack_from(section, self.data, shoff + i * shentsize)
+            if sh_type != SHT_NOBITS and flags & SHF_ALLOC and addr != 0:
+                self.sections.append((addr, offset, size))
+
+    def string(self, address):
+        for addr, offset, size in self.sections:
+            if addr <= address < addr + size:
+                start = offset + address - addr
+                end = self.data.find(b"\0", start, offset + size)
+                return self.data[start:end if end >= 0 else offset + size]
+        return None
+
+
+def cobs_decode(frame):
+    out = bytearray()
+    i = 0
+    while i < len(frame):
+        code = frame[i]
+        if code == 0 or i + code > len(frame):
+            return None
+        out += frame[i + 1:i + code]
+        i += code
+        if code != 0xFF and i < len(frame):
+            out.append(0)
+    return bytes(out)
+
+
+class Args:
+    def __init__(self, data):
+        self.data = data
+        self.at = 0
+        self.short = False
+
+    def take(self, fmt):
+        size = struct.calcsize(fmt)
+        if self.at + size > len(self.data):
+            self.short = True
+            self.at = len(self.data)
+            return None
+        value, = struct.unpack_from(fmt, self.data, self.at)
+        self.at += size
+        return value
+
+    def string(self, elf):
+        length = self.take("<B")
+        if length is None:
+            return None
+        if length == FLASH_STRING:
+            address = self.take("<I")
+            if address is None:
+                return None
+            text = elf.string(address)
+            return text if text is not None else b"<string 0x%08x>" % address
+        text = self.data[self.at:self.at + length]
+        self.at += length
+        if len(text) < length:
+            self.short = True
+        return text
+
+
+def render(elf, fmt, args):
+    """Walks fmt the same way LogRing::vlog did, pulling each argument back out"""
+    out = bytearray()
+    i = 0
+    while i < len(fmt):
+        if fmt[i] != ord("%"):
+            out.append(fmt[i])
+            i += 1
+            continue
+        start = i
+        i += 1
+
+        flags = b""
+        while i < len(fmt) and fmt[i:i + 1] in (b"-", b"+", b" ", b"#", b"0"):
+            flags += fmt[i:i + 1]
+            i += 1
+        width = b""
+        if fmt[i:i + 1] == b"*":
+            value = args.take("<i")
+            width = b"%d" % (value or 0)
+            i += 1
+        while fmt[i:i + 1].isdigit():
+            width += fmt[i:i + 1]
+            i += 1
+
+        precision = None
+        if fmt[i:i + 1] == b".":
+            i += 1
+            if fmt[i:i + 1] == b"*":
+                precision = args.take("<i") or 0
+                i += 1
+            else:
+                digits = b""
+                while fmt[i:i + 1].isdigit():
+                    digits += fmt[i:i + 1]
+                    i += 1
+                precision = int(digits or b"0")
+
+        wide = False
+        for modifier in (b"hh", b"h", b"ll", b"l", b"j", b"z", b"t", b"L"):
+            if fmt[i:i + len(modifier)] == modifier:
+                wide = modifier in (b"ll", b"j")
+                i += len(modifier)
+                break
+
+        conversion = chr(fmt[i]) if i < len(fmt) else ""
+        i += 1
+        spec = "%" + flags.decode() + width.decode() + ("" if precision is None else ".%d" % max(precision, 0))
+
+        if conversion and conversion in "diuoxXc":
+            value = args.take("<Q" if wide else "<I")
+            if value is None:
+                piece = "?"
+            elif conversion in "di":
+                bits = 64 if wide else 32
+                piece = (spec + "d") % (value - (1 << bits) if value >= 1 << (bits - 1) else value)
+            elif conversion == "u":
+                piece = (spec + "d") % value
+            elif conversion == "c":
+                piece = (spec + "c") % chr(value & 0xFF)
+            else:
+                piece = (spec + conversion) % value
+        elif conversion and conversion in "fFeEgG":
+            value = args.take("<d")
+            piece = "?" if value is None else (spec + conversion) % value
+        elif conversion and conversion in "aA":
+            value = args.take("<d")
+            piece = "?" if value is None else value.hex()
+        elif conversion == "p":
+            value = args.take("<I")
+            piece = "?" if value is None else "0x%x" % value
+        elif conversion == "s":
+            value = args.string(elf)
+            if value is None:
+                piece = "?"
+            else:
+                if precision is not None:
+                    value = value[:max(precision, 0)]
+                piece = (spec.split(".")[0] + "s") % value.decode("utf-8", "replace")
+        elif conversion == "%":
+            piece = "%"
+        elif conversion == "n":
+            piece = ""
+        else:
+            piece = fmt[start:i].decode("utf-8", "replace")
+        out += piece.encode("utf-8", "replace")
+    return bytes(out)
+
+
+def decode_record(elf, record):
+    kind = record[0]
+    if kind in (LOG, TRUNCATED):
+        if len(record) < 5:
+            return b"<short log record>\n"
+        address, = struct.unpack_from("<I", record, 1)
+        fmt = elf.string(address)
+        if fmt is None:
+            return b"<format 0x%08x not in this ELF>\n" % address
+        args = Args(record[5:])
+        text = render(elf, fmt, args)
+        if kind == TRUNCATED or args.short:
+            body = text.rstrip(b"\r\n")
+            text = body + b" [truncated]" + text[len(body):]
+        return text
+    if kind == TEXT:
+        return record[1:]
+    if kind == DROPPED and len(record) >= 5:
+        return b"(%d log lines dropped)\n" % struct.unpack_from("<I", record, 1)
+    return b"<record type %d, %d bytes>\n" % (kind, len(record))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("elf", help="firmware ELF the board is running")
+    parser.add_argument("input", nargs="?", help="serial port or capture file, stdin if omitted")
+    args = parser.parse_args()
+
+    elf = Elf(args.elf)
+    source = open(args.input, "rb", buffering=0) if args.input else sys.stdin.buffer
+    out = sys.stdout.buffer
+
+    pending = bytearray()
+    while True:
+        chunk = source.read(4096)
+        if not chunk:
+            break
+        pending += chunk
+        while True:
+            end = pending.find(b"\0")
+            if end < 0:
+                break
+            frame = bytes(pending[:end])
+            del pending[:end + 1]
+            if not frame:
+                continue
+            record = cobs_decode(frame)
+            # Bytes from before the board switched to binary come through as is
+            out.write(frame + b"\n" if not record else decode_record(elf, record))
+        out.flush()
+
+
+if __name__ == "__main__":
+    main()
@@ -5,11 +5,19 @@ The Bus Manager is responsible for everything OneWire related
 */
 
 //Busmanager has been disabled, will re-visit in future hardware that has stronger OneWire drivers.
+//It doesn't stall its task: the temperature conversion is started on one pass and read on a later
+//one instead of waiting 750ms, and a scratchpad read with a bad CRC is retried, with the errors
+//counted per device.
+
+#define SCRATCHPAD_ATTEMPTS 3
+#define CONVERSION_TIME 750 //ms for a 12 bit conversion
 
 /*
 
 void BusManager(void *pvParameters){
   unsigned long long OneWireTime = 0;      //Next time we should check the bus.
+  unsigned long long ConversionReady = 0;  //When the temperatures we asked for can be read.
+  bool ConversionPending = false;
 
   while(1){
     //Step 0: Process any OneWire config we have;
@@ -25,9 +33,9 @@ void BusManager(void *pvParameters){
       SealBroken = false;
       //Set state lockout;
       for(int i = 0; i < ChannelCount; i++){
-        if(State[i] == "FAULT"){
-          State[i] = "LOCKED_OUT";
-          StateChangeReason[i] = "LOCAL";
+        if(State[i] == STATE_FAULT){
+          State[i] = STATE_LOCKED_OUT;
+          StateChangeReason[i] = REASON_LOCAL;
         }
       }
       //Immediately re-run the bus scan;
@@ -41,10 +49,17 @@ void BusManager(void *pvParameters){
       if(SealBroken){
         refreshLiveAddressBuffer();
       }
-      //Step 3: Check for any overtemp devices
+      //Step 3: Start every device converting, we come back for the results
+      startBusConversion();
+      ConversionReady = millis64() + CONVERSION_TIME;
+      ConversionPending = true;
+    }
+    //Step 4: Once the conversion is done, check for any overtemp devices
+    if(ConversionPending && ConversionReady <= millis64()){
+      ConversionPending = false;
       updateBusTemperatures();
     }
-    vTaskDelay(1000 / portTICK_PERIOD_MS);
+    vTaskDelay(100 / portTICK_PERIOD_MS);
   }
 }
 
@@ -116,7 +131,9 @@ void discoverDevices() {
     
     // NEW: Read the scratchpad to populate deviceMode, deviceID, and highTempLimit
     byte data[9];
-    if (readScratchpad(addr, data)) {
+    sensorList[deviceCount].crcErrors = 0;
+    sensorList[deviceCount].readFailures = 0;
+    if (readScratchpad(addr, data, &sensorList[deviceCount])) {
       parseDeviceMetadata(data, &sensorList[deviceCount]);
     } else {
       Serial.println(F("Warning: Failed to read scratchpad during discovery."));
@@ -291,19 +308,22 @@ void provisionDeviceViaJSON(JsonDocument doc) {
   Serial.println(F("Device provisioned and locked to EEPROM successfully."));
 }
 
-void updateBusTemperatures() {
-  //Scans through the bus, gets the temperature of every device.
+void startBusConversion() {
+  //Every device starts a conversion at once, they take CONVERSION_TIME to finish.
   ds.reset();
   ds.skip();
-  ds.write(0x44); 
-  delay(750); 
+  ds.write(0x44);
+}
+
+void updateBusTemperatures() {
+  //Reads back the temperature of every device, after startBusConversion has had CONVERSION_TIME.
 
   //Start by assuming everything is fine. 
   OverTemp = false; 
 
   for (int i = 0; i < deviceCount; i++) {
     byte data[9];
-    if (readScratchpad(sensorList[i].address, data)) {
+    if (readScratchpad(sensorList[i].address, data, &sensorList[i])) {
       parseDeviceMetadata(data, &sensorList[i]);
       sensorList[i].isOnline = true; 
 
@@ -354,12 +374,20 @@ void printAddress(byte addr[8]) {
   }
 }
 
-bool readScratchpad(byte addr[8], byte* buffer) {
-  ds.reset();
-  ds.select(addr);
-  ds.write(0xBE); 
-  for (int i = 0; i < 9; i++) buffer[i] = ds.read();
-  return (OneWire::crc8(buffer, 8) == buffer[8]);
+bool readScratchpad(byte addr[8], byte* buffer, Device* dev) {
+  //Retries a bad CRC, noise on a long bus usually clears on the next read.
+  for (int attempt = 0; attempt < SCRATCHPAD_ATTEMPTS; attempt++) {
+    ds.reset();
+    ds.select(addr);
+    ds.write(0xBE);
+    for (int i = 0; i < 9; i++) buffer[i] = ds.read();
+    if (OneWire::crc8(buffer, 8) == buffer[8]) {
+      return true;
+    }
+    dev->crcErrors++;
+  }
+  dev->readFailures++;
+  return false;
 }
 
 */
@@ -0,0 +1,61 @@
+#pragma once
+#include <Arduino.h>
+
+//Channel states are kept as small enums so tasks can compare and copy them without touching the heap.
+//They only become strings when we serialize them for the server or the screen.
+
+enum ChannelState : uint8_t {
+  STATE_UNKNOWN,
+  STATE_IDLE,
+  STATE_UNLOCKED,
+  STATE_ALWAYS_ON,
+  STATE_LOCKED_OUT,
+  STATE_FAULT,
+  STATE_COUNT
+};
+
+//Bitmask of states, OR these together to ask about several states at once.
+#define STATE_BIT(s) ((uint8_t)(1 << (s)))
+#define ACCESS_STATES (STATE_BIT(STATE_UNLOCKED) | STATE_BIT(STATE_ALWAYS_ON)) //States that turn the channel on
+
+enum ChangeReason : uint8_t {
+  REASON_UNKNOWN,
+  REASON_AUTHED,
+  REASON_CARD_REMOVED,
+  REASON_COMMANDED,
+  REASON_SERVER_COMMANDED,
+  REASON_LOCAL,
+  REASON_LOCK_TEMP,
+  REASON_FAULT,
+  REASON_OVER_TEMP,
+  REASON_INTEGRITY_FAIL,
+  REASON_COUNT
+};
+
+//Names as the server knows them, in enum order.
+static const char* const StateNames[STATE_COUNT] = {
+  "UNKNOWN", "IDLE", "UNLOCKED", "ALWAYS_ON", "LOCKED_OUT", "FAULT"
+};
+static const char* const ReasonNames[REASON_COUNT] = {
+  "UNKNOWN", "AUTHED", "CARD_REMOVED", "COMMANDED", "SERVER_COMMANDED", "LOCAL", "LOCK_TEMP", "FAULT", "OVER_TEMP", "INTEGRITY_FAIL"
+};
+
+inline const char* stateName(ChannelState state){
+  return state < STATE_COUNT ? StateNames[state] : StateNames[STATE_UNKNOWN];
+}
+
+inline ChannelState stateFromName(const char* name){
+  //Anything we don't recognize is treated as UNKNOWN, so we ask the server again.
+  if(name != nullptr){
+    for(uint8_t i = 0; i < STATE_COUNT; i++){
+      if(strcmp(name, StateNames[i]) == 0){
+        return (ChannelState)i;
+      }
+    }
+  }
+  return STATE_UNKNOWN;
+}
+
+inline const char* reasonName(ChangeReason reason){
+  return reason < REASON_COUNT ? ReasonNames[reason] : ReasonNames[REASON_UNKNOWN];
+}
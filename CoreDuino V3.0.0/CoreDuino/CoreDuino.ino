@@ -6,6 +6,9 @@
 //How often you send a status message, in milliseconds
 #define STATUS_INTERVAL 15000 
 
+//How often the Hobbs meters are saved to flash while a channel runs, in milliseconds. See Hobbs.ino for the flash budget.
+#define HOBBS_SAVE_INTERVAL 300000
+
 //Pin Definitions:
   #define SCREEN4 35
   #define IODIR1 36
@@ -85,6 +88,8 @@
   #include <esp_crc.h>  // ESP32 built-in CRC header
 
   #include "Device.h" //Struct definition in a header so it can be used in multiple places and in function calls
+  #include "ChannelState.h" //Channel state enums, same reason as above
+  #include "Messages.h" //Queue item types passed between tasks, same reason as above
 
 //Objects:
   Preferences settings;
@@ -118,7 +123,6 @@ bool Access = 0; //Used to tell the frontend to enable the access signal to the
 String UID; //Stores the UID of the user currently using the machine.
 String FoundUID = ""; //Stores the last-found UID
 bool ChangeBeep = 0; //Lets the frontend know to beep.
-bool FaultBeep = 0; //We use the 3 beep normally for fault to indicate cannot welcome/auth due to no network, to differentiate from welcome/auth denied.
 
 //Variables - Hours
 JsonDocument HoursDoc;      // Global document to hold the latest hours
@@ -152,32 +156,27 @@ String Key;
 int MakerspaceID;
 
 //Variables - MQTT Incoming
-String AuthResponse; 
-bool NewAuth = 0;
-String InfoResponse;
-bool NewInfo = 0;
-String CommandResponse;
-bool NewCommand = 0;
 bool NewPing = 1;
-bool SendPing = 0;
 unsigned long long NextPingTime = 0;
-bool NewWelcome = 0;
-String WelcomeResponse;
 bool WelcomingPending = 0;
 
 //Variables - MQTT Outgoing
 String BaseTopic; //Used to store the root topic that all others are appended to.
-String Message; //Info for the history tab
-bool MessageToSend = 0;
-bool LogToSend = 0;
-String Log; //Non-message log to send to the server
-String LogType;
-bool SendAuth = 0;
-bool StateChange = 0;
-bool ReportConfig = 0;
-bool RequestInfo = 0;
-bool SendStatus = 0;
-bool SendWelcome = 0;
+String OutgoingTopics[OUT_COUNT]; //Full topic for each OutgoingType, built on connect from OutgoingClasses
+
+//Queues - Inter-Task Communication
+//Anything with a payload goes through a queue so two close together can't overwrite each other.
+//Tasks block on these instead of polling flags, see Messages.h for the item types.
+QueueHandle_t OutgoingQueue; //Other tasks -> MQTT loop, everything we send to the server
+QueueHandle_t IncomingQueue; //MQTT subscriptions -> MQTT loop, responses and commands from the server
+EventGroupHandle_t Events; //Payload-free nudges for the screen and buzzer, see EVENT_*
+QueueLatency OutgoingLatency; //How long items waited in OutgoingQueue
+QueueLatency IncomingLatency; //How long items waited in IncomingQueue
+//Snapshot types (OutgoingClasses[].snapshot) don't take a queue slot, asking for one only sets its bit.
+//They are built from current state when sent, so any number of requests before then coalesce into one.
+uint32_t PendingSnapshots = 0; //One bit per OutgoingType
+uint64_t SnapshotQueuedAt[OUT_COUNT]; //When each pending snapshot was first asked for
+portMUX_TYPE OutgoingLock = portMUX_INITIALIZER_UNLOCKED; //Guards the two above and OutgoingLatency.dropped
 
 Device sensorList[10];
 
@@ -198,20 +197,21 @@ byte Blue = 0; //Tracks the blue channel light intensity
 bool NewBuzzer = 0; //Set to 1 when there is a new valid buzzer tone to send.
 unsigned int Tone = 0; //Set to the tone that the buzzer should play.
 bool ResetLED = 0; //Set to 1 to take priority over the LED controller, to indicate the restart is imminent.
-bool UnlockedBeep = 0;
-bool SingleBeep = 0;
 
 //Variables - Per-channel tracking (4 channels)
 byte ChannelCount = 0; //Tracks how many channels are actually present, based on OneWire detection.
 bool ChannelAccess[4] = {0, 0, 0, 0};
-String State[4] = {"UNKNOWN", "UNKNOWN", "UNKNOWN", "UNKNOWN"};
-String LastState[4] = {"UNKNOWN", "UNKNOWN", "UNKNOWN", "UNKNOWN"}; //What state we used to be in, used for state change detect.
-String StateChangeReason[4];
+ChannelState State[4] = {STATE_UNKNOWN, STATE_UNKNOWN, STATE_UNKNOWN, STATE_UNKNOWN};
+ChannelState LastState[4] = {STATE_UNKNOWN, STATE_UNKNOWN, STATE_UNKNOWN, STATE_UNKNOWN}; //What state we used to be in, used for state change detect.
+ChangeReason StateChangeReason[4] = {REASON_UNKNOWN, REASON_UNKNOWN, REASON_UNKNOWN, REASON_UNKNOWN};
 String AuthReason[4];
-String PreservedLastState[4] = {"UNKNOWN", "UNKNOWN", "UNKNOWN", "UNKNOWN"}; //What state we used to be in, but kept until we send it to the server.
+ChannelState PreservedLastState[4] = {STATE_UNKNOWN, STATE_UNKNOWN, STATE_UNKNOWN, STATE_UNKNOWN}; //What state we used to be in, but kept until we send it to the server.
 unsigned long TapDuration[4] = {0, 0, 0, 0}; //How long a temporary tap is kept valid for.
 unsigned long long CurrentTapExpires[4] = {0, 0, 0, 0}; //When each channel's timer decays.
-volatile unsigned long HobbsSeconds[4] = {0, 0, 0, 0}; //Tracks how long the equipment has been running for.
+volatile unsigned long HobbsSeconds[4] = {0, 0, 0, 0}; //Tracks how long the equipment has been running for. Saved by Hobbs.ino.
+RTC_NOINIT_ATTR uint32_t HobbsMirror[4]; //Copy of HobbsSeconds that survives crashes and brown-outs, but not power loss.
+RTC_NOINIT_ATTR uint32_t HobbsMirrorCRC; //Tells a valid mirror from the garbage RTC memory holds after power on.
+portMUX_TYPE HobbsLock = portMUX_INITIALIZER_UNLOCKED; //Guards HobbsSeconds and the mirror between the timer and Hobbs.ino
 
 //Interrupt Response Mode:
 //The device can respond to an interrupt in a few different ways;
@@ -227,7 +227,6 @@ bool IsInterrupted = false; //Tracks if we are in a maintained interrupt mode, s
 byte InterruptCount = 0; //Counts how many times we read an interrupt as we cycle, for debouncing.
 
 //Variables related to any connected screen;
-bool UpdateScreen = false;
 String FaultReason = "";
 String HMIMachineName[4] = {"","","",""};
 String HMIMakerspace;
@@ -278,8 +277,13 @@ void setup() {
 
   sendStartup("Starting Tasks...");
 
+  //The queues have to exist before any task that uses them starts.
+  OutgoingQueue = xQueueCreate(OUTGOING_QUEUE_LENGTH, sizeof(Outgoing));
+  IncomingQueue = xQueueCreate(INCOMING_QUEUE_LENGTH, sizeof(Incoming));
+  Events = xEventGroupCreate();
+
   xTaskCreate(AVControl, "AVControl", 2048, NULL, 5, NULL);
-  xTaskCreate(RestartController, "RestartController", 2048, NULL, 5, NULL);
+  xTaskCreate(RestartController, "RestartController", 4096, NULL, 5, NULL); //Room for the NVS writes before a restart
 
   //Start i2C
   Wire.begin(SDA, SCL);
@@ -545,6 +549,9 @@ void setup() {
 
   */
 
+  //Restore the Hobbs meters before they start counting again
+  loadHobbs();
+
   //Initialize a precise timer for the Hobbs Timer
   Serial.println(F("Starting Critical Timer for Hobbs Time..."));
   const esp_timer_create_args_t timer_args = {
@@ -576,7 +583,14 @@ void setup() {
 void loop() {
   // put your main code here, to run repeatedly:
 
-  delay(10);
+  //Sleep until another task queues something for the server.
+  //We still wake every 10ms, MQTT needs servicing to stay connected.
+  if(mqtt.isConnected() && !NoNetwork){
+    Outgoing next;
+    xQueuePeek(OutgoingQueue, &next, pdMS_TO_TICKS(10));
+  } else{
+    delay(10);
+  }
 
   //Step 0: Call the MQTT updater;
   mqtt.update();
@@ -591,470 +605,483 @@ void loop() {
 
     if(NoNetwork){
       NoNetwork = false;
-      UpdateScreen = true;
+      requestScreenUpdate();
     }
 
     JsonDocument outgoing; //Json to construct the outgoing message in
 
-     //Step 4.1: See if we have any outgoing messages, and send them.
-
-     //temp disabled for testing
-
-    if(MessageToSend){
-      //Send a message to the history
-      MessageToSend = 0;
-      outgoing["auditLog"] = true; //Print in the history
-      outgoing["message"] = Message;
-      outgoing["category"] = "message";
-      String MessagePayload;
-      serializeJson(outgoing, MessagePayload);
-      outgoing.clear(); //Clear so other sends can use it
-      String MessageTopic = BaseTopic + "/log";
-      publish(MessageTopic, MessagePayload);
+    //Step 4.1: Send everything the other tasks queued for the server.
+    //We take the whole queue and every pending snapshot at once, then publish it most urgent class first
+    //(highest QoS), oldest first within a class.
+    static Outgoing Batch[OUTGOING_QUEUE_LENGTH + OUT_COUNT]; //Static to keep it off the loop() stack
+    byte BatchSize = 0;
+    while(BatchSize < OUTGOING_QUEUE_LENGTH && xQueueReceive(OutgoingQueue, &Batch[BatchSize], 0) == pdTRUE){
+      noteLatency(OutgoingLatency, Batch[BatchSize].queuedAt);
+      BatchSize++;
     }
-    if(LogToSend){
-      //Send a log to the audit logs (not the user-visible history)
-      LogToSend = 0;
-      outgoing["auditLog"] = false; //Don't print in the history
-      outgoing["message"] = Log;
-      outgoing["type"] = LogType;
-      String LogPayload;
-      serializeJson(outgoing, LogPayload);
-      outgoing.clear();
-      String LogTopic = BaseTopic + "/log";
-      publish(LogTopic, LogPayload);
-      LogType = "message"; //Default value unless we say otherwise.
+    byte FirstSnapshot = BatchSize;
+    taskENTER_CRITICAL(&OutgoingLock);
+    uint32_t Snapshots = PendingSnapshots;
+    PendingSnapshots = 0;
+    for(byte t = 0; t < OUT_COUNT; t++){
+      if(Snapshots & (1UL << t)){
+        Batch[BatchSize].type = (OutgoingType)t;
+        Batch[BatchSize].queuedAt = SnapshotQueuedAt[t];
+        BatchSize++;
+      }
     }
-    if(SendAuth){
-      //Send an auth request to the server
-      SendAuth = 0;
-      outgoing["state"] = "UNLOCKED";
-      outgoing["cardTagID"] = UID;
-      String AuthPayload;
-      serializeJson(outgoing, AuthPayload);
-      outgoing.clear();
-      String AuthTopic = BaseTopic + "/authTo/request";
-      publish(AuthTopic, AuthPayload);
+    taskEXIT_CRITICAL(&OutgoingLock);
+    for(byte b = FirstSnapshot; b < BatchSize; b++){
+      noteLatency(OutgoingLatency, Batch[b].queuedAt);
     }
-    if(StateChange){
-      //Send report of a changed state
-      StateChange = 0;
-      if(!WelcomeMode){
-        //We don't report state change when we are in welcoming.
-        JsonArray stateChannels = outgoing["channels"].to<JsonArray>();
-        for( int i = 0; i < ChannelCount; i++){
-          if(State[i] != PreservedLastState[i]){
-            JsonObject stateObject = stateChannels.createNestedObject();
-            stateObject["channelID"] = i;
-            stateObject["fromState"] = PreservedLastState[i];
-            stateObject["toState"] = State[i];
-            //The server doesn't recognize the "LOCK_TEMP" state change reason
-            //So we replace if with "LOCAL":
-            if(StateChangeReason[i] == "LOCK_TEMP"){
-              stateObject["reason"] = "LOCAL";
-            } else{
-              stateObject["reason"] = StateChangeReason[i];
+    for(int qos = 2; qos >= 0; qos--){
+      for(byte b = 0; b < BatchSize; b++){
+        const Outgoing &out = Batch[b];
+        if(OutgoingClasses[out.type].qos != qos){
+          continue;
+        }
+        if(out.type == OUT_MESSAGE){
+          //Send a message to the history
+          outgoing["auditLog"] = true; //Print in the history
+          outgoing["message"] = out.text;
+          outgoing["category"] = "message";
+          String MessagePayload;
+          serializeJson(outgoing, MessagePayload);
+          outgoing.clear(); //Clear so other sends can use it
+          publish(OUT_MESSAGE, MessagePayload);
+        }
+        if(out.type == OUT_LOG){
+          //Send a log to the audit logs (not the user-visible history)
+          outgoing["auditLog"] = false; //Don't print in the history
+          outgoing["message"] = out.text;
+          outgoing["type"] = out.logType;
+          String LogPayload;
+          serializeJson(outgoing, LogPayload);
+          outgoing.clear();
+          publish(OUT_LOG, LogPayload);
+        }
+        if(out.type == OUT_AUTH){
+          //Send an auth request to the server
+          outgoing["state"] = stateName(STATE_UNLOCKED);
+          outgoing["cardTagID"] = out.text;
+          String AuthPayload;
+          serializeJson(outgoing, AuthPayload);
+          outgoing.clear();
+          publish(OUT_AUTH, AuthPayload);
+        }
+        if(out.type == OUT_STATE_CHANGE){
+          //Send report of a changed state
+          if(!WelcomeMode){
+            //We don't report state change when we are in welcoming.
+            JsonArray stateChannels = outgoing["channels"].to<JsonArray>();
+            for( int i = 0; i < ChannelCount; i++){
+              if(State[i] != PreservedLastState[i]){
+                JsonObject stateObject = stateChannels.createNestedObject();
+                stateObject["channelID"] = i;
+                stateObject["fromState"] = stateName(PreservedLastState[i]);
+                stateObject["toState"] = stateName(State[i]);
+                //The server doesn't recognize the "LOCK_TEMP" state change reason
+                //So we replace if with "LOCAL":
+                if(StateChangeReason[i] == REASON_LOCK_TEMP){
+                  stateObject["reason"] = reasonName(REASON_LOCAL);
+                } else{
+                  stateObject["reason"] = reasonName(StateChangeReason[i]);
+                }
+                //Update the preserved last state;
+                PreservedLastState[i] = State[i];
+              }
+            }
+            outgoing["currentCardTag"] = UID;
+            String StateChangePayload;
+            serializeJson(outgoing, StateChangePayload);
+            //Built from PreservedLastState, so nothing is lost to coalescing. Skip it if every change was undone.
+            bool AnyChanged = stateChannels.size() > 0;
+            outgoing.clear();
+            if(AnyChanged){
+              publish(OUT_STATE_CHANGE, StateChangePayload);
             }
-            //Update the preserved last state;
-            PreservedLastState[i] = State[i];
           }
         }
-        outgoing["currentCardTag"] = UID;
-        String StateChangePayload;
-        serializeJson(outgoing, StateChangePayload);
-        outgoing.clear();
-        String StateChangeTopic = BaseTopic + "/stateChange";
-        publish(StateChangeTopic, StateChangePayload);
-        //At the end, set change reason to nothing:
-      }
-    }
-    if(ReportConfig){
-      //Report the current configuration
-      ReportConfig = 0;
-      JsonArray configChannels = outgoing["channels"].to<JsonArray>();
-      for(int i = 0; i < ChannelCount; i++){
-        JsonObject configObject = configChannels.createNestedObject();
-        configObject["channelID"] = i;
-        configObject["tempDuration"] = TapDuration[i];
-      }
-      outgoing["inputMode"] = InputMode;
-      JsonObject configDeployment = outgoing["deployment"].to<JsonObject>();
-      configDeployment["SN"] = SerialNumber;
-      JsonArray configComponents = configDeployment["components"].to<JsonArray>();
-      //Iterate through and add every component on the bus to the components array;
-      for(int i = 0; i < liveAddressCount; i++){
-        JsonObject deviceObj = configComponents.createNestedObject();
-        // Convert the 8-byte address to a Hex String for JSON
-        char addrStr[17]; 
-        snprintf(addrStr, sizeof(addrStr), "%02X%02X%02X%02X%02X%02X%02X%02X",
-        liveAddresses[i][0], liveAddresses[i][1], liveAddresses[i][2], liveAddresses[i][3],
-        liveAddresses[i][4], liveAddresses[i][5], liveAddresses[i][6], liveAddresses[i][7]);
-        deviceObj["SN"] = String(addrStr);
-        for(int j = 0; j < deviceCount; j++) {
-          if(memcmp(liveAddresses[i], sensorList[j].address, 8) == 0) {
-            // Here we grab the deviceMode and other data from the struct
-            deviceObj["type"] = sensorList[j].deviceMode; 
-            deviceObj["identifier"] = sensorList[j].deviceID; //Server doesn't expect this yet, but we should send it
-            break;
+        if(out.type == OUT_CONFIG){
+          //Report the current configuration
+          JsonArray configChannels = outgoing["channels"].to<JsonArray>();
+          for(int i = 0; i < ChannelCount; i++){
+            JsonObject configObject = configChannels.createNestedObject();
+            configObject["channelID"] = i;
+            configObject["tempDuration"] = TapDuration[i];
+          }
+          outgoing["inputMode"] = InputMode;
+          JsonObject configDeployment = outgoing["deployment"].to<JsonObject>();
+          configDeployment["SN"] = SerialNumber;
+          JsonArray configComponents = configDeployment["components"].to<JsonArray>();
+          //Iterate through and add every component on the bus to the components array;
+          for(int i = 0; i < liveAddressCount; i++){
+            JsonObject deviceObj = configComponents.createNestedObject();
+            // Convert the 8-byte address to a Hex String for JSON
+            char addrStr[17]; 
+            snprintf(addrStr, sizeof(addrStr), "%02X%02X%02X%02X%02X%02X%02X%02X",
+            liveAddresses[i][0], liveAddresses[i][1], liveAddresses[i][2], liveAddresses[i][3],
+            liveAddresses[i][4], liveAddresses[i][5], liveAddresses[i][6], liveAddresses[i][7]);
+            deviceObj["SN"] = String(addrStr);
+            for(int j = 0; j < deviceCount; j++) {
+              if(memcmp(liveAddresses[i], sensorList[j].address, 8) == 0) {
+                // Here we grab the deviceMode and other data from the struct
+                deviceObj["type"] = sensorList[j].deviceMode; 
+                deviceObj["identifier"] = sensorList[j].deviceID; //Server doesn't expect this yet, but we should send it
+                break;
+              }
+            }
           }
+          JsonObject flags = outgoing["flags"].to<JsonObject>();
+          flags["lockWhenIdle"] = LockWhenIdle;
+          flags["restartWhenUnused"] = RestartWhenUnused;
+          flags["welcoming"] = WelcomeMode;
+          String FWVer = "CoreDuino " + String(Version);
+          outgoing["firmware"] = FWVer;
+          String ConfigPayload;
+          serializeJson(outgoing, ConfigPayload);
+          outgoing.clear();
+          publish(OUT_CONFIG, ConfigPayload);
         }
-      }
-      JsonObject flags = outgoing["flags"].to<JsonObject>();
-      flags["lockWhenIdle"] = LockWhenIdle;
-      flags["restartWhenUnused"] = RestartWhenUnused;
-      flags["welcoming"] = WelcomeMode;
-      String FWVer = "CoreDuino " + String(Version);
-      outgoing["firmware"] = FWVer;
-      String ConfigPayload;
-      serializeJson(outgoing, ConfigPayload);
-      outgoing.clear();
-      String ConfigTopic = BaseTopic + "/config/report";
-      publish(ConfigTopic, ConfigPayload);
-    }
-    if(RequestInfo){
-      //Request information from the server
-      RequestInfo = 0;
-      JsonArray infoFields = outgoing["fields"].to<JsonArray>();
-      infoFields.add("TIME");
-      //Check if any of the states or HobbsTimers are unknown;
-      bool AskForStates = false;
-      bool AskForHobbs = false;
-      for(int i = 0; i < ChannelCount; i++){
-        if(State[i] == "UNKNOWN"){
-          AskForStates = true;
+        if(out.type == OUT_INFO){
+          //Request information from the server
+          JsonArray infoFields = outgoing["fields"].to<JsonArray>();
+          infoFields.add("TIME");
+          //Check if any of the states or HobbsTimers are unknown;
+          bool AskForStates = false;
+          bool AskForHobbs = false;
+          for(int i = 0; i < ChannelCount; i++){
+            if(State[i] == STATE_UNKNOWN){
+              AskForStates = true;
+            }
+            if(HobbsSeconds[i] == 0){
+              AskForHobbs = true;
+            }
+          }
+          if(AskForStates){
+            //We don't know what state we should be in, so request it. 
+            infoFields.add("STATE");
+          }
+          if(AskForHobbs){
+            //We do not know what the Hobbs timer should be at, let's request that.
+            infoFields.add("HOBBS_TIME");
+          }
+          infoFields.add("FLAGS"); //Check our flags, mostly for welcoming
+          infoFields.add("HMI"); //Request human-readable info for any attached interface.
+          String InfoPayload;
+          serializeJson(outgoing, InfoPayload);
+          outgoing.clear();
+          publish(OUT_INFO, InfoPayload);
         }
-        if(HobbsSeconds[i] == 0){
-          AskForHobbs = true;
+        if(out.type == OUT_STATUS && !anyChannelIs(STATE_BIT(STATE_UNKNOWN))){
+          //Send our current status to the server, we do not send it if we do not know our state. 
+          //A status skipped here is not lost for long, MachineState queues a fresh one every STATUS_INTERVAL.
+          JsonArray statusChannels = outgoing["channels"].to<JsonArray>();
+          if(!WelcomeMode){
+            //We don't send this in welcoming mode
+            for(int i = 0; i < ChannelCount; i++){
+              JsonObject statusObject = statusChannels.createNestedObject();
+              statusObject["channelID"] = i;
+              statusObject["state"] = stateName(State[i]);
+              statusObject["hobbsTime"] = HobbsSeconds[i];
+            }
+          }
+          outgoing["currentCardTag"] = UID;
+          //Server doesn't expect these yet, but they show a device that is losing messages
+          outgoing["droppedOutgoing"] = OutgoingLatency.dropped;
+          outgoing["droppedIncoming"] = IncomingLatency.dropped;
+          String StatusPayload;
+          serializeJson(outgoing, StatusPayload);
+          outgoing.clear();
+          publish(OUT_STATUS, StatusPayload);
+          printQueueLatency();
         }
-      }
-      if(AskForStates){
-        //We don't know what state we should be in, so request it. 
-        infoFields.add("STATE");
-      }
-      if(AskForHobbs){
-        //We do not know what the Hobbs timer should be at, let's request that.
-        infoFields.add("HOBBS_TIME");
-      }
-      infoFields.add("FLAGS"); //Check our flags, mostly for welcoming
-      infoFields.add("HMI"); //Request human-readable info for any attached interface.
-      String InfoPayload;
-      serializeJson(outgoing, InfoPayload);
-      outgoing.clear();
-      String InfoTopic = BaseTopic + "/info/request";
-      publish(InfoTopic, InfoPayload);
-    }
-    if(SendStatus && !anyChannelIs("UNKNOWN")){
-      //Send our current status to the server, we do not send it if we do not know our state. 
-      SendStatus = 0;
-      JsonArray statusChannels = outgoing["channels"].to<JsonArray>();
-      if(!WelcomeMode){
-        //We don't send this in welcoming mode
-        for(int i = 0; i < ChannelCount; i++){
-          JsonObject statusObject = statusChannels.createNestedObject();
-          statusObject["channelID"] = i;
-          statusObject["state"] = State[i];
-          statusObject["hobbsTime"] = HobbsSeconds[i];
+        if(out.type == OUT_WELCOME && UID == out.text){
+          //Send a welcome message to the server, unless the card was taken away while this was queued.
+          outgoing["cardTagID"] = out.text;
+          String WelcomePayload;
+          serializeJson(outgoing, WelcomePayload);
+          outgoing.clear();
+          publish(OUT_WELCOME, WelcomePayload);
+        }
+        if(out.type == OUT_PING){
+          //Send a ping if requested
+          publish(OUT_PING, "Ping!");
+          //Serial.println(F("Ping sent."));
+          NextPingTime = millis64() + 1000;
         }
       }
-      outgoing["currentCardTag"] = UID;
-      String StatusPayload;
-      serializeJson(outgoing, StatusPayload);
-      outgoing.clear();
-      String StatusTopic = BaseTopic + "/status";
-      publish(StatusTopic, StatusPayload);
-    }
-    if(SendWelcome){
-      //Send a welcome message to the server
-      SendWelcome = 0;
-      outgoing["cardTagID"] = UID;
-      String WelcomePayload;
-      serializeJson(outgoing, WelcomePayload);
-      outgoing.clear();
-      String WelcomeTopic = BaseTopic + "/welcome/request";
-      publish(WelcomeTopic, WelcomePayload);
     }
 
-    JsonDocument incoming; //Json doucment to parse the incoming
-    
-    //Step 4.3: Process any incoming messages
-
-    if(NewAuth){
-      //Process a response to an auth request.
-      NewAuth = 0;
-      deserializeJson(incoming, AuthResponse);
-      String AuthID = incoming["cardTagID"].as<String>();
-      PendingApproval = false;
-      bool SendUnlockedBeep = false;
-      bool SendAccessDenied = false;
-      for(JsonVariant v : incoming["channels"].as<JsonArray>()){
-        int ch = v["channelID"] | 0;
-        if(ch >= 0 && ch < ChannelCount){
-          bool IsAuthed = v["approved"].as<bool>();
-          AuthReason[ch] = v["reason"].as<String>();
+    //Step 4.3: Process any incoming messages the subscriptions queued up
+    Incoming in;
+    while(xQueueReceive(IncomingQueue, &in, 0) == pdTRUE){
+      noteLatency(IncomingLatency, in.receivedAt);
+      JsonDocument incoming; //Json doucment to parse the incoming
+      //Parse from a const pointer so the document copies its strings, then the payload can go.
+      deserializeJson(incoming, (const char*)in.payload);
+      free(in.payload);
+      if(in.type == IN_AUTH){
+        //Process a response to an auth request.
+        String AuthID = incoming["cardTagID"].as<String>();
+        PendingApproval = false;
+        bool SendUnlockedBeep = false;
+        bool SendAccessDenied = false;
+        for(JsonVariant v : incoming["channels"].as<JsonArray>()){
+          int ch = v["channelID"] | 0;
+          if(ch >= 0 && ch < ChannelCount){
+            bool IsAuthed = v["approved"].as<bool>();
+            AuthReason[ch] = v["reason"].as<String>();
           
-          if(State[ch] == "IDLE" || (State[ch] == "UNLOCKED" && InputMode == "TEMP_PRESENT")){ //Unlock only if idle, or re-up unlocked channels if in tap-present mode.
-            if(IsAuthed){
-              Serial.println(F("Access Granted!"));
-              if(AuthID == UID){
-                Serial.println(F("UIDs match. Unlocking."));
-                State[ch] = "UNLOCKED";
-                StateChangeReason[ch] = "AUTHED"; 
-                SendUnlockedBeep = true;
-                if(InputMode == "TEMP_PRESENT"){
-                  //Add all the times now;
-                  CurrentTapExpires[ch] = TapDuration[ch] * 1000 + millis64();
+            if(State[ch] == STATE_IDLE || (State[ch] == STATE_UNLOCKED && InputMode == "TEMP_PRESENT")){ //Unlock only if idle, or re-up unlocked channels if in tap-present mode.
+              if(IsAuthed){
+                Serial.println(F("Access Granted!"));
+                if(AuthID == UID){
+                  Serial.println(F("UIDs match. Unlocking."));
+                  State[ch] = STATE_UNLOCKED;
+                  StateChangeReason[ch] = REASON_AUTHED;
+                  SendUnlockedBeep = true;
+                  if(InputMode == "TEMP_PRESENT"){
+                    //Add all the times now;
+                    CurrentTapExpires[ch] = TapDuration[ch] * 1000 + millis64();
+                  }
+                }
+              } else{
+                Serial.println(F("Access Denied!"));
+                if(CardPresent){
+                  SendAccessDenied = 1;
                 }
               }
             } else{
-              Serial.println(F("Access Denied!"));
-              if(CardPresent){
-                SendAccessDenied = 1;
-              }
+              Serial.println(F("Ignoring auth due to improper state."));
             }
-          } else{
-            Serial.println(F("Ignoring auth due to improper state."));
           }
         }
+        if(SendUnlockedBeep){
+          //We do it this way so we don't trigger the beep 4 times
+          requestBeep(EVENT_UNLOCKED_BEEP);
+        }
+        if(SendAccessDenied){
+          AccessDenied = true;
+        }
+        requestScreenUpdate();
       }
-      if(SendUnlockedBeep){
-        //We do it this way so we don't trigger the beep 4 times
-        UnlockedBeep = true;
-      }
-      if(SendAccessDenied){
-        AccessDenied = true;
-      }
-      UpdateScreen = true;
-    }
-    if(NewInfo){
-      //Process a response to an info request.
-      NewInfo = 0;
-      deserializeJson(incoming, InfoResponse);
-      //Set the state;
-      if (incoming["state"].is<JsonArray>()) {
-        for (JsonObject item : incoming["state"].as<JsonArray>()) {
-          int id = item["id"] | -1; // Default to -1 if missing
+      if(in.type == IN_INFO){
+        //Process a response to an info request.
+        //Set the state;
+        if (incoming["state"].is<JsonArray>()) {
+          for (JsonObject item : incoming["state"].as<JsonArray>()) {
+            int id = item["id"] | -1; // Default to -1 if missing
           
-          // Bounds check to avoid crashing the MCU with array out-of-bounds
-          if (id >= 0 && id < ChannelCount) {
-            State[id] = item["state"].as<String>();
-            StateChangeReason[id] = "COMMANDED";
-            if(State[id] == "FAULT"){
-              //We don't go back to a fault state;
-              State[id] = "LOCKED_OUT";
-            }
-            if (State[id] == "UNLOCKED" || State[id] == "ALWAYS_ON") {
-              //We don't go back to an unlocked state;
-              State[id] = "IDLE";
+            // Bounds check to avoid crashing the MCU with array out-of-bounds
+            if (id >= 0 && id < ChannelCount) {
+              State[id] = stateFromName(item["state"] | "UNKNOWN");
+              StateChangeReason[id] = REASON_COMMANDED;
+              if(State[id] == STATE_FAULT){
+                //We don't go back to a fault state;
+                State[id] = STATE_LOCKED_OUT;
+              }
+              if (STATE_BIT(State[id]) & ACCESS_STATES) {
+                //We don't go back to an unlocked state;
+                State[id] = STATE_IDLE;
+              }
             }
           }
+          requestBeep(EVENT_SINGLE_BEEP);
         }
-        SingleBeep = 1;
-      }
 
-      // Process the "hobbsTime" array
-      if (incoming["hobbsTime"].is<JsonArray>()) {
-        for (JsonObject item : incoming["hobbsTime"].as<JsonArray>()) {
-          // Notice this uses "channelID" instead of "id"
-          int ch = item["channelID"] | -1; 
+        // Process the "hobbsTime" array
+        if (incoming["hobbsTime"].is<JsonArray>()) {
+          for (JsonObject item : incoming["hobbsTime"].as<JsonArray>()) {
+            // Notice this uses "channelID" instead of "id"
+            int ch = item["channelID"] | -1; 
           
-          if (ch >= 0 && ch < ChannelCount) {
-            HobbsSeconds[ch] = item["hobbsTime"].as<unsigned long>(); 
+            if (ch >= 0 && ch < ChannelCount) {
+              syncHobbs(ch, item["hobbsTime"].as<unsigned long>());
+            }
           }
         }
-      }
-      //Process the HMI info:
-      if(incoming.containsKey("hmi")){
-        HMIRole = incoming["hmi"]["role"].as<String>();
-        HMIDeviceName = incoming["hmi"]["deviceName"].as<String>();
-        HMIMakerspace = incoming["hmi"]["makerspace"].as<String>();
-        JsonArray channels = incoming["hmi"]["channels"];
-        for (JsonObject channel : channels){
-          int channelID = channel["channelID"];
-          HMIMachineName[channelID] = channel["pairedEntity"].as<String>();
-        }
-      }
-      //Set the time;
-      if(incoming.containsKey("time")){
-        unsigned long long millisecondTime = incoming["time"];
-        rtc.setTime(millisecondTime/1000);
-        Serial.print(F("Time set to: "));
-        Serial.println(rtc.getDateTime(true));
-      }
-      //Set flags:
-      if(incoming.containsKey("flags")){
-        JsonObject flagObj = incoming["flags"].as<JsonObject>();
-        if(flagObj.containsKey("lockWhenIdle")){
-          LockWhenIdle = flagObj["lockWhenIdle"].as<bool>();
-          Serial.print(F("Server set LockWhenIdle to: "));
-          Serial.println(LockWhenIdle);
+        //Process the HMI info:
+        if(incoming.containsKey("hmi")){
+          HMIRole = incoming["hmi"]["role"].as<String>();
+          HMIDeviceName = incoming["hmi"]["deviceName"].as<String>();
+          HMIMakerspace = incoming["hmi"]["makerspace"].as<String>();
+          JsonArray channels = incoming["hmi"]["channels"];
+          for (JsonObject channel : channels){
+            int channelID = channel["channelID"];
+            HMIMachineName[channelID] = channel["pairedEntity"].as<String>();
+          }
         }
-        if(flagObj.containsKey("restartWhenUnused")){
-          RestartWhenUnused = flagObj["restartWhenUnused"].as<bool>();
-          Serial.print(F("Server set RestartWhenUnused to: "));
-          Serial.println(RestartWhenUnused);
+        //Set the time;
+        if(incoming.containsKey("time")){
+          unsigned long long millisecondTime = incoming["time"];
+          rtc.setTime(millisecondTime/1000);
+          Serial.print(F("Time set to: "));
+          Serial.println(rtc.getDateTime(true));
         }
-        if(flagObj.containsKey("welcoming")){
-          if(WelcomeMode != flagObj["welcoming"].as<bool>()){
-            WelcomeMode = flagObj["welcoming"].as<bool>();
-            if(WelcomeMode){
-            Serial.println(F("Server flag set to enter welcoming mode."));
-            } else{
-              Serial.println(F("Server flag unset for welcoming mode. Entering state 'UNKNOWN'"));
-              WelcomeMode = false;
-              for(int i = 0; i < ChannelCount; i++){
-                State[i] = "UNKNOWN";
-                StateChangeReason[i] = "SERVER_COMMANDED";
+        //Set flags:
+        if(incoming.containsKey("flags")){
+          JsonObject flagObj = incoming["flags"].as<JsonObject>();
+          if(flagObj.containsKey("lockWhenIdle")){
+            LockWhenIdle = flagObj["lockWhenIdle"].as<bool>();
+            Serial.print(F("Server set LockWhenIdle to: "));
+            Serial.println(LockWhenIdle);
+          }
+          if(flagObj.containsKey("restartWhenUnused")){
+            RestartWhenUnused = flagObj["restartWhenUnused"].as<bool>();
+            Serial.print(F("Server set RestartWhenUnused to: "));
+            Serial.println(RestartWhenUnused);
+          }
+          if(flagObj.containsKey("welcoming")){
+            if(WelcomeMode != flagObj["welcoming"].as<bool>()){
+              WelcomeMode = flagObj["welcoming"].as<bool>();
+              if(WelcomeMode){
+              Serial.println(F("Server flag set to enter welcoming mode."));
+              } else{
+                Serial.println(F("Server flag unset for welcoming mode. Entering state 'UNKNOWN'"));
+                WelcomeMode = false;
+                for(int i = 0; i < ChannelCount; i++){
+                  State[i] = STATE_UNKNOWN;
+                  StateChangeReason[i] = REASON_SERVER_COMMANDED;
+                }
+                //We should ask what state we should be in
+                queueOutgoing(OUT_INFO);
               }
-              //We should ask what state we should be in
-              RequestInfo = 1;
             }
           }
         }
-      }
-      if(incoming.containsKey("hobbsTime")){
-        for(int i = 0; i < ChannelCount; i++){
-          HobbsSeconds[i] = incoming["hobbsTime"][i]["hobbsTime"];
-          Serial.print(F("Hobbs timer for channel "));
-          Serial.print(i);
-          Serial.print(F(" set to: "));
-          Serial.print(HobbsSeconds[i]);
-          Serial.println(F(" seconds."));
+        if(incoming.containsKey("hobbsTime")){
+          for(int i = 0; i < ChannelCount; i++){
+            syncHobbs(i, incoming["hobbsTime"][i]["hobbsTime"].as<unsigned long>());
+          }
         }
+        queueOutgoing(OUT_CONFIG); //Once we get some info, we should send our configuration.
+        queueOutgoing(OUT_STATUS); //Once we get some info, we should send our status.
+        requestScreenUpdate();
       }
-      ReportConfig = 1; //Once we get some info, we should send our configuration.
-      SendStatus = 1; //Once we get some info, we should send our status.
-      UpdateScreen = true;
-    }
-    if(NewCommand){
-      //Process an incoming command.
-      NewCommand = 0;
-      deserializeJson(incoming, CommandResponse);
-      //State change command
-      if(incoming["toState"].is<JsonArray>()){
-        JsonArray toStateArray = incoming["toState"].as<JsonArray>();
-        for (JsonVariant v : toStateArray) {
-          int ch = v["id"] | -1;
-          if (ch >= 0 && ch < ChannelCount) {
-            State[ch] = v["state"] | "UNKNOWN";
-            if(State[ch] == "UNLOCKED" && !CardPresent){
-              State[ch] = "IDLE";
+      if(in.type == IN_COMMAND){
+        //Process an incoming command.
+        //State change command
+        if(incoming["toState"].is<JsonArray>()){
+          JsonArray toStateArray = incoming["toState"].as<JsonArray>();
+          for (JsonVariant v : toStateArray) {
+            int ch = v["id"] | -1;
+            if (ch >= 0 && ch < ChannelCount) {
+              State[ch] = stateFromName(v["state"] | "UNKNOWN");
+              if(State[ch] == STATE_UNLOCKED && !CardPresent){
+                State[ch] = STATE_IDLE;
+              }
+              StateChangeReason[ch] = REASON_COMMANDED;
             }
-            StateChangeReason[ch] = "COMMANDED";
           }
+          requestBeep(EVENT_SINGLE_BEEP);
         }
-        SingleBeep = 1;
-      }
-      //Set flags
-      if(incoming.containsKey("flags")){
-        JsonObject flagObj = incoming["flags"].as<JsonObject>();
-        if(flagObj.containsKey("lockWhenIdle")){
-          LockWhenIdle = flagObj["lockWhenIdle"].as<bool>();
-          Serial.print(F("Server set LockWhenIdle to: "));
-          Serial.println(LockWhenIdle);
-        }
-        if(flagObj.containsKey("restartWhenUnused")){
-          RestartWhenUnused = flagObj["restartWhenUnused"].as<bool>();
-          Serial.print(F("Server set RestartWhenUnused to: "));
-          Serial.println(RestartWhenUnused);
-        }
-        if(flagObj.containsKey("welcoming")){
-          if(WelcomeMode != flagObj["welcoming"].as<bool>()){
-            WelcomeMode = flagObj["welcoming"].as<bool>();
-            if(WelcomeMode){
-            Serial.println(F("Server flag set to enter welcoming mode."));
-            } else{
-              Serial.println(F("Server flag unset for welcoming mode. Entering state 'UNKNOWN'"));
-              for(int i = 0; i < ChannelCount; i++){
-                State[i] = "UNKNOWN";
-                StateChangeReason[i] = "SERVER_COMMANDED";
+        //Set flags
+        if(incoming.containsKey("flags")){
+          JsonObject flagObj = incoming["flags"].as<JsonObject>();
+          if(flagObj.containsKey("lockWhenIdle")){
+            LockWhenIdle = flagObj["lockWhenIdle"].as<bool>();
+            Serial.print(F("Server set LockWhenIdle to: "));
+            Serial.println(LockWhenIdle);
+          }
+          if(flagObj.containsKey("restartWhenUnused")){
+            RestartWhenUnused = flagObj["restartWhenUnused"].as<bool>();
+            Serial.print(F("Server set RestartWhenUnused to: "));
+            Serial.println(RestartWhenUnused);
+          }
+          if(flagObj.containsKey("welcoming")){
+            if(WelcomeMode != flagObj["welcoming"].as<bool>()){
+              WelcomeMode = flagObj["welcoming"].as<bool>();
+              if(WelcomeMode){
+              Serial.println(F("Server flag set to enter welcoming mode."));
+              } else{
+                Serial.println(F("Server flag unset for welcoming mode. Entering state 'UNKNOWN'"));
+                for(int i = 0; i < ChannelCount; i++){
+                  State[i] = STATE_UNKNOWN;
+                  StateChangeReason[i] = REASON_SERVER_COMMANDED;
+                }
+                //We should ask what state we should be in
+                queueOutgoing(OUT_INFO);
               }
-              //We should ask what state we should be in
-              RequestInfo = 1;
             }
           }
         }
-      }
-      //Set HobbsTime
-      if(incoming.containsKey("hobbsTime")){
-        JsonArray hobbsTimeArray = incoming["hobbsTime"].as<JsonArray>();
-        for (JsonVariant v : hobbsTimeArray) {
-          int ch = v["hobbsTime"] | 0;
-          if (ch >= 0 && ch < ChannelCount) {
-            HobbsSeconds[ch] = v["channelID"] | 0;
-            Serial.print(F("Hobbs timer for channel "));
-            Serial.print(ch);
-            Serial.print(F(" set to: "));
-            Serial.print(HobbsSeconds[ch]);
-            Serial.println(F(" seconds."));
+        //Set HobbsTime
+        //Unlike a sync, a command can set a meter lower, so it is saved right away.
+        if(incoming.containsKey("hobbsTime")){
+          JsonArray hobbsTimeArray = incoming["hobbsTime"].as<JsonArray>();
+          for (JsonVariant v : hobbsTimeArray) {
+            int ch = v["channelID"] | -1;
+            if (ch >= 0 && ch < ChannelCount) {
+              unsigned long seconds = v["hobbsTime"] | 0UL;
+              taskENTER_CRITICAL(&HobbsLock);
+              HobbsSeconds[ch] = seconds;
+              taskEXIT_CRITICAL(&HobbsLock);
+              Serial.print(F("Hobbs timer for channel "));
+              Serial.print(ch);
+              Serial.print(F(" set to: "));
+              Serial.print(HobbsSeconds[ch]);
+              Serial.println(F(" seconds."));
+            }
           }
+          saveHobbs();
         }
-      }
-      //Action to do something
-      if(incoming.containsKey("action")){
-        if(incoming["action"] == "RESTART"){
-          Serial.println(F("Server commanded restart!"));
-          Serial.flush();
-          ResetReason = "Server Ordered";
-          RequestReset = true;
-        }
-        if((incoming["action"] == "SEAL") && SealBroken){
-          Serial.println(F("Server commanded bus integrity re-seal."));
-          ReSealBus = true;
-        }
-        if(incoming["action"] == "IDENTIFY"){
-          Serial.println(F("Server commanded identify."));
-          Identify = !Identify;
-          if(!Identify){
-            //Play a single beep to end the identify command.
-            SingleBeep = true;
+        //Action to do something
+        if(incoming.containsKey("action")){
+          if(incoming["action"] == "RESTART"){
+            Serial.println(F("Server commanded restart!"));
+            Serial.flush();
+            ResetReason = "Server Ordered";
+            RequestReset = true;
+          }
+          if((incoming["action"] == "SEAL") && SealBroken){
+            Serial.println(F("Server commanded bus integrity re-seal."));
+            ReSealBus = true;
+          }
+          if(incoming["action"] == "IDENTIFY"){
+            Serial.println(F("Server commanded identify."));
+            Identify = !Identify;
+            if(!Identify){
+              //Play a single beep to end the identify command.
+              requestBeep(EVENT_SINGLE_BEEP);
+            }
+          }
+          if(incoming["action"] == "SCHEDULED_RESTART"){
+            Serial.println(F("Server indicated it is time for a scheduled restart."));
+            ScheduledRestart = true;
           }
-        }
-        if(incoming["action"] == "SCHEDULED_RESTART"){
-          Serial.println(F("Server indicated it is time for a scheduled restart."));
-          ScheduledRestart = true;
-        }
 
+        }
+        requestScreenUpdate();
       }
-      UpdateScreen = true;
-    }
-    if(NewWelcome){
-      //Response to welcoming a user
-      NewWelcome = 0;
-      deserializeJson(incoming, WelcomeResponse);
-      bool IsWelcomed = incoming["welcomed"];
-      String WelcomeID = incoming["cardTagID"];
-      String WelcomeReason = incoming["reason"];
-      if(IsWelcomed){
-        //User was welcomed into the space properly.
-        Serial.println(F("User welcomed!"));
-        if(UID == WelcomeID){
-          //The user's card is still here, so beep and light up.
-          UserWelcomed = 1;
+      if(in.type == IN_WELCOME){
+        //Response to welcoming a user
+        bool IsWelcomed = incoming["welcomed"];
+        String WelcomeID = incoming["cardTagID"];
+        String WelcomeReason = incoming["reason"];
+        if(IsWelcomed){
+          //User was welcomed into the space properly.
+          Serial.println(F("User welcomed!"));
+          if(UID == WelcomeID){
+            //The user's card is still here, so beep and light up.
+            UserWelcomed = 1;
+          } else{
+            Serial.println(F("But their card isn't here anymore, so we will skip the lights/sounds."));
+          }
         } else{
-          Serial.println(F("But their card isn't here anymore, so we will skip the lights/sounds."));
+          //User was denied entry into the space.
+          Serial.print(F("User denied! Reason: "));
+          Serial.println(WelcomeReason);
+          AccessDenied = 1; //Act like we denied the user access
         }
-      } else{
-        //User was denied entry into the space.
-        Serial.print(F("User denied! Reason: "));
-        Serial.println(WelcomeReason);
-        AccessDenied = 1; //Act like we denied the user access
+        requestScreenUpdate();
       }
-      UpdateScreen = true;
-    }
-    
-    //Step 4.4: Send a ping if requested
-    if(SendPing){
-      String PingTopic = BaseTopic + "/ping";
-      publish(PingTopic, "Ping!");
-      //Serial.println(F("Ping sent."));
-      SendPing = 0;
-      NextPingTime = millis64() + 1000;
     }
     
   } else{
     Serial.println(F("No network?"));
     NoNetwork = true;
-    UpdateScreen = true;
+    requestScreenUpdate();
     NetworkConnect();
   }
 
@@ -1249,8 +1276,7 @@ void NetworkConnect(){
         NoNetwork = true;
         FaultReason = "TLS hash does not match!";
         Serial.println(F("CRITICAL ERROR: ATTEMPT WAS MADE TO LOAD BAD TLS CERTS!"));
-        //Message = "Attmpted to load cert with bad hash?";
-        //MessageToSend = true;
+        //queueOutgoing(OUT_MESSAGE, "Attmpted to load cert with bad hash?");
         delay(1000);
         goto retryNetwork;
       }
@@ -1273,33 +1299,33 @@ void NetworkConnect(){
 
   //Subscribe to all MQTT topics relevant to us;
   BaseTopic = "makerspace/device/" + SerialNumber;
+  //Build every topic we publish to once, rather than on each publish.
+  for(int i = 0; i < OUT_COUNT; i++){
+    OutgoingTopics[i] = BaseTopic + OutgoingClasses[i].topic;
+  }
   String SubAuth = BaseTopic + "/authTo/response";
   mqtt.subscribe(SubAuth, 2, [](const String& payload, const size_t size) {
     Serial.print(F("AuthTo Response: "));
     Serial.println(payload);
-    AuthResponse = payload;
-    NewAuth = 1;
+    queueIncoming(IN_AUTH, payload);
   });
   String SubInfo = BaseTopic + "/info/response";
   mqtt.subscribe(SubInfo, 2, [](const String& payload, const size_t size) {
     Serial.print(F("Info Response: "));
     Serial.println(payload);
-    InfoResponse = payload;
-    NewInfo = 1;
+    queueIncoming(IN_INFO, payload);
   });
   String SubCommand = BaseTopic + "/command";
   mqtt.subscribe(SubCommand, 2, [](const String& payload, const size_t size) {
     Serial.print(F("Command Input: "));
     Serial.println(payload);
-    CommandResponse = payload;
-    NewCommand = 1;
+    queueIncoming(IN_COMMAND, payload);
   });
   String SubWelcome = BaseTopic + "/welcome/response";
   mqtt.subscribe(SubWelcome, 2, [](const String& payload, const size_t size) {
     Serial.print(F("Welcome Response: "));
     Serial.println(payload);
-    WelcomeResponse = payload;
-    NewWelcome = 1;
+    queueIncoming(IN_WELCOME, payload);
   });
   String SubPing = BaseTopic + "/ping";
   mqtt.subscribe(SubPing, 2, [](const String& payload, const size_t size) {
@@ -1308,27 +1334,109 @@ void NetworkConnect(){
   });
 
   NoNetwork = false;
-  UpdateScreen = true;
+  requestScreenUpdate();
 
   //We should request and report things when we (re)connect
-  ReportConfig = 1;
-  RequestInfo = 1;
-  SendPing = 1;
+  queueOutgoing(OUT_CONFIG);
+  queueOutgoing(OUT_INFO);
+  queueOutgoing(OUT_PING);
   NextPingTime = millis64() + 1000;
-  LogType = "Network Connected";
-  Log = "Network Connected";
-  LogToSend = true;
+  queueOutgoing(OUT_LOG, "Network Connected", "Network Connected");
+}
+
+bool queueOutgoing(OutgoingType type, const char* text = "", const char* logType = "message"){
+  //Hands something to the MQTT loop to send. Safe from any task and never waits,
+  //MachineState calls this from its safety loop.
+  uint64_t now = millis64();
+  if(OutgoingClasses[type].snapshot){
+    taskENTER_CRITICAL(&OutgoingLock);
+    if(!(PendingSnapshots & (1UL << type))){
+      PendingSnapshots |= 1UL << type;
+      SnapshotQueuedAt[type] = now;
+    }
+    taskEXIT_CRITICAL(&OutgoingLock);
+    return true;
+  }
+  Outgoing out;
+  out.type = type;
+  out.queuedAt = now;
+  strlcpy(out.text, text, sizeof(out.text));
+  strlcpy(out.logType, logType, sizeof(out.logType));
+  //Only messages, logs, auths and welcomes take a slot. The queue fills if we are offline long
+  //enough, then the newest are dropped, counted and reported with our status once we are back.
+  if(xQueueSend(OutgoingQueue, &out, 0) != pdTRUE){
+    taskENTER_CRITICAL(&OutgoingLock);
+    OutgoingLatency.dropped++;
+    taskEXIT_CRITICAL(&OutgoingLock);
+    Serial.print(F("Outgoing queue full, dropped a message for "));
+    Serial.println(OutgoingClasses[type].topic);
+    return false;
+  }
+  return true;
 }
 
-void publish(String Topic, String Payload){
-  if(Payload != "Ping!"){
+bool queueIncoming(IncomingType type, const String& payload){
+  //Called from the MQTT subscriptions, which run inside mqtt.update() in loop().
+  //We can't wait for room here, loop() is the task that would make it, so a full queue drops the message.
+  //Drops are counted and reported with our status, a dropped response is handled like one that never came.
+  Incoming in;
+  in.type = type;
+  in.receivedAt = millis64();
+  in.payload = strdup(payload.c_str());
+  if(in.payload == NULL || xQueueSend(IncomingQueue, &in, 0) != pdTRUE){
+    free(in.payload);
+    IncomingLatency.dropped++;
+    Serial.print(F("Incoming queue full, dropped a message of type "));
+    Serial.println(type);
+    return false;
+  }
+  return true;
+}
+
+void noteLatency(QueueLatency &latency, uint64_t since){
+  uint32_t waited = millis64() - since;
+  latency.count++;
+  latency.lastMs = waited;
+  latency.totalMs += waited;
+  if(waited > latency.maxMs){
+    latency.maxMs = waited;
+  }
+}
+
+void printQueueLatency(){
+  //Printed with every status, so latency can be watched over USB without a debugger.
+  Serial.printf("Queue latency (ms) - outgoing: last %lu, avg %lu, max %lu, dropped %lu | incoming: last %lu, avg %lu, max %lu, dropped %lu\n",
+    (unsigned long)OutgoingLatency.lastMs,
+    (unsigned long)(OutgoingLatency.count ? OutgoingLatency.totalMs / OutgoingLatency.count : 0),
+    (unsigned long)OutgoingLatency.maxMs, (unsigned long)OutgoingLatency.dropped,
+    (unsigned long)IncomingLatency.lastMs,
+    (unsigned long)(IncomingLatency.count ? IncomingLatency.totalMs / IncomingLatency.count : 0),
+    (unsigned long)IncomingLatency.maxMs, (unsigned long)IncomingLatency.dropped);
+}
+
+void requestScreenUpdate(){
+  //Wakes the ScreenController to send the screen fresh data.
+  xEventGroupSetBits(Events, EVENT_UPDATE_SCREEN);
+}
+
+void requestBeep(EventBits_t beep){
+  //Asks AVControl to play one of the EVENT_*_BEEP melodies.
+  xEventGroupSetBits(Events, beep);
+}
+
+void publish(OutgoingType type, const String& Payload){
+  const String& Topic = OutgoingTopics[type];
+  uint8_t QoS = OutgoingClasses[type].qos;
+  if(type != OUT_PING){
     //No point in printing the ping payload constantly
     Serial.print(F("Publishing "));
     Serial.print(Payload);
     Serial.print(F(" to topic "));
-    Serial.println(Topic);
+    Serial.print(Topic);
+    Serial.print(F(" at QoS "));
+    Serial.println(QoS);
   }
-  mqtt.publish(Topic, Payload, false, 2); //Send not retained at QoS 2
+  mqtt.publish(Topic, Payload, false, QoS); //Never retained
 }
 
 // Implement the HAL functions on an Arduino compatible system.
@@ -1546,10 +1654,18 @@ String getSHA256(String input) {
 
 void IRAM_ATTR onTimerCallback(void* arg) {
   //This is called in an ISR to increment the Hobbs timer very precisely!
+  //HobbsLock keeps saveHobbs from snapshotting the meters halfway through an update.
+  taskENTER_CRITICAL(&HobbsLock);
   for(int i = 0; i < ChannelCount; i++){
     if(ChannelAccess[i]){
       HobbsSeconds[i]++;
     }
   }
+  //Refresh the RTC mirror, this is what lets Hobbs.ino recover after a crash or brown-out.
+  for(int i = 0; i < 4; i++){
+    HobbsMirror[i] = HobbsSeconds[i];
+  }
+  HobbsMirrorCRC = hobbsMirrorCheck();
+  taskEXIT_CRITICAL(&HobbsLock);
 }
 
@@ -8,5 +8,7 @@ struct Device {
   byte highTempLimit;      
   float currentTemp;       
   bool isAlarming;         
-  bool isOnline;           
+  bool isOnline;
+  uint16_t crcErrors;      //Scratchpad reads that came back with a bad CRC, including ones a retry recovered
+  uint16_t readFailures;   //Scratchpad reads that still failed after every retry
 };
\ No newline at end of file
@@ -1,7 +1,7 @@
 /* 
 These tasks are responsible for communicating with the frontend, handling things like switch states, LED and buzzer control, etc.
 There are 3 tasks;
-  AVControl - Converts flags from other tasks into a series of LED lights and buzzer tones.
+  AVControl - Converts flags and beep events from other tasks into a series of LED lights and buzzer tones.
   RestartController - Listens for the front button to be held for 5 seconds, restarts the device. All other reset source throughout the code are handled by this task as well.
 */
 
@@ -16,9 +16,13 @@ void AVControl(void *pvParameters){
   byte DonePlaying;
   byte MelodyStep;
   uint64_t MelodyTime = 0;
+  EventBits_t PendingBeeps = 0; //Beeps asked for through the event group, held until their melody finishes
   Serial.println(F("AVControl Started."));
   while(1){
-    vTaskDelay(20 / portTICK_PERIOD_MS);
+    //Wait out the animation frame, but wake right away if a beep is requested.
+    xEventGroupWaitBits(Events, BEEP_EVENTS, pdFALSE, pdFALSE, 20 / portTICK_PERIOD_MS);
+    //Clearing returns the bits as they were, so no request set in between is lost.
+    PendingBeeps |= xEventGroupClearBits(Events, BEEP_EVENTS) & BEEP_EVENTS;
     //First, set the animation state:
     //Animation triggers are not exclusive, so if statements written in reverse-priority order.
 
@@ -27,39 +31,25 @@ void AVControl(void *pvParameters){
     //i.e. if Ch 1 is unlocked and Ch 2 is locked out, show a light as if we are unlocked
     //But, any channel being in fault or unknown takes priority.
     //So, we do a reverse-priority order collection of the states here to use for old lighting code.
-    String LightState = "NOTHING";
+    // Tier 4 (Absolute Priority): Faults or Unknown states
+    // Tier 3 (Most Permissive): Active access states
+    // Tier 2 (Neutral): Waiting for interaction
+    // Tier 1 (Least Permissive): Completely locked out
+    // Indexed by ChannelState: UNKNOWN, IDLE, UNLOCKED, ALWAYS_ON, LOCKED_OUT, FAULT
+    static const byte LightPriority[STATE_COUNT] = {4, 2, 3, 3, 1, 4};
+    ChannelState LightState = STATE_UNKNOWN; //If there are no channels, we show unknown.
     int highestPriority = 0;
     for (int i = 0; i < ChannelCount; i++) {
-      int currentPriority = 0;
-
-      // Tier 4 (Absolute Priority): Faults or Unknown states
-      if (State[i] == "FAULT" || State[i] == "UNKNOWN") {
-        currentPriority = 4;
-      } 
-      // Tier 3 (Most Permissive): Active access states
-      else if (State[i] == "UNLOCKED" || State[i] == "ALWAYS_ON") {
-        currentPriority = 3;
-      } 
-      // Tier 2 (Neutral): Waiting for interaction
-      else if (State[i] == "IDLE") {
-        currentPriority = 2;
-      } 
-      // Tier 1 (Least Permissive): Completely locked out
-      else if (State[i] == "LOCKED_OUT") {
-        currentPriority = 1;
-      }
+      int currentPriority = LightPriority[State[i]];
 
       // If this channel outranks the previous ones, update the LightState
       if (currentPriority > highestPriority) {
         highestPriority = currentPriority;
-        LightState = State[i]; // Inherit the actual state string (e.g., grabs "ALWAYS_ON" vs "UNLOCKED")
+        LightState = State[i]; // Inherit the actual state (e.g., grabs ALWAYS_ON vs UNLOCKED)
       }
     }
-    if(LightState == "NOTHING"){
-      LightState = "UNKNOWN";
-    }
 
-    if(LightState.equals("IDLE")){
+    if(LightState == STATE_IDLE){
       //Animation 3: Solid Yellow
       LEDAnimation = 3;
     }
@@ -71,15 +61,15 @@ void AVControl(void *pvParameters){
       //Animation 4: Flashing Yellow
       LEDAnimation = 4;
     }
-    if(LightState.equals("UNLOCKED") || LightState.equals("ALWAYS_ON") || UserWelcomed){
+    if((STATE_BIT(LightState) & ACCESS_STATES) || UserWelcomed){
       //Animation 2: Solid Green
       LEDAnimation = 2;
     }
-    if(LightState.equals("UNKNOWN") || NoNetwork){
+    if(LightState == STATE_UNKNOWN || NoNetwork){
       //Animation 7: Solid Blue
       LEDAnimation = 7;
     }
-    if((LightState.equals("UNLOCKED") || LightState.equals("ALWAYS_ON")) && NoNetwork){
+    if((STATE_BIT(LightState) & ACCESS_STATES) && NoNetwork){
       //Animation 5: Alternate blue/green
       LEDAnimation = 5;
     }
@@ -88,7 +78,7 @@ void AVControl(void *pvParameters){
       //Used when a machine is unlocked, but we should tell the user to stop.
       LEDAnimation = 11;
     }
-    if(LightState.equals("LOCKED_OUT") || AccessDenied){
+    if(LightState == STATE_LOCKED_OUT || AccessDenied){
       //Animation 1: Solid Red
       LEDAnimation = 1;
     }
@@ -100,7 +90,7 @@ void AVControl(void *pvParameters){
       //Animation 8: Solid Purple
       LEDAnimation = 8;
     }
-    if(LightState.equals("FAULT")){
+    if(LightState == STATE_FAULT){
       LEDAnimation = 0;
     }
     if(GamerMode){
@@ -263,14 +253,14 @@ void AVControl(void *pvParameters){
     
     //After the LED, we need to set up the buzzer.
 
-    if(UnlockedBeep || UserWelcomed){
+    if((PendingBeeps & EVENT_UNLOCKED_BEEP) || UserWelcomed){
       //The machine has been unlocked
       Melody = 1;
     } else if(AccessDenied){
       Melody = 2;
-    } else if(LightState == "FAULT" || FaultBeep){
+    } else if(LightState == STATE_FAULT || (PendingBeeps & EVENT_FAULT_BEEP)){
       Melody = 3;
-    } else if(SingleBeep){
+    } else if(PendingBeeps & EVENT_SINGLE_BEEP){
       Melody = 4;
     } else if(Identify){
       //Play a constant tone to identify the device
@@ -304,7 +294,7 @@ void AVControl(void *pvParameters){
           break;
           case 2:
             Tone = 0;
-            UnlockedBeep = 0;
+            PendingBeeps &= ~EVENT_UNLOCKED_BEEP;
             DonePlaying = 1;
           break;
         }
@@ -345,7 +335,7 @@ void AVControl(void *pvParameters){
           case 5:
             Tone = 0;
             DonePlaying = 1;
-            FaultBeep = 0;
+            PendingBeeps &= ~EVENT_FAULT_BEEP;
           break;
         }
       break;
@@ -358,7 +348,7 @@ void AVControl(void *pvParameters){
           case 1:
             Tone = 0;
             DonePlaying = 1;
-            SingleBeep = 0;
+            PendingBeeps &= ~EVENT_SINGLE_BEEP;
           break;
         }
       break;
@@ -410,13 +400,15 @@ void RestartController(void *pvParameters){
     }
     //Next, check if anything has asked for the device to be restarted.
     if(RequestReset){
+      //Do every NVS write while the other tasks still run, it can't be written once they are suspended.
+      saveHobbs();
+      settings.putString("ResetReason",ResetReason);
       vTaskSuspendAll(); //Stop all other tasks
       Serial.print(F("Restarting. Source: "));
       Serial.println(ResetReason);
       Serial.flush();
       CBI.setPixelColor(0, 255, 0, 0);
       CBI.show();
-      settings.putString("ResetReason",ResetReason);
       //Tell the frontend, if connected;
       Serial0.println("{\"command\":\"restart\"}");
       Serial0.flush();
@@ -0,0 +1,160 @@
+/*
+Hobbs Meters
+Keeps HobbsSeconds across restarts, OTA updates and power loss.
+
+  * While any channel runs, a snapshot of all 4 meters is written to NVS every HOBBS_SAVE_INTERVAL.
+    Snapshots rotate through HOBBS_SLOTS keys, each with a sequence number and CRC, so a write cut off
+    by power loss only spoils that one slot; on boot we take the newest good one.
+  * The meters are mirrored in RTC memory every second. That survives panics, watchdog and brown-out
+    resets, so after one of those we recover every second and save it straight away on boot.
+    We don't try to write flash from the brown-out itself, a write while the supply collapses can corrupt NVS.
+  * Restarts we ask for (RestartController) save a final snapshot first.
+  * The meters only count up. A sync from the server can raise them but not lower them,
+    only an explicit hobbsTime command can.
+
+Worst case, a clean power cut loses up to HOBBS_SAVE_INTERVAL of run time.
+
+Flash write budget:
+  A snapshot is a 24 byte blob, which NVS stores in 3 entries of 32 bytes (96 bytes).
+  At one per 5 minutes that is at most 12 writes, 1152 bytes, per hour of run time, and none while idle.
+  A 4096 byte NVS page holds 126 entries, so 42 snapshots, and is erased about every 3.5 hours of
+  continuous running. NVS rotates pages, but even on a single page the 100,000 erase cycle rating
+  of the flash lasts about 40 years at this rate.
+*/
+
+#define HOBBS_SLOTS 4
+#define HOBBS_MAGIC 0x484F4242 //"HOBB", marks the RTC mirror as ours
+
+struct HobbsSnapshot {
+  uint32_t sequence;
+  uint32_t seconds[4];
+  uint32_t crc; //Over everything above
+};
+
+Preferences hobbsStore;
+uint32_t HobbsSequence = 0; //Sequence of the newest snapshot, the next one goes in slot (HobbsSequence + 1) % HOBBS_SLOTS
+unsigned long HobbsSaved[4] = {0, 0, 0, 0}; //What the newest snapshot holds, so we only write when a meter moved
+unsigned long long NextHobbsSave = 0;
+
+uint32_t hobbsMirrorCheck(){
+  return HOBBS_MAGIC ^ esp_crc32_le(0, (const uint8_t*)HobbsMirror, sizeof(HobbsMirror));
+}
+
+void loadHobbs(){
+  //Called once from setup, before the Hobbs timer starts.
+  hobbsStore.begin("hobbs", false);
+
+  HobbsSnapshot newest = {};
+  bool found = false;
+  for(int i = 0; i < HOBBS_SLOTS; i++){
+    HobbsSnapshot snapshot;
+    char key[8];
+    snprintf(key, sizeof(key), "snap%d", i);
+    if(hobbsStore.getBytesLength(key) != sizeof(snapshot)){
+      continue;
+    }
+    hobbsStore.getBytes(key, &snapshot, sizeof(snapshot));
+    if(snapshot.crc != esp_crc32_le(0, (const uint8_t*)&snapshot, offsetof(HobbsSnapshot, crc))){
+      Serial.print(F("Hobbs snapshot slot "));
+      Serial.print(i);
+      Serial.println(F(" is corrupt, skipping it."));
+      continue;
+    }
+    if(!found || snapshot.sequence > newest.sequence){
+      newest = snapshot;
+      found = true;
+    }
+  }
+  if(found){
+    HobbsSequence = newest.sequence;
+    for(int i = 0; i < 4; i++){
+      HobbsSeconds[i] = newest.seconds[i];
+      HobbsSaved[i] = newest.seconds[i];
+    }
+  }
+
+  //RTC memory is garbage after a power on, otherwise the mirror is at most a second behind.
+  esp_reset_reason_t reason = esp_reset_reason();
+  bool recovered = false;
+  if(reason != ESP_RST_POWERON && HobbsMirrorCRC == hobbsMirrorCheck()){
+    for(int i = 0; i < 4; i++){
+      if(HobbsMirror[i] > HobbsSeconds[i]){
+        HobbsSeconds[i] = HobbsMirror[i];
+        recovered = true;
+      }
+    }
+  }
+
+  Serial.print(F("Hobbs meters loaded (snapshot "));
+  Serial.print(HobbsSequence);
+  if(recovered){
+    Serial.print(F(", plus RTC after reset reason "));
+  } else{
+    Serial.print(F(", reset reason "));
+  }
+  Serial.print(reason);
+  Serial.print(F("):"));
+  for(int i = 0; i < 4; i++){
+    Serial.print(" ");
+    Serial.print(HobbsSeconds[i]);
+  }
+  Serial.println();
+
+  if(recovered){
+    //This is the final flush for a brown-out or crash, done now that the supply is good again.
+    saveHobbs();
+  }
+  NextHobbsSave = millis64() + HOBBS_SAVE_INTERVAL;
+}
+
+bool saveHobbs(){
+  //Writes a snapshot of all meters. Safe from any task, but not with the scheduler suspended.
+  HobbsSnapshot snapshot;
+  taskENTER_CRITICAL(&HobbsLock);
+  snapshot.sequence = ++HobbsSequence;
+  for(int i = 0; i < 4; i++){
+    snapshot.seconds[i] = HobbsSeconds[i];
+  }
+  taskEXIT_CRITICAL(&HobbsLock);
+  snapshot.crc = esp_crc32_le(0, (const uint8_t*)&snapshot, offsetof(HobbsSnapshot, crc));
+
+  char key[8]; //No String, this also runs on the RestartController's small stack
+  snprintf(key, sizeof(key), "snap%u", (unsigned)(snapshot.sequence % HOBBS_SLOTS));
+  if(hobbsStore.putBytes(key, &snapshot, sizeof(snapshot)) != sizeof(snapshot)){
+    Serial.println(F("Failed to save Hobbs snapshot!"));
+    return false;
+  }
+  for(int i = 0; i < 4; i++){
+    HobbsSaved[i] = snapshot.seconds[i];
+  }
+  return true;
+}
+
+void hobbsCheckpoint(){
+  //Called regularly from MachineState, saves if a meter moved since the last snapshot.
+  if(NextHobbsSave > millis64()){
+    return;
+  }
+  NextHobbsSave = millis64() + HOBBS_SAVE_INTERVAL;
+  for(int i = 0; i < 4; i++){
+    if(HobbsSeconds[i] != HobbsSaved[i]){
+      saveHobbs();
+      return;
+    }
+  }
+}
+
+void syncHobbs(int ch, unsigned long seconds){
+  //Takes a meter reading from the server. We report totals that only go up,
+  //so if we already counted past the server's value we keep ours.
+  taskENTER_CRITICAL(&HobbsLock);
+  if(seconds > HobbsSeconds[ch]){
+    HobbsSeconds[ch] = seconds;
+  }
+  taskEXIT_CRITICAL(&HobbsLock);
+  Serial.print(F("Hobbs timer for channel "));
+  Serial.print(ch);
+  Serial.print(F(" synced to: "));
+  Serial.print(HobbsSeconds[ch]);
+  Serial.println(F(" seconds."));
+}
@@ -9,34 +9,28 @@ void MachineState(void *pvParameters){
     //Step 1.1: Check for any reason we should be in a fault state
     if(OverTemp || SealBroken){
       //Check if every channel is in "FAULT";
-      byte faultCount = 0;
-      for( int i = 0; i < ChannelCount; i++){
-        if(State[i] == "FAULT"){
-          faultCount++;
-        }
-      }
-      if(ChannelCount != faultCount){
+      if(channelStateMask() & ~STATE_BIT(STATE_FAULT)){
         //This is our first time going to the fault state
-        String SetFaultReason;
-        SetFaultReason = "FAULT";
-        Message = "ACS Fault!";
+        ChangeReason SetFaultReason;
+        SetFaultReason = REASON_FAULT;
+        const char* Message = "ACS Fault!";
         FaultReason = "ACS Fault!";
         if(OverTemp){
-          SetFaultReason = "OVER_TEMP";
+          SetFaultReason = REASON_OVER_TEMP;
           Message = "Overtemperature!";
           FaultReason = "Overtemperature!";
         }
         if(SealBroken){
-          SetFaultReason = "INTEGRITY_FAIL";
+          SetFaultReason = REASON_INTEGRITY_FAIL;
           Message = "Bus Integrity Broken!";
           FaultReason = "Bus Integrity!";
         }
         for (int i = 0; i < ChannelCount; i++) {
-          State[i] = "FAULT";
+          State[i] = STATE_FAULT;
           StateChangeReason[i] = SetFaultReason;
         }
-        MessageToSend = 1;
-        UpdateScreen = true;
+        queueOutgoing(OUT_MESSAGE, Message);
+        requestScreenUpdate();
       }
     }
 
@@ -58,38 +52,37 @@ void MachineState(void *pvParameters){
         //Actually execute on the interrupt state;
         if(InterruptResponse == "MESSAGE"){
           //Send a message
-          Message = "Interrupt Triggered!";
-          MessageToSend = true;
+          queueOutgoing(OUT_MESSAGE, "Interrupt Triggered!");
         }
         if(InterruptResponse == "LOCK_TEMP"){
           //Temporarily lock the channels;
           for(int i = 0; i < ChannelCount; i++){
-            if(State[i] == "UNLOCKED" || State[i] == "ALWAYS_ON" || State[i] == "IDLE"){
-              State[i] = "LOCKED_OUT";
-              StateChangeReason[i] = "LOCK_TEMP";
-              SingleBeep = true;
+            if(STATE_BIT(State[i]) & (ACCESS_STATES | STATE_BIT(STATE_IDLE))){
+              State[i] = STATE_LOCKED_OUT;
+              StateChangeReason[i] = REASON_LOCK_TEMP;
+              requestBeep(EVENT_SINGLE_BEEP);
             }
           }
         }
         if(InterruptResponse == "IDLE"){
           //Idle any unlocked or Always-On channel:
           for(int i = 0; i < ChannelCount; i++){
-            if(State[i] == "UNLOCKED" || State[i] == "ALWAYS_ON"){
-              State[i] = "IDLE";
-              StateChangeReason[i] = "LOCAL";
-              SingleBeep = true;
+            if(STATE_BIT(State[i]) & ACCESS_STATES){
+              State[i] = STATE_IDLE;
+              StateChangeReason[i] = REASON_LOCAL;
+              requestBeep(EVENT_SINGLE_BEEP);
             }
           }
         }
         if(InterruptResponse == "FAULT"){
           //Fault all channels.
           for(int i = 0; i < ChannelCount; i++){
-            State[i] = "FAULT";
-            StateChangeReason[i] = "FAULT";
+            State[i] = STATE_FAULT;
+            StateChangeReason[i] = REASON_FAULT;
           }
           FaultReason = "Interrupt Asserted!";
         }
-        UpdateScreen = true; //tell the frontend ASAP
+        requestScreenUpdate(); //tell the frontend ASAP
       }
     } else{
       //Check if we are out of the interrupt state;
@@ -103,10 +96,10 @@ void MachineState(void *pvParameters){
           if(InterruptResponse == "LOCK_TEMP"){
             //Now that the interrupt is clear, release the locks on channels
             for(int i = 0; i < ChannelCount; i++){
-              if(State[i] == "LOCKED_OUT"){
-                State[i] = "IDLE";
-                StateChangeReason[i] = "LOCAL";
-                SingleBeep = true;
+              if(State[i] == STATE_LOCKED_OUT){
+                State[i] = STATE_IDLE;
+                StateChangeReason[i] = REASON_LOCAL;
+                requestBeep(EVENT_SINGLE_BEEP);
               }
             }
           }
@@ -134,11 +127,17 @@ void MachineState(void *pvParameters){
 
     //See if we have a regular status update to send
     if(NextStatusTime <= millis64()){
-      //Time to send a status message.
-      SendStatus = 1;
+      //Time to send a status message. Offline, we don't let these pile up in the queue;
+      //reconnecting asks the server for info, and the reply queues a fresh status.
+      if(!NoNetwork){
+        queueOutgoing(OUT_STATUS);
+      }
       NextStatusTime = millis64() + STATUS_INTERVAL;
     }
 
+    //Save the Hobbs meters if it is time to
+    hobbsCheckpoint();
+
     //Step 1.2: Check for a change to the card. New one? Removed? 
     FoundUID = NFCCardFound();
     if(FoundUID == ""){
@@ -157,19 +156,20 @@ void MachineState(void *pvParameters){
         UID = FoundUID;
         if(WelcomeMode && !NoNetwork){
           //Let's welcome the user to the makerspace
-          SendWelcome = 1;
+          queueOutgoing(OUT_WELCOME, UID.c_str());
           WelcomingPending = 1;
         }
-        if((anyChannelIs("IDLE") || anyChannelIs("UNLOCKED")) && !NoNetwork){
+        uint8_t StateMask = channelStateMask();
+        if((StateMask & (STATE_BIT(STATE_IDLE) | STATE_BIT(STATE_UNLOCKED))) && !NoNetwork){
           //Let's check for auth with the server
           PendingApproval = true;
-          SendAuth = true;
-        } else if(!anyChannelIs("IDLE") && (!anyChannelIs("UNLOCKED") || anyChannelIs("ALWAYS_ON"))){
+          queueOutgoing(OUT_AUTH, UID.c_str());
+        } else if(!(StateMask & STATE_BIT(STATE_IDLE)) && (!(StateMask & STATE_BIT(STATE_UNLOCKED)) || (StateMask & STATE_BIT(STATE_ALWAYS_ON)))){
           //Logic: If there are no channels in a state that the user could unlock, but something is already unlocked or always on, beep to confirm.
-          SingleBeep = true;
-        } else if((anyChannelIs("IDLE") || anyChannelIs("UNLOCKED")) && NoNetwork){
+          requestBeep(EVENT_SINGLE_BEEP);
+        } else if((StateMask & (STATE_BIT(STATE_IDLE) | STATE_BIT(STATE_UNLOCKED))) && NoNetwork){
           //Fault beep and deny the user due to no network
-          FaultBeep = true;
+          requestBeep(EVENT_FAULT_BEEP);
           AccessDenied = true;
           for(int i = 0; i < ChannelCount; i++){
             AuthReason[i] = "No network, try again soon or talk to staff.";
@@ -185,7 +185,7 @@ void MachineState(void *pvParameters){
         }
         if(NoNetwork){
           //Give a fault beep, reject them immediately
-          FaultBeep = 1;
+          requestBeep(EVENT_FAULT_BEEP);
         }
       }
     } else{ //INSERT
@@ -193,16 +193,17 @@ void MachineState(void *pvParameters){
         //New card inserted!
         CardPresent = true;
         UID = FoundUID;
-        if(anyChannelIs("IDLE") && !NoNetwork){
+        uint8_t StateMask = channelStateMask();
+        if((StateMask & STATE_BIT(STATE_IDLE)) && !NoNetwork){
           //Let's check for auth with the server
           PendingApproval = true;
-          SendAuth = true;
-        } else if(!anyChannelIs("IDLE") && (anyChannelIs("UNLOCKED") || anyChannelIs("ALWAYS_ON"))){
+          queueOutgoing(OUT_AUTH, UID.c_str());
+        } else if(!(StateMask & STATE_BIT(STATE_IDLE)) && (StateMask & ACCESS_STATES)){
           //Logic: If there are no channels in IDLE that the user could unlock, but something is already unlocked or always on, beep to confirm.
-          SingleBeep = true;
-        } else if(anyChannelIs("IDLE") && NoNetwork){
+          requestBeep(EVENT_SINGLE_BEEP);
+        } else if((StateMask & STATE_BIT(STATE_IDLE)) && NoNetwork){
           //Fault beep and deny the user due to no network
-          FaultBeep = true;
+          requestBeep(EVENT_FAULT_BEEP);
           AccessDenied = true;
           for(int i = 0; i < ChannelCount; i++){
             AuthReason[i] = "No network, try again soon or talk to staff.";
@@ -230,8 +231,7 @@ void MachineState(void *pvParameters){
         Serial.print(F(" replaced with "));
         Serial.println(FoundUID);
         CardPresent = false;
-        UID = "";
-        SendWelcome = 0;
+        UID = ""; //A welcome still queued for this card is skipped, since UID no longer matches
         WelcomingPending = 0;
         UserWelcomed = 0;
         AccessDenied = 0;
@@ -245,9 +245,9 @@ void MachineState(void *pvParameters){
         PendingApproval = false;
         AccessDenied = false;
         for(int i = 0; i < ChannelCount; i++){
-          if(State[i] == "UNLOCKED"){
-            State[i] = "IDLE";
-            StateChangeReason[i] = "CARD_REMOVED";
+          if(State[i] == STATE_UNLOCKED){
+            State[i] = STATE_IDLE;
+            StateChangeReason[i] = REASON_CARD_REMOVED;
           }
         }
       }
@@ -257,10 +257,10 @@ void MachineState(void *pvParameters){
     if(InputMode == "TEMP_PRESENT"){
       for(int i = 0; i < ChannelCount; i++){
         if(CurrentTapExpires[i] <= millis64()){
-          if(State[i] == "UNLOCKED"){
-            State[i] = "IDLE";
-            StateChangeReason[i] = "CARD_REMOVED";
-            SingleBeep = true;
+          if(State[i] == STATE_UNLOCKED){
+            State[i] = STATE_IDLE;
+            StateChangeReason[i] = REASON_CARD_REMOVED;
+            requestBeep(EVENT_SINGLE_BEEP);
           }
           CurrentTapExpires[i] = 0; //Cleanup
         }
@@ -277,7 +277,7 @@ void MachineState(void *pvParameters){
     bool AccessOn = false;
     bool TellUpdateScreen = false;
     for(int i = 0; i < ChannelCount; i++){
-      if(State[i] == "UNLOCKED" || State[i] == "ALWAYS_ON"){
+      if(STATE_BIT(State[i]) & ACCESS_STATES){
         if(ChannelAccess[i] != 1){
           TellUpdateScreen = true;
         }
@@ -290,10 +290,6 @@ void MachineState(void *pvParameters){
         }
         ChannelAccess[i] = 0;
       }
-      //While we are here, check that there is a valid state change reason for everyone. 
-      if(StateChangeReason[i] == ""){
-        StateChangeReason[i] = "UNKNOWN";
-      }
     }
     if(AccessOn == false){
       //No channels are on, disable Access
@@ -301,7 +297,7 @@ void MachineState(void *pvParameters){
     }
     if(TellUpdateScreen){
       //A ChannelAccess state changed, update the screen
-      UpdateScreen = true;
+      requestScreenUpdate();
     }
     //Set the GPIO of the bus based on ChannelAccess
     digitalWrite(GPIO1, ChannelAccess[0]);
@@ -313,7 +309,7 @@ void MachineState(void *pvParameters){
     bool SendStateChange = false;
     for(int i = 0; i < ChannelCount; i++){
       if(State[i] != LastState[i]){
-        if(LastState[i] != "UNKNOWN"){
+        if(LastState[i] != STATE_UNKNOWN){
           //The state changed for something other than setting back from unkown, we should send it.
           SendStateChange = true;
         }
@@ -321,21 +317,21 @@ void MachineState(void *pvParameters){
       }
     }
     if(SendStateChange){
-      StateChange = true;
+      queueOutgoing(OUT_STATE_CHANGE);
     }
 
     //Step 1.4: Check for and execute any flags;
-    if(LockWhenIdle && !anyChannelIs("UNLOCKED") && !anyChannelIs("ALWAYS_ON")){
+    if(LockWhenIdle && !anyChannelIs(ACCESS_STATES)){
       //If no channel is unlocked or always on, lock any idle channels.
       for(int i = 0; i < ChannelCount; i++){
-        if(State[i] == "IDLE"){
-          State[i] = "LOCKED_OUT";
-          StateChangeReason[i] = "COMMANDED";
+        if(State[i] == STATE_IDLE){
+          State[i] = STATE_LOCKED_OUT;
+          StateChangeReason[i] = REASON_COMMANDED;
         }
       }
       LockWhenIdle = 0;
     }
-    if(RestartWhenUnused && !anyChannelIs("UNLOCKED") && !anyChannelIs("ALWAYS_ON")){
+    if(RestartWhenUnused && !anyChannelIs(ACCESS_STATES)){
       Serial.println(F("Executing restart-when-unused flag."));
       Serial.flush();
       delay(5);
@@ -349,11 +345,11 @@ void MachineState(void *pvParameters){
       if(ScheduledRestartTime <= millis64() && ScheduledRestartTime != 0){
         //Time to force a restart, the user has had 60 seconds to stop.
         for(int i = 0; i < ChannelCount; i++){
-          State[i] = "UNKNOWN";
+          State[i] = STATE_UNKNOWN;
         }
         Serial.println(F("User has had 60 seconds to end session, forcing scheduled restart."));
       }
-      if(anyChannelIs("ALWAYS_ON") || anyChannelIs("UNLOCKED")){
+      if(anyChannelIs(ACCESS_STATES)){
         //We should not restart now, someone is using the machine? 
         //Let the user know we are restarting soon.
         ImminentShutdown = true;
@@ -384,7 +380,7 @@ void MachineState(void *pvParameters){
         Serial.println(F("Didn't get a ping response?"));
         NoNetwork = true;
       }
-      SendPing = 1;
+      queueOutgoing(OUT_PING);
     }
   }
 }
@@ -427,12 +423,16 @@ String NFCCardFound(){
   return ReturnedID;
 }
 
-bool anyChannelIs(String targetState) {
-  //Checks if any channel is in this state
+uint8_t channelStateMask() {
+  //One bit per state that at least one channel is in, see STATE_BIT
+  uint8_t mask = 0;
   for (int i = 0; i < ChannelCount; i++) {
-    if (State[i] == targetState) {
-      return true; // Found a match, exit early
-    }
+    mask |= STATE_BIT(State[i]);
   }
-  return false; // No matches found
+  return mask;
+}
+
+bool anyChannelIs(uint8_t stateMask) {
+  //Checks if any channel is in one of the states in the mask
+  return (channelStateMask() & stateMask) != 0;
 }
\ No newline at end of file
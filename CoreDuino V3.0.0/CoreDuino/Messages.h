@@ -0,0 +1,83 @@
+#pragma once
+#include <Arduino.h>
+#include <freertos/queue.h>
+#include <freertos/event_groups.h>
+
+//Items passed between tasks through FreeRTOS queues, instead of flag + shared String pairs.
+
+#define OUTGOING_QUEUE_LENGTH 16 //Snapshot types don't use it, so this is messages, logs and requests only
+#define INCOMING_QUEUE_LENGTH 8
+
+//Something for the MQTT loop to send to the server.
+enum OutgoingType : uint8_t {
+  OUT_MESSAGE,      //text goes to the user-visible history
+  OUT_LOG,          //text goes to the audit log, with logType
+  OUT_AUTH,         //text is the card UID to auth
+  OUT_STATE_CHANGE,
+  OUT_CONFIG,
+  OUT_INFO,
+  OUT_STATUS,
+  OUT_WELCOME,      //text is the card UID to welcome
+  OUT_PING,
+  OUT_COUNT
+};
+
+//How each OutgoingType is published. QoS follows what losing or repeating one would cost:
+//  0 - telemetry that is resent on a timer anyway, a lost one is replaced within seconds
+//  1 - logs and reports, duplicates are harmless but they shouldn't vanish
+//  2 - auth, welcome and state changes, exactly once since they change what the server records
+//Every QoS 1 publish waits on a PUBACK and every QoS 2 one on a full PUBREC/PUBREL/PUBCOMP exchange,
+//so this keeps the handshakes for the messages that need them.
+struct OutgoingClass {
+  const char* topic; //Appended to BaseTopic
+  uint8_t qos;
+  bool snapshot;     //Built from current state when sent, so requests for one coalesce instead of queueing
+};
+
+static const OutgoingClass OutgoingClasses[OUT_COUNT] = {
+  {"/log",             1, false}, //OUT_MESSAGE
+  {"/log",             1, false}, //OUT_LOG
+  {"/authTo/request",  2, false}, //OUT_AUTH
+  {"/stateChange",     2, true},  //OUT_STATE_CHANGE
+  {"/config/report",   1, true},  //OUT_CONFIG
+  {"/info/request",    1, true},  //OUT_INFO
+  {"/status",          0, true},  //OUT_STATUS
+  {"/welcome/request", 2, false}, //OUT_WELCOME
+  {"/ping",            0, true},  //OUT_PING
+};
+
+struct Outgoing {
+  OutgoingType type;
+  uint64_t queuedAt;  //millis64() when it was queued, for latency tracking
+  char text[96];
+  char logType[32];
+};
+
+//Something the server sent us, waiting to be processed.
+enum IncomingType : uint8_t {
+  IN_AUTH,
+  IN_INFO,
+  IN_COMMAND,
+  IN_WELCOME
+};
+
+struct Incoming {
+  IncomingType type;
+  uint64_t receivedAt;  //millis64() when the subscription got it
+  char* payload;        //Copied off the heap by the subscription, freed once parsed
+};
+
+struct QueueLatency {
+  uint32_t count;
+  uint32_t dropped; //Items that found the queue full
+  uint32_t lastMs;
+  uint32_t maxMs;
+  uint64_t totalMs;
+};
+
+//Event group bits, for nudges that carry no payload.
+#define EVENT_UPDATE_SCREEN (1 << 0)
+#define EVENT_UNLOCKED_BEEP (1 << 1)
+#define EVENT_SINGLE_BEEP   (1 << 2)
+#define EVENT_FAULT_BEEP    (1 << 3) //3 beeps, also used for "can't auth, no network" to tell it apart from a denial
+#define BEEP_EVENTS (EVENT_UNLOCKED_BEEP | EVENT_SINGLE_BEEP | EVENT_FAULT_BEEP)
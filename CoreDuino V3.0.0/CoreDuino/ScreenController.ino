@@ -75,7 +75,7 @@ void sendCurrent(bool sendRarely = false, bool sendFrequently = true){
     JsonArray durationArray = CurrentStates["durations"].to<JsonArray>();
     JsonArray hobbsArray = CurrentStates["hobbsSeconds"].to<JsonArray>();
     for (int i = 0; i < ChannelCount; i++) {
-      stateArray.add(State[i]);
+      stateArray.add(stateName(State[i]));
       deniedReasonArray.add(AuthReason[i]);
       unsigned long TapExpirationLeft = CurrentTapExpires[i] - millis64();
       if (TapExpirationLeft > 0) {
@@ -108,7 +108,7 @@ void sendCurrent(bool sendRarely = false, bool sendFrequently = true){
 
 void SceenController(void *pvParameters){
   
-  unsigned long long NextScreenUpdate;
+  unsigned long long NextScreenUpdate = 0;
 
 
   //One time only; need to ask for all the info about the screen
@@ -125,7 +125,10 @@ void SceenController(void *pvParameters){
 
   while(1){
 
-    delay(20);
+    //Sleep until someone asks for a screen update, or the regular one is due.
+    unsigned long long Now = millis64();
+    TickType_t Wait = NextScreenUpdate > Now ? pdMS_TO_TICKS(NextScreenUpdate - Now) : 0;
+    EventBits_t Bits = xEventGroupWaitBits(Events, EVENT_UPDATE_SCREEN, pdTRUE, pdFALSE, Wait);
 
     //Every 10 minutes, fetch the latest announcements and hours;
     if (CheckAnnouncements <= millis64()) {
@@ -139,15 +142,10 @@ void SceenController(void *pvParameters){
     //If we are approaching closing time, send an motd;
     updateClosingMOTD();
 
-    //Check if it is time for a regular update of the screen
-    if(NextScreenUpdate <= millis64()){
-      UpdateScreen = true;
-    }
-
-    if(UpdateScreen){
+    //Update if asked to, or if it is time for a regular update of the screen
+    if((Bits & EVENT_UPDATE_SCREEN) || NextScreenUpdate <= millis64()){
       NextScreenUpdate = millis64() + 1000;
       sendCurrent();
-      UpdateScreen = false;
     }
   }
 }